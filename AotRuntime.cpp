@@ -0,0 +1,128 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include "AotRuntime.h"
+#include "Memory.h"
+#include "LoxError.h"
+
+int AotRuntime::main(int argc, char *argv[], const AotProgram &program) {
+    //the same GC log clox writes, see main.cpp. Without a log file the allocation log is discarded
+    std::ofstream out;
+    if (argc > 1){
+        out.open(argv[1]);
+    }
+    auto old_rdbuf = std::clog.rdbuf(argc > 1 ? out.rdbuf() : nullptr);
+    auto epochTime = [](){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    };
+    std::clog << epochTime() << "\n";
+
+    Memory heap;
+    GlobalVariables globalVariables;
+    for (size_t i = 0; i < program.globalCount; i++){
+        globalVariables.resolve(program.globals[i]);
+    }
+
+    //the same function the Compiler would have produced, minus the bytecode
+    auto *name = static_cast<StringObj*>(heap.allocateHeapString("mainCompilerFunction"));
+    auto *function = static_cast<FunctionObj*>(heap.allocateHeapFunction(name, new Chunk(), 0));
+    Chunk *chunk = function->chunk;
+    for (size_t i = 0; i < program.constantCount; i++){
+        const AotConstant &constant = program.constants[i];
+        if (constant.type == AotConstant::Type::NUMBER){
+            chunk->constants.emplace_back(constant.number);
+        } else {
+            chunk->constants.emplace_back(heap.allocateHeapString(std::string_view(constant.chars, constant.length)));
+        }
+    }
+    chunk->lines.assign(program.lines, program.lines + program.lineCount);
+    chunk->propertyCaches.assign(program.byteCount, PropertyCache());
+    chunk->maxStackDepth = program.maxStackDepth;
+    chunk->verified = true; //the generated code was compiled from verified bytecode
+
+    int exitCode = 0;
+    try {
+        AotRuntime runtime(heap);
+        runtime.run(function, globalVariables, program);
+    } catch (const LoxRuntimeError &error) {
+        std::cout << error.what() << "\n";
+        exitCode = 70;
+    }
+    heap.freeAllHeapObjects(); //a runtime error leaves them in the heap, freed while the log is still open
+
+    std::clog << epochTime() << "\n";
+    std::clog.rdbuf(old_rdbuf);
+    return exitCode;
+}
+
+void AotRuntime::run(FunctionObj *function, GlobalVariables &globalVariables, const AotProgram &program) {
+    heap.vm = this;
+    globals = &globalVariables;
+    globals->allocateValues();
+    currentFrame = CallFrame(function, 0, 0);
+    stackTop = stack.get();
+
+    checkStackSpace(currentFrame.stackIndex, currentChunk()->maxStackDepth);
+    pushStack(CLoxLiteral(function));
+
+    program.run(*this);
+    heap.freeAllHeapObjects();
+}
+
+CLoxLiteral *AotRuntime::print(CLoxLiteral *stackTop) {
+    out << stackTop[-1] << "\n";
+    return stackTop - 1;
+}
+
+CLoxLiteral *AotRuntime::defineGlobal(CLoxLiteral *stackTop, uint32_t slot, int next) {
+    enter(stackTop, next);
+    VM::defineGlobal(slot, stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *AotRuntime::makeClass(CLoxLiteral *stackTop, uint32_t constant, int next) {
+    enter(stackTop, next);
+    auto *name = static_cast<StringObj*>(currentChunk()->constants[constant].getObj());
+    *stackTop = VM::makeClass(name);
+    return stackTop + 1;
+}
+
+CLoxLiteral *AotRuntime::call(CLoxLiteral *stackTop, int argCount, int next) {
+    enter(stackTop, next);
+    stackTop[-1 - argCount] = instantiate(stackTop[-1 - argCount], argCount);
+    return stackTop - argCount;
+}
+
+CLoxLiteral *AotRuntime::getProperty(CLoxLiteral *stackTop, uint32_t constant, int offset, int next) {
+    enter(stackTop, next);
+    Chunk *chunk = currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[constant].getObj());
+    stackTop[-1] = VM::getProperty(stackTop[-1], name, chunk->propertyCaches[offset]);
+    return stackTop;
+}
+
+CLoxLiteral *AotRuntime::setProperty(CLoxLiteral *stackTop, uint32_t constant, int offset, int next) {
+    enter(stackTop, next);
+    Chunk *chunk = currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[constant].getObj());
+    VM::setProperty(stackTop[-2], name, stackTop[-1], chunk->propertyCaches[offset]);
+    stackTop[-2] = stackTop[-1];
+    return stackTop - 1;
+}
+
+//programs with functions cannot be emitted, so there are no methods and the property can only be a field that is called
+CLoxLiteral *AotRuntime::invoke(CLoxLiteral *stackTop, uint32_t constant, int argCount, int offset, int next) {
+    enter(stackTop, next);
+    Chunk *chunk = currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[constant].getObj());
+    CLoxLiteral &receiver = stackTop[-1 - argCount];
+    receiver = VM::getProperty(receiver, name, chunk->propertyCaches[offset]);
+    receiver = instantiate(receiver, argCount);
+    return stackTop - argCount;
+}
+
+CLoxLiteral *AotRuntime::allocate(CLoxLiteral *stackTop, int next) {
+    enter(stackTop, next);
+    stackTop[-1] = VM::allocate(stackTop[-1]);
+    return stackTop;
+}
@@ -0,0 +1,203 @@
+#ifndef CLOX_AOTRUNTIME_H
+#define CLOX_AOTRUNTIME_H
+
+
+#include <cstddef>
+#include "VM.h"
+
+class AotRuntime;
+
+//a constant of the script's chunk, see CppEmitter
+struct AotConstant {
+    enum class Type {NUMBER, STRING};
+
+    Type type;
+    double number;
+    const char *chars; //not null terminated, strings can contain null characters
+    size_t length;
+};
+
+//everything the generated code describes about the script it was compiled from
+struct AotProgram {
+    const AotConstant *constants;
+    size_t constantCount;
+    const char *const *globals; //names of the global slots, in slot order
+    size_t globalCount;
+    const int *lines; //run length encoded like Chunk::lines
+    size_t lineCount;
+    size_t byteCount; //size of the bytecode the code was generated from, which the inline caches are indexed by
+    int maxStackDepth;
+    void (*run)(AotRuntime &runtime);
+};
+
+/* Runtime of the programs clox --emit-cpp generates (see CppEmitter). It rebuilds the script's FunctionObj from the
+ * constants and line table the generated code describes, so the GC, the inline caches and the error messages work
+ * exactly as they do when the script is interpreted, and then runs the generated code on the VM's stack.
+ *
+ * The generated code keeps the top of the stack in a local and calls the operations below with it. Each one takes the
+ * offset of the next instruction of the original bytecode, which is where the VM reports errors, and returns the new top
+ * of the stack. The operations on numbers are defined here so the C++ compiler can inline them into the generated code,
+ * everything else goes through the VM's helpers.
+ */
+class AotRuntime : public VM {
+public:
+    //the main() of a generated program: clox's exit codes, and the GC log is written to argv[1] if it is given
+    static int main(int argc, char *argv[], const AotProgram &program);
+
+    using VM::VM;
+
+    CLoxLiteral *frame();
+    CLoxLiteral *top();
+    const CLoxLiteral *constants();
+
+    CLoxLiteral *print(CLoxLiteral *stackTop);
+    CLoxLiteral *negate(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *add(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *subtract(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *multiply(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *divide(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *equal(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *greater(CLoxLiteral *stackTop, int next);
+    CLoxLiteral *less(CLoxLiteral *stackTop, int next);
+    bool truthy(const CLoxLiteral &value);
+    CLoxLiteral *defineGlobal(CLoxLiteral *stackTop, uint32_t slot, int next);
+    CLoxLiteral *getGlobal(CLoxLiteral *stackTop, uint32_t slot, int next);
+    CLoxLiteral *setGlobal(CLoxLiteral *stackTop, uint32_t slot, int next);
+    CLoxLiteral *makeClass(CLoxLiteral *stackTop, uint32_t constant, int next);
+    CLoxLiteral *call(CLoxLiteral *stackTop, int argCount, int next);
+    //offset is the offset of the property instruction, whose inline cache is used
+    CLoxLiteral *getProperty(CLoxLiteral *stackTop, uint32_t constant, int offset, int next);
+    CLoxLiteral *setProperty(CLoxLiteral *stackTop, uint32_t constant, int offset, int next);
+    CLoxLiteral *invoke(CLoxLiteral *stackTop, uint32_t constant, int argCount, int offset, int next);
+    CLoxLiteral *allocate(CLoxLiteral *stackTop, int next);
+
+private:
+    void run(FunctionObj *function, GlobalVariables &globalVariables, const AotProgram &program);
+
+    //what the interpreter does before calling a helper: publishes the top of the stack for the GC and saves the pc
+    void enter(CLoxLiteral *stackTop, int next);
+};
+
+inline CLoxLiteral *AotRuntime::frame() {
+    return stack.get() + currentFrame.stackIndex;
+}
+
+inline CLoxLiteral *AotRuntime::top() {
+    return stackTop;
+}
+
+inline const CLoxLiteral *AotRuntime::constants() {
+    return currentChunk()->constants.data();
+}
+
+inline void AotRuntime::enter(CLoxLiteral *stackTop, int next) {
+    this->stackTop = stackTop;
+    currentFrame.programCounter = next;
+}
+
+inline CLoxLiteral *AotRuntime::negate(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-1].isNumber()){
+        stackTop[-1] = CLoxLiteral(-stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-1] = VM::negate(stackTop[-1]);
+    }
+    return stackTop;
+}
+
+inline CLoxLiteral *AotRuntime::add(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() + stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::add(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline CLoxLiteral *AotRuntime::subtract(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() - stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::subtract(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline CLoxLiteral *AotRuntime::multiply(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() * stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::multiply(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline CLoxLiteral *AotRuntime::divide(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber() && stackTop[-1].getNumber() != 0.0){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() / stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::divide(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+//comparing values for equality cannot fail, it has no error to report at the next instruction
+inline CLoxLiteral *AotRuntime::equal(CLoxLiteral *stackTop, int) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() == stackTop[-1].getNumber());
+    } else {
+        stackTop[-2] = VM::equal(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline CLoxLiteral *AotRuntime::greater(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() > stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::greater(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline CLoxLiteral *AotRuntime::less(CLoxLiteral *stackTop, int next) {
+    if (stackTop[-2].isNumber() && stackTop[-1].isNumber()){
+        stackTop[-2] = CLoxLiteral(stackTop[-2].getNumber() < stackTop[-1].getNumber());
+    } else {
+        enter(stackTop, next);
+        stackTop[-2] = VM::less(stackTop[-2], stackTop[-1]);
+    }
+    return stackTop - 1;
+}
+
+inline bool AotRuntime::truthy(const CLoxLiteral &value) {
+    return isTruthy(value);
+}
+
+inline CLoxLiteral *AotRuntime::getGlobal(CLoxLiteral *stackTop, uint32_t slot, int next) {
+    const CLoxLiteral &global = globals->values[slot];
+    if (global.isUndefined()){
+        enter(stackTop, next);
+        VM::getGlobal(slot); //reports the undefined variable
+    }
+    *stackTop = global;
+    return stackTop + 1;
+}
+
+inline CLoxLiteral *AotRuntime::setGlobal(CLoxLiteral *stackTop, uint32_t slot, int next) {
+    CLoxLiteral &global = globals->values[slot];
+    if (global.isUndefined()){
+        enter(stackTop, next);
+        VM::setGlobal(slot, stackTop[-1]); //reports the undefined variable
+    }
+    global = stackTop[-1];
+    return stackTop;
+}
+
+
+#endif //CLOX_AOTRUNTIME_H
@@ -0,0 +1,384 @@
+#include <cassert>
+#include "BaselineCompiler.h"
+#ifdef TRACING_JIT
+#include "TracingJit.h"
+#endif
+
+CompiledChunk::CompiledChunk(std::unique_ptr<ExecutableMemory> memory, std::vector<int> instructionAddresses) :
+    memory(std::move(memory)), instructionAddresses(std::move(instructionAddresses)) {}
+
+CLoxLiteral *CompiledChunk::run(VM *vm, CLoxLiteral *stackTop, CLoxLiteral *frame, CLoxLiteral *globals) const {
+    auto entry = reinterpret_cast<Entry>(const_cast<void*>(memory->entry()));
+    return entry(vm, stackTop, frame, globals);
+}
+
+const void *CompiledChunk::address(int offset) const {
+    assert(instructionAddresses[offset] != -1);
+    return static_cast<const uint8_t*>(memory->entry()) + instructionAddresses[offset];
+}
+
+BaselineCompiler::BaselineCompiler(Chunk *chunk, std::optional<int32_t> executingOffsetDisplacement)
+    : chunk(chunk), executingOffsetDisplacement(executingOffsetDisplacement) {}
+
+//The code is the prologue, which falls through into the first instruction, then every instruction in bytecode order,
+//then the slow paths and the error exit.
+std::unique_ptr<CompiledChunk> BaselineCompiler::compile() {
+    emitPrologue();
+
+    instructionAddresses.assign(chunk->byteCount(), -1);
+    int offset = 0;
+    while (offset < static_cast<int>(chunk->byteCount())){
+        instructionAddresses[offset] = assembler.size();
+        compileInstruction(offset);
+        offset += Chunk::instructionLength(static_cast<OpCode>(chunk->readByte(offset)));
+    }
+    emitSlowPaths();
+
+    for (int jump : errorJumps){
+        assembler.bind(jump, assembler.size());
+    }
+    assembler.xorRegister(X64Assembler::RAX, X64Assembler::RAX);
+    emitEpilogue();
+
+    for (const InstructionJump &jump : instructionJumps){
+        assembler.bind(jump.displacementOffset, instructionAddresses[jump.target]);
+    }
+
+    std::unique_ptr<ExecutableMemory> memory = ExecutableMemory::create(assembler.code());
+    if (memory == nullptr){
+        return nullptr;
+    }
+    return std::make_unique<CompiledChunk>(std::move(memory), std::move(instructionAddresses));
+}
+
+//saves the callee saved registers, five pushes also realign the stack to 16 bytes for the stencil calls
+void BaselineCompiler::emitPrologue() {
+    assembler.push(X64Assembler::RBX);
+    assembler.push(X64Assembler::R12);
+    assembler.push(X64Assembler::R13);
+    assembler.push(X64Assembler::R14);
+    assembler.push(X64Assembler::R15);
+    assembler.movRegister(VM_POINTER, X64Assembler::RDI);
+    assembler.movRegister(STACK_TOP, X64Assembler::RSI);
+    assembler.movRegister(FRAME, X64Assembler::RDX);
+    assembler.movRegister(GLOBALS, X64Assembler::RCX);
+    assembler.movImmediate(NAN_MASK, CLoxLiteral::QUIET_NAN);
+}
+
+void BaselineCompiler::emitEpilogue() {
+    assembler.pop(X64Assembler::R15);
+    assembler.pop(X64Assembler::R14);
+    assembler.pop(X64Assembler::R13);
+    assembler.pop(X64Assembler::R12);
+    assembler.pop(X64Assembler::RBX);
+    assembler.ret();
+}
+
+//superinstructions are compiled as their components, except for the compare and branch, which is fused
+void BaselineCompiler::compileInstruction(int offset) {
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    if (executingOffsetDisplacement.has_value()){
+        assembler.movMemory32(VM_POINTER, *executingOffsetDisplacement, offset);
+    }
+    if (Chunk::genericForm(opCode) == OpCode::OP_LESS_JUMP_IF_FALSE){
+        compileLessJumpIfFalse(offset);
+        return;
+    }
+
+    int operandOffset = offset + 1;
+    for (OpCode component : Chunk::componentOpCodes(opCode)){
+        uint32_t operand = Chunk::operandWidth(component) > 0 ? chunk->readOperand(operandOffset, component) : 0;
+        operandOffset += Chunk::operandWidth(component);
+        compileComponent(Chunk::narrowForm(component), operand, offset);
+    }
+}
+
+void BaselineCompiler::compileComponent(OpCode code, uint32_t operand, int offset) {
+    switch (code) {
+        case OpCode::OP_RETURN:
+            assembler.movRegister(X64Assembler::RAX, STACK_TOP);
+            emitEpilogue();
+            break;
+        case OpCode::OP_CONSTANT:
+            pushBits(chunk->constants[operand].getBits());
+            break;
+        case OpCode::OP_TRUE:
+            pushBits(CLoxLiteral(true).getBits());
+            break;
+        case OpCode::OP_FALSE:
+            pushBits(CLoxLiteral(false).getBits());
+            break;
+        case OpCode::OP_NIL:
+            pushBits(CLoxLiteral::Nil().getBits());
+            break;
+        case OpCode::OP_POP:
+            assembler.addImmediate(STACK_TOP, -static_cast<int32_t>(sizeof(CLoxLiteral)));
+            break;
+        case OpCode::OP_GET_LOCAL:
+            assembler.movLoad(X64Assembler::RAX, FRAME, slotDisplacement(static_cast<int32_t>(operand)));
+            pushRegister(X64Assembler::RAX);
+            break;
+        case OpCode::OP_SET_LOCAL:
+            assembler.movLoad(X64Assembler::RAX, STACK_TOP, slotDisplacement(-1));
+            assembler.movStore(FRAME, slotDisplacement(static_cast<int32_t>(operand)), X64Assembler::RAX);
+            break;
+        case OpCode::OP_GET_GLOBAL: {
+            //the stencil reports undefined globals
+            SlowPath &slowPath = addSlowPath(SlowPath::Kind::CALL, code, operand, offset);
+            assembler.movLoad(X64Assembler::RAX, GLOBALS, slotDisplacement(static_cast<int32_t>(operand)));
+            assembler.movImmediate(X64Assembler::RCX, CLoxLiteral::Undefined().getBits());
+            assembler.cmpRegister(X64Assembler::RAX, X64Assembler::RCX);
+            slowPath.jumps.push_back(assembler.jcc(X64Assembler::EQUAL));
+            pushRegister(X64Assembler::RAX);
+            slowPath.resume = assembler.size();
+            break;
+        }
+        case OpCode::OP_SET_GLOBAL: {
+            SlowPath &slowPath = addSlowPath(SlowPath::Kind::CALL, code, operand, offset);
+            assembler.movLoad(X64Assembler::RAX, GLOBALS, slotDisplacement(static_cast<int32_t>(operand)));
+            assembler.movImmediate(X64Assembler::RCX, CLoxLiteral::Undefined().getBits());
+            assembler.cmpRegister(X64Assembler::RAX, X64Assembler::RCX);
+            slowPath.jumps.push_back(assembler.jcc(X64Assembler::EQUAL));
+            assembler.movLoad(X64Assembler::RAX, STACK_TOP, slotDisplacement(-1));
+            assembler.movStore(GLOBALS, slotDisplacement(static_cast<int32_t>(operand)), X64Assembler::RAX);
+            slowPath.resume = assembler.size();
+            break;
+        }
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+            compileArithmetic(code, offset);
+            break;
+        case OpCode::OP_NEGATE:
+            compileNegate(offset);
+            break;
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_LESS:
+            compileComparison(code, offset);
+            break;
+        case OpCode::OP_JUMP:
+            jumpToInstruction(chunk->jumpTarget(offset));
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+            compileJumpIfFalse(offset);
+            break;
+        case OpCode::OP_LOOP:
+            compileLoop(offset);
+            break;
+        default: {
+            Stencil stencil = BaselineStencils::forOpCode(code);
+            assert(stencil != nullptr);
+            callStencil(reinterpret_cast<const void*>(stencil), operand, offset);
+        }
+    }
+}
+
+//the inline code only handles numbers, strings and type errors go through the stencil
+void BaselineCompiler::compileArithmetic(OpCode code, int offset) {
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::CALL, code, 0, offset);
+    checkNumber(slotDisplacement(-2), slowPath);
+    checkNumber(slotDisplacement(-1), slowPath);
+    assembler.movsdLoad(X64Assembler::XMM0, STACK_TOP, slotDisplacement(-2));
+    assembler.movsdLoad(X64Assembler::XMM1, STACK_TOP, slotDisplacement(-1));
+
+    switch (code) {
+        case OpCode::OP_ADD:
+            assembler.addsd(X64Assembler::XMM0, X64Assembler::XMM1);
+            break;
+        case OpCode::OP_SUBTRACT:
+            assembler.subsd(X64Assembler::XMM0, X64Assembler::XMM1);
+            break;
+        case OpCode::OP_MULTIPLY:
+            assembler.mulsd(X64Assembler::XMM0, X64Assembler::XMM1);
+            break;
+        default:
+            //a zero (or NaN) divisor sets ZF, the stencil reports the division by zero
+            assembler.xorpd(X64Assembler::XMM2, X64Assembler::XMM2);
+            assembler.ucomisd(X64Assembler::XMM1, X64Assembler::XMM2);
+            slowPath.jumps.push_back(assembler.jcc(X64Assembler::EQUAL));
+            assembler.divsd(X64Assembler::XMM0, X64Assembler::XMM1);
+    }
+
+    assembler.movsdStore(STACK_TOP, slotDisplacement(-2), X64Assembler::XMM0);
+    assembler.addImmediate(STACK_TOP, -static_cast<int32_t>(sizeof(CLoxLiteral)));
+    slowPath.resume = assembler.size();
+}
+
+void BaselineCompiler::compileNegate(int offset) {
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::CALL, OpCode::OP_NEGATE, 0, offset);
+    checkNumber(slotDisplacement(-1), slowPath);
+    assembler.movLoad(X64Assembler::RAX, STACK_TOP, slotDisplacement(-1));
+    assembler.movImmediate(X64Assembler::RCX, CLoxLiteral::SIGN_BIT);
+    assembler.xorRegister(X64Assembler::RAX, X64Assembler::RCX);
+    assembler.movStore(STACK_TOP, slotDisplacement(-1), X64Assembler::RAX);
+    slowPath.resume = assembler.size();
+}
+
+//ucomisd sets ZF, PF and CF for unordered operands, so every comparison with a NaN is false like in C++
+void BaselineCompiler::compileComparison(OpCode code, int offset) {
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::CALL, code, 0, offset);
+    checkNumber(slotDisplacement(-2), slowPath);
+    checkNumber(slotDisplacement(-1), slowPath);
+    assembler.movsdLoad(X64Assembler::XMM0, STACK_TOP, slotDisplacement(-2));
+    assembler.movsdLoad(X64Assembler::XMM1, STACK_TOP, slotDisplacement(-1));
+    assembler.addImmediate(STACK_TOP, -static_cast<int32_t>(sizeof(CLoxLiteral)));
+    assembler.movImmediate(X64Assembler::RAX, CLoxLiteral(false).getBits());
+    assembler.movImmediate(X64Assembler::RCX, CLoxLiteral(true).getBits());
+
+    std::vector<int> isFalse;
+    if (code == OpCode::OP_EQUAL){
+        assembler.ucomisd(X64Assembler::XMM0, X64Assembler::XMM1);
+        isFalse.push_back(assembler.jcc(X64Assembler::NOT_EQUAL));
+        isFalse.push_back(assembler.jcc(X64Assembler::PARITY));
+    } else {
+        if (code == OpCode::OP_LESS){
+            assembler.ucomisd(X64Assembler::XMM1, X64Assembler::XMM0); //a < b is b > a
+        } else {
+            assembler.ucomisd(X64Assembler::XMM0, X64Assembler::XMM1);
+        }
+        isFalse.push_back(assembler.jcc(X64Assembler::BELOW_OR_EQUAL));
+    }
+    assembler.movRegister(X64Assembler::RAX, X64Assembler::RCX);
+    for (int jump : isFalse){
+        assembler.bind(jump, assembler.size());
+    }
+    assembler.movStore(STACK_TOP, slotDisplacement(-1), X64Assembler::RAX);
+    slowPath.resume = assembler.size();
+}
+
+//the condition stays on the stack, like with OP_JUMP_IF_FALSE
+void BaselineCompiler::compileLessJumpIfFalse(int offset) {
+    int target = chunk->jumpTarget(offset);
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::BRANCH, OpCode::OP_LESS_JUMP_IF_FALSE, 0, offset);
+    slowPath.target = target;
+    checkNumber(slotDisplacement(-2), slowPath);
+    checkNumber(slotDisplacement(-1), slowPath);
+    assembler.movsdLoad(X64Assembler::XMM0, STACK_TOP, slotDisplacement(-2));
+    assembler.movsdLoad(X64Assembler::XMM1, STACK_TOP, slotDisplacement(-1));
+    assembler.addImmediate(STACK_TOP, -static_cast<int32_t>(sizeof(CLoxLiteral)));
+
+    //a < b is b > a, which is false for unordered operands like in C++
+    assembler.ucomisd(X64Assembler::XMM1, X64Assembler::XMM0);
+    assembler.movImmediate(X64Assembler::RAX, CLoxLiteral(false).getBits());
+    assembler.movImmediate(X64Assembler::RCX, CLoxLiteral(true).getBits());
+    int isLess = assembler.jcc(X64Assembler::ABOVE);
+    assembler.movStore(STACK_TOP, slotDisplacement(-1), X64Assembler::RAX);
+    jumpToInstruction(target);
+    assembler.bind(isLess, assembler.size());
+    assembler.movStore(STACK_TOP, slotDisplacement(-1), X64Assembler::RCX);
+    slowPath.resume = assembler.size();
+}
+
+//booleans are tested inline, the truthiness of any other value is left to the stencil
+void BaselineCompiler::compileJumpIfFalse(int offset) {
+    int target = chunk->jumpTarget(offset);
+    assembler.movLoad(X64Assembler::RAX, STACK_TOP, slotDisplacement(-1));
+    assembler.movImmediate(X64Assembler::RCX, CLoxLiteral(false).getBits());
+    assembler.cmpRegister(X64Assembler::RAX, X64Assembler::RCX);
+    jumpToInstruction(X64Assembler::EQUAL, target);
+
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::BRANCH, OpCode::OP_JUMP_IF_FALSE, 0, offset);
+    slowPath.target = target;
+    assembler.movImmediate(X64Assembler::RCX, CLoxLiteral(true).getBits());
+    assembler.cmpRegister(X64Assembler::RAX, X64Assembler::RCX);
+    slowPath.jumps.push_back(assembler.jcc(X64Assembler::NOT_EQUAL));
+    slowPath.resume = assembler.size();
+}
+
+//Back edges count towards the TracingJit's threshold like in the interpreter, so hot loops of generated code still get
+//traced. The trace can stop at any instruction, so the stencil returns the address to continue at.
+void BaselineCompiler::compileLoop(int offset) {
+    int header = chunk->jumpTarget(offset);
+#ifdef TRACING_JIT
+    assembler.movImmediate(X64Assembler::RAX, reinterpret_cast<uint64_t>(chunk->loopCounters.data() + header));
+    assembler.addMemory32(X64Assembler::RAX, 0, 1);
+    assembler.cmpMemory32(X64Assembler::RAX, 0, TracingJit::HOT_LOOP_THRESHOLD);
+    SlowPath &slowPath = addSlowPath(SlowPath::Kind::HOT_LOOP, OpCode::OP_LOOP, static_cast<uint32_t>(header), offset);
+    slowPath.jumps.push_back(assembler.jcc(X64Assembler::GREATER_OR_EQUAL));
+#endif
+    jumpToInstruction(header);
+}
+
+void BaselineCompiler::pushRegister(Register source) {
+    assembler.movStore(STACK_TOP, 0, source);
+    assembler.addImmediate(STACK_TOP, static_cast<int32_t>(sizeof(CLoxLiteral)));
+}
+
+void BaselineCompiler::pushBits(uint64_t bits) {
+    assembler.movImmediate(X64Assembler::RAX, bits);
+    pushRegister(X64Assembler::RAX);
+}
+
+void BaselineCompiler::checkNumber(int32_t displacement, SlowPath &slowPath) {
+    assembler.movLoad(X64Assembler::RAX, STACK_TOP, displacement);
+    assembler.andRegister(X64Assembler::RAX, NAN_MASK);
+    assembler.cmpRegister(X64Assembler::RAX, NAN_MASK);
+    slowPath.jumps.push_back(assembler.jcc(X64Assembler::EQUAL));
+}
+
+void BaselineCompiler::jumpToInstruction(int target) {
+    instructionJumps.push_back({assembler.jmp(), target});
+}
+
+void BaselineCompiler::jumpToInstruction(X64Assembler::Condition condition, int target) {
+    instructionJumps.push_back({assembler.jcc(condition), target});
+}
+
+//the returned reference is only valid until the next slow path is added
+BaselineCompiler::SlowPath &BaselineCompiler::addSlowPath(SlowPath::Kind kind, OpCode code, uint32_t operand, int offset) {
+    SlowPath slowPath;
+    slowPath.kind = kind;
+    slowPath.opCode = code;
+    slowPath.operand = operand;
+    slowPath.offset = offset;
+    slowPaths.push_back(slowPath);
+    return slowPaths.back();
+}
+
+//calls a Stencil and takes the top of the stack it returns, leaving the value it returns in rdx
+void BaselineCompiler::callStencil(const void *stencil, uint32_t operand, int offset) {
+    assembler.movRegister(X64Assembler::RDI, VM_POINTER);
+    assembler.movRegister(X64Assembler::RSI, STACK_TOP);
+    assembler.movImmediate(X64Assembler::RDX, operand);
+    assembler.movImmediate(X64Assembler::RCX, static_cast<uint32_t>(offset));
+    auto next = offset + Chunk::instructionLength(static_cast<OpCode>(chunk->readByte(offset)));
+    assembler.movImmediate(X64Assembler::R8, static_cast<uint32_t>(next));
+    assembler.movImmediate(X64Assembler::RAX, reinterpret_cast<uint64_t>(stencil));
+    assembler.callRegister(X64Assembler::RAX);
+    assembler.testRegister(X64Assembler::RAX, X64Assembler::RAX);
+    errorJumps.push_back(assembler.jcc(X64Assembler::EQUAL));
+    assembler.movRegister(STACK_TOP, X64Assembler::RAX);
+}
+
+void BaselineCompiler::emitSlowPaths() {
+    for (const SlowPath &slowPath : slowPaths){
+        for (int jump : slowPath.jumps){
+            assembler.bind(jump, assembler.size());
+        }
+
+        switch (slowPath.kind) {
+            case SlowPath::Kind::CALL:
+                callStencil(reinterpret_cast<const void*>(BaselineStencils::forOpCode(slowPath.opCode)), slowPath.operand, slowPath.offset);
+                assembler.jmpTo(slowPath.resume);
+                break;
+            case SlowPath::Kind::BRANCH:
+                callStencil(reinterpret_cast<const void*>(BaselineStencils::forOpCode(slowPath.opCode)), slowPath.operand, slowPath.offset);
+                assembler.testRegister(X64Assembler::RDX, X64Assembler::RDX);
+                jumpToInstruction(X64Assembler::EQUAL, slowPath.target);
+                assembler.jmpTo(slowPath.resume);
+                break;
+            case SlowPath::Kind::HOT_LOOP:
+#ifdef TRACING_JIT
+                callStencil(reinterpret_cast<const void*>(BaselineStencils::hotLoop), slowPath.operand, slowPath.offset);
+                assembler.jmpRegister(X64Assembler::RDX);
+#endif
+                break;
+        }
+    }
+}
+
+int32_t BaselineCompiler::slotDisplacement(int32_t slot) {
+    return slot * static_cast<int32_t>(sizeof(CLoxLiteral));
+}
@@ -0,0 +1,118 @@
+#ifndef CLOX_BASELINECOMPILER_H
+#define CLOX_BASELINECOMPILER_H
+
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include "Chunk.h"
+#include "CLoxLiteral.h"
+#include "X64Assembler.h"
+#include "ExecutableMemory.h"
+#include "BaselineStencils.h"
+
+class VM;
+
+class CompiledChunk {
+public:
+    CompiledChunk(std::unique_ptr<ExecutableMemory> memory, std::vector<int> instructionAddresses);
+
+    //Runs the chunk from its first instruction until OP_RETURN. Returns the final top of the stack, or nullptr if a
+    //stencil threw a runtime error.
+    CLoxLiteral *run(VM *vm, CLoxLiteral *stackTop, CLoxLiteral *frame, CLoxLiteral *globals) const;
+
+    //machine code address of the instruction that starts at offset
+    const void *address(int offset) const;
+
+private:
+    using Entry = CLoxLiteral *(*)(VM *vm, CLoxLiteral *stackTop, CLoxLiteral *frame, CLoxLiteral *globals);
+
+    std::unique_ptr<ExecutableMemory> memory;
+    std::vector<int> instructionAddresses; //code offset of every instruction, indexed by its bytecode offset
+};
+
+/* Compiles a whole chunk to x86-64 code in the style of a copy-and-patch compiler: every opcode has a stencil, a fixed
+ * piece of machine code with holes for the operands of the instruction (constant bits, slot displacements and jump
+ * targets), and the chunk's code is those stencils copied one after another with the holes patched. There is no
+ * analysis or register allocation, so compiling costs about as much as reading the bytecode once.
+ *
+ * The generated code keeps the VM's stack layout, it only keeps the top of the stack in a register instead of in
+ * VM::stackTop. Loads, stores, jumps and arithmetic on numbers are emitted inline. Everything else, and the cases the
+ * inline code does not handle (like adding strings), calls the precompiled stencils in BaselineStencils, which run the
+ * instruction with the VM's own helpers.
+ */
+class BaselineCompiler {
+public:
+    //With executingOffsetDisplacement, every instruction stores its offset at that displacement from the VM pointer
+    //first, which is VM::executingOffset for the SamplingProfiler
+    explicit BaselineCompiler(Chunk *chunk, std::optional<int32_t> executingOffsetDisplacement = std::nullopt);
+
+    //returns nullptr if the code cannot be made executable
+    std::unique_ptr<CompiledChunk> compile();
+
+private:
+    using Register = X64Assembler::Register;
+
+    //the state of the interpreter loop, kept in callee saved registers so stencil calls preserve it
+    static const Register VM_POINTER = X64Assembler::RBX;
+    static const Register STACK_TOP = X64Assembler::R12;
+    static const Register FRAME = X64Assembler::R13;
+    static const Register GLOBALS = X64Assembler::R14;
+    static const Register NAN_MASK = X64Assembler::R15; //CLoxLiteral::QUIET_NAN, for type checks
+
+    //code emitted after the body for the cases the inline code leaves to a stencil
+    struct SlowPath {
+        enum class Kind {
+            CALL,   //call the stencil and continue after the inline code
+            BRANCH, //call the stencil and jump to target if the condition it returns is false
+            HOT_LOOP
+        };
+
+        Kind kind = Kind::CALL;
+        std::vector<int> jumps;
+        OpCode opCode = OpCode::OP_COUNT;
+        uint32_t operand = 0;
+        int offset = 0;
+        int target = 0; //bytecode offset of the branch target
+        int resume = 0;
+    };
+
+    //a jump to the instruction at a bytecode offset, bound once every instruction has an address
+    struct InstructionJump {
+        int displacementOffset;
+        int target;
+    };
+
+    Chunk *chunk;
+    std::optional<int32_t> executingOffsetDisplacement;
+    X64Assembler assembler;
+    std::vector<int> instructionAddresses;
+    std::vector<SlowPath> slowPaths;
+    std::vector<InstructionJump> instructionJumps;
+    std::vector<int> errorJumps;
+
+    void emitPrologue();
+    void emitEpilogue();
+    void compileInstruction(int offset);
+    void compileComponent(OpCode code, uint32_t operand, int offset);
+    void compileArithmetic(OpCode code, int offset);
+    void compileNegate(int offset);
+    void compileComparison(OpCode code, int offset);
+    void compileLessJumpIfFalse(int offset);
+    void compileJumpIfFalse(int offset);
+    void compileLoop(int offset);
+
+    void pushRegister(Register source);
+    void pushBits(uint64_t bits);
+    void checkNumber(int32_t displacement, SlowPath &slowPath); //of the stack slot at STACK_TOP + displacement
+    void jumpToInstruction(int target);
+    void jumpToInstruction(X64Assembler::Condition condition, int target);
+    SlowPath &addSlowPath(SlowPath::Kind kind, OpCode code, uint32_t operand, int offset);
+    void callStencil(const void *stencil, uint32_t operand, int offset);
+    void emitSlowPaths();
+
+    static int32_t slotDisplacement(int32_t slot); //negative slots are relative to the top of the stack
+};
+
+
+#endif //CLOX_BASELINECOMPILER_H
@@ -0,0 +1,47 @@
+#include "BaselineJit.h"
+#include "SamplingProfiler.h"
+#include "VM.h"
+
+bool BaselineJit::execute(VM *vm, Chunk *chunk, CLoxLiteral *&stackTop, CLoxLiteral *frame, CLoxLiteral *globals) {
+    if (chunk->containsFunctions()){
+        //compiled code has no way to enter the frame of another chunk
+        return false;
+    }
+
+    auto found = chunks.find(chunk);
+    if (found == chunks.end()){
+        //the stores that keep VM::executingOffset up to date are only emitted while profiling
+        std::optional<int32_t> executingOffsetDisplacement;
+#ifdef SAMPLING_PROFILER
+        if (SamplingProfiler::isRunning()){
+            executingOffsetDisplacement = static_cast<int32_t>(reinterpret_cast<const volatile char*>(&vm->executingOffset) - reinterpret_cast<const volatile char*>(vm));
+        }
+#endif
+        found = chunks.emplace(chunk, BaselineCompiler(chunk, executingOffsetDisplacement).compile()).first;
+    }
+    if (found->second == nullptr){
+        return false;
+    }
+
+    CLoxLiteral *result = found->second->run(vm, stackTop, frame, globals);
+    vm->executingOffset = -1;
+    if (result == nullptr){
+        std::exception_ptr error = pendingError;
+        pendingError = nullptr;
+        std::rethrow_exception(error);
+    }
+    stackTop = result;
+    return true;
+}
+
+const void *BaselineJit::address(const Chunk *chunk, int offset) const {
+    return chunks.at(chunk)->address(offset);
+}
+
+void BaselineJit::raise(std::exception_ptr error) {
+    pendingError = std::move(error);
+}
+
+void BaselineJit::clear() {
+    chunks.clear();
+}
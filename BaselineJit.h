@@ -0,0 +1,39 @@
+#ifndef CLOX_BASELINEJIT_H
+#define CLOX_BASELINEJIT_H
+
+
+#include <map>
+#include <memory>
+#include <exception>
+#include "BaselineCompiler.h"
+
+/* The first tier of the stack VM: every chunk is compiled by the BaselineCompiler the first time it runs, and the VM
+ * runs the machine code instead of interpreting the bytecode. Compiling is a single pass over the bytecode, so it pays
+ * off even for scripts that finish before any loop gets hot. Hot loops still go to the TracingJit.
+ *
+ * Built with BASELINE_JIT (cmake -DCLOX_BASELINE_JIT=ON, the default), which has the same requirements as the
+ * TracingJit. Builds that profile or debug print opcodes always interpret.
+ */
+class BaselineJit {
+public:
+    //Runs chunk from its first instruction until its OP_RETURN and sets stackTop to where it ended. Returns false without
+    //running anything if the chunk cannot be compiled or declares functions, in which case the interpreter has to run it.
+    //A runtime error of the script is thrown like the interpreter throws it.
+    bool execute(VM *vm, Chunk *chunk, CLoxLiteral *&stackTop, CLoxLiteral *frame, CLoxLiteral *globals);
+
+    //machine code address of the instruction at offset in a chunk that is running
+    const void *address(const Chunk *chunk, int offset) const;
+
+    //called by the stencils with the exception they caught, which execute rethrows
+    void raise(std::exception_ptr error);
+
+    //drops the code of every chunk, called before the VM runs another script whose chunks may reuse their addresses
+    void clear();
+
+private:
+    std::map<const Chunk*, std::unique_ptr<CompiledChunk>> chunks;
+    std::exception_ptr pendingError;
+};
+
+
+#endif //CLOX_BASELINEJIT_H
@@ -0,0 +1,187 @@
+#include <iostream>
+#include <exception>
+#include "BaselineStencils.h"
+#include "VM.h"
+
+Stencil BaselineStencils::forOpCode(OpCode code) {
+    switch (code) {
+        case OpCode::OP_PRINT: return guarded<print>;
+        case OpCode::OP_NEGATE: return guarded<negate>;
+        case OpCode::OP_ADD: return guarded<add>;
+        case OpCode::OP_SUBTRACT: return guarded<subtract>;
+        case OpCode::OP_MULTIPLY: return guarded<multiply>;
+        case OpCode::OP_DIVIDE: return guarded<divide>;
+        case OpCode::OP_NOT: return guarded<notValue>;
+        case OpCode::OP_EQUAL: return guarded<equal>;
+        case OpCode::OP_GREATER: return guarded<greater>;
+        case OpCode::OP_LESS: return guarded<less>;
+        case OpCode::OP_DEFINE_GLOBAL: return guarded<defineGlobal>;
+        case OpCode::OP_GET_GLOBAL: return guarded<getGlobal>;
+        case OpCode::OP_SET_GLOBAL: return guarded<setGlobal>;
+        case OpCode::OP_CLASS: return guarded<makeClass>;
+        case OpCode::OP_CALL: return guarded<call>;
+        case OpCode::OP_GET_PROPERTY: return guarded<getProperty>;
+        case OpCode::OP_INVOKE: return guarded<invoke>;
+        case OpCode::OP_SET_PROPERTY: return guarded<setProperty>;
+        case OpCode::OP_ALLOCATE: return guarded<allocate>;
+        case OpCode::OP_JUMP_IF_FALSE: return jumpIfFalse;
+        case OpCode::OP_LESS_JUMP_IF_FALSE: return lessJumpIfFalse;
+        default: return nullptr;
+    }
+}
+
+#ifdef TRACING_JIT
+StencilResult BaselineStencils::hotLoop(VM *vm, CLoxLiteral *stackTop, uint32_t header, uint32_t, uint32_t next) {
+    try {
+        enter(vm, stackTop, next);
+        CLoxLiteral *frame = vm->stack.get() + vm->currentFrame.stackIndex;
+        int resume = vm->jit.runHotLoop(vm->currentChunk(), static_cast<int>(header), frame, stackTop, vm->globals->values.data());
+        return {stackTop, reinterpret_cast<uint64_t>(vm->baselineJit.address(vm->currentChunk(), resume))};
+    } catch (...) {
+        fail(vm);
+        return {nullptr, 0};
+    }
+}
+#endif
+
+template<CLoxLiteral *(*body)(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next)>
+StencilResult BaselineStencils::guarded(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next) {
+    try {
+        enter(vm, stackTop, next);
+        return {body(vm, stackTop, operand, offset, next), 0};
+    } catch (...) {
+        fail(vm);
+        return {nullptr, 0};
+    }
+}
+
+StencilResult BaselineStencils::jumpIfFalse(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    return {stackTop, vm->isTruthy(stackTop[-1])};
+}
+
+StencilResult BaselineStencils::lessJumpIfFalse(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next) {
+    StencilResult result = guarded<less>(vm, stackTop, operand, offset, next);
+    if (result.stackTop != nullptr){
+        result.value = vm->isTruthy(result.stackTop[-1]);
+    }
+    return result;
+}
+
+//what the interpreter does before calling a helper: errors are reported at the end of the instruction, like SAVE_PC
+void BaselineStencils::enter(VM *vm, CLoxLiteral *stackTop, uint32_t next) {
+    vm->stackTop = stackTop;
+    vm->currentFrame.programCounter = static_cast<int>(next);
+}
+
+void BaselineStencils::fail(VM *vm) {
+    vm->baselineJit.raise(std::current_exception());
+}
+
+CLoxLiteral *BaselineStencils::print(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    vm->out << stackTop[-1] << "\n";
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::negate(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-1] = vm->negate(stackTop[-1]);
+    return stackTop;
+}
+
+CLoxLiteral *BaselineStencils::add(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->add(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::subtract(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->subtract(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::multiply(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->multiply(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::divide(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->divide(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::notValue(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-1] = CLoxLiteral(!vm->isTruthy(stackTop[-1]));
+    return stackTop;
+}
+
+CLoxLiteral *BaselineStencils::equal(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->equal(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::greater(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->greater(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::less(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-2] = vm->less(stackTop[-2], stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::defineGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t, uint32_t) {
+    vm->defineGlobal(operand, stackTop[-1]);
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::getGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t, uint32_t) {
+    *stackTop = vm->getGlobal(operand);
+    return stackTop + 1;
+}
+
+CLoxLiteral *BaselineStencils::setGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t, uint32_t) {
+    vm->setGlobal(operand, stackTop[-1]);
+    return stackTop;
+}
+
+CLoxLiteral *BaselineStencils::makeClass(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t, uint32_t) {
+    auto *name = static_cast<StringObj*>(vm->currentChunk()->constants[operand].getObj());
+    *stackTop = vm->makeClass(name);
+    return stackTop + 1;
+}
+
+CLoxLiteral *BaselineStencils::call(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t, uint32_t) {
+    //the operand is the argument count. Compiled chunks declare no functions, so the callee is never one
+    auto argCount = static_cast<int>(operand);
+    stackTop[-1 - argCount] = vm->instantiate(stackTop[-1 - argCount], argCount);
+    return stackTop - argCount;
+}
+
+CLoxLiteral *BaselineStencils::getProperty(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t) {
+    Chunk *chunk = vm->currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[operand].getObj());
+    stackTop[-1] = vm->getProperty(stackTop[-1], name, chunk->propertyCaches[offset]);
+    return stackTop;
+}
+
+CLoxLiteral *BaselineStencils::invoke(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t) {
+    //compiled chunks declare no functions, so there are no methods and the property can only be a field that is called
+    Chunk *chunk = vm->currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[operand >> 8u].getObj());
+    auto argCount = static_cast<int>(operand & 0xffu);
+    CLoxLiteral &receiver = stackTop[-1 - argCount];
+    receiver = vm->getProperty(receiver, name, chunk->propertyCaches[offset]);
+    receiver = vm->instantiate(receiver, argCount);
+    return stackTop - argCount;
+}
+
+CLoxLiteral *BaselineStencils::setProperty(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t) {
+    Chunk *chunk = vm->currentChunk();
+    auto *name = static_cast<StringObj*>(chunk->constants[operand].getObj());
+    vm->setProperty(stackTop[-2], name, stackTop[-1], chunk->propertyCaches[offset]);
+    stackTop[-2] = stackTop[-1];
+    return stackTop - 1;
+}
+
+CLoxLiteral *BaselineStencils::allocate(VM *vm, CLoxLiteral *stackTop, uint32_t, uint32_t, uint32_t) {
+    stackTop[-1] = vm->allocate(stackTop[-1]);
+    return stackTop;
+}
@@ -0,0 +1,68 @@
+#ifndef CLOX_BASELINESTENCILS_H
+#define CLOX_BASELINESTENCILS_H
+
+
+#include <cstdint>
+#include "Chunk.h"
+#include "CLoxLiteral.h"
+
+class VM;
+
+//Returned in rax and rdx by the System V calling convention. stackTop is nullptr if the stencil threw a runtime error
+struct StencilResult {
+    CLoxLiteral *stackTop;
+    uint64_t value; //the condition of a branch, or where to continue after a hot loop
+};
+
+//operand is the operand of the instruction, offset the bytecode offset of the instruction it belongs to and next the
+//offset of the instruction after it
+using Stencil = StencilResult (*)(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+
+/* The precompiled part of the BaselineCompiler's stencils: the instructions that are too large to emit inline are
+ * compiled to calls to these functions, which run them on the VM exactly like the interpreter does. They take the top of
+ * the stack the generated code keeps in a register, and publish it in VM::stackTop before doing anything that can run
+ * the GC. Exceptions must not unwind through generated code, so every stencil catches them and hands them to the
+ * BaselineJit, which rethrows them once the generated code has returned.
+ */
+class BaselineStencils {
+public:
+    //returns the stencil of an instruction or superinstruction component, nullptr for those that are always inline
+    static Stencil forOpCode(OpCode code);
+
+#ifdef TRACING_JIT
+    //called once a loop of generated code gets hot, value is the address the generated code continues at
+    static StencilResult hotLoop(VM *vm, CLoxLiteral *stackTop, uint32_t header, uint32_t offset, uint32_t next);
+#endif
+
+private:
+    template<CLoxLiteral *(*body)(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next)>
+    static StencilResult guarded(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static StencilResult jumpIfFalse(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static StencilResult lessJumpIfFalse(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+
+    static void enter(VM *vm, CLoxLiteral *stackTop, uint32_t next);
+    static void fail(VM *vm);
+
+    static CLoxLiteral *print(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *negate(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *add(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *subtract(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *multiply(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *divide(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *notValue(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *equal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *greater(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *less(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *defineGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *getGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *setGlobal(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *makeClass(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *call(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *getProperty(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *invoke(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *setProperty(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+    static CLoxLiteral *allocate(VM *vm, CLoxLiteral *stackTop, uint32_t operand, uint32_t offset, uint32_t next);
+};
+
+
+#endif //CLOX_BASELINESTENCILS_H
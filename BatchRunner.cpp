@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <thread>
+#include "BatchRunner.h"
+#include "FileReader.h"
+#include "LoxError.h"
+#include "Scanner.h"
+#include "Compiler.h"
+
+//The GC log is only written for a single script, the allocations of scripts on different threads would interleave. The
+//other workers already keep the cores busy, so collections do not start threads of their own
+BatchRunner::Slot::Slot() : vm(heap, output) {
+    heap.log = nullptr;
+    heap.markThreadCount = 1;
+}
+
+BatchRunner::BatchRunner(const std::vector<std::string> &scriptFiles, unsigned threadCount) {
+    for (const std::string &scriptFile : scriptFiles){
+        jobs.push_back(Job{scriptFile, ExecutionResult::OK, ""});
+    }
+
+    if (threadCount == 0){
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    size_t workerCount = std::max<size_t>(std::min<size_t>(threadCount, jobs.size()), 1);
+    for (size_t i = 0; i < workerCount; i++){
+        auto worker = std::make_unique<Worker>();
+        worker->freeSlots = {&worker->slots[0], &worker->slots[1]};
+        workers.push_back(std::move(worker));
+    }
+    for (size_t i = 0; i < jobs.size(); i++){
+        workers[i % workerCount]->jobs.push_back(i);
+    }
+}
+
+std::vector<BatchRunner::Job> BatchRunner::run() {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); i++){
+        threads.emplace_back(&BatchRunner::prepareJobs, this, i);
+        threads.emplace_back(&BatchRunner::runJobs, this, i);
+    }
+    for (std::thread &thread : threads){
+        thread.join();
+    }
+    return std::move(jobs);
+}
+
+std::vector<std::string> BatchRunner::readManifest(const std::string &manifestFile) {
+    std::istringstream manifest(FileReader(manifestFile).readAll());
+    std::vector<std::string> scriptFiles;
+    std::string line;
+    while (std::getline(manifest, line)){
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if (!line.empty() && line[0] != '#'){
+            scriptFiles.push_back(line);
+        }
+    }
+    return scriptFiles;
+}
+
+//No jobs are added once the batch runs, so when every queue is empty the worker is done
+bool BatchRunner::takeJob(size_t worker, size_t &job) {
+    for (size_t i = 0; i < workers.size(); i++){
+        Worker &victim = *workers[(worker + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.jobsMutex);
+        if (victim.jobs.empty()){
+            continue;
+        }
+        if (i == 0){
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+        } else {
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+//The compiling thread of a worker. It only takes a job once it has a slot to compile it into, so a job is never held up
+//waiting while another worker could steal it
+void BatchRunner::prepareJobs(size_t index) {
+    Worker &worker = *workers[index];
+    while (true){
+        Slot *slot;
+        {
+            std::unique_lock<std::mutex> lock(worker.slotsMutex);
+            worker.slotsChanged.wait(lock, [&worker]() { return !worker.freeSlots.empty(); });
+            slot = worker.freeSlots.front();
+            worker.freeSlots.pop_front();
+        }
+
+        size_t job;
+        bool hasJob = takeJob(index, job);
+        if (hasJob){
+            prepare(*slot, jobs[job]);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(worker.slotsMutex);
+            if (hasJob){
+                worker.preparedSlots.push_back(slot);
+            } else {
+                worker.freeSlots.push_back(slot);
+                worker.finished = true;
+            }
+        }
+        worker.slotsChanged.notify_all();
+        if (!hasJob){
+            return;
+        }
+    }
+}
+
+//the executing thread of a worker, runs the scripts in the order they were prepared
+void BatchRunner::runJobs(size_t index) {
+    Worker &worker = *workers[index];
+    while (true){
+        Slot *slot;
+        {
+            std::unique_lock<std::mutex> lock(worker.slotsMutex);
+            worker.slotsChanged.wait(lock, [&worker]() { return !worker.preparedSlots.empty() || worker.finished; });
+            if (worker.preparedSlots.empty()){
+                return;
+            }
+            slot = worker.preparedSlots.front();
+            worker.preparedSlots.pop_front();
+        }
+
+        execute(*slot);
+
+        {
+            std::lock_guard<std::mutex> lock(worker.slotsMutex);
+            worker.freeSlots.push_back(slot);
+        }
+        worker.slotsChanged.notify_all();
+    }
+}
+
+//reads, scans and compiles the script of job, reporting errors the way clox does for a single script
+void BatchRunner::prepare(Slot &slot, Job &job) {
+    slot.heap.freeAllHeapObjects(); //what the previous script left behind if a runtime error stopped it
+    slot.globals = GlobalVariables();
+    slot.output.str("");
+    slot.output.clear();
+    slot.job = &job;
+    slot.function = nullptr;
+
+    std::string code;
+    try {
+        FileReader reader(job.scriptFile);
+        code = reader.readAll();
+    } catch (const LoxFileNotFoundError &error) {
+        slot.output << error.what() << "\n";
+        job.result = ExecutionResult::COMPILE_ERROR;
+        return;
+    } catch (...) {
+        slot.output << "Unknown error occurred while reading file\n";
+        job.result = ExecutionResult::COMPILE_ERROR;
+        return;
+    }
+
+    std::vector<Token> tokens;
+    try {
+        tokens = Scanner(code).scanTokens();
+    } catch (const LoxScanningError &exception) {
+        slot.output << exception.what() << "\n";
+        job.result = ExecutionResult::COMPILE_ERROR;
+        return;
+    }
+
+    Compiler compiler(slot.globals, slot.heap, slot.output);
+    bool successFlag;
+    FunctionObj *function = compiler.compile(tokens, successFlag);
+    if (!successFlag){
+        job.result = ExecutionResult::COMPILE_ERROR;
+        return;
+    }
+    slot.function = function;
+}
+
+void BatchRunner::execute(Slot &slot) {
+    Job &job = *slot.job;
+    if (slot.function != nullptr){
+        try {
+            job.result = slot.vm.execute(slot.function, slot.globals);
+        } catch (const LoxVerificationError &error) {
+            slot.output << error.what() << "\n";
+            job.result = ExecutionResult::COMPILE_ERROR;
+        } catch (const LoxRuntimeError &error) {
+            slot.output << error.what() << "\n";
+            job.result = ExecutionResult::RUNTIME_ERROR;
+        }
+    }
+    job.output = slot.output.str();
+}
@@ -0,0 +1,82 @@
+#ifndef CLOX_BATCHRUNNER_H
+#define CLOX_BATCHRUNNER_H
+
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "VM.h"
+#include "Memory.h"
+
+/* Runs many scripts in one process on a pool of worker threads (clox --batch). Every script runs as if it was the only
+ * one: it gets its own globals and its output and errors are collected separately, they are what clox would have printed
+ * for it. Scripts never share a heap, so the workers do not synchronize while they run (see Memory).
+ *
+ * The scripts are dealt out round-robin to a queue per worker. A worker takes the next script from the front of its own
+ * queue, and once that is empty it steals from the back of the others, so a worker that drew long scripts does not hold
+ * up the batch. Every worker owns two heaps and a VM on each, which are reused for all of its scripts, and is run by two
+ * threads: one reads, scans and compiles the next script into one heap while the other runs the previous script on the
+ * other, so preparing a script overlaps with executing the one before it.
+ *
+ * The OpcodeProfiler and the InstructionCounter keep process wide counters, so builds with either of them must not run a
+ * batch, clox --batch refuses to.
+ */
+class BatchRunner {
+public:
+    struct Job {
+        std::string scriptFile;
+        ExecutionResult result = ExecutionResult::OK;
+        std::string output; //everything the script printed, followed by the message of the error that stopped it if any
+    };
+
+    //runs on threadCount workers, or one per hardware thread if it is 0. There are never more workers than scripts
+    explicit BatchRunner(const std::vector<std::string> &scriptFiles, unsigned threadCount = 0);
+
+    //runs every script and returns them in the order they were given
+    std::vector<Job> run();
+
+    //paths of the scripts listed in a manifest file, one per line. Empty lines and lines starting with # are skipped
+    static std::vector<std::string> readManifest(const std::string &manifestFile);
+
+private:
+    //a script being compiled or run by a worker, with the heap and VM it uses for it
+    struct Slot {
+        Slot();
+
+        Memory heap;
+        std::ostringstream output;
+        VM vm;
+        GlobalVariables globals;
+        Job *job = nullptr;
+        FunctionObj *function = nullptr; //nullptr if the script did not compile
+    };
+
+    struct Worker {
+        std::mutex jobsMutex;
+        std::deque<size_t> jobs; //indices into BatchRunner::jobs
+
+        //slots move from freeSlots to preparedSlots when a script is compiled into them and back when it has run
+        Slot slots[2];
+        std::mutex slotsMutex;
+        std::condition_variable slotsChanged;
+        std::deque<Slot*> freeSlots;
+        std::deque<Slot*> preparedSlots;
+        bool finished = false; //no more scripts will be prepared
+    };
+
+    std::vector<Job> jobs;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    bool takeJob(size_t worker, size_t &job);
+    void prepareJobs(size_t worker);
+    void runJobs(size_t worker);
+    void prepare(Slot &slot, Job &job);
+    void execute(Slot &slot);
+};
+
+
+#endif //CLOX_BATCHRUNNER_H
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include "BytecodeVerifier.h"
+#include "CLoxLiteral.h"
+#include "LoxError.h"
+
+namespace {
+    struct StackEffect {
+        int pops; //amount of values the instruction needs on the stack
+        int pushes;
+    };
+
+    //operand is only used by instructions whose effect depends on it
+    StackEffect stackEffect(OpCode code, uint32_t operand) {
+        switch (Chunk::narrowForm(code)) {
+            case OpCode::OP_NEGATE:
+            case OpCode::OP_NOT:
+            case OpCode::OP_JUMP:
+            case OpCode::OP_LOOP:
+            case OpCode::OP_SET_LOCAL:
+            case OpCode::OP_SET_UPVALUE:
+                return {0, 0};
+            case OpCode::OP_RETURN: //the returned value
+            case OpCode::OP_PRINT:
+            case OpCode::OP_POP:
+            case OpCode::OP_CLOSE_UPVALUE:
+                return {1, 0};
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_TRUE:
+            case OpCode::OP_FALSE:
+            case OpCode::OP_NIL:
+            case OpCode::OP_GET_LOCAL:
+            case OpCode::OP_GET_GLOBAL:
+            case OpCode::OP_CLASS:
+            case OpCode::OP_CLOSURE:
+            case OpCode::OP_GET_UPVALUE:
+                return {0, 1};
+            case OpCode::OP_ADD:
+            case OpCode::OP_SUBTRACT:
+            case OpCode::OP_MULTIPLY:
+            case OpCode::OP_DIVIDE:
+            case OpCode::OP_EQUAL:
+            case OpCode::OP_GREATER:
+            case OpCode::OP_LESS:
+                return {2, 1};
+            case OpCode::OP_DEFINE_GLOBAL:
+                return {1, 0};
+            case OpCode::OP_SET_GLOBAL: //the value is left on the stack
+            case OpCode::OP_JUMP_IF_FALSE: //the condition is left on the stack
+            case OpCode::OP_ALLOCATE:
+            case OpCode::OP_GET_PROPERTY: //replaces the instance with the value of the property
+                return {1, 1};
+            case OpCode::OP_SET_PROPERTY: //replaces the instance and the value with the value
+            case OpCode::OP_METHOD: //pops the method, the class it is added to stays
+                return {2, 1};
+            case OpCode::OP_CALL: //replaces the callee and its arguments with the result
+            case OpCode::OP_TAIL_CALL:
+                return {static_cast<int>(operand) + 1, 1};
+            case OpCode::OP_INVOKE: //replaces the receiver and the arguments with the result
+            case OpCode::OP_TAIL_INVOKE:
+                return {static_cast<int>(operand & 0xffu) + 1, 1};
+            default:
+                throw std::runtime_error("Unreachable");
+        }
+    }
+}
+
+BytecodeVerifier::BytecodeVerifier(Chunk *chunk, size_t globalCount, int initialStackDepth) :
+    chunk(chunk), globalCount(globalCount), initialStackDepth(initialStackDepth) {}
+
+void BytecodeVerifier::verify() {
+    decodeInstructions();
+    for (size_t offset = 0; offset < chunk->byteCount(); offset++){
+        if (instructionStarts[offset]){
+            checkOperands(offset);
+        }
+    }
+    computeStackDepths();
+    chunk->verified = true;
+    chunk->maxStackDepth = maxDepth;
+}
+
+int BytecodeVerifier::stackDepthAt(int offset) const {
+    return stackDepths.at(offset);
+}
+
+int BytecodeVerifier::maxStackDepth() const {
+    return maxDepth;
+}
+
+//Splits the bytecode into instructions, checking that every opcode exists and that its operands fit in the chunk.
+void BytecodeVerifier::decodeInstructions() {
+    int byteCount = static_cast<int>(chunk->byteCount());
+    if (byteCount == 0){
+        throw LoxVerificationError("Chunk is empty", 0);
+    }
+
+    instructionStarts.assign(byteCount, false);
+    int offset = 0;
+    while (offset < byteCount){
+        auto opCode = static_cast<uint8_t>(chunk->readByte(offset));
+        if (opCode >= static_cast<uint8_t>(OpCode::OP_COUNT)){
+            throw LoxVerificationError("Invalid opcode " + std::to_string(opCode), offset);
+        }
+
+        instructionStarts[offset] = true;
+        offset += Chunk::instructionLength(static_cast<OpCode>(opCode));
+    }
+
+    if (offset != byteCount){
+        throw LoxVerificationError("Last instruction is missing its operands", offset);
+    }
+}
+
+//superinstructions are checked as the sequence of instructions they replace
+void BytecodeVerifier::checkOperands(int offset) {
+    int operandOffset = offset + 1;
+    for (OpCode component : Chunk::componentOpCodes(opCodeAt(offset))){
+        checkOperands(offset, component, operandOffset);
+        operandOffset += Chunk::instructionLength(component) - 1;
+    }
+}
+
+void BytecodeVerifier::checkOperands(int offset, OpCode opCode, int operandOffset) {
+    uint32_t operand = chunk->readOperand(operandOffset, opCode);
+    switch (Chunk::narrowForm(opCode)) {
+        case OpCode::OP_CONSTANT: {
+            if (operand >= chunk->constantCount()){
+                throw LoxVerificationError("Constant index out of range", offset);
+            }
+            const CLoxLiteral &constant = chunk->constants[operand];
+            if (constant.isObj() && constant.getObj()->isFunction() && !static_cast<FunctionObj*>(constant.getObj())->chunk->upvalues.empty()){
+                throw LoxVerificationError("A function that captures variables can only be loaded with OP_CLOSURE", offset);
+            }
+            break;
+        }
+        case OpCode::OP_CLOSURE: {
+            if (operand >= chunk->constantCount()){
+                throw LoxVerificationError("Constant index out of range", offset);
+            }
+            const CLoxLiteral &constant = chunk->constants[operand];
+            if (!constant.isObj() || !constant.getObj()->isFunction()){
+                throw LoxVerificationError("Expected a function constant as the operand of OP_CLOSURE", offset);
+            }
+            //captured locals are checked against the stack depth like local accesses
+            for (const UpvalueDescriptor &upvalue : static_cast<FunctionObj*>(constant.getObj())->chunk->upvalues){
+                if (!upvalue.isLocal && upvalue.index >= chunk->upvalues.size()){
+                    throw LoxVerificationError("Captured upvalue " + std::to_string(upvalue.index) + " does not exist", offset);
+                }
+            }
+            break;
+        }
+        case OpCode::OP_GET_UPVALUE:
+        case OpCode::OP_SET_UPVALUE:
+            if (operand >= chunk->upvalues.size()){
+                throw LoxVerificationError("Upvalue " + std::to_string(operand) + " does not exist", offset);
+            }
+            break;
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+            if (operand >= globalCount){
+                throw LoxVerificationError("Global slot " + std::to_string(operand) + " does not exist", offset);
+            }
+            break;
+        case OpCode::OP_INVOKE:
+        case OpCode::OP_TAIL_INVOKE:
+        case OpCode::OP_CLASS:
+        case OpCode::OP_GET_PROPERTY:
+        case OpCode::OP_SET_PROPERTY:
+        case OpCode::OP_METHOD: {
+            if (opCode == OpCode::OP_INVOKE || opCode == OpCode::OP_TAIL_INVOKE){
+                operand >>= 8u; //the name constant, the argument count is checked as a stack effect
+            }
+            if (operand >= chunk->constantCount()){
+                throw LoxVerificationError("Constant index out of range", offset);
+            }
+            const CLoxLiteral &constant = chunk->constants[operand];
+            if (!constant.isObj() || !constant.getObj()->isString()){
+                throw LoxVerificationError("Expected a string constant as the identifier operand", offset);
+            }
+            break;
+        }
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP: {
+            int target = chunk->jumpTarget(offset);
+            if (target < 0 || target >= static_cast<int>(chunk->byteCount()) || !instructionStarts[target]){
+                throw LoxVerificationError("Jump target " + std::to_string(target) + " is not the start of an instruction", offset);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* Walks every path through the chunk simulating how many values are on the stack before each instruction. Local slots
+ * are checked against the depth here because a local can only be accessed if its slot is already on the stack.
+ */
+void BytecodeVerifier::computeStackDepths() {
+    stackDepths.assign(chunk->byteCount(), -1);
+    maxDepth = initialStackDepth;
+
+    std::vector<int> worklist;
+    mergeStackDepth(0, initialStackDepth, worklist);
+
+    while (!worklist.empty()){
+        int offset = worklist.back();
+        worklist.pop_back();
+
+        OpCode opCode = opCodeAt(offset);
+        int depth = stackDepths[offset];
+        int operandOffset = offset + 1;
+
+        for (OpCode component : Chunk::componentOpCodes(opCode)){
+            StackEffect effect = stackEffect(component, chunk->readOperand(operandOffset, component));
+            if (depth < effect.pops){
+                throw LoxVerificationError("Stack underflow", offset);
+            }
+
+            OpCode narrowComponent = Chunk::narrowForm(component);
+            bool isLocalAccess = narrowComponent == OpCode::OP_GET_LOCAL || narrowComponent == OpCode::OP_SET_LOCAL;
+            if (isLocalAccess && chunk->readOperand(operandOffset, component) >= static_cast<uint32_t>(depth)){
+                throw LoxVerificationError("Local slot " + std::to_string(chunk->readOperand(operandOffset, component)) + " is not on the stack", offset);
+            }
+            if (narrowComponent == OpCode::OP_CLOSURE){
+                checkCapturedLocals(offset, chunk->readOperand(operandOffset, component), depth);
+            }
+
+            depth = depth - effect.pops + effect.pushes;
+            maxDepth = std::max(maxDepth, depth);
+            operandOffset += Chunk::instructionLength(component) - 1;
+        }
+
+        int next = offset + Chunk::instructionLength(opCode);
+
+        switch (Chunk::narrowForm(opCode)) {
+            case OpCode::OP_RETURN:
+                break;
+            case OpCode::OP_JUMP:
+            case OpCode::OP_LOOP:
+                mergeStackDepth(chunk->jumpTarget(offset), depth, worklist);
+                break;
+            default:
+                if (Chunk::isJump(opCode)){
+                    mergeStackDepth(chunk->jumpTarget(offset), depth, worklist);
+                }
+                mergeStackDepth(next, depth, worklist);
+        }
+    }
+}
+
+//a closure can capture the slot it is pushed into, that is how functions declared in a local refer to themselves
+void BytecodeVerifier::checkCapturedLocals(int offset, uint32_t constant, int depth) {
+    for (const UpvalueDescriptor &upvalue : static_cast<FunctionObj*>(chunk->constants[constant].getObj())->chunk->upvalues){
+        if (upvalue.isLocal && upvalue.index > static_cast<uint32_t>(depth)){
+            throw LoxVerificationError("Captured local slot " + std::to_string(upvalue.index) + " is not on the stack", offset);
+        }
+    }
+}
+
+void BytecodeVerifier::mergeStackDepth(int offset, int depth, std::vector<int> &worklist) {
+    if (offset >= static_cast<int>(chunk->byteCount())){
+        throw LoxVerificationError("Execution can run past the end of the chunk", offset);
+    }
+
+    if (stackDepths[offset] == -1){
+        stackDepths[offset] = depth;
+        worklist.push_back(offset);
+    } else if (stackDepths[offset] != depth){
+        throw LoxVerificationError("Inconsistent stack depth (" + std::to_string(stackDepths[offset]) + " and " + std::to_string(depth) + ")", offset);
+    }
+}
+
+OpCode BytecodeVerifier::opCodeAt(int offset) const {
+    return static_cast<OpCode>(chunk->readByte(offset));
+}
@@ -0,0 +1,46 @@
+#ifndef CLOX_BYTECODEVERIFIER_H
+#define CLOX_BYTECODEVERIFIER_H
+
+
+#include <vector>
+#include "Chunk.h"
+
+/* Checks a chunk once before it is executed so the VM can run it without any bounds checks. The verifier makes sure that
+ * every opcode is valid, every operand is in range (constants, local and global slots, upvalues and jump targets), jumps always land at the
+ * start of an instruction, the stack never underflows, every path through the chunk reaches the same stack depth at a
+ * given instruction and execution can never run past the end of the bytecode.
+ */
+class BytecodeVerifier {
+public:
+    //globalCount is the amount of global variable slots of the program the chunk belongs to. initialStackDepth is the
+    //amount of values the frame starts with (the function itself is always on slot 0)
+    BytecodeVerifier(Chunk *chunk, size_t globalCount, int initialStackDepth = 1);
+
+    //Throws a LoxVerificationError describing the first problem found. Marks the chunk as verified and records its
+    //maximum stack depth if it succeeds.
+    void verify();
+
+    //stack depth before executing the instruction at offset, or -1 if the instruction is unreachable. Only valid after verify()
+    int stackDepthAt(int offset) const;
+    int maxStackDepth() const;
+
+private:
+    Chunk *chunk;
+    size_t globalCount;
+    int initialStackDepth;
+    std::vector<bool> instructionStarts;
+    std::vector<int> stackDepths;
+    int maxDepth = 0;
+
+    void decodeInstructions();
+    void checkOperands(int offset);
+    void checkOperands(int offset, OpCode opCode, int operandOffset);
+    void computeStackDepths();
+    void checkCapturedLocals(int offset, uint32_t constant, int depth);
+    void mergeStackDepth(int offset, int depth, std::vector<int> &worklist);
+
+    OpCode opCodeAt(int offset) const;
+};
+
+
+#endif //CLOX_BYTECODEVERIFIER_H
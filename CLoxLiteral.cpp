@@ -1,13 +1,12 @@
 #include <stdexcept>
 #include <cmath>
 #include <utility>
+#include <new>
 #include "CLoxLiteral.h"
 #include "Utils.h"
 
 Obj::Obj(ObjType type) : type(type) {}
 
-Obj::~Obj() = default;
-
 bool Obj::isString() const {
     return type == ObjType::STRING;
 }
@@ -28,79 +27,133 @@ bool Obj::isAllocation() const {
     return type == ObjType::ALLOCATION;
 }
 
-StringObj::StringObj(std::string str) : Obj(ObjType::STRING), str(std::move(str)) {}
+bool Obj::isClosure() const {
+    return type == ObjType::CLOSURE;
+}
 
+bool Obj::isBoundMethod() const {
+    return type == ObjType::BOUND_METHOD;
+}
 
-FunctionObj::FunctionObj(StringObj *name, Chunk *chunk, int arity) :
-    Obj(ObjType::FUNCTION), name(name), chunk(chunk), arity(arity) {}
+StringObj::StringObj(uint32_t length, uint32_t hash) : Obj(ObjType::STRING), length(length), hash(hash) {}
 
-FunctionObj::~FunctionObj() {
-    delete chunk;
+StringObj *StringObj::create(std::string_view chars, uint32_t hash) {
+    void *memory = ::operator new(sizeof(StringObj) + chars.size() + 1);
+    auto *string = new (memory) StringObj(static_cast<uint32_t>(chars.size()), hash);
+    char *destination = reinterpret_cast<char*>(string + 1);
+    std::memcpy(destination, chars.data(), chars.size());
+    destination[chars.size()] = '\0';
+    return string;
 }
 
-ClassObj::ClassObj(StringObj *name) : Obj(ObjType::CLASS), name(name) {}
+void StringObj::destroy(StringObj *string) {
+    string->~StringObj();
+    ::operator delete(string);
+}
 
-InstanceObj::InstanceObj(ClassObj *klass) : Obj(ObjType::INSTANCE), klass(klass) {}
+//FNV-1a
+uint32_t StringObj::hashChars(std::string_view chars) {
+    uint32_t hash = 2166136261u;
+    for (char c : chars){
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-AllocationObj::AllocationObj(size_t kilobytes, char* memoryBlock) : Obj(ObjType::ALLOCATION), kilobytes(kilobytes), memoryBlock(memoryBlock) {}
+const char *StringObj::chars() const {
+    return reinterpret_cast<const char*>(this + 1);
+}
 
-AllocationObj::~AllocationObj() {
-    delete[] memoryBlock;
+std::string_view StringObj::view() const {
+    return {chars(), length};
 }
 
-CLoxLiteral::CLoxLiteral(double number) : type(LiteralType::NUMBER), number(number) {}
+std::string StringObj::str() const {
+    return std::string(view());
+}
 
-CLoxLiteral::CLoxLiteral(Obj *obj) : type(LiteralType::OBJ), obj(obj) {}
 
-CLoxLiteral::CLoxLiteral(bool boolean) : type(LiteralType::BOOL), boolean(boolean) {}
+FunctionObj::FunctionObj(StringObj *name, Chunk *chunk, int arity) :
+    Obj(ObjType::FUNCTION), arity(arity), name(name), chunk(chunk) {}
 
-CLoxLiteral CLoxLiteral::Nil() {
-    return CLoxLiteral();
+FunctionObj::~FunctionObj() {
+    delete chunk;
+    delete registerChunk;
 }
 
-CLoxLiteral::CLoxLiteral() : type(LiteralType::NIL) {}
+UpvalueObj::UpvalueObj(CLoxLiteral *slot) : Obj(ObjType::UPVALUE), location(slot) {}
 
+ClosureObj::ClosureObj(FunctionObj *function) : Obj(ObjType::CLOSURE), function(function), captures(function->chunk->upvalues.size()) {}
 
-bool CLoxLiteral::isNumber() const {
-    return type == LiteralType::NUMBER;
-}
+ClassObj::ClassObj(StringObj *name) : Obj(ObjType::CLASS), name(name) {}
 
-bool CLoxLiteral::isBoolean() const {
-    return type == LiteralType::BOOL;
+Obj *ClassObj::findMethod(StringObj *methodName) const {
+    auto method = methods.find(methodName);
+    return method == methods.end() ? nullptr : method->second;
 }
 
-bool CLoxLiteral::isObj() const {
-    return type == LiteralType::OBJ;
+BoundMethodObj::BoundMethodObj(InstanceObj *receiver, Obj *method) : Obj(ObjType::BOUND_METHOD), receiver(receiver), method(method) {}
+
+InstanceObj::InstanceObj(ClassObj *klass, Shape *shape) : Obj(ObjType::INSTANCE), klass(klass), shape(shape) {}
+
+CLoxLiteral &InstanceObj::slot(int index) {
+    return index < INLINE_SLOTS ? inlineSlots[index] : outOfLineSlots[index - INLINE_SLOTS];
 }
 
-bool CLoxLiteral::isNil() const {
-    return type == LiteralType::NIL;
+CLoxLiteral *InstanceObj::findField(StringObj *name) {
+    if (shape->isDictionary()){
+        auto it = dictionaryFields->find(name);
+        return it == dictionaryFields->end() ? nullptr : &it->second;
+    }
+
+    int index = shape->lookup(name);
+    return index == -1 ? nullptr : &slot(index);
 }
 
-double CLoxLiteral::getNumber() const {
-    if (!isNumber()){
-        throw std::runtime_error("CLoxLiteral does not contain a number");
+void InstanceObj::setField(StringObj *name, const CLoxLiteral &value) {
+    if (CLoxLiteral *field = findField(name)){
+        *field = value;
+    } else if (shape->isDictionary()){
+        dictionaryFields->emplace(name, value);
+    } else if (shape->slotCount == Shape::MAX_SLOTS){
+        convertToDictionary();
+        dictionaryFields->emplace(name, value);
+    } else {
+        addSlot(shape->transition(name), value);
     }
-    return number;
 }
 
-bool CLoxLiteral::getBoolean() const {
-    if (!isBoolean()){
-        throw std::runtime_error("CLoxLiteral does not contain a boolean");
+void InstanceObj::addSlot(Shape *newShape, const CLoxLiteral &value) {
+    if (shape->slotCount < INLINE_SLOTS){
+        inlineSlots[shape->slotCount] = value;
+    } else {
+        outOfLineSlots.push_back(value);
     }
-    return boolean;
+    shape = newShape;
 }
 
-Obj *CLoxLiteral::getObj() const {
-    if (!isObj()){
-        throw std::runtime_error("CLoxLiteral does not contain a obj");
+//Builds the map from the names along the shape chain. The slots are released since dictionary mode never goes back.
+void InstanceObj::convertToDictionary() {
+    auto fields = std::make_unique<std::unordered_map<StringObj*, CLoxLiteral>>();
+    std::vector<StringObj*> names = shape->fieldNames();
+    for (int i = 0; i < shape->slotCount; i++){
+        fields->emplace(names[i], slot(i));
     }
 
-    return obj;
+    dictionaryFields = std::move(fields);
+    outOfLineSlots = std::vector<CLoxLiteral>();
+    shape = Shape::dictionary();
+}
+
+AllocationObj::AllocationObj(size_t kilobytes, char* memoryBlock) : Obj(ObjType::ALLOCATION), kilobytes(kilobytes), memoryBlock(memoryBlock) {}
+
+AllocationObj::~AllocationObj() {
+    delete[] memoryBlock;
 }
 
 std::ostream &operator<<(std::ostream &os, const CLoxLiteral &object) {
-    switch (object.type) {
+    switch (object.getType()) {
         case LiteralType::NIL:
             os << std::string("nil");
             return os;
@@ -118,25 +171,34 @@ std::ostream &operator<<(std::ostream &os, const CLoxLiteral &object) {
         {
             switch (object.getObj()->type) {
                 case ObjType::STRING: {
-                    std::string s = dynamic_cast<StringObj *>(object.getObj())->str;
+                    std::string s = static_cast<StringObj*>(object.getObj())->str();
                     utils::replaceAll(s, "\\n", "\n");
                     utils::replaceAll(s, "\\t", "\t");
                     os << s;
                     return os;
                 }
                 case ObjType::FUNCTION:
-                    os << std::string("<function ") << dynamic_cast<FunctionObj*>(object.getObj())->name->str << std::string(">");
+                    os << std::string("<function ") << static_cast<FunctionObj*>(object.getObj())->name->view() << std::string(">");
+                    return os;
+                case ObjType::CLOSURE:
+                    os << std::string("<function ") << static_cast<ClosureObj*>(object.getObj())->function->name->view() << std::string(">");
+                    return os;
+                case ObjType::UPVALUE:
+                    os << std::string("<upvalue>");
                     return os;
+                case ObjType::BOUND_METHOD:
+                    return os << CLoxLiteral(static_cast<BoundMethodObj*>(object.getObj())->method);
                 case ObjType::CLASS:
-                    os << std::string("<class ") << dynamic_cast<ClassObj*>(object.getObj())->name->str << std::string(">");
+                    os << std::string("<class ") << static_cast<ClassObj*>(object.getObj())->name->view() << std::string(">");
                     return os;
                 case ObjType::INSTANCE:
-                    os << std::string("<instance of ") << dynamic_cast<InstanceObj*>(object.getObj())->klass->name->str << std::string(">");
+                    os << std::string("<instance of ") << static_cast<InstanceObj*>(object.getObj())->klass->name->view() << std::string(">");
                     return os;
                 case ObjType::ALLOCATION:
-                    os << std::string("<allocation of size ") << std::to_string(dynamic_cast<AllocationObj*>(object.getObj())->kilobytes) << std::string(">");
+                    os << std::string("<allocation of size ") << std::to_string(static_cast<AllocationObj*>(object.getObj())->kilobytes) << std::string(">");
                     return os;
             }
+            [[fallthrough]]; //only an object of no known type gets here
         }
         default:
             throw std::runtime_error("Object has no string representation");
@@ -154,6 +216,8 @@ std::string literalTypeToString(LiteralType type) {
             return "number";
         case LiteralType::OBJ:
             return "obj";
+        case LiteralType::UNDEFINED:
+            return "undefined";
     }
 
     throw std::runtime_error("This should be unreachable. Missing case.");
@@ -2,14 +2,22 @@
 #define CLOX_CLOXLITERAL_H
 
 
+#include <atomic>
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <memory>
 #include <unordered_map>
 #include "Token.h"
 #include "Chunk.h"
+#include "RegisterChunk.h"
+#include "Shape.h"
 
 enum class LiteralType {
-    NIL, BOOL, NUMBER, OBJ
+    NIL, BOOL, NUMBER, OBJ,
+    UNDEFINED //value of a global variable slot before the variable is defined, never visible to Lox code
 };
 
 class Obj;
@@ -17,20 +25,28 @@ class Obj;
 std::string literalTypeToString(LiteralType type);
 
 
-class CLoxLiteral { //This could be made into a more efficient std::variant some day (i.e. probably never....)
+/* A Lox value. Built with NAN_BOXING (the default, see CLOX_NAN_BOXING in CMakeLists.txt) a value is a single 64 bit
+ * word: numbers are stored as plain doubles, and every other type is packed into the payload of a quiet NaN, which no
+ * arithmetic operation ever produces. Objects set the sign bit and keep their pointer in the low 48 bits, and nil,
+ * booleans and undefined are small tags. Without NAN_BOXING the fields are stored side by side, which is easier to
+ * inspect in a debugger but four times as large.
+ */
+class CLoxLiteral {
 public:
-    LiteralType type = LiteralType::NIL;
-
     explicit CLoxLiteral(double number);
     explicit CLoxLiteral(Obj *obj);
     explicit CLoxLiteral(bool boolean);
     static CLoxLiteral Nil();
+    static CLoxLiteral Undefined();
     CLoxLiteral(); //Initializes the object as NIL
 
+    LiteralType getType() const;
+
     bool isNumber() const;
     bool isBoolean() const;
     bool isObj() const;
     bool isNil() const;
+    bool isUndefined() const;
 
     double getNumber() const;
     bool getBoolean() const ;
@@ -38,71 +54,348 @@ public:
 
     friend std::ostream& operator<<(std::ostream& os, const CLoxLiteral& object);
 
+#ifdef NAN_BOXING
+    //The encoding is public for the TracingJit, which generates machine code that tests and builds values directly
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QUIET_NAN = 0x7ffc000000000000; //every value that is not a number has all of these bits set
+    uint64_t getBits() const;
+#endif
+
 private:
 
+#ifdef NAN_BOXING
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+    static constexpr uint64_t TAG_UNDEFINED = 4;
+
+    uint64_t bits = QUIET_NAN | TAG_NIL;
+#else
+    LiteralType type = LiteralType::NIL;
     double number = 0.0;
     bool boolean = false;
     Obj *obj = nullptr;
+#endif
 };
 
+#ifdef NAN_BOXING
+static_assert(sizeof(CLoxLiteral) == sizeof(uint64_t), "NaN boxed values must fit in 64 bits");
+static_assert(sizeof(void*) == sizeof(uint64_t), "NaN boxing requires 64 bit pointers, build with -DCLOX_NAN_BOXING=OFF");
+#endif
+
+//The accessors are defined here so the VM's hot loops can inline them
+
+#ifdef NAN_BOXING
+
+inline CLoxLiteral::CLoxLiteral(double number) {
+    std::memcpy(&bits, &number, sizeof(double));
+}
+
+inline CLoxLiteral::CLoxLiteral(Obj *obj) : bits(SIGN_BIT | QUIET_NAN | reinterpret_cast<uintptr_t>(obj)) {}
+
+inline CLoxLiteral::CLoxLiteral(bool boolean) : bits(QUIET_NAN | (boolean ? TAG_TRUE : TAG_FALSE)) {}
 
-enum class ObjType {
-    STRING, FUNCTION, CLASS, INSTANCE, ALLOCATION
+inline CLoxLiteral CLoxLiteral::Undefined() {
+    CLoxLiteral literal;
+    literal.bits = QUIET_NAN | TAG_UNDEFINED;
+    return literal;
+}
+
+inline CLoxLiteral::CLoxLiteral() = default;
+
+inline bool CLoxLiteral::isNumber() const {
+    return (bits & QUIET_NAN) != QUIET_NAN;
+}
+
+inline bool CLoxLiteral::isBoolean() const {
+    return (bits | 1u) == (QUIET_NAN | TAG_TRUE);
+}
+
+inline bool CLoxLiteral::isObj() const {
+    return (bits & (QUIET_NAN | SIGN_BIT)) == (QUIET_NAN | SIGN_BIT);
+}
+
+inline bool CLoxLiteral::isNil() const {
+    return bits == (QUIET_NAN | TAG_NIL);
+}
+
+inline bool CLoxLiteral::isUndefined() const {
+    return bits == (QUIET_NAN | TAG_UNDEFINED);
+}
+
+inline uint64_t CLoxLiteral::getBits() const {
+    return bits;
+}
+
+#else
+
+inline CLoxLiteral::CLoxLiteral(double number) : type(LiteralType::NUMBER), number(number) {}
+
+inline CLoxLiteral::CLoxLiteral(Obj *obj) : type(LiteralType::OBJ), obj(obj) {}
+
+inline CLoxLiteral::CLoxLiteral(bool boolean) : type(LiteralType::BOOL), boolean(boolean) {}
+
+inline CLoxLiteral CLoxLiteral::Undefined() {
+    CLoxLiteral literal;
+    literal.type = LiteralType::UNDEFINED;
+    return literal;
+}
+
+inline CLoxLiteral::CLoxLiteral() : type(LiteralType::NIL) {}
+
+inline bool CLoxLiteral::isNumber() const {
+    return type == LiteralType::NUMBER;
+}
+
+inline bool CLoxLiteral::isBoolean() const {
+    return type == LiteralType::BOOL;
+}
+
+inline bool CLoxLiteral::isObj() const {
+    return type == LiteralType::OBJ;
+}
+
+inline bool CLoxLiteral::isNil() const {
+    return type == LiteralType::NIL;
+}
+
+inline bool CLoxLiteral::isUndefined() const {
+    return type == LiteralType::UNDEFINED;
+}
+
+#endif
+
+inline CLoxLiteral CLoxLiteral::Nil() {
+    return CLoxLiteral();
+}
+
+inline LiteralType CLoxLiteral::getType() const {
+    if (isNumber()) return LiteralType::NUMBER;
+    if (isObj()) return LiteralType::OBJ;
+    if (isBoolean()) return LiteralType::BOOL;
+    if (isNil()) return LiteralType::NIL;
+    return LiteralType::UNDEFINED;
+}
+
+inline double CLoxLiteral::getNumber() const {
+    if (!isNumber()){
+        throw std::runtime_error("CLoxLiteral does not contain a number");
+    }
+#ifdef NAN_BOXING
+    double number;
+    std::memcpy(&number, &bits, sizeof(double));
+#endif
+    return number;
+}
+
+inline bool CLoxLiteral::getBoolean() const {
+    if (!isBoolean()){
+        throw std::runtime_error("CLoxLiteral does not contain a boolean");
+    }
+#ifdef NAN_BOXING
+    return bits == (QUIET_NAN | TAG_TRUE);
+#else
+    return boolean;
+#endif
+}
+
+inline Obj *CLoxLiteral::getObj() const {
+    if (!isObj()){
+        throw std::runtime_error("CLoxLiteral does not contain a obj");
+    }
+#ifdef NAN_BOXING
+    return reinterpret_cast<Obj*>(static_cast<uintptr_t>(bits & ~(SIGN_BIT | QUIET_NAN)));
+#else
+    return obj;
+#endif
+}
+
+
+enum class ObjType : uint8_t {
+    STRING, FUNCTION, CLASS, INSTANCE, ALLOCATION, CLOSURE, UPVALUE, BOUND_METHOD
 };
 
 
+/* Header shared by every heap object. Obj has no virtual functions, so objects carry no vtable pointer: type tells which
+ * subclass an object is, and code checks it and then downcasts with static_cast. Objects must be freed through
+ * Memory::freeObject, which deletes them as their concrete type.
+ */
 class Obj {
 public:
     ObjType type;
-    bool marked = false;
-
-    explicit Obj(ObjType type);
-    virtual ~Obj() = 0;
+    //atomic because the threads of a ParallelMarker mark the same objects, it is a plain byte on the platforms we run on
+    std::atomic<bool> marked{false};
+    uint32_t size = 0; //bytes the object accounts for in Memory::bytesAllocated, set once when it is allocated
 
     bool isString() const;
     bool isClass() const;
     bool isFunction() const;
     bool isInstance() const;
     bool isAllocation() const;
+    bool isClosure() const;
+    bool isBoundMethod() const;
+
+protected:
+    explicit Obj(ObjType type);
+    ~Obj() = default;
 };
 
+static_assert(sizeof(Obj) == 8, "Obj header should stay a single word");
+
+/* Strings are interned (see StringTable), so there is a single StringObj for every distinct sequence of characters and
+ * two strings are equal exactly when they are the same object. The characters are stored right after the object in the
+ * same allocation, followed by a '\0', so strings must be created with StringObj::create and freed with destroy.
+ */
 class StringObj : public Obj {
 public:
+    static StringObj *create(std::string_view chars, uint32_t hash);
+    static void destroy(StringObj *string);
+    static uint32_t hashChars(std::string_view chars);
 
-    explicit StringObj(std::string str);
+    uint32_t length;
+    uint32_t hash;
 
-    std::string str;
+    const char *chars() const;
+    std::string_view view() const;
+    std::string str() const;
+
+private:
+    StringObj(uint32_t length, uint32_t hash);
 };
 
 class FunctionObj : public Obj {
 public:
     FunctionObj(StringObj *name, Chunk *chunk, int arity);
-    ~FunctionObj() override;
+    ~FunctionObj();
 
     int arity;
     StringObj *name;
     Chunk *chunk;
+    RegisterChunk *registerChunk = nullptr; //translation of chunk for the register VM, created the first time it runs
 };
 
+/* A captured variable that escapes its scope (see Compiler::analyzeEscape). While the variable is in scope the upvalue is
+ * open and location points at its stack slot. When the scope ends it is closed: the value moves into closed and location
+ * points there, so the closures that captured the variable keep sharing it.
+ */
+class UpvalueObj : public Obj {
+public:
+    explicit UpvalueObj(CLoxLiteral *slot);
+
+    CLoxLiteral *location;
+    CLoxLiteral closed;
+    UpvalueObj *nextOpen = nullptr; //see VM::openUpvalues
+};
+
+/* A function declared inside another one, with the variables it captures. Only functions whose chunk has upvalues are
+ * turned into closures, the others are called as plain FunctionObjs.
+ */
+class ClosureObj : public Obj {
+public:
+    //Variables that do not escape are captured by their stack slot, which stays valid for as long as the closure can be
+    //called. The others are captured through an UpvalueObj.
+    struct Capture {
+        CLoxLiteral *slot = nullptr;
+        UpvalueObj *upvalue = nullptr;
+    };
+
+    explicit ClosureObj(FunctionObj *function);
+
+    FunctionObj *function;
+    std::vector<Capture> captures; //one for every upvalue of the function's chunk, in the same order
+    const CLoxLiteral *highestSlot = nullptr; //highest stack slot captured, a tail call must not overwrite it
+
+    CLoxLiteral &captured(int index);
+};
+
+inline CLoxLiteral &ClosureObj::captured(int index) {
+    const Capture &capture = captures[index];
+    return capture.upvalue == nullptr ? *capture.slot : *capture.upvalue->location;
+}
+
+/* Methods are added by OP_METHOD while the class declaration runs, and never change after that, so inline caches can
+ * keep the methods they found.
+ */
 class ClassObj : public Obj {
 public:
     explicit ClassObj(StringObj *name);
 
     StringObj *name;
+    std::unordered_map<StringObj*, Obj*> methods; //FunctionObjs or ClosureObjs, called with the receiver in slot 0
+    Obj *initializer = nullptr; //the method named init, called with the arguments of the class when it is called
+
+    //returns nullptr if the class has no method with this name
+    Obj *findMethod(StringObj *methodName) const;
 };
 
+/* Fields are stored in slots laid out by the instance's shape. The first INLINE_SLOTS live inside the object itself and
+ * the rest in outOfLineSlots. Once the instance has too many fields for a shape it switches to dictionary mode and keeps
+ * them all in dictionaryFields instead, see Shape.
+ */
 class InstanceObj : public Obj {
 public:
-    explicit InstanceObj(ClassObj *klass);
+    static const int INLINE_SLOTS = 4;
+
+    //shape is the root shape of the heap the instance is allocated in
+    InstanceObj(ClassObj *klass, Shape *shape);
 
     ClassObj *klass;
-    std::unordered_map<std::string, CLoxLiteral> fields;
+    Shape *shape;
+
+    CLoxLiteral &slot(int index);
+
+    //returns nullptr if the instance has no field with this name
+    CLoxLiteral *findField(StringObj *name);
+    void setField(StringObj *name, const CLoxLiteral &value);
+
+    //appends a field at slot shape->slotCount and moves the instance to newShape, which must be that transition of shape
+    void addSlot(Shape *newShape, const CLoxLiteral &value);
+
+    //calls visit with every field value
+    template<typename Visitor>
+    void forEachField(Visitor visit) {
+        if (shape->isDictionary()){
+            for (auto &field : *dictionaryFields){
+                visit(field.second);
+            }
+            return;
+        }
+        for (int i = 0; i < shape->slotCount; i++){
+            visit(slot(i));
+        }
+    }
+
+    //calls visit with the names of the fields added in dictionary mode. Slot names are kept alive by the shapes
+    template<typename Visitor>
+    void forEachDictionaryName(Visitor visit) {
+        if (shape->isDictionary()){
+            for (auto &field : *dictionaryFields){
+                visit(field.first);
+            }
+        }
+    }
+
+private:
+    CLoxLiteral inlineSlots[INLINE_SLOTS];
+    std::vector<CLoxLiteral> outOfLineSlots;
+    std::unique_ptr<std::unordered_map<StringObj*, CLoxLiteral>> dictionaryFields;
+
+    void convertToDictionary();
+};
+
+//A method read as a property without calling it, see OP_INVOKE for the calls that skip creating one
+class BoundMethodObj : public Obj {
+public:
+    BoundMethodObj(InstanceObj *receiver, Obj *method);
+
+    InstanceObj *receiver;
+    Obj *method; //a FunctionObj or a ClosureObj
 };
 
 class AllocationObj : public Obj {
 public:
     explicit AllocationObj(size_t kilobytes, char* memoryBlock);
-    ~AllocationObj() override;
+    ~AllocationObj();
 
     size_t kilobytes;
     char* memoryBlock;
@@ -1,5 +1,7 @@
 
 #include "Chunk.h"
+#include <algorithm>
+#include <cstring>
 #include "CLoxLiteral.h"
 
 size_t Chunk::write(std::byte code, int line) {
@@ -21,7 +23,24 @@ size_t Chunk::byteCount() const {
 }
 
 size_t Chunk::writeConstant(const CLoxLiteral &value) {
+    uint64_t bits = 0;
+    if (value.isNumber()){
+        double number = value.getNumber();
+        std::memcpy(&bits, &number, sizeof(double));
+    } else if (value.isObj()){
+        bits = reinterpret_cast<uintptr_t>(value.getObj());
+    } else if (value.isBoolean()){
+        bits = value.getBoolean();
+    }
+
+    auto key = std::make_pair(static_cast<int>(value.getType()), bits);
+    auto it = constantOffsets.find(key);
+    if (it != constantOffsets.end()){
+        return it->second;
+    }
+
     constants.push_back(value);
+    constantOffsets.emplace(key, constants.size() - 1);
     return constants.size() - 1;
 }
 
@@ -33,6 +52,12 @@ size_t Chunk::constantCount() const {
     return constants.size();
 }
 
+bool Chunk::containsFunctions() const {
+    return std::any_of(constants.begin(), constants.end(), [](const CLoxLiteral &constant) {
+        return constant.isObj() && constant.getObj()->isFunction();
+    });
+}
+
 /* Writes a line into the lines array.
  *
  * ASSUMPTION: lines are added incrementally. If writeLine(4) is called, this
@@ -70,8 +95,203 @@ int Chunk::readLine(int instructionOffset) const {
     return lines.at(index);
 }
 
+//Decodes the whole lines vector in one pass, for code that needs the line of every byte. readLine starts over from the
+//first run on every call.
+std::vector<int> Chunk::byteLines() const {
+    std::vector<int> result;
+    result.reserve(bytecode.size());
+    for (size_t i = 0; i + 1 < lines.size(); i += 2){
+        result.insert(result.end(), lines[i + 1], lines[i]);
+    }
+    return result;
+}
+
+int Chunk::readLineUnchecked(int instructionOffset) const noexcept {
+    if (lines.empty()){
+        return 0;
+    }
+    int currentOffset = lines[1];
+    size_t index = 0;
+    while (instructionOffset + 1 > currentOffset && index + 2 < lines.size()){
+        index += 2;
+        currentOffset += lines[index+1];
+    }
+
+    return lines[index];
+}
+
 size_t Chunk::lineCount() const {
     return lines.size();
 }
 
+//a superinstruction takes the operands of all of its components
+int Chunk::instructionLength(OpCode code) {
+    int length = 1;
+    for (OpCode component : componentOpCodes(code)){
+        length += operandWidth(component);
+    }
+    return length;
+}
+
+int Chunk::operandWidth(OpCode code) {
+    if (isLongForm(code)){
+        return 3;
+    }
+
+    switch (code) {
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_CLASS:
+        case OpCode::OP_GET_PROPERTY:
+        case OpCode::OP_SET_PROPERTY:
+        case OpCode::OP_CALL: //argument count
+        case OpCode::OP_TAIL_CALL:
+        case OpCode::OP_CLOSURE:
+        case OpCode::OP_GET_UPVALUE:
+        case OpCode::OP_SET_UPVALUE:
+        case OpCode::OP_METHOD:
+            return 1;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+        case OpCode::OP_INVOKE: //name constant and argument count, it has no long form
+        case OpCode::OP_TAIL_INVOKE:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+OpCode Chunk::longForm(OpCode code) {
+    switch (code) {
+        case OpCode::OP_CONSTANT: return OpCode::OP_CONSTANT_LONG;
+        case OpCode::OP_DEFINE_GLOBAL: return OpCode::OP_DEFINE_GLOBAL_LONG;
+        case OpCode::OP_GET_GLOBAL: return OpCode::OP_GET_GLOBAL_LONG;
+        case OpCode::OP_SET_GLOBAL: return OpCode::OP_SET_GLOBAL_LONG;
+        case OpCode::OP_GET_LOCAL: return OpCode::OP_GET_LOCAL_LONG;
+        case OpCode::OP_SET_LOCAL: return OpCode::OP_SET_LOCAL_LONG;
+        case OpCode::OP_JUMP_IF_FALSE: return OpCode::OP_JUMP_IF_FALSE_LONG;
+        case OpCode::OP_JUMP: return OpCode::OP_JUMP_LONG;
+        case OpCode::OP_LOOP: return OpCode::OP_LOOP_LONG;
+        case OpCode::OP_CLASS: return OpCode::OP_CLASS_LONG;
+        case OpCode::OP_GET_PROPERTY: return OpCode::OP_GET_PROPERTY_LONG;
+        case OpCode::OP_SET_PROPERTY: return OpCode::OP_SET_PROPERTY_LONG;
+        case OpCode::OP_CLOSURE: return OpCode::OP_CLOSURE_LONG;
+        case OpCode::OP_METHOD: return OpCode::OP_METHOD_LONG;
+        default: return OpCode::OP_COUNT;
+    }
+}
 
+OpCode Chunk::narrowForm(OpCode code) {
+    switch (code) {
+        case OpCode::OP_CONSTANT_LONG: return OpCode::OP_CONSTANT;
+        case OpCode::OP_DEFINE_GLOBAL_LONG: return OpCode::OP_DEFINE_GLOBAL;
+        case OpCode::OP_GET_GLOBAL_LONG: return OpCode::OP_GET_GLOBAL;
+        case OpCode::OP_SET_GLOBAL_LONG: return OpCode::OP_SET_GLOBAL;
+        case OpCode::OP_GET_LOCAL_LONG: return OpCode::OP_GET_LOCAL;
+        case OpCode::OP_SET_LOCAL_LONG: return OpCode::OP_SET_LOCAL;
+        case OpCode::OP_JUMP_IF_FALSE_LONG: return OpCode::OP_JUMP_IF_FALSE;
+        case OpCode::OP_JUMP_LONG: return OpCode::OP_JUMP;
+        case OpCode::OP_LOOP_LONG: return OpCode::OP_LOOP;
+        case OpCode::OP_CLASS_LONG: return OpCode::OP_CLASS;
+        case OpCode::OP_GET_PROPERTY_LONG: return OpCode::OP_GET_PROPERTY;
+        case OpCode::OP_SET_PROPERTY_LONG: return OpCode::OP_SET_PROPERTY;
+        case OpCode::OP_CLOSURE_LONG: return OpCode::OP_CLOSURE;
+        case OpCode::OP_METHOD_LONG: return OpCode::OP_METHOD;
+        default: return code;
+    }
+}
+
+bool Chunk::isLongForm(OpCode code) {
+    return narrowForm(code) != code;
+}
+
+OpCode Chunk::quickenedForm(OpCode code) {
+    switch (code) {
+        case OpCode::OP_ADD: return OpCode::OP_ADD_NUMBER;
+        case OpCode::OP_SUBTRACT: return OpCode::OP_SUBTRACT_NUMBER;
+        case OpCode::OP_MULTIPLY: return OpCode::OP_MULTIPLY_NUMBER;
+        case OpCode::OP_DIVIDE: return OpCode::OP_DIVIDE_NUMBER;
+        case OpCode::OP_GREATER: return OpCode::OP_GREATER_NUMBER;
+        case OpCode::OP_LESS: return OpCode::OP_LESS_NUMBER;
+        case OpCode::OP_GET_LOCAL_CONSTANT_ADD: return OpCode::OP_GET_LOCAL_CONSTANT_ADD_NUMBER;
+        case OpCode::OP_LESS_JUMP_IF_FALSE: return OpCode::OP_LESS_JUMP_IF_FALSE_NUMBER;
+        default: return OpCode::OP_COUNT;
+    }
+}
+
+OpCode Chunk::genericForm(OpCode code) {
+    switch (code) {
+        case OpCode::OP_ADD_NUMBER: return OpCode::OP_ADD;
+        case OpCode::OP_SUBTRACT_NUMBER: return OpCode::OP_SUBTRACT;
+        case OpCode::OP_MULTIPLY_NUMBER: return OpCode::OP_MULTIPLY;
+        case OpCode::OP_DIVIDE_NUMBER: return OpCode::OP_DIVIDE;
+        case OpCode::OP_GREATER_NUMBER: return OpCode::OP_GREATER;
+        case OpCode::OP_LESS_NUMBER: return OpCode::OP_LESS;
+        case OpCode::OP_GET_LOCAL_CONSTANT_ADD_NUMBER: return OpCode::OP_GET_LOCAL_CONSTANT_ADD;
+        case OpCode::OP_LESS_JUMP_IF_FALSE_NUMBER: return OpCode::OP_LESS_JUMP_IF_FALSE;
+        default: return code;
+    }
+}
+
+uint32_t Chunk::readOperand(int operandOffset, OpCode code) const {
+    uint32_t operand = 0;
+    for (int i = 0; i < operandWidth(code); i++){
+        operand = (operand << 8u) | std::to_integer<uint32_t>(readByte(operandOffset + i));
+    }
+    return operand;
+}
+
+void Chunk::writeOperand(int operandOffset, OpCode code, uint32_t operand) {
+    int width = operandWidth(code);
+    for (int i = 0; i < width; i++){
+        bytecode[operandOffset + i] = std::byte((operand >> (8u * (width - 1 - i))) & 0xffu);
+    }
+}
+
+const std::vector<OpCode> &Chunk::componentOpCodes(OpCode code) {
+    static const std::vector<std::vector<OpCode>> components = [](){
+        std::vector<std::vector<OpCode>> table;
+        for (int i = 0; i < static_cast<int>(OpCode::OP_COUNT); i++){
+            table.push_back({static_cast<OpCode>(i)});
+        }
+
+        table[static_cast<int>(OpCode::OP_GET_LOCAL_CONSTANT_ADD)] = {OpCode::OP_GET_LOCAL, OpCode::OP_CONSTANT, OpCode::OP_ADD};
+        table[static_cast<int>(OpCode::OP_LESS_JUMP_IF_FALSE)] = {OpCode::OP_LESS, OpCode::OP_JUMP_IF_FALSE};
+        table[static_cast<int>(OpCode::OP_SET_LOCAL_POP)] = {OpCode::OP_SET_LOCAL, OpCode::OP_POP};
+        table[static_cast<int>(OpCode::OP_SET_GLOBAL_POP)] = {OpCode::OP_SET_GLOBAL, OpCode::OP_POP};
+        for (int i = 0; i < static_cast<int>(OpCode::OP_COUNT); i++){
+            table[i] = table[static_cast<int>(genericForm(static_cast<OpCode>(i)))];
+        }
+        return table;
+    }();
+
+    return components[static_cast<int>(code)];
+}
+
+bool Chunk::isJump(OpCode code) {
+    switch (narrowForm(genericForm(code))) {
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+        case OpCode::OP_LESS_JUMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Jump operands are the last bytes of the instruction and are relative to the end of the instruction, backwards (and
+ * off by one) for loops. Superinstructions can only end with a jump, so this works for them too.
+ */
+int Chunk::jumpTarget(int offset) const {
+    auto opCode = static_cast<OpCode>(readByte(offset));
+    OpCode jumpOpCode = componentOpCodes(opCode).back();
+    int next = offset + instructionLength(opCode);
+    auto jump = static_cast<int>(readOperand(next - operandWidth(jumpOpCode), jumpOpCode));
+    return narrowForm(jumpOpCode) == OpCode::OP_LOOP ? next - jump - 1 : next + jump;
+}
@@ -4,9 +4,20 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <map>
+#include "Shape.h"
 
 class CLoxLiteral;
 
+//A variable captured by the closures of a function, see OP_CLOSURE
+struct UpvalueDescriptor {
+    bool isLocal; //a local of the enclosing function, otherwise one of the enclosing closure's upvalues
+    uint32_t index; //slot of the local in the frame of the enclosing function, or index of the enclosing upvalue
+    //Only for locals: the variable may be used after its scope ends, so it is captured through an UpvalueObj. Others are
+    //captured by their stack slot. Set by the compiler's escape analysis once the variable goes out of scope.
+    bool escapes = false;
+};
+
 
 enum class OpCode  : uint8_t { //opcodes are internally represented as unsigned 8-bit integers
     OP_RETURN,
@@ -35,9 +46,53 @@ enum class OpCode  : uint8_t { //opcodes are internally represented as unsigned
     OP_LOOP,
     OP_CLASS,
     OP_CALL,
+    OP_TAIL_CALL, //OP_CALL whose result is returned right away, the callee reuses the frame of the caller
+    OP_CLOSURE, //creates a closure of the function constant, capturing the variables in its chunk's upvalues
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_CLOSE_UPVALUE, //pops a local that escaping closures captured, moving it into its UpvalueObj
+    OP_METHOD, //pops a function or closure and adds it to the methods of the class below it under the constant's name
+    //OP_GET_PROPERTY and OP_CALL in one, without binding the method. Its 16 bit operand holds the name constant in the
+    //high byte and the argument count in the low byte, the receiver is below the arguments. See MethodCache
+    OP_INVOKE,
+    OP_TAIL_INVOKE, //OP_INVOKE whose result is returned right away, like OP_TAIL_CALL
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
-    OP_ALLOCATE
+    OP_ALLOCATE,
+
+    //Long forms, see Chunk::longForm. They behave like the instruction without _LONG but their operand is 24 bits wide
+    OP_CONSTANT_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_LONG,
+    OP_LOOP_LONG,
+    OP_CLASS_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_CLOSURE_LONG,
+    OP_METHOD_LONG,
+
+    //Superinstructions, see PeepholeOptimizer. Their operands are the operands of the instructions they replace, in order
+    OP_GET_LOCAL_CONSTANT_ADD,  //OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+    OP_LESS_JUMP_IF_FALSE,      //OP_LESS, OP_JUMP_IF_FALSE
+    OP_SET_LOCAL_POP,           //OP_SET_LOCAL, OP_POP
+    OP_SET_GLOBAL_POP,          //OP_SET_GLOBAL, OP_POP
+
+    //Quickened forms, see Chunk::quickenedForm. The compiler never emits them, the VM rewrites instructions into them
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_GET_LOCAL_CONSTANT_ADD_NUMBER,
+    OP_LESS_JUMP_IF_FALSE_NUMBER,
+
+    OP_COUNT //number of opcodes, not an actual instruction
 };
 
 class Chunk {
@@ -49,21 +104,91 @@ public:
     std::byte readByte(int offset) const;
     size_t byteCount() const;
 
-    //writes a constant to the chunk and returns the offset it was added at
+    //writes a constant to the chunk and returns its offset. A constant identical to one already in the chunk is reused
     size_t writeConstant(const CLoxLiteral &value);
 
     CLoxLiteral readConstant(int offset) const;
     size_t constantCount() const;
 
+    //true if functions are declared in the chunk, the compiler stores them as constants of the enclosing chunk
+    bool containsFunctions() const;
+
     //writes a line to the chunk
     void writeLine(int line);
 
     int readLine(int offset) const;
+    //readLine for the SamplingProfiler's signal handler: never throws, an offset past the end reads the last line
+    int readLineUnchecked(int offset) const noexcept;
+    //the line of every byte of bytecode
+    std::vector<int> byteLines() const;
     size_t lineCount() const;
 
+    //returns the size in bytes of an instruction, counting the opcode and its operands
+    static int instructionLength(OpCode code);
+
+    /* Instructions with an operand come in a narrow form, with an 8 bit operand (16 bits for jumps), and a long form
+     * with a 24 bit operand. The compiler uses the narrow form whenever the operand fits, so the long forms only show
+     * up in very large chunks. Operands are stored big endian.
+     */
+    static const uint32_t MAX_LONG_OPERAND = 0xffffff;
+    static OpCode longForm(OpCode code); //returns OP_COUNT if the instruction has no long form
+    static OpCode narrowForm(OpCode code); //returns code itself for instructions that are not long forms
+    static bool isLongForm(OpCode code);
+
+    //size in bytes of the operand of an instruction that is not a superinstruction
+    static int operandWidth(OpCode code);
+
+    //reads the operand of code (an instruction or a component of a superinstruction) stored at operandOffset
+    uint32_t readOperand(int operandOffset, OpCode code) const;
+    void writeOperand(int operandOffset, OpCode code, uint32_t operand);
+
+    /* Arithmetic and comparisons have a quickened form that only works on numbers. The VM rewrites an instruction in
+     * place into its quickened form once it runs on numbers, and back into the generic form if its operands stop being
+     * numbers. The quickened form has the same operands and components as the generic one, so everything that decodes
+     * bytecode through componentOpCodes sees the generic instruction.
+     */
+    static OpCode quickenedForm(OpCode code); //returns OP_COUNT if the instruction has no quickened form
+    static OpCode genericForm(OpCode code); //returns code itself for instructions that are not quickened
+
+    //returns the sequence of instructions a superinstruction replaces, or a quickened instruction the components of its
+    //generic form. Any other instruction only contains itself
+    static const std::vector<OpCode> &componentOpCodes(OpCode code);
+
+    //true for instructions that can transfer control somewhere other than the next instruction, except OP_RETURN
+    static bool isJump(OpCode code);
+
+    //returns the offset a jump instruction at offset transfers control to
+    int jumpTarget(int offset) const;
+
     std::vector<std::byte> bytecode;
     std::vector<CLoxLiteral> constants;
     std::vector<int> lines;
+    //variables the closures of the function this chunk belongs to capture, indexed by the operand of OP_GET_UPVALUE
+    std::vector<UpvalueDescriptor> upvalues;
+
+    //offset of every constant, keyed by its type and the bits of its value. Strings are interned, so their pointer is enough
+    std::map<std::pair<int, uint64_t>, size_t> constantOffsets;
+
+    //set by the BytecodeVerifier once the chunk has been checked, allowing the VM to execute it without bounds checks
+    bool verified = false;
+    //most values a frame running this chunk ever has on the stack, including its own slot 0. Set with verified
+    int maxStackDepth = 0;
+
+    /* Pre-decoded handler table used by the VM's threaded dispatch. Entry i holds the address of the handler for the
+     * instruction that starts at bytecode offset i (operand offsets are left null). It is built lazily by the VM the
+     * first time the chunk is executed, because handler addresses are only known inside VM::execute.
+     */
+    std::vector<const void*> threadedCode;
+
+    //Inline caches of the property instructions, indexed by the bytecode offset of the instruction like threadedCode.
+    //Sized by the VM the first time the chunk is executed.
+    std::vector<PropertyCache> propertyCaches;
+    //Inline caches of OP_INVOKE, indexed the same way. Sized by the VM the first time the chunk is executed.
+    std::vector<MethodCache> methodCaches;
+
+    //How often each loop header was reached through a back edge, indexed by the offset of the header. Only used by the
+    //TracingJit, which resets the counters. Sized by the VM the first time the chunk is executed.
+    std::vector<int32_t> loopCounters;
 };
 
 
@@ -5,6 +5,8 @@
 #include "LoxError.h"
 #include "DebugUtils.h"
 #include "Memory.h"
+#include "PeepholeOptimizer.h"
+#include "BytecodeVerifier.h"
 
 //if this directive is enabled the compiler prints out every opcode after emitting them to the current chunk
 //#define DEBUG_COMPILER
@@ -15,12 +17,13 @@ ParseRule::ParseRule(ParseFunction parseAsPrefix, ParseFunction parseAsInfix, Pr
 
 LocalVariables::Variable::Variable(const Token &name, int depth) : name(name), depth(depth) {}
 
-Compiler::Compiler() {
+Compiler::Compiler(GlobalVariables &globalVariables, Memory &heap, std::ostream &errors) : globalVariables(globalVariables), heap(heap), errors(errors) {
     functionType = FunctionType::SCRIPT;
-    StringObj *name = dynamic_cast<StringObj*>(Memory::allocateHeapString("mainCompilerFunction"));
-    function = dynamic_cast<FunctionObj*>(Memory::allocateHeapFunction(name, new Chunk(), 0));
+    StringObj *name = static_cast<StringObj*>(heap.allocateHeapString("mainCompilerFunction"));
+    function = static_cast<FunctionObj*>(heap.allocateHeapFunction(name, new Chunk(), 0));
 
     localVariables.locals.emplace_back(Token(TokenType::IDENTIFIER, "", 0), 0);
+    localVariables.function = function;
 
     registerParsingRules();
 }
@@ -68,7 +71,7 @@ void Compiler::registerParsingRules() {
             {TokenType::PRINT, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
             {TokenType::RETURN, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
             {TokenType::SUPER, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
-            {TokenType::THIS, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
+            {TokenType::THIS, ParseRule([this] (bool canAssign) {thisExpression(canAssign);}, std::nullopt, PrecedenceLevel::NONE)},
             {TokenType::TRUE, ParseRule([this] (bool canAssign) {literal(canAssign);}, std::nullopt, PrecedenceLevel::NONE)},
             {TokenType::VAR, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
             {TokenType::WHILE, ParseRule(std::nullopt, std::nullopt, PrecedenceLevel::NONE)},
@@ -92,11 +95,34 @@ FunctionObj* Compiler::compile(const std::vector<Token> &tokens, bool &successFl
         assert(match(TokenType::END_OF_FILE)); //Scanner should have included a END_OF_FILE token
     }
 
-    emitByte(OpCode::OP_RETURN);
+    endFunction();
     successFlag = !hadError;
     return function;
 }
 
+//Finishes the chunk of the function being compiled, which returns like a bare 'return' if it runs off its end.
+void Compiler::endFunction() {
+    //the locals of the outermost scope are never popped, returning closes their upvalues
+    for (auto reverse_it = localVariables.locals.rbegin(); reverse_it != localVariables.locals.rend(); ++reverse_it){
+        analyzeEscape(*reverse_it);
+    }
+    emitReturn();
+    if (hadError){
+        return;
+    }
+
+    PeepholeOptimizer(currentChunk()).optimize();
+
+    //the verifier computes the maximum stack depth the VM sizes the frame with, so it runs here once instead of on
+    //every execution. Failing it means the compiler emitted bad bytecode.
+    try {
+        BytecodeVerifier(currentChunk(), globalVariables.count(), function->arity + 1).verify();
+    } catch (const LoxVerificationError &error) {
+        errors << error.what() << "\n";
+        hadError = true;
+    }
+}
+
 void Compiler::declaration() {
     try {
         if (match(TokenType::VAR)){
@@ -106,14 +132,14 @@ void Compiler::declaration() {
             statement();
         }
     } catch (const LoxCompileError &error) {
-        std::cout << error.what() << "\n";
+        errors << error.what() << "\n";
         hadError = true;
         synchronize();
     }
 }
 
 void Compiler::varDeclaration() {
-    std::byte offset = parseVariableName();
+    uint32_t offset = parseVariableName();
 
     if (match(TokenType::EQUAL)){
         expression();
@@ -142,8 +168,7 @@ void Compiler::statement() {
     } else if (match(TokenType::FUN)){
         functionDeclaration();
     } else if (match(TokenType::RETURN)){
-        emitByte(OpCode::OP_RETURN);
-        expect(TokenType::SEMICOLON, "Expected ';' after return");
+        returnStatement();
     } else if (match(TokenType::CLASS)){
         classDeclaration();
     } else {
@@ -160,27 +185,127 @@ void Compiler::block() {
     expect(TokenType::RIGHT_BRACE, "Expected '}' after block");
 }
 
+//The class is loaded again once it is defined, so the OP_METHOD of every method can add it to the class
 void Compiler::classDeclaration() {
     Token name = expect(TokenType::IDENTIFIER, "Expected identifier after 'class'");
-    std::byte nameConstant = emitIdentifierConstant(name);
+    uint32_t nameConstant = identifierConstant(name);
     declareVariable();
+    uint32_t globalSlot = localVariables.currentScopeDepth > 0 ? 0 : resolveGlobalVariable(name);
 
-    emitByte(OpCode::OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitOperandInstruction(OpCode::OP_CLASS, nameConstant);
+    defineVariable(globalSlot);
+    namedVariable(false, name);
 
     expect(TokenType::LEFT_BRACE, "Expected '{' before class body");
+    classDepth++;
+    try {
+        while (peek().type != TokenType::RIGHT_BRACE && peek().type != TokenType::END_OF_FILE){
+            method();
+        }
+    } catch (const LoxCompileError &) {
+        classDepth--;
+        throw;
+    }
+    classDepth--;
     expect(TokenType::RIGHT_BRACE, "Expected '}' after class body");
+    emitByte(OpCode::OP_POP);
+}
+
+void Compiler::method() {
+    Token name = expect(TokenType::IDENTIFIER, "Expected method declaration in class body");
+    uint32_t nameConstant = identifierConstant(name);
+    parseFunction(name.lexeme == "init" ? FunctionType::INITIALIZER : FunctionType::METHOD);
+    emitOperandInstruction(OpCode::OP_METHOD, nameConstant);
 }
 
 void Compiler::functionDeclaration() {
-    std::byte global = parseVariableName();
+    uint32_t global = parseVariableName("Expected function name after 'fun'");
     markVariableInitialized();
     parseFunction(FunctionType::FUNCTION);
     defineVariable(global);
 }
 
+/* Compiles the parameters and body of a function into a FunctionObj with a chunk of its own, and emits the function as a
+ * constant of the enclosing chunk, or a closure of it if it captures variables. The enclosing function's state is set
+ * aside while the body is compiled and linked through localVariables.enclosing, where the variables of enclosing
+ * functions are resolved as upvalues. Its frame starts with the function itself in slot 0 followed by the arguments,
+ * which the parameters are the first locals of. Methods have the receiver in slot 0 instead, as the local 'this'.
+ */
 void Compiler::parseFunction(FunctionType type) {
-    //TODO
+    Token name = previous();
+    FunctionObj *enclosingFunction = function;
+    FunctionType enclosingFunctionType = functionType;
+    LocalVariables enclosingLocalVariables = std::move(localVariables);
+
+    auto *nameString = static_cast<StringObj*>(heap.allocateHeapString(name.lexeme));
+    function = static_cast<FunctionObj*>(heap.allocateHeapFunction(nameString, new Chunk(), 0));
+    functionType = type;
+    if (type == FunctionType::FUNCTION && enclosingLocalVariables.currentScopeDepth > 0){
+        enclosingLocalVariables.locals.back().function = function; //the variable the function is declared in
+    }
+    localVariables = LocalVariables();
+    localVariables.locals.emplace_back(Token(TokenType::IDENTIFIER, type == FunctionType::FUNCTION ? "" : "this", name.line), 0);
+    localVariables.function = function;
+    localVariables.enclosing = &enclosingLocalVariables;
+
+    auto restoreEnclosingFunction = [&]() {
+        function = enclosingFunction;
+        functionType = enclosingFunctionType;
+        localVariables = std::move(enclosingLocalVariables);
+    };
+
+    try {
+        beginScope();
+        expect(TokenType::LEFT_PAREN, "Expected '(' after function name");
+        if (peek().type != TokenType::RIGHT_PAREN){
+            do {
+                if (function->arity == UINT8_MAX){
+                    throw LoxCompileError("Cannot have more than " + std::to_string(UINT8_MAX) + " parameters", peek().line);
+                }
+                function->arity++;
+                defineVariable(parseVariableName("Expected parameter name"));
+            } while (match(TokenType::COMMA));
+        }
+        expect(TokenType::RIGHT_PAREN, "Expected ')' after parameters");
+        expect(TokenType::LEFT_BRACE, "Expected '{' before function body");
+        block();
+        endFunction();
+    } catch (const LoxCompileError &) {
+        restoreEnclosingFunction();
+        throw;
+    }
+
+    FunctionObj *compiled = function;
+    restoreEnclosingFunction();
+    if (type != FunctionType::FUNCTION){
+        escapeCaptures(compiled); //a method can be called wherever its class ends up
+    }
+    if (compiled->chunk->upvalues.empty()){
+        emitConstant(CLoxLiteral(compiled));
+    } else {
+        emitOperandInstruction(OpCode::OP_CLOSURE, makeConstant(CLoxLiteral(compiled)));
+    }
+}
+
+//the script can return too, which ends it. The value it returns is discarded
+void Compiler::returnStatement() {
+    if (match(TokenType::SEMICOLON)){
+        emitReturn();
+        return;
+    }
+    if (functionType == FunctionType::INITIALIZER){
+        throw LoxCompileError("Cannot return a value from an initializer", previous().line);
+    }
+
+    expression();
+    expect(TokenType::SEMICOLON, "Expected ';' after return value");
+    //A call that is the last instruction of the value returns its result right away, so the callee can take over the
+    //frame. The OP_RETURN is still needed by other paths through the expression, like the left operand of an 'or'.
+    if ((functionType == FunctionType::FUNCTION || functionType == FunctionType::METHOD) && lastCallOffset != -1){
+        std::byte &call = currentChunk()->bytecode[lastCallOffset];
+        call = std::byte(call == std::byte(OpCode::OP_INVOKE) ? OpCode::OP_TAIL_INVOKE : OpCode::OP_TAIL_CALL);
+    }
+    emitByte(OpCode::OP_RETURN);
 }
 
 void Compiler::ifStatement() {
@@ -286,19 +411,42 @@ void Compiler::expression() {
 }
 
 void Compiler::call(bool canAssign) {
-    emitByte(OpCode::OP_CALL);
-    expect(TokenType::RIGHT_PAREN, "Expected ')' after call");
+    uint32_t argCount = argumentList();
+    auto callOffset = static_cast<int>(currentChunk()->byteCount());
+    emitOperandInstruction(OpCode::OP_CALL, argCount);
+    lastCallOffset = callOffset;
+}
+
+uint32_t Compiler::argumentList() {
+    uint32_t argCount = 0;
+    if (peek().type != TokenType::RIGHT_PAREN){
+        do {
+            if (argCount == UINT8_MAX){
+                throw LoxCompileError("Cannot pass more than " + std::to_string(UINT8_MAX) + " arguments", peek().line);
+            }
+            expression();
+            argCount++;
+        } while (match(TokenType::COMMA));
+    }
+    expect(TokenType::RIGHT_PAREN, "Expected ')' after arguments");
+    return argCount;
 }
 
 void Compiler::dot(bool canAssign) {
     Token name = expect(TokenType::IDENTIFIER, "Expected identifier after '.'");
-    std::byte offset = emitIdentifierConstant(name);
+    uint32_t offset = identifierConstant(name);
 
     if (canAssign && match(TokenType::EQUAL)){
         expression();
-        emitByte(OpCode::OP_SET_PROPERTY, offset);
+        emitOperandInstruction(OpCode::OP_SET_PROPERTY, offset);
+    } else if (offset <= UINT8_MAX && match(TokenType::LEFT_PAREN)){
+        //OP_INVOKE has no long form, past its operand the method is bound and then called
+        uint32_t argCount = argumentList();
+        auto callOffset = static_cast<int>(currentChunk()->byteCount());
+        emitOperandInstruction(OpCode::OP_INVOKE, offset << 8u | argCount);
+        lastCallOffset = callOffset;
     } else {
-        emitByte(OpCode::OP_GET_PROPERTY, offset);
+        emitOperandInstruction(OpCode::OP_GET_PROPERTY, offset);
     }
 }
 
@@ -306,6 +454,14 @@ void Compiler::variable(bool canAssign) {
     namedVariable(canAssign, previous());
 }
 
+//'this' is the local in slot 0 of methods, functions declared in a method capture it like any other variable
+void Compiler::thisExpression(bool canAssign) {
+    if (classDepth == 0){
+        throw LoxCompileError("Cannot use 'this' outside of a class", previous().line);
+    }
+    namedVariable(false, previous());
+}
+
 void Compiler::beginScope() {
     localVariables.currentScopeDepth++;
 }
@@ -315,56 +471,149 @@ void Compiler::endScope() {
 
     auto reverse_it = localVariables.locals.rbegin();
     while (reverse_it != localVariables.locals.rend() && reverse_it->depth > localVariables.currentScopeDepth) {
+        bool closed = analyzeEscape(*reverse_it);
         //https://stackoverflow.com/questions/1830158/how-to-call-erase-with-a-reverse-iterator/50282077#50282077
         reverse_it = decltype(reverse_it) (localVariables.locals.erase(std::next(reverse_it).base()));
-        emitByte(OpCode::OP_POP);
+        emitByte(closed ? OpCode::OP_CLOSE_UPVALUE : OpCode::OP_POP);
+    }
+}
+
+/* Escape analysis of a local that goes out of scope. A variable escapes if it may still be used after its scope ends,
+ * which for a variable holding a closure means the closure may still be called. That is the case when the closure is read
+ * for anything but calling it right away, since it could be stored, passed or returned, and when a closure that captures
+ * it escapes. Everything an escaping closure captures escapes as well.
+ *
+ * Locals are analyzed innermost first, after every use of them and every closure declared after them has been compiled.
+ * A captured variable that escapes is captured through an UpvalueObj and closed over here. All others stay in their stack
+ * slot and closures refer to the slot directly, so closures that are only called where they are declared allocate no
+ * upvalues at all.
+ */
+bool Compiler::analyzeEscape(LocalVariables::Variable &variable) {
+    if (variable.escapes && variable.function != nullptr){
+        escapeCaptures(variable.function);
+    }
+
+    if (!variable.escapes || variable.capturedBy.empty()){
+        return false;
+    }
+    for (const auto &[chunk, upvalue] : variable.capturedBy){
+        chunk->upvalues[upvalue].escapes = true;
+    }
+    return true;
+}
+
+void Compiler::escapeCaptures(FunctionObj *closure) {
+    for (const UpvalueDescriptor &upvalue : closure->chunk->upvalues){
+        LocalVariables::Variable &captured = upvalue.isLocal ? localVariables.locals[upvalue.index] : capturedVariable(localVariables, upvalue.index);
+        captured.escapes = true;
     }
 }
 
 void Compiler::namedVariable(bool canAssign, const Token &name) {
     OpCode getOpCode, setOpCode;
-    std::optional<std::byte> offset = resolveLocalVariable(name);
+    LocalVariables::Variable *variable = nullptr;
+    std::optional<uint32_t> offset = resolveLocalVariable(localVariables, name);
 
     if (offset.has_value()){
         getOpCode = OpCode::OP_GET_LOCAL;
         setOpCode = OpCode::OP_SET_LOCAL;
+        variable = &localVariables.locals[offset.value()];
+    } else if ((offset = resolveUpvalue(localVariables, name)).has_value()){
+        getOpCode = OpCode::OP_GET_UPVALUE;
+        setOpCode = OpCode::OP_SET_UPVALUE;
+        variable = &capturedVariable(localVariables, offset.value());
     } else {
         getOpCode = OpCode::OP_GET_GLOBAL;
         setOpCode = OpCode::OP_SET_GLOBAL;
-        offset = emitIdentifierConstant(name);
+        offset = resolveGlobalVariable(name);
     }
 
     if (canAssign && match(TokenType::EQUAL)){
         expression();
-        emitByte(setOpCode, offset.value());
+        emitOperandInstruction(setOpCode, offset.value());
     } else {
-        emitByte(getOpCode, offset.value());
+        //a closure that is called right away cannot be kept anywhere, see analyzeEscape
+        if (variable != nullptr && peek().type != TokenType::LEFT_PAREN){
+            variable->escapes = variable->escapes || variable->function != nullptr;
+        }
+        emitOperandInstruction(getOpCode, offset.value());
     }
 }
 
-std::optional<std::byte> Compiler::resolveLocalVariable(const Token &name) {
-    for (auto reverse_it = localVariables.locals.rbegin(); reverse_it != localVariables.locals.rend(); ++reverse_it){
+std::optional<uint32_t> Compiler::resolveLocalVariable(LocalVariables &variables, const Token &name) {
+    for (auto reverse_it = variables.locals.rbegin(); reverse_it != variables.locals.rend(); ++reverse_it){
         if (reverse_it->name.lexeme == name.lexeme){
             if (reverse_it->depth == -1){
                 throw LoxCompileError("Can't read local variable in its own initializer", previous().line);
             }
 
-            //https://stackoverflow.com/a/24998000  safe to narrowly cast to int because maximum amount of locals is 256
-            int index = (int) std::distance(localVariables.locals.begin(), reverse_it.base()) - 1;
-            return (std::byte) index;
+            //https://stackoverflow.com/a/24998000  safe to narrowly cast because the amount of locals fits in a long operand
+            auto index = static_cast<uint32_t>(std::distance(variables.locals.begin(), reverse_it.base()) - 1);
+            return index;
         }
     }
 
     return std::nullopt;
 }
 
-std::byte Compiler::parseVariableName() {
-    Token name = expect(TokenType::IDENTIFIER, "Expected variable identifier after 'var'");
+//A variable of an enclosing function is captured by every function between it and the one using it
+std::optional<uint32_t> Compiler::resolveUpvalue(LocalVariables &variables, const Token &name) {
+    if (variables.enclosing == nullptr){
+        return std::nullopt;
+    }
+
+    if (std::optional<uint32_t> local = resolveLocalVariable(*variables.enclosing, name)){
+        return addUpvalue(variables, local.value(), true);
+    }
+    if (std::optional<uint32_t> upvalue = resolveUpvalue(*variables.enclosing, name)){
+        return addUpvalue(variables, upvalue.value(), false);
+    }
+    return std::nullopt;
+}
+
+uint32_t Compiler::addUpvalue(LocalVariables &variables, uint32_t index, bool isLocal) {
+    std::vector<UpvalueDescriptor> &upvalues = variables.function->chunk->upvalues;
+    for (uint32_t i = 0; i < upvalues.size(); i++){
+        if (upvalues[i].index == index && upvalues[i].isLocal == isLocal){
+            return i;
+        }
+    }
+
+    //upvalue operands are a single byte
+    if (upvalues.size() == UINT8_MAX + 1){
+        throw LoxCompileError("Too many closure variables in function", previous().line);
+    }
+    upvalues.push_back({isLocal, index});
+    auto upvalue = static_cast<uint32_t>(upvalues.size() - 1);
+    if (isLocal){
+        variables.enclosing->locals[index].capturedBy.emplace_back(variables.function->chunk, upvalue);
+    }
+    return upvalue;
+}
+
+LocalVariables::Variable &Compiler::capturedVariable(LocalVariables &variables, uint32_t upvalue) {
+    const UpvalueDescriptor &descriptor = variables.function->chunk->upvalues[upvalue];
+    if (descriptor.isLocal){
+        return variables.enclosing->locals[descriptor.index];
+    }
+    return capturedVariable(*variables.enclosing, descriptor.index);
+}
+
+uint32_t Compiler::parseVariableName(const std::string &errorMessage) {
+    Token name = expect(TokenType::IDENTIFIER, errorMessage);
 
     declareVariable();
-    if (localVariables.currentScopeDepth > 0) return std::byte{0};
+    if (localVariables.currentScopeDepth > 0) return 0;
+
+    return resolveGlobalVariable(name);
+}
+
+uint32_t Compiler::resolveGlobalVariable(const Token &name) {
+    if (globalVariables.count() == GlobalVariables::MAX_GLOBALS && !globalVariables.contains(name.lexeme)){
+        throw LoxCompileError("Too many global variables", name.line);
+    }
 
-    return emitIdentifierConstant(name);
+    return globalVariables.resolve(name.lexeme);
 }
 
 void Compiler::declareVariable() {
@@ -386,7 +635,7 @@ void Compiler::declareVariable() {
 }
 
 void Compiler::addLocalVariable(const Token &name) {
-    if (localVariables.locals.size() == 256){
+    if (localVariables.locals.size() == Chunk::MAX_LONG_OPERAND + 1){
         throw LoxCompileError("Too many local variables in scope", previous().line);
     }
 
@@ -395,18 +644,18 @@ void Compiler::addLocalVariable(const Token &name) {
     localVariables.locals.push_back(v);
 }
 
-std::byte Compiler::emitIdentifierConstant(const Token &identifier) {
-    Obj* obj = Memory::allocateHeapString(identifier.lexeme);
-    return emitConstant(CLoxLiteral(obj));
+uint32_t Compiler::identifierConstant(const Token &identifier) {
+    Obj* obj = heap.allocateHeapString(identifier.lexeme);
+    return makeConstant(CLoxLiteral(obj));
 }
 
-void Compiler::defineVariable(std::byte identifierOffset) {
+void Compiler::defineVariable(uint32_t globalSlot) {
     if (localVariables.currentScopeDepth > 0){
         markVariableInitialized();
         return;
     }
 
-    emitByte(OpCode::OP_DEFINE_GLOBAL, identifierOffset);
+    emitOperandInstruction(OpCode::OP_DEFINE_GLOBAL, globalSlot);
 }
 
 void Compiler::markVariableInitialized() {
@@ -526,7 +775,7 @@ void Compiler::literal(bool canAssign) {
 }
 
 void Compiler::string(bool canAssign) {
-    Obj* obj = Memory::allocateHeapString(previous().lexeme);
+    Obj* obj = heap.allocateHeapString(previous().lexeme);
     CLoxLiteral str(obj);
     emitConstant(str);
 }
@@ -549,38 +798,48 @@ void Compiler::parseOr(bool canAssign) {
     patchJump(endJump);
 }
 
+/* Forward jumps are always emitted in their long form because the distance is not known yet. The PeepholeOptimizer
+ * turns them back into narrow jumps when the distance fits.
+ */
 int Compiler::emitJump(OpCode instruction) {
-    emitByte(instruction);
+    emitByte(Chunk::longForm(instruction));
     emitByte(std::byte(0xff));
     emitByte(std::byte(0xff));
-    return currentChunk()->byteCount() - 2;
+    emitByte(std::byte(0xff));
+    return currentChunk()->byteCount() - 3;
 }
 
 void Compiler::patchJump(int offset) {
-    // -2 to adjust for the bytecode for the jump offset itself.
-    unsigned int jump = currentChunk()->byteCount() - offset - 2;
+    // -3 to adjust for the bytecode for the jump offset itself.
+    unsigned int jump = currentChunk()->byteCount() - offset - 3;
 
-    if (jump > UINT16_MAX){
+    if (jump > Chunk::MAX_LONG_OPERAND){
         throw LoxCompileError("Too much code to jump over", previous().line);
     }
 
-    currentChunk()->bytecode[offset] = std::byte((jump >> 8u) & 0xff);
-    currentChunk()->bytecode[offset+1] = std::byte(jump & 0xff);
+    auto opCode = static_cast<OpCode>(currentChunk()->readByte(offset - 1));
+    currentChunk()->writeOperand(offset, opCode, jump);
  }
 
 void Compiler::emitLoop(int loopStart) {
+    //the distance is counted from the end of the instruction, which depends on the width of the operand
     int offset = currentChunk()->byteCount() - loopStart + 2;
+    OpCode opCode = OpCode::OP_LOOP;
     if (offset > UINT16_MAX){
+        offset++;
+        opCode = OpCode::OP_LOOP_LONG;
+    }
+
+    if (offset > static_cast<int>(Chunk::MAX_LONG_OPERAND)){
         throw LoxCompileError("Loop body too large", previous().line);
     }
 
-    emitByte(OpCode::OP_LOOP);
-    emitByte(std::byte((offset >> 8u) & 0xff));
-    emitByte(std::byte(offset & 0xff));
+    emitOperandInstruction(opCode, offset);
 }
 
 void Compiler::emitByte(std::byte byte) {
     currentChunk()->write(byte, previous().line);
+    lastCallOffset = -1;
 #ifdef DEBUG_COMPILER
     std::cout << "[DEBUG] Compiler Emitted: " << std::to_integer<int>(byte) << "\n";
 #endif
@@ -595,9 +854,25 @@ void Compiler::emitByte(OpCode opCode) {
     emitByte(static_cast<std::byte>(opCode));
 }
 
-void Compiler::emitByte(OpCode opCode1, std::byte byte) {
-    emitByte(opCode1);
-    emitByte(byte);
+void Compiler::emitOperandInstruction(OpCode opCode, uint32_t operand) {
+    if (operand > UINT8_MAX && Chunk::operandWidth(opCode) == 1){
+        opCode = Chunk::longForm(opCode);
+    }
+
+    emitByte(opCode);
+    for (int i = 0; i < Chunk::operandWidth(opCode); i++){
+        emitByte(std::byte(0));
+    }
+    currentChunk()->writeOperand(currentChunk()->byteCount() - Chunk::operandWidth(opCode), opCode, operand);
+}
+
+void Compiler::emitReturn() {
+    if (functionType == FunctionType::INITIALIZER){
+        emitOperandInstruction(OpCode::OP_GET_LOCAL, 0);
+        emitByte(OpCode::OP_RETURN);
+    } else {
+        emitByte(OpCode::OP_NIL, OpCode::OP_RETURN);
+    }
 }
 
 void Compiler::emitByte(OpCode opCode1, OpCode opcode2) {
@@ -605,19 +880,20 @@ void Compiler::emitByte(OpCode opCode1, OpCode opcode2) {
     emitByte(opcode2);
 }
 
-std::byte Compiler::emitConstant(const CLoxLiteral &constant) {
+uint32_t Compiler::makeConstant(const CLoxLiteral &constant) {
     size_t constantOffset = currentChunk()->writeConstant(constant);
 
-    ////A chunk can only hold 256 constants because 8 bits are used to represent the index of the constant in the constant pool
-    //TODO: Add a special OP_CONSTANT_16 special instruction that uses 16 bits?
-    if (constantOffset >= 256) {
-        throw LoxCompileError("Cannot have more than 256 constants", previous().line);
+    if (constantOffset > Chunk::MAX_LONG_OPERAND) {
+        throw LoxCompileError("Cannot have more than " + std::to_string(Chunk::MAX_LONG_OPERAND + 1) + " constants", previous().line);
     }
 
-    emitByte(OpCode::OP_CONSTANT);
-    auto offsetAsByte = static_cast<std::byte>(constantOffset);
-    emitByte(offsetAsByte);
-    return offsetAsByte;
+    return static_cast<uint32_t>(constantOffset);
+}
+
+uint32_t Compiler::emitConstant(const CLoxLiteral &constant) {
+    uint32_t offset = makeConstant(constant);
+    emitOperandInstruction(OpCode::OP_CONSTANT, offset);
+    return offset;
 }
 
 Chunk* Compiler::currentChunk() {
@@ -3,13 +3,17 @@
 
 
 #include <memory>
+#include <iostream>
 #include <functional>
 #include <map>
 #include <list>
+#include <optional>
 #include "CLoxLiteral.h"
 #include "Chunk.h"
 #include "Token.h"
+#include "GlobalVariables.h"
 
+class Memory;
 
 
 enum class PrecedenceLevel {
@@ -27,7 +31,7 @@ enum class PrecedenceLevel {
 };
 
 enum class FunctionType {
-    FUNCTION, SCRIPT
+    FUNCTION, METHOD, INITIALIZER, SCRIPT
 };
 
 
@@ -49,17 +53,23 @@ public:
     struct Variable {
         Token name;
         int depth;
+        bool escapes = false; //may still be used after its scope ends, see Compiler::analyzeEscape
+        FunctionObj *function = nullptr; //the function declared with 'fun' in this variable, if any
+        std::vector<std::pair<Chunk*, uint32_t>> capturedBy; //chunk and index of every upvalue that captures the variable
 
         Variable(const Token &name, int depth);
     };
 
     std::vector<Variable> locals;
     int currentScopeDepth = 0;
+    FunctionObj *function = nullptr; //function the locals belong to
+    LocalVariables *enclosing = nullptr; //locals of the function this one is declared in, nullptr for the script
 };
 
 class Compiler {
 public:
-    Compiler();
+    //the compiled functions and their constants are allocated in heap, compile errors are reported to errors
+    Compiler(GlobalVariables &globalVariables, Memory &heap, std::ostream &errors = std::cout);
     FunctionObj* compile(const std::vector<Token> &tokens, bool &successFlag);
 
 private:
@@ -70,6 +80,11 @@ private:
     FunctionType functionType;
 
     LocalVariables localVariables;
+    int lastCallOffset = -1; //offset of the OP_CALL or OP_INVOKE in the current chunk if it is the last instruction emitted, otherwise -1
+    int classDepth = 0; //how many class declarations the code being compiled is nested in, 'this' is only valid inside one
+    GlobalVariables &globalVariables; //slots of global variables, shared with the VM that runs the compiled code
+    Memory &heap;
+    std::ostream &errors;
 
     //Parselets for pratt parser
     std::unordered_map<TokenType, ParseRule> parsingRules;
@@ -92,7 +107,9 @@ private:
     void whileStatement();
     void forStatement();
     void functionDeclaration();
+    void returnStatement();
     void classDeclaration();
+    void method();
     void expression();
 
     void number(bool canAssign);
@@ -102,13 +119,17 @@ private:
     void literal(bool canAssign);
     void string(bool canAssign);
     void variable(bool canAssign);
+    void thisExpression(bool canAssign);
     void parseAnd(bool canAssign);
     void parseOr(bool canAssign);
     void call(bool canAssign);
+    uint32_t argumentList(); //parses the arguments of a call after its '(' and returns how many there are
     void dot(bool canAssign);
     void allocate(bool canAssign);
 
     void parseFunction(FunctionType type);
+    void endFunction(); //emits the implicit return, then optimizes and verifies the chunk of the function being compiled
+    void emitReturn(); //returns nil, or the instance from initializers
 
     void block();
 
@@ -118,19 +139,26 @@ private:
     void declareVariable();
     void addLocalVariable(const Token &name);
     void namedVariable(bool canAssign, const Token &name);
-    std::byte parseVariableName(); //returns the offset in the chunk where the string of the variable's name is stored
-    std::byte emitIdentifierConstant(const Token &identifier);
-    void defineVariable(std::byte identifierOffset);
-    std::optional<std::byte> resolveLocalVariable(const Token &name);
+    uint32_t parseVariableName(const std::string &errorMessage = "Expected variable identifier after 'var'"); //returns the global slot of the variable, only meaningful for global variables
+    uint32_t identifierConstant(const Token &identifier); //stores the identifier's name in the constant pool and returns its index
+    void defineVariable(uint32_t globalSlot);
+    std::optional<uint32_t> resolveLocalVariable(LocalVariables &variables, const Token &name);
+    std::optional<uint32_t> resolveUpvalue(LocalVariables &variables, const Token &name); //returns the index of the upvalue in the chunk of variables.function
+    uint32_t addUpvalue(LocalVariables &variables, uint32_t index, bool isLocal);
+    LocalVariables::Variable &capturedVariable(LocalVariables &variables, uint32_t upvalue); //the local an upvalue refers to, however far out it is
+    bool analyzeEscape(LocalVariables::Variable &variable); //returns true if the variable has to be closed over when it goes out of scope
+    void escapeCaptures(FunctionObj *closure); //marks every variable an escaping closure captures as escaping
+    uint32_t resolveGlobalVariable(const Token &name);
     void markVariableInitialized();
 
     void emitByte(OpCode opCode);
     void emitByte(OpCode opCode1, OpCode opcode2);
-    void emitByte(OpCode opCode1, std::byte byte);
     void emitByte(std::byte byte);
     void emitByte(std::byte first, std::byte second);
-    std::byte emitConstant(const CLoxLiteral &constant); //returns the index in the constant pool the constant was stored at
-    int emitJump(OpCode instruction); //emits a jump instruction and fills in the instruction operand with placeholders
+    void emitOperandInstruction(OpCode opCode, uint32_t operand); //emits the narrow form of opCode if the operand fits, otherwise the long form
+    uint32_t makeConstant(const CLoxLiteral &constant); //adds the constant to the pool without emitting code, returns its index
+    uint32_t emitConstant(const CLoxLiteral &constant); //returns the index in the constant pool the constant was stored at
+    int emitJump(OpCode instruction); //emits the long form of a jump instruction with a placeholder operand and returns the operand's offset
     void patchJump(int offset);//changes an existing jump instruction operands to offset
     void emitLoop(int loopStart);
 
@@ -0,0 +1,249 @@
+#include <cmath>
+#include <sstream>
+#include "CppEmitter.h"
+#include "BytecodeVerifier.h"
+#include "DebugUtils.h"
+#include "LoxError.h"
+
+CppEmitter::CppEmitter(FunctionObj *function, const GlobalVariables &globals, std::string scriptName)
+    : chunk(function->chunk), globals(globals), scriptName(std::move(scriptName)) {}
+
+//The program is written to out only once all of it was generated, a script that cannot be emitted leaves out untouched
+void CppEmitter::emit(std::ostream &out) {
+    if (chunk->containsFunctions()){
+        throw LoxUnsupportedError("Scripts that declare functions cannot be emitted as C++");
+    }
+    //the generated code indexes constants and slots without checks, just like the VM
+    if (!chunk->verified){
+        BytecodeVerifier(chunk, globals.count()).verify();
+    }
+
+    std::ostringstream program;
+    emitProgram(program);
+    out << program.str();
+}
+
+void CppEmitter::emitProgram(std::ostream &out) {
+    jumpTargets.clear();
+    for (int offset = 0; offset < static_cast<int>(chunk->byteCount()); ){
+        auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+        if (Chunk::isJump(opCode)){
+            jumpTargets.insert(chunk->jumpTarget(offset));
+        }
+        offset += Chunk::instructionLength(opCode);
+    }
+
+    out << "//Generated by clox --emit-cpp from " << scriptName << ". Link it against clox-runtime, see AotRuntime.h\n";
+    out << "#include <limits>\n";
+    out << "#include \"AotRuntime.h\"\n\n";
+    out << "namespace {\n\n";
+    emitTables(out);
+
+    out << "void run(AotRuntime &runtime) {\n";
+    out << "    [[maybe_unused]] CLoxLiteral *frame = runtime.frame();\n";
+    out << "    [[maybe_unused]] const CLoxLiteral *constants = runtime.constants();\n";
+    out << "    CLoxLiteral *stackTop = runtime.top();\n\n";
+    for (int offset = 0; offset < static_cast<int>(chunk->byteCount()); ){
+        emitInstruction(out, offset);
+        offset += Chunk::instructionLength(static_cast<OpCode>(chunk->readByte(offset)));
+    }
+    out << "}\n\n";
+    out << "}\n\n";
+
+    out << "int main(int argc, char *argv[]) {\n";
+    out << "    static const AotProgram program = {\n";
+    out << "        " << (chunk->constants.empty() ? "nullptr" : "programConstants") << ", " << chunk->constants.size() << ",\n";
+    out << "        " << (globals.count() == 0 ? "nullptr" : "programGlobals") << ", " << globals.count() << ",\n";
+    out << "        " << (chunk->lines.empty() ? "nullptr" : "programLines") << ", " << chunk->lines.size() << ",\n";
+    out << "        " << chunk->byteCount() << ", " << chunk->maxStackDepth << ", run\n";
+    out << "    };\n";
+    out << "    return AotRuntime::main(argc, argv, program);\n";
+    out << "}\n";
+}
+
+//the parts of the chunk AotRuntime rebuilds the script's FunctionObj from. Arrays cannot be empty, so those are left out
+void CppEmitter::emitTables(std::ostream &out) {
+    if (!chunk->constants.empty()){
+        out << "const AotConstant programConstants[] = {\n";
+        for (size_t i = 0; i < chunk->constants.size(); i++){
+            const CLoxLiteral &constant = chunk->constants[i];
+            if (constant.isNumber()){
+                out << "    {AotConstant::Type::NUMBER, " << numberLiteral(constant.getNumber()) << ", nullptr, 0},\n";
+            } else if (constant.isObj() && constant.getObj()->isString()){
+                std::string_view chars = static_cast<StringObj*>(constant.getObj())->view();
+                out << "    {AotConstant::Type::STRING, 0, " << stringLiteral(chars) << ", " << chars.size() << "},\n";
+            } else {
+                throw LoxUnsupportedError("Constant " + std::to_string(i) + " cannot be emitted as C++");
+            }
+        }
+        out << "};\n\n";
+    }
+
+    if (globals.count() > 0){
+        out << "const char *const programGlobals[] = {\n";
+        for (uint32_t slot = 0; slot < globals.count(); slot++){
+            out << "    " << stringLiteral(globals.name(slot)) << ",\n";
+        }
+        out << "};\n\n";
+    }
+
+    if (!chunk->lines.empty()){
+        out << "const int programLines[] = {";
+        for (size_t i = 0; i < chunk->lines.size(); i++){
+            out << (i % 16 == 0 ? "\n    " : " ") << chunk->lines[i] << ",";
+        }
+        out << "\n};\n\n";
+    }
+}
+
+void CppEmitter::emitInstruction(std::ostream &out, int offset) {
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    int next = offset + Chunk::instructionLength(opCode);
+
+    if (jumpTargets.count(offset)){
+        out << "L" << offset << ":\n";
+    }
+    out << "    //" << offset << ": " << DebugUtils::opCodeName(opCode) << ", line " << chunk->readLine(offset) << "\n";
+
+    //superinstructions are emitted as their components, the C++ compiler fuses them again
+    int operandOffset = offset + 1;
+    for (OpCode component : Chunk::componentOpCodes(opCode)){
+        uint32_t operand = Chunk::operandWidth(component) > 0 ? chunk->readOperand(operandOffset, component) : 0;
+        operandOffset += Chunk::operandWidth(component);
+        emitComponent(out, Chunk::narrowForm(component), operand, offset, next);
+    }
+}
+
+void CppEmitter::emitComponent(std::ostream &out, OpCode code, uint32_t operand, int offset, int next) {
+    out << "    ";
+    switch (code) {
+        case OpCode::OP_RETURN:
+            out << "return;\n";
+            break;
+        case OpCode::OP_PRINT:
+            out << "stackTop = runtime.print(stackTop);\n";
+            break;
+        case OpCode::OP_CONSTANT:
+            //numbers are emitted as literals so the C++ compiler can fold them
+            if (chunk->constants[operand].isNumber()){
+                out << "*stackTop++ = CLoxLiteral(" << numberLiteral(chunk->constants[operand].getNumber()) << ");\n";
+            } else {
+                out << "*stackTop++ = constants[" << operand << "];\n";
+            }
+            break;
+        case OpCode::OP_NEGATE:
+            out << "stackTop = runtime.negate(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_ADD:
+            out << "stackTop = runtime.add(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_SUBTRACT:
+            out << "stackTop = runtime.subtract(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_MULTIPLY:
+            out << "stackTop = runtime.multiply(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_DIVIDE:
+            out << "stackTop = runtime.divide(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_TRUE:
+            out << "*stackTop++ = CLoxLiteral(true);\n";
+            break;
+        case OpCode::OP_FALSE:
+            out << "*stackTop++ = CLoxLiteral(false);\n";
+            break;
+        case OpCode::OP_NIL:
+            out << "*stackTop++ = CLoxLiteral::Nil();\n";
+            break;
+        case OpCode::OP_NOT:
+            out << "stackTop[-1] = CLoxLiteral(!runtime.truthy(stackTop[-1]));\n";
+            break;
+        case OpCode::OP_EQUAL:
+            out << "stackTop = runtime.equal(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_GREATER:
+            out << "stackTop = runtime.greater(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_LESS:
+            out << "stackTop = runtime.less(stackTop, " << next << ");\n";
+            break;
+        case OpCode::OP_POP:
+            out << "stackTop--;\n";
+            break;
+        case OpCode::OP_DEFINE_GLOBAL:
+            out << "stackTop = runtime.defineGlobal(stackTop, " << operand << ", " << next << ");\n";
+            break;
+        case OpCode::OP_GET_GLOBAL:
+            out << "stackTop = runtime.getGlobal(stackTop, " << operand << ", " << next << ");\n";
+            break;
+        case OpCode::OP_SET_GLOBAL:
+            out << "stackTop = runtime.setGlobal(stackTop, " << operand << ", " << next << ");\n";
+            break;
+        case OpCode::OP_GET_LOCAL:
+            out << "*stackTop++ = frame[" << operand << "];\n";
+            break;
+        case OpCode::OP_SET_LOCAL:
+            out << "frame[" << operand << "] = stackTop[-1];\n";
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+            out << "if (!runtime.truthy(stackTop[-1])) goto L" << chunk->jumpTarget(offset) << ";\n";
+            break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+            out << "goto L" << chunk->jumpTarget(offset) << ";\n";
+            break;
+        case OpCode::OP_CLASS:
+            out << "stackTop = runtime.makeClass(stackTop, " << operand << ", " << next << ");\n";
+            break;
+        case OpCode::OP_CALL:
+            out << "stackTop = runtime.call(stackTop, " << operand << ", " << next << ");\n";
+            break;
+        case OpCode::OP_GET_PROPERTY:
+            out << "stackTop = runtime.getProperty(stackTop, " << operand << ", " << offset << ", " << next << ");\n";
+            break;
+        case OpCode::OP_INVOKE:
+            out << "stackTop = runtime.invoke(stackTop, " << (operand >> 8u) << ", " << (operand & 0xffu) << ", " << offset << ", " << next << ");\n";
+            break;
+        case OpCode::OP_SET_PROPERTY:
+            out << "stackTop = runtime.setProperty(stackTop, " << operand << ", " << offset << ", " << next << ");\n";
+            break;
+        case OpCode::OP_ALLOCATE:
+            out << "stackTop = runtime.allocate(stackTop, " << next << ");\n";
+            break;
+        default:
+            throw LoxUnsupportedError(DebugUtils::opCodeName(code) + " at offset " + std::to_string(offset) + " cannot be emitted as C++");
+    }
+}
+
+//hexadecimal floating point literals are exact, so the generated program computes with the same doubles
+std::string CppEmitter::numberLiteral(double number) {
+    if (std::isnan(number)){
+        return "std::numeric_limits<double>::quiet_NaN()";
+    } else if (std::isinf(number)){
+        return number > 0 ? "std::numeric_limits<double>::infinity()" : "-std::numeric_limits<double>::infinity()";
+    }
+
+    std::ostringstream literal;
+    literal << std::hexfloat << number;
+    return literal.str();
+}
+
+//escapes everything that is not printable ASCII as octal, which unlike hex escapes always ends after three digits
+std::string CppEmitter::stringLiteral(std::string_view chars) {
+    std::string literal = "\"";
+    for (char c : chars){
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\'){
+            literal += '\\';
+            literal += c;
+        } else if (byte >= 0x20 && byte < 0x7f && c != '?'){
+            literal += c;
+        } else {
+            literal += '\\';
+            literal += static_cast<char>('0' + ((byte >> 6u) & 7u));
+            literal += static_cast<char>('0' + ((byte >> 3u) & 7u));
+            literal += static_cast<char>('0' + (byte & 7u));
+        }
+    }
+    return literal + "\"";
+}
@@ -0,0 +1,45 @@
+#ifndef CLOX_CPPEMITTER_H
+#define CLOX_CPPEMITTER_H
+
+
+#include <ostream>
+#include <string>
+#include <set>
+#include "CLoxLiteral.h"
+#include "GlobalVariables.h"
+
+/* Translates a compiled script to a standalone C++ translation unit (clox --emit-cpp). The generated program runs the
+ * script on AotRuntime, so it has to be linked against the clox-runtime library, see clox_add_aot_executable in
+ * CMakeLists.txt.
+ *
+ * Every instruction becomes a few lines of C++ working on the VM's stack, in bytecode order, and jumps become gotos to
+ * labels at their targets. Scanning, compiling and dispatching are gone, and the C++ compiler is free to keep the stack
+ * in registers and inline the arithmetic and comparisons, which AotRuntime defines in its header for that reason.
+ * Everything else the script does, and every error it reports, goes through the same VM helpers as when it is
+ * interpreted, so the output of the program is the same as running the script with clox.
+ */
+class CppEmitter {
+public:
+    //function is the script function produced by the Compiler, globals the global variables it was compiled with
+    CppEmitter(FunctionObj *function, const GlobalVariables &globals, std::string scriptName);
+
+    //throws a LoxUnsupportedError if the script uses something the generated program cannot do
+    void emit(std::ostream &out);
+
+private:
+    Chunk *chunk;
+    const GlobalVariables &globals;
+    std::string scriptName;
+    std::set<int> jumpTargets;
+
+    void emitProgram(std::ostream &out);
+    void emitTables(std::ostream &out);
+    void emitInstruction(std::ostream &out, int offset);
+    void emitComponent(std::ostream &out, OpCode code, uint32_t operand, int offset, int next);
+
+    static std::string numberLiteral(double number);
+    static std::string stringLiteral(std::string_view chars);
+};
+
+
+#endif //CLOX_CPPEMITTER_H
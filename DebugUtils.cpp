@@ -3,125 +3,157 @@
 #include "DebugUtils.h"
 #include "CLoxLiteral.h"
 
-void DebugUtils::printChunk(const Chunk *chunk, const std::string &name) {
-    std::cout << "Chunk: " << name << "\n";
+void DebugUtils::printChunk(const Chunk *chunk, const std::string &name, std::ostream &out) {
+    out << "Chunk: " << name << "\n";
     int offset = 0;
     while (offset < chunk->byteCount()){
-        offset = printInstruction(offset, chunk);
+        offset = printInstruction(offset, chunk, out);
     }
 }
 
-void DebugUtils::constantInstruction(const std::string& instructionName, int offset, const Chunk *chunk) {
-    std::cout << instructionName << " ";
-    int constantOffset = (int) chunk->readByte(offset + 1);
-    std::cout << chunk->readConstant(constantOffset) << "\n";
+void DebugUtils::constantInstruction(const std::string& instructionName, int offset, const Chunk *chunk, std::ostream &out) {
+    out << instructionName << " ";
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    int constantOffset = (int) chunk->readOperand(offset + 1, opCode);
+    out << chunk->readConstant(constantOffset) << "\n";
 }
 
-void DebugUtils::jumpInstruction(const std::string &instructionName, int sign, int offset, const Chunk *chunk) {
-    uint16_t jump = ((uint16_t) chunk->readByte(offset+1) >> 8u) | (uint16_t) chunk->readByte(offset + 2);
-    std::cout << instructionName << " " << jump * sign << "\n";
+void DebugUtils::byteInstruction(const std::string &instructionName, int offset, const Chunk *chunk, std::ostream &out) {
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    out << instructionName << " " << chunk->readOperand(offset + 1, Chunk::componentOpCodes(opCode).front()) << "\n";
+}
+
+void DebugUtils::jumpInstruction(const std::string &instructionName, int sign, int offset, const Chunk *chunk, std::ostream &out) {
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    OpCode jumpOpCode = Chunk::componentOpCodes(opCode).back();
+    int next = offset + Chunk::instructionLength(opCode);
+    auto jump = (int) chunk->readOperand(next - Chunk::operandWidth(jumpOpCode), jumpOpCode);
+    out << instructionName << " " << jump * sign << "\n";
 }
 
 
 //Prints instruction and returns the offset of next instruction. Instructions are not always one byte
-//(constants are 2 bytes for example) so this function takes care of that.
-int DebugUtils::printInstruction(int offset, const Chunk *chunk) {
-    std::byte byteInstruction = chunk->readByte(offset);
+//(constants are 2 bytes for example, 4 in their long form) so this function takes care of that.
+int DebugUtils::printInstruction(int offset, const Chunk *chunk, std::ostream &out) {
+    std::byte instructionByte = chunk->readByte(offset);
     int lineNumber = chunk->readLine(offset);
-    std::cout << lineNumber << " ";
-    auto opcode = static_cast<OpCode>(byteInstruction);
-    switch (opcode) {
+    out << lineNumber << " ";
+    auto opcode = static_cast<OpCode>(instructionByte);
+    if (opcode >= OpCode::OP_COUNT){
+        out << "UNKNOWN\n";
+        return offset + 1;
+    }
+
+    std::string name = opCodeName(opcode);
+    switch (Chunk::narrowForm(Chunk::genericForm(opcode))) {
         case OpCode::OP_CONSTANT:
-            constantInstruction("OP_CONSTANT", offset, chunk);
-            return offset + 2;
-        case OpCode::OP_RETURN:
-            std::cout << "OP_RETURN\n";
-            return offset + 1;
-        case OpCode::OP_PRINT:
-            std::cout << "OP_PRINT\n";
-            return offset + 1;
-        case OpCode::OP_NEGATE:
-            std::cout << "OP_NEGATE\n";
-            return offset + 1;
-        case OpCode::OP_ADD:
-            std::cout << "OP_ADD\n";
-            return offset + 1;
-        case OpCode::OP_SUBTRACT:
-            std::cout << "OP_SUBTRACT\n";
-            return offset + 1;
-        case OpCode::OP_MULTIPLY:
-            std::cout << "OP_MULTIPLY\n";
-            return offset + 1;
-        case OpCode::OP_DIVIDE:
-            std::cout << "OP_DIVIDE\n";
-            return offset + 1;
-        case OpCode::OP_TRUE:
-            std::cout << "OP_TRUE\n";
-            return offset + 1;
-        case OpCode::OP_FALSE:
-            std::cout << "OP_FALSE\n";
-            return offset + 1;
-        case OpCode::OP_NIL:
-            std::cout << "OP_NIL\n";
-            return offset + 1;
-        case OpCode::OP_NOT:
-            std::cout << "OP_NOT\n";
-            return offset + 1;
-        case OpCode::OP_EQUAL:
-            std::cout << "OP_EQUAL\n";
-            return offset + 1;
-        case OpCode::OP_GREATER:
-            std::cout << "OP_GREATER\n";
-            return offset + 1;
-        case OpCode::OP_LESS:
-            std::cout << "OP_LESS\n";
-            return offset + 1;
-        case OpCode::OP_POP:
-            std::cout << "OP_POP\n";
-            return offset + 1;
+        case OpCode::OP_CLASS:
+        case OpCode::OP_GET_PROPERTY:
+        case OpCode::OP_SET_PROPERTY:
+        case OpCode::OP_CLOSURE:
+        case OpCode::OP_METHOD:
+            constantInstruction(name, offset, chunk, out);
+            break;
+        case OpCode::OP_INVOKE:
+        case OpCode::OP_TAIL_INVOKE:
+            out << name << " " << chunk->readConstant((int) chunk->readByte(offset + 1)) << " (" << (int) chunk->readByte(offset + 2) << " args)\n";
+            break;
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_SET_LOCAL_POP:
         case OpCode::OP_DEFINE_GLOBAL:
-            constantInstruction("OP_DEFINE_GLOBAL", offset, chunk);
-            return offset + 2;
         case OpCode::OP_GET_GLOBAL:
-            constantInstruction("OP_GET_GLOBAL", offset, chunk);
-            return offset + 2;
         case OpCode::OP_SET_GLOBAL:
-            constantInstruction("OP_SET_GLOBAL", offset, chunk);
-            return offset + 2;
-        case OpCode::OP_GET_LOCAL:
-            constantInstruction("OP_GET_LOCAL", offset, chunk);
-            return offset + 2;
-        case OpCode::OP_SET_LOCAL:
-            constantInstruction("OP_SET_LOCAL", offset, chunk);
-            return offset + 2;
+        case OpCode::OP_SET_GLOBAL_POP:
+        case OpCode::OP_CALL:
+        case OpCode::OP_TAIL_CALL:
+        case OpCode::OP_GET_UPVALUE:
+        case OpCode::OP_SET_UPVALUE:
+            byteInstruction(name, offset, chunk, out);
+            break;
+        case OpCode::OP_GET_LOCAL_CONSTANT_ADD:
+            out << name << " " << (int) chunk->readByte(offset + 1) << " " << chunk->readConstant((int) chunk->readByte(offset + 2)) << "\n";
+            break;
         case OpCode::OP_JUMP_IF_FALSE:
-            jumpInstruction("OP_JUMP_IF_FALSE", 1, offset, chunk);
-            return offset + 3;
+        case OpCode::OP_LESS_JUMP_IF_FALSE:
         case OpCode::OP_JUMP:
-            jumpInstruction("OP_JUMP", 1, offset, chunk);
-            return offset + 3;
+            jumpInstruction(name, 1, offset, chunk, out);
+            break;
         case OpCode::OP_LOOP:
-            jumpInstruction("OP_LOOP", -1, offset, chunk);
-            return offset + 3;
-        case OpCode::OP_CLASS:
-            std::cout << "OP_CLASS\n";
-            return offset + 1;
-        case OpCode::OP_CALL:
-            std::cout << "OP_CALL\n";
-            return offset + 1;
-        case OpCode::OP_GET_PROPERTY:
-            constantInstruction("OP_GET_PROPERTY", offset, chunk);
-            return offset + 2;
-        case OpCode::OP_SET_PROPERTY:
-            constantInstruction("OP_SET_PROPERTY", offset, chunk);
-            return offset + 2;
-        case OpCode::OP_ALLOCATE:
-            std::cout << "OP_ALLOCATE\n";
-            return offset + 1;
+            jumpInstruction(name, -1, offset, chunk, out);
+            break;
         default:
-            std::cout << "UNKNOWN\n";
-            return offset + 1;
-
+            out << name << "\n";
     }
 
-}
\ No newline at end of file
+    return offset + Chunk::instructionLength(opcode);
+}
+
+std::string DebugUtils::opCodeName(OpCode opCode) {
+    switch (opCode) {
+        case OpCode::OP_RETURN: return "OP_RETURN";
+        case OpCode::OP_PRINT: return "OP_PRINT";
+        case OpCode::OP_CONSTANT: return "OP_CONSTANT";
+        case OpCode::OP_NEGATE: return "OP_NEGATE";
+        case OpCode::OP_ADD: return "OP_ADD";
+        case OpCode::OP_SUBTRACT: return "OP_SUBTRACT";
+        case OpCode::OP_MULTIPLY: return "OP_MULTIPLY";
+        case OpCode::OP_DIVIDE: return "OP_DIVIDE";
+        case OpCode::OP_TRUE: return "OP_TRUE";
+        case OpCode::OP_FALSE: return "OP_FALSE";
+        case OpCode::OP_NIL: return "OP_NIL";
+        case OpCode::OP_NOT: return "OP_NOT";
+        case OpCode::OP_EQUAL: return "OP_EQUAL";
+        case OpCode::OP_GREATER: return "OP_GREATER";
+        case OpCode::OP_LESS: return "OP_LESS";
+        case OpCode::OP_POP: return "OP_POP";
+        case OpCode::OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
+        case OpCode::OP_GET_GLOBAL: return "OP_GET_GLOBAL";
+        case OpCode::OP_SET_GLOBAL: return "OP_SET_GLOBAL";
+        case OpCode::OP_GET_LOCAL: return "OP_GET_LOCAL";
+        case OpCode::OP_SET_LOCAL: return "OP_SET_LOCAL";
+        case OpCode::OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
+        case OpCode::OP_JUMP: return "OP_JUMP";
+        case OpCode::OP_LOOP: return "OP_LOOP";
+        case OpCode::OP_CLASS: return "OP_CLASS";
+        case OpCode::OP_CALL: return "OP_CALL";
+        case OpCode::OP_TAIL_CALL: return "OP_TAIL_CALL";
+        case OpCode::OP_CLOSURE: return "OP_CLOSURE";
+        case OpCode::OP_GET_UPVALUE: return "OP_GET_UPVALUE";
+        case OpCode::OP_SET_UPVALUE: return "OP_SET_UPVALUE";
+        case OpCode::OP_CLOSE_UPVALUE: return "OP_CLOSE_UPVALUE";
+        case OpCode::OP_METHOD: return "OP_METHOD";
+        case OpCode::OP_INVOKE: return "OP_INVOKE";
+        case OpCode::OP_TAIL_INVOKE: return "OP_TAIL_INVOKE";
+        case OpCode::OP_GET_PROPERTY: return "OP_GET_PROPERTY";
+        case OpCode::OP_SET_PROPERTY: return "OP_SET_PROPERTY";
+        case OpCode::OP_ALLOCATE: return "OP_ALLOCATE";
+        case OpCode::OP_CONSTANT_LONG: return "OP_CONSTANT_LONG";
+        case OpCode::OP_DEFINE_GLOBAL_LONG: return "OP_DEFINE_GLOBAL_LONG";
+        case OpCode::OP_GET_GLOBAL_LONG: return "OP_GET_GLOBAL_LONG";
+        case OpCode::OP_SET_GLOBAL_LONG: return "OP_SET_GLOBAL_LONG";
+        case OpCode::OP_GET_LOCAL_LONG: return "OP_GET_LOCAL_LONG";
+        case OpCode::OP_SET_LOCAL_LONG: return "OP_SET_LOCAL_LONG";
+        case OpCode::OP_JUMP_IF_FALSE_LONG: return "OP_JUMP_IF_FALSE_LONG";
+        case OpCode::OP_JUMP_LONG: return "OP_JUMP_LONG";
+        case OpCode::OP_LOOP_LONG: return "OP_LOOP_LONG";
+        case OpCode::OP_CLASS_LONG: return "OP_CLASS_LONG";
+        case OpCode::OP_GET_PROPERTY_LONG: return "OP_GET_PROPERTY_LONG";
+        case OpCode::OP_SET_PROPERTY_LONG: return "OP_SET_PROPERTY_LONG";
+        case OpCode::OP_CLOSURE_LONG: return "OP_CLOSURE_LONG";
+        case OpCode::OP_METHOD_LONG: return "OP_METHOD_LONG";
+        case OpCode::OP_GET_LOCAL_CONSTANT_ADD: return "OP_GET_LOCAL_CONSTANT_ADD";
+        case OpCode::OP_LESS_JUMP_IF_FALSE: return "OP_LESS_JUMP_IF_FALSE";
+        case OpCode::OP_SET_LOCAL_POP: return "OP_SET_LOCAL_POP";
+        case OpCode::OP_SET_GLOBAL_POP: return "OP_SET_GLOBAL_POP";
+        case OpCode::OP_ADD_NUMBER: return "OP_ADD_NUMBER";
+        case OpCode::OP_SUBTRACT_NUMBER: return "OP_SUBTRACT_NUMBER";
+        case OpCode::OP_MULTIPLY_NUMBER: return "OP_MULTIPLY_NUMBER";
+        case OpCode::OP_DIVIDE_NUMBER: return "OP_DIVIDE_NUMBER";
+        case OpCode::OP_GREATER_NUMBER: return "OP_GREATER_NUMBER";
+        case OpCode::OP_LESS_NUMBER: return "OP_LESS_NUMBER";
+        case OpCode::OP_GET_LOCAL_CONSTANT_ADD_NUMBER: return "OP_GET_LOCAL_CONSTANT_ADD_NUMBER";
+        case OpCode::OP_LESS_JUMP_IF_FALSE_NUMBER: return "OP_LESS_JUMP_IF_FALSE_NUMBER";
+        default: return "UNKNOWN";
+    }
+}
@@ -2,15 +2,18 @@
 #define CLOX_DEBUGUTILS_H
 
 
+#include <iostream>
 #include "Chunk.h"
 
 namespace DebugUtils {
 
-    void printChunk(const Chunk *chunk, const std::string &name);
+    void printChunk(const Chunk *chunk, const std::string &name, std::ostream &out = std::cout);
     //prints instruction and returns offset of next instruction
-    int printInstruction(int offset, const Chunk *chunk);
-    void constantInstruction(const std::string& instructionName, int offset, const Chunk *chunk);
-    void jumpInstruction(const std::string &instructionName, int sign, int offset, const Chunk *chunk);
+    int printInstruction(int offset, const Chunk *chunk, std::ostream &out = std::cout);
+    std::string opCodeName(OpCode opCode);
+    void constantInstruction(const std::string& instructionName, int offset, const Chunk *chunk, std::ostream &out = std::cout);
+    void byteInstruction(const std::string &instructionName, int offset, const Chunk *chunk, std::ostream &out = std::cout);
+    void jumpInstruction(const std::string &instructionName, int sign, int offset, const Chunk *chunk, std::ostream &out = std::cout);
 
 }
 
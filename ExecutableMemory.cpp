@@ -0,0 +1,32 @@
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ExecutableMemory.h"
+
+std::unique_ptr<ExecutableMemory> ExecutableMemory::create(const std::vector<uint8_t> &code) {
+    auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t size = (code.size() + pageSize - 1) / pageSize * pageSize;
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED){
+        return nullptr;
+    }
+
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0){
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    return std::unique_ptr<ExecutableMemory>(new ExecutableMemory(memory, size));
+}
+
+ExecutableMemory::ExecutableMemory(void *memory, size_t size) : memory(memory), size(size) {}
+
+ExecutableMemory::~ExecutableMemory() {
+    munmap(memory, size);
+}
+
+const void *ExecutableMemory::entry() const {
+    return memory;
+}
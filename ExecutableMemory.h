@@ -0,0 +1,32 @@
+#ifndef CLOX_EXECUTABLEMEMORY_H
+#define CLOX_EXECUTABLEMEMORY_H
+
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+/* Pages holding machine code generated at runtime. The code is copied into pages mapped read/write, which are then made
+ * read/execute, so the memory is never writable and executable at the same time.
+ */
+class ExecutableMemory {
+public:
+    //returns nullptr if the system refuses to map executable memory
+    static std::unique_ptr<ExecutableMemory> create(const std::vector<uint8_t> &code);
+    ~ExecutableMemory();
+
+    ExecutableMemory(const ExecutableMemory &) = delete;
+    ExecutableMemory &operator=(const ExecutableMemory &) = delete;
+
+    const void *entry() const;
+
+private:
+    ExecutableMemory(void *memory, size_t size);
+
+    void *memory;
+    size_t size;
+};
+
+
+#endif //CLOX_EXECUTABLEMEMORY_H
@@ -0,0 +1,30 @@
+#include "GlobalVariables.h"
+
+uint32_t GlobalVariables::resolve(const std::string &name) {
+    auto it = slots.find(name);
+    if (it != slots.end()){
+        return it->second;
+    }
+
+    auto slot = static_cast<uint32_t>(names.size());
+    slots.emplace(name, slot);
+    names.push_back(name);
+    return slot;
+}
+
+bool GlobalVariables::contains(const std::string &name) const {
+    return slots.find(name) != slots.end();
+}
+
+const std::string &GlobalVariables::name(uint32_t slot) const {
+    return names.at(slot);
+}
+
+size_t GlobalVariables::count() const {
+    return names.size();
+}
+
+//slots reserved after the last call start undefined, values that were already defined are kept
+void GlobalVariables::allocateValues() {
+    values.resize(names.size(), CLoxLiteral::Undefined());
+}
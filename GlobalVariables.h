@@ -0,0 +1,34 @@
+#ifndef CLOX_GLOBALVARIABLES_H
+#define CLOX_GLOBALVARIABLES_H
+
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "CLoxLiteral.h"
+
+/* Global variables of a program. The compiler resolves every global name to a slot once, and the global instructions
+ * carry that slot as their operand, so the VM accesses globals by indexing values instead of hashing their names. A slot
+ * holds CLoxLiteral::Undefined() until its variable is defined, which is how the VM detects undefined variables.
+ */
+class GlobalVariables {
+public:
+    static const size_t MAX_GLOBALS = Chunk::MAX_LONG_OPERAND + 1; //slots are encoded in an instruction operand
+
+    //returns the slot of the global with this name, reserving a new slot the first time a name is seen
+    uint32_t resolve(const std::string &name);
+    bool contains(const std::string &name) const;
+    const std::string &name(uint32_t slot) const;
+    size_t count() const;
+
+    //Values of every slot, indexed by slot. Must be sized with allocateValues() before the program runs.
+    std::vector<CLoxLiteral> values;
+    void allocateValues();
+
+private:
+    std::unordered_map<std::string, uint32_t> slots;
+    std::vector<std::string> names;
+};
+
+
+#endif //CLOX_GLOBALVARIABLES_H
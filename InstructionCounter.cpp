@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include "InstructionCounter.h"
+#include "DebugUtils.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+std::vector<InstructionCounter::Counter> InstructionCounter::opCodeCounters(static_cast<int>(OpCode::OP_COUNT));
+std::map<const FunctionObj*, InstructionCounter::FunctionCounters> InstructionCounter::functionCounters;
+std::string InstructionCounter::disassembly;
+InstructionCounter::FunctionCounters *InstructionCounter::current = nullptr;
+int InstructionCounter::currentOffset = 0;
+OpCode InstructionCounter::currentOpCode = OpCode::OP_RETURN;
+uint64_t InstructionCounter::startTimestamp = 0;
+
+void InstructionCounter::record(const FunctionObj *function, int offset, OpCode opCode) {
+    charge(timestamp());
+
+    auto found = functionCounters.find(function);
+    if (found == functionCounters.end()){
+        FunctionCounters counters;
+        counters.name = std::string(function->name->view());
+        counters.order = static_cast<int>(functionCounters.size());
+        counters.offsets.resize(function->chunk->byteCount());
+        found = functionCounters.emplace(function, std::move(counters)).first;
+    }
+    current = &found->second;
+    currentOffset = offset;
+    currentOpCode = opCode;
+    //taken last, so the bookkeeping above is not charged to the instruction
+    startTimestamp = timestamp();
+}
+
+void InstructionCounter::finish() {
+    charge(timestamp());
+    current = nullptr;
+
+    std::ostringstream out;
+    disassembleAll(out);
+    disassembly += out.str();
+    //the functions are freed after this, and later ones may get their addresses
+    functionCounters.clear();
+}
+
+void InstructionCounter::writeReport(std::ostream &out) {
+    //an instruction still executing threw a runtime error, the time until now was spent reporting it
+    charge(startTimestamp);
+    current = nullptr;
+
+    uint64_t totalCycles = 0;
+    std::vector<int> opCodes;
+    for (int i = 0; i < static_cast<int>(opCodeCounters.size()); i++){
+        totalCycles += opCodeCounters[i].cycles;
+        if (opCodeCounters[i].count > 0){
+            opCodes.push_back(i);
+        }
+    }
+    std::sort(opCodes.begin(), opCodes.end(), [](int a, int b){
+        return opCodeCounters[a].cycles > opCodeCounters[b].cycles;
+    });
+
+    out << "Opcodes (count, cycles, cycles per execution, share of cycles):\n";
+    for (int opCode : opCodes){
+        const Counter &counter = opCodeCounters[opCode];
+        out << std::setw(12) << counter.count << std::setw(16) << counter.cycles
+            << std::setw(10) << counter.cycles / counter.count << std::setw(8) << percentage(counter.cycles, totalCycles)
+            << "  " << DebugUtils::opCodeName(static_cast<OpCode>(opCode)) << "\n";
+    }
+
+    out << "\n" << disassembly;
+    disassembleAll(out);
+}
+
+uint64_t InstructionCounter::timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+//charges the cycles since startTimestamp to the instruction being executed
+void InstructionCounter::charge(uint64_t now) {
+    if (current == nullptr){
+        return;
+    }
+    uint64_t cycles = now - startTimestamp;
+    Counter &opCodeCounter = opCodeCounters[static_cast<int>(currentOpCode)];
+    opCodeCounter.count++;
+    opCodeCounter.cycles += cycles;
+    Counter &offsetCounter = current->offsets[currentOffset];
+    offsetCounter.count++;
+    offsetCounter.cycles += cycles;
+}
+
+void InstructionCounter::disassembleAll(std::ostream &out) {
+    std::vector<const std::pair<const FunctionObj *const, FunctionCounters>*> functions;
+    for (const auto &entry : functionCounters){
+        functions.push_back(&entry);
+    }
+    std::sort(functions.begin(), functions.end(), [](const auto *a, const auto *b){
+        return a->second.order < b->second.order;
+    });
+    for (const auto *entry : functions){
+        disassemble(entry->first, entry->second, out);
+    }
+}
+
+//DebugUtils' disassembly with the count and share of the chunk's cycles of every instruction in front
+void InstructionCounter::disassemble(const FunctionObj *function, const FunctionCounters &counters, std::ostream &out) {
+    uint64_t totalCycles = 0;
+    for (const Counter &counter : counters.offsets){
+        totalCycles += counter.cycles;
+    }
+
+    const Chunk *chunk = function->chunk;
+    out << "Chunk: " << counters.name << " (count, share of cycles, offset, line, instruction)\n";
+    int offset = 0;
+    while (offset < static_cast<int>(chunk->byteCount())){
+        const Counter &counter = counters.offsets[offset];
+        out << std::setw(12) << counter.count << std::setw(8) << percentage(counter.cycles, totalCycles)
+            << std::setw(8) << offset << "  ";
+        offset = DebugUtils::printInstruction(offset, chunk, out);
+    }
+    out << "\n";
+}
+
+std::string InstructionCounter::percentage(uint64_t part, uint64_t total) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << (total == 0 ? 0.0 : 100.0 * part / total) << "%";
+    return out.str();
+}
@@ -0,0 +1,63 @@
+#ifndef CLOX_INSTRUCTIONCOUNTER_H
+#define CLOX_INSTRUCTIONCOUNTER_H
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "CLoxLiteral.h"
+
+/* Counts how often every instruction is executed and how many cycles it takes, per opcode and per bytecode offset. The
+ * cycles of an instruction are the time stamp counter ticks (nanoseconds where there is no rdtsc) from the moment the VM
+ * dispatched it until it dispatched the next one, so they include the dispatch and a little of the counting itself.
+ * Compare them with each other rather than with an uninstrumented build.
+ *
+ * The report written by clox --instruction-counts has the opcodes, most expensive first, followed by the disassembly of
+ * every chunk that ran, each instruction annotated with its count and share of the chunk's cycles. Opcodes are counted
+ * as executed, so a quickened instruction shows up under its quickened form, and the disassembly shows the chunk as it
+ * was when it finished. The VM only counts instructions when it is built with COUNT_INSTRUCTIONS
+ * (cmake -DCLOX_COUNT_INSTRUCTIONS=ON), which dispatches through the switch and turns off both JITs.
+ */
+class InstructionCounter {
+public:
+    //called by the VM before it executes the instruction at offset of function's chunk
+    static void record(const FunctionObj *function, int offset, OpCode opCode);
+
+    //called by the VM when the script returns, before the functions are freed
+    static void finish();
+
+    //a script that stopped with a runtime error was not finished, its chunks are still there and reported too
+    static void writeReport(std::ostream &out);
+
+private:
+    struct Counter {
+        uint64_t count = 0;
+        uint64_t cycles = 0;
+    };
+
+    struct FunctionCounters {
+        std::string name;
+        int order; //functions are reported in the order they first ran
+        std::vector<Counter> offsets; //indexed by bytecode offset
+    };
+
+    static std::vector<Counter> opCodeCounters;
+    static std::map<const FunctionObj*, FunctionCounters> functionCounters;
+    static std::string disassembly; //of the finished functions
+
+    //the instruction being executed, which is charged the cycles until the next record
+    static FunctionCounters *current;
+    static int currentOffset;
+    static OpCode currentOpCode;
+    static uint64_t startTimestamp;
+
+    static uint64_t timestamp();
+    static void charge(uint64_t now);
+    static void disassembleAll(std::ostream &out);
+    static void disassemble(const FunctionObj *function, const FunctionCounters &counters, std::ostream &out);
+    static std::string percentage(uint64_t part, uint64_t total);
+};
+
+
+#endif //CLOX_INSTRUCTIONCOUNTER_H
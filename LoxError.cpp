@@ -47,5 +47,18 @@ const char *LoxCompileError::what() const noexcept {
     return message.c_str();
 }
 
+LoxVerificationError::LoxVerificationError(const std::string &message, int offset) : LoxError(message) {
+    this->message = "[Offset " + std::to_string(offset) + "] " +  "Verification Error: " + message;
+}
 
+const char *LoxVerificationError::what() const noexcept {
+    return message.c_str();
+}
 
+LoxUnsupportedError::LoxUnsupportedError(const std::string &message) : LoxError(message) {
+    this->message = "Unsupported: " + message;
+}
+
+const char *LoxUnsupportedError::what() const noexcept {
+    return message.c_str();
+}
@@ -38,5 +38,18 @@ public:
     const char* what() const noexcept override;
 };
 
+class LoxVerificationError : public LoxError {
+public:
+    LoxVerificationError(const std::string &message, int offset);
+    const char* what() const noexcept override;
+};
+
+//a valid script using something a backend cannot do, such as a function in a script translated to C++
+class LoxUnsupportedError : public LoxError {
+public:
+    LoxUnsupportedError(const std::string &message);
+    const char* what() const noexcept override;
+};
+
 
 #endif //JLOX_LOXERROR_H
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <chrono>
+#include <thread>
+#include <algorithm>
 #include "Memory.h"
+#include "ParallelMarker.h"
 
 //#define DEBUG_STRESS_GC //Run the GC after every allocation
 //#define DEBUG_LOG_GC
@@ -8,108 +11,211 @@
 //collector because marked objects will be freed, but can be useful for debugging.
 //#define UNMARK_OBJECTS
 
-std::vector<Obj*> Memory::heapObjects = std::vector<Obj*>();
-std::stack<Obj*> Memory::grayObjects = std::stack<Obj*>();
-size_t Memory::nextGCByteThreshold = 200;
-size_t Memory::heapGrowFactor = 1;
-size_t Memory::bytesAllocated = 0;
+Memory::Memory() : markThreadCount(std::max(std::thread::hardware_concurrency(), 1u)) {}
+
+Memory::~Memory() {
+    freeAllHeapObjects();
+}
 
 auto Memory::epochTime() {
     return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
-Obj *Memory::allocateHeapFunction(StringObj *name, Chunk *chunk, int arity, VM *vm) {
+Obj *Memory::allocateHeapFunction(StringObj *name, Chunk *chunk, int arity) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage(vm);
+    collectGarbage();
 #endif
 
     auto *obj = new FunctionObj(name, chunk, arity);
-    bytesAllocated += calculateObjectSize(obj);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
     logAllocation(obj);
 
-    heapObjects.push_back(obj);
+    addObject(obj);
     return obj;
 }
 
 
-Obj *Memory::allocateHeapString(std::string str, VM *vm) {
+Obj *Memory::allocateHeapString(std::string_view chars) {
+    uint32_t hash = StringObj::hashChars(chars);
+    if (StringObj *interned = strings.find(chars, hash)){
+        //it may be garbage the collection in progress has not freed yet. Strings refer to nothing, so once the sweep
+        //passed it, marking it only keeps it alive through the next collection too
+        if (phase != GCPhase::IDLE){
+            markObject(interned);
+        }
+        return interned;
+    }
+
 #ifdef DEBUG_STRESS_GC
-    collectGarbage(vm);
+    collectGarbage();
 #endif
 
-    auto *obj = new StringObj(std::move(str));
-    bytesAllocated += calculateObjectSize(obj);
+    StringObj *obj = StringObj::create(chars, hash);
+    strings.insert(obj);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
     logAllocation(obj);
 
 #ifdef DEBUG_LOG_GC
-    std::cout << "[DEBUG] Allocated string " <<  calculateObjectSize(obj) << " " << epochTime() << "\n";
+    std::cout << "[DEBUG] Allocated string " <<  obj->size << " " << epochTime() << "\n";
 #endif
 
-    heapObjects.push_back(obj);
+    addObject(obj);
     return obj;
 }
 
-Obj *Memory::allocateHeapClass(StringObj *name, VM *vm) {
+Obj *Memory::allocateHeapClass(StringObj *name) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage(vm);
+    collectGarbage();
 #endif
 
     auto *obj = new ClassObj(name);
-    bytesAllocated += calculateObjectSize(obj);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
     logAllocation(obj);
 
 #ifdef DEBUG_LOG_GC
-    std::cout << "[DEBUG] Allocated class " <<  calculateObjectSize(obj)  << " " << epochTime() << "\n";
+    std::cout << "[DEBUG] Allocated class " <<  obj->size << " " << epochTime() << "\n";
 #endif
 
-    heapObjects.push_back(obj);
+    addObject(obj);
     return obj;
 }
 
-Obj *Memory::allocateHeapInstance(ClassObj *klass, VM *vm) {
+Obj *Memory::allocateHeapInstance(ClassObj *klass) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage(vm);
+    collectGarbage();
 #endif
 
-    auto *obj = new InstanceObj(klass);
-    bytesAllocated += calculateObjectSize(obj);
+    auto *obj = new InstanceObj(klass, &rootShape);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
     logAllocation(obj);
 
 #ifdef DEBUG_LOG_GC
-    std::cout << "[DEBUG] Allocated instance " <<  calculateObjectSize(obj) << " " << epochTime() << "\n";
+    std::cout << "[DEBUG] Allocated instance " <<  obj->size << " " << epochTime() << "\n";
 #endif
 
-    heapObjects.push_back(obj);
+    addObject(obj);
+    return obj;
+}
+
+Obj *Memory::allocateHeapClosure(FunctionObj *function) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    auto *obj = new ClosureObj(function);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
+    logAllocation(obj);
+
+    addObject(obj);
+    return obj;
+}
+
+Obj *Memory::allocateHeapUpvalue(CLoxLiteral *slot) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    auto *obj = new UpvalueObj(slot);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
+    logAllocation(obj);
+
+    addObject(obj);
+    return obj;
+}
+
+Obj *Memory::allocateHeapBoundMethod(InstanceObj *receiver, Obj *method) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    auto *obj = new BoundMethodObj(receiver, method);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
+    logAllocation(obj);
+
+    addObject(obj);
     return obj;
 }
 
 Obj *Memory::allocateAllocationObject(size_t kilobytes) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage(vm);
+    collectGarbage();
 #endif
 
     char* memoryBlock = new char[kilobytes * 1024];
     auto *obj = new AllocationObj(kilobytes, memoryBlock);
-    bytesAllocated += calculateObjectSize(obj);
+    obj->size = calculateObjectSize(obj);
+    bytesAllocated += obj->size;
     logAllocation(obj);
 
 #ifdef DEBUG_LOG_GC
-    std::cout << "[DEBUG] Allocated allocation " <<  calculateObjectSize(obj) << " " << bytesAllocated << " " << epochTime() << "\n";
+    std::cout << "[DEBUG] Allocated allocation " <<  obj->size << " " << bytesAllocated << " " << epochTime() << "\n";
 #endif
 
-    heapObjects.push_back(obj);
+    addObject(obj);
     return obj;
 }
 
 void Memory::freeAllHeapObjects() {
+    if (phase == GCPhase::SWEEPING){
+        //the entries between the survivors and the objects still to be swept were freed already
+        heapObjects.erase(heapObjects.begin() + sweepKept, heapObjects.begin() + sweepIndex);
+    }
+    phase = GCPhase::IDLE;
+    grayObjects = {};
     for (Obj *obj : heapObjects){
-        bytesAllocated -= calculateObjectSize(obj);
+        bytesAllocated -= obj->size;
         logDeallocation(obj);
-        delete obj;
+        freeObject(obj);
+    }
+    heapObjects.clear();
+    strings.clear();
+    rootShape = Shape(); //the field names of the shapes were just freed
+    vm = nullptr;
+}
+
+void Memory::addObject(Obj *obj) {
+    obj->marked.store(phase == GCPhase::MARKING, std::memory_order_relaxed); //see collectGarbageSlice
+    heapObjects.push_back(obj);
+}
+
+//Obj has no virtual destructor, so objects have to be deleted as their concrete type
+void Memory::freeObject(Obj *obj) {
+    switch (obj->type) {
+        case ObjType::STRING:
+            StringObj::destroy(static_cast<StringObj*>(obj));
+            return;
+        case ObjType::FUNCTION:
+            delete static_cast<FunctionObj*>(obj);
+            return;
+        case ObjType::CLASS:
+            delete static_cast<ClassObj*>(obj);
+            return;
+        case ObjType::INSTANCE:
+            delete static_cast<InstanceObj*>(obj);
+            return;
+        case ObjType::ALLOCATION:
+            delete static_cast<AllocationObj*>(obj);
+            return;
+        case ObjType::CLOSURE:
+            delete static_cast<ClosureObj*>(obj);
+            return;
+        case ObjType::UPVALUE:
+            delete static_cast<UpvalueObj*>(obj);
+            return;
+        case ObjType::BOUND_METHOD:
+            delete static_cast<BoundMethodObj*>(obj);
+            return;
     }
 }
 
-void Memory::collectGarbage(VM *vm) {
+void Memory::collectGarbage() {
 #ifdef DEBUG_LOG_GC
     std::cout << "[DEBUG] GC begin\n";
 #endif
@@ -121,8 +227,19 @@ void Memory::collectGarbage(VM *vm) {
         return;
     }
 
-    markRoots(vm);
-    traceReferences();
+    if (phase != GCPhase::IDLE){
+        advanceCollection(Deadline::max());
+    }
+    if (markThreadCount > 1 && heapObjects.size() >= PARALLEL_MARK_MIN_OBJECTS){
+        if (parallelMarker == nullptr){
+            parallelMarker = std::make_unique<ParallelMarker>(*this, markThreadCount);
+        }
+        parallelMarker->mark();
+    } else {
+        markRoots();
+        traceReferences();
+    }
+    strings.removeUnmarked(); //must happen before the sweep frees the strings
     sweep();
     nextGCByteThreshold = bytesAllocated * heapGrowFactor;
 
@@ -138,14 +255,95 @@ void Memory::collectGarbage(VM *vm) {
 
 }
 
-void Memory::markRoots(VM *vm) {
-    for (CLoxLiteral &obj : vm->stack){
-        markObject(obj);
+/* Does a bounded part of an incremental collection, which is spread over the allocation points of the mutator. The first
+ * slice marks the roots, the following ones trace from them and then sweep until maxPause has passed. Slices are at
+ * least maxPause apart, so the mutator gets at least half of the time while a collection is in progress.
+ *
+ * Marking keeps a snapshot at the beginning: everything that was reachable when the roots were marked is marked.
+ * Objects allocated while marking are allocated black. The mutator can only hide a white object from the marker by
+ * overwriting the last reference to it in an object, so stores into objects shade the value they overwrite
+ * (writeBarrier). The stack and the globals were marked in the first slice, whatever the mutator stores into them later
+ * was reachable then or allocated since, so stores into them need no barrier.
+ *
+ * The sweep moves the survivors to the front of heapObjects and removes the strings it frees from the intern table.
+ * Objects allocated while sweeping are white, they are behind the swept part and are left for the next collection.
+ * Only marking the roots is not bounded by maxPause, it takes as long as the stack and the globals are large.
+ */
+void Memory::collectGarbageSlice() {
+    if (vm == nullptr){
+        return;
     }
 
-    for (auto it = vm->globals.begin(); it != vm->globals.end(); it++){
-        markObject(it->second);
+    Deadline now = std::chrono::steady_clock::now();
+    if (phase != GCPhase::IDLE && now < nextSliceTime){
+        return;
     }
+    advanceCollection(now + maxPause);
+    nextSliceTime = std::chrono::steady_clock::now() + maxPause;
+}
+
+//runs the incremental collection until it finishes or the deadline passes, returns whether it finished
+bool Memory::advanceCollection(Deadline deadline) {
+    if (phase == GCPhase::IDLE){
+        markRoots();
+        phase = GCPhase::MARKING;
+    }
+
+    if (phase == GCPhase::MARKING){
+        if (!traceReferences(deadline)){
+            return false;
+        }
+        phase = GCPhase::SWEEPING;
+        sweepIndex = 0;
+        sweepKept = 0;
+        sweepEnd = heapObjects.size();
+    }
+
+    if (!sweep(deadline)){
+        return false;
+    }
+    phase = GCPhase::IDLE;
+    nextGCByteThreshold = bytesAllocated * heapGrowFactor;
+    return true;
+}
+
+void Memory::markRoots() {
+    markRoots(0, 1, [this](Obj *obj) { markObject(obj); });
+}
+
+//The stack and the globals are split between the parts, the other roots are few and all go to the first part
+void Memory::markRoots(size_t part, size_t parts, const std::function<void(Obj*)> &mark) {
+    auto markRange = [&](CLoxLiteral *begin, CLoxLiteral *end) {
+        size_t count = end - begin;
+        for (CLoxLiteral *slot = begin + count * part / parts; slot < begin + count * (part + 1) / parts; slot++){
+            if (slot->isObj() && slot->getObj() != nullptr){
+                mark(slot->getObj());
+            }
+        }
+    };
+    markRange(vm->stack.get(), vm->stackTop);
+    markRange(vm->globals->values.data(), vm->globals->values.data() + vm->globals->values.size());
+    if (part != 0){
+        return;
+    }
+
+    //slot 0 of a method's frame holds the receiver instead of the closure being run
+    for (int i = 0; i < vm->frameCount; i++){
+        if (vm->callFrames[i].closure != nullptr){
+            mark(vm->callFrames[i].closure);
+        }
+    }
+    if (vm->currentFrame.closure != nullptr){
+        mark(vm->currentFrame.closure);
+    }
+
+    //an open upvalue is still needed to close it even if no live closure refers to it anymore
+    for (UpvalueObj *upvalue = vm->openUpvalues; upvalue != nullptr; upvalue = upvalue->nextOpen){
+        mark(upvalue);
+    }
+
+    //shapes live as long as the heap and compare field names by pointer, so their names can never be freed and reused
+    rootShape.forEachFieldName([&mark](StringObj *name) { mark(name); });
 }
 
 void Memory::traceReferences() {
@@ -157,6 +355,20 @@ void Memory::traceReferences() {
     }
 }
 
+//returns whether the gray stack is empty, false if the deadline passed first
+bool Memory::traceReferences(Deadline deadline) {
+    for (size_t count = 1; !grayObjects.empty(); count++){
+        if (count % OBJECTS_PER_CLOCK_CHECK == 0 && std::chrono::steady_clock::now() >= deadline){
+            return false;
+        }
+        Obj *obj = grayObjects.top();
+        grayObjects.pop();
+
+        blackenObject(obj);
+    }
+    return true;
+}
+
 void Memory::markObject(CLoxLiteral &literal) {
     if (!literal.isObj()){ //value in the stack not an object. Could be an int or boolean for example
         return;
@@ -171,11 +383,11 @@ void Memory::markObject(CLoxLiteral &literal) {
 }
 
 void Memory::markObject(Obj *obj) {
-    if (obj->marked){
+    if (obj->marked.load(std::memory_order_relaxed)){
         return; //Avoid cycles
     }
 
-    obj->marked = true;
+    obj->marked.store(true, std::memory_order_relaxed);
     grayObjects.push(obj);
 
 #ifdef DEBUG_LOG_GC
@@ -188,55 +400,54 @@ void Memory::blackenObject(Obj *obj) {
 #ifdef DEBUG_LOG_GC
     std::cout << "[DEBUG] Blackened object " << CLoxLiteral(obj) << " address " << obj << "\n";
 #endif
-    switch (obj->type) {
-        case ObjType::STRING:
-            break;
-        case ObjType::FUNCTION: {
-            auto *function = dynamic_cast<FunctionObj *>(obj);
-            markObject(function->name);
-            for (CLoxLiteral &literal : function->chunk->constants){
-                markObject(literal);
-            }
-            break;
-        }
-        case ObjType::CLASS: {
-            auto *klass = dynamic_cast<ClassObj*>(obj);
-            markObject(klass->name);
-            break;
-        }
-        case ObjType::INSTANCE: {
-            auto *instance = dynamic_cast<InstanceObj *>(obj);
-            markObject(instance->klass);
-            for (auto it = instance->fields.begin(); it != instance->fields.end(); it++) {
-                markObject(it->second);
-            }
-            break;
-        }
-        case ObjType::ALLOCATION:
-            break;
-    }
+    forEachReference(obj, [this](Obj *reference) { markObject(reference); });
 }
 
 void Memory::sweep() {
     auto it = heapObjects.begin();
     while (it != heapObjects.end()){
         Obj *obj = *it;
-        if (obj->marked) {
-            obj->marked = false;
+        if (obj->marked.load(std::memory_order_relaxed)) {
+            obj->marked.store(false, std::memory_order_relaxed);
             ++it;
         } else {
 #ifdef DEBUG_LOG_GC
             std::cout << "[DEBUG] Sweeped " << CLoxLiteral(obj) << " address " << obj << "\n";
 #endif
-            bytesAllocated -= calculateObjectSize(obj);
+            bytesAllocated -= obj->size;
             logDeallocation(obj);
             it = heapObjects.erase(it); //constant time because we are using a linked list
-            delete obj;
+            freeObject(obj);
         }
     }
 }
 
 
+//returns whether every object up to sweepEnd was swept, false if the deadline passed first
+bool Memory::sweep(Deadline deadline) {
+    for (size_t count = 1; sweepIndex < sweepEnd; count++){
+        if (count % OBJECTS_PER_CLOCK_CHECK == 0 && std::chrono::steady_clock::now() >= deadline){
+            return false;
+        }
+
+        Obj *obj = heapObjects[sweepIndex++];
+        if (obj->marked.load(std::memory_order_relaxed)){
+            obj->marked.store(false, std::memory_order_relaxed);
+            heapObjects[sweepKept++] = obj;
+        } else {
+            if (obj->isString()){
+                strings.remove(static_cast<StringObj*>(obj));
+            }
+            bytesAllocated -= obj->size;
+            logDeallocation(obj);
+            freeObject(obj);
+        }
+    }
+
+    //moves what was allocated while sweeping behind the survivors
+    heapObjects.erase(heapObjects.begin() + sweepKept, heapObjects.begin() + sweepEnd);
+    return true;
+}
 
 /*Calculates estimates of the memory usage of every object. Their implementations depend on each other to avoid
  * double counting. For example, the size of an instance on the heap is the size instance object itself + the size of the
@@ -245,47 +456,66 @@ void Memory::sweep() {
  * to the instance), so we shouldn't count the size of that field again when calculating the size of the instance object.
  * */
 size_t Memory::calculateObjectSize(const Obj *obj) {
-    if (const auto* str = dynamic_cast<const StringObj*>(obj)){
-        return sizeof(*str) + str->str.size() * sizeof(std::string::value_type);
-    } else if (const auto* klass = dynamic_cast<const ClassObj*>(obj)) {
-        return sizeof(*klass);
-    } else if (const auto* instance = dynamic_cast<const InstanceObj*>(obj)) {
-        return sizeof(*instance);
-    } else if (const auto* function = dynamic_cast<const FunctionObj*>(obj)) {
-        return sizeof(*function);
-    } else if (const auto* allocation = dynamic_cast<const AllocationObj*>(obj)) {
-        return allocation->kilobytes * 1024;
+    switch (obj->type) {
+        case ObjType::STRING: {
+            const auto *str = static_cast<const StringObj*>(obj);
+            return sizeof(*str) + str->length + 1; //the characters and their '\0' are stored after the object
+        }
+        case ObjType::CLASS:
+            return sizeof(ClassObj);
+        case ObjType::INSTANCE:
+            return sizeof(InstanceObj);
+        case ObjType::FUNCTION:
+            return sizeof(FunctionObj);
+        case ObjType::ALLOCATION:
+            return static_cast<const AllocationObj*>(obj)->kilobytes * 1024;
+        case ObjType::CLOSURE:
+            return sizeof(ClosureObj) + static_cast<const ClosureObj*>(obj)->captures.size() * sizeof(ClosureObj::Capture);
+        case ObjType::UPVALUE:
+            return sizeof(UpvalueObj);
+        case ObjType::BOUND_METHOD:
+            return sizeof(BoundMethodObj);
+    }
+
+    throw std::runtime_error("Unreachable");
+}
+
+/* Type and name of the object printed in the GC log. When freeing every object at exit, the objects an object refers to
+ * may already be gone, so deallocations only print the names strings own themselves.
+ */
+std::string Memory::logName(const Obj *obj, bool isDeallocation) {
+    switch (obj->type) {
+        case ObjType::STRING:
+            return "string " + static_cast<const StringObj*>(obj)->str();
+        case ObjType::CLASS:
+            return "class " + (isDeallocation ? "[noname]" : static_cast<const ClassObj*>(obj)->name->str());
+        case ObjType::INSTANCE:
+            return "instance " + (isDeallocation ? "[noname]" : static_cast<const InstanceObj*>(obj)->klass->name->str());
+        case ObjType::FUNCTION:
+            return "function " + (isDeallocation ? "[noname]" : static_cast<const FunctionObj*>(obj)->name->str());
+        case ObjType::ALLOCATION:
+            return "allocation [noname]";
+        case ObjType::CLOSURE:
+            return "closure " + (isDeallocation ? "[noname]" : static_cast<const ClosureObj*>(obj)->function->name->str());
+        case ObjType::UPVALUE:
+            return "upvalue [noname]";
+        case ObjType::BOUND_METHOD:
+            return "bound method [noname]";
     }
 
     throw std::runtime_error("Unreachable");
 }
 
 void Memory::logAllocation(const Obj *obj) {
-    if (const auto* str = dynamic_cast<const StringObj*>(obj)){
-        std::clog << "Allocated string " << str->str << " " <<  calculateObjectSize(str)  << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* klass = dynamic_cast<const ClassObj*>(obj)) {
-        std::clog << "Allocated class " << klass->name->str << " " <<   calculateObjectSize(klass)  << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* instance = dynamic_cast<const InstanceObj*>(obj)) {
-        std::clog << "Allocated instance " << instance->klass->name->str << " " <<  calculateObjectSize(instance) << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* function = dynamic_cast<const FunctionObj*>(obj)) {
-        std::clog << "Allocated function " << function->name->str << " " << calculateObjectSize(function)  << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* allocation = dynamic_cast<const AllocationObj*>(obj)) {
-        std::clog << "Allocated allocation [noname] " << calculateObjectSize(allocation)  << " " << bytesAllocated << " "  <<  epochTime() << "\n";
+    if (log == nullptr){
+        return;
     }
+    *log << "Allocated " << logName(obj, false) << " " << obj->size << " " << bytesAllocated << " " << epochTime() << "\n";
 }
 
 void Memory::logDeallocation(const Obj *obj) {
-    if (const auto* str = dynamic_cast<const StringObj*>(obj)){
-        std::clog << "Deallocated string " << str->str << " " <<  calculateObjectSize(str) << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* klass = dynamic_cast<const ClassObj*>(obj)) {
-        std::clog << "Deallocated class " << klass->name->str << " " << calculateObjectSize(klass) << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* instance = dynamic_cast<const InstanceObj*>(obj)) {
-        std::clog << "Deallocated instance " << instance->klass->name->str << " " << calculateObjectSize(instance) << " " << bytesAllocated << " " << epochTime() << "\n";
-    } else if (const auto* function = dynamic_cast<const FunctionObj*>(obj)) {
-        std::clog << "Deallocated function [noname] " << calculateObjectSize(function)  << " " << bytesAllocated << " " <<  epochTime() << "\n";
-    } else if (const auto* allocation = dynamic_cast<const AllocationObj*>(obj)) {
-        std::clog << "Deallocated allocation [noname] " << calculateObjectSize(allocation)  << " " << bytesAllocated << " " <<  epochTime() << "\n";
+    if (log == nullptr){
+        return;
     }
+    *log << "Deallocated " << logName(obj, true) << " " << obj->size << " " << bytesAllocated << " " << epochTime() << "\n";
 }
-
-
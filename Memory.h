@@ -2,41 +2,188 @@
 #define CLOX_MEMORY_H
 
 #include <vector>
+#include <ostream>
+#include <chrono>
 #include <list>
+#include <memory>
+#include <functional>
 #include <unordered_map>
 #include "CLoxLiteral.h"
 #include "VM.h"
+#include "StringTable.h"
 
+class ParallelMarker;
+
+/* A garbage collected heap. Objects only ever refer to objects of their own heap, and heaps share no state, so VMs
+ * running on different heaps can run on different threads at the same time. The compiler allocates the functions and
+ * constants of a script in the heap before a VM runs it. The VM attaches itself to the heap when it starts executing, its
+ * stack and globals are the roots of the heap's GC, which does nothing while no VM is attached. Emptying the heap detaches
+ * the VM, and destroying it frees every object still in it.
+ */
 class Memory {
 public:
-    static std::vector<Obj*> heapObjects;
-    static std::stack<Obj*> grayObjects;
-    static size_t bytesAllocated;
-    static size_t nextGCByteThreshold;
-    static size_t heapGrowFactor;
-
-    static Obj* allocateHeapString(std::string str, VM *vm = nullptr);
-    static Obj* allocateHeapClass(StringObj *name, VM *vm = nullptr);
-    static Obj* allocateHeapInstance(ClassObj *klass, VM *vm = nullptr);
-    static Obj* allocateHeapFunction(StringObj *name, Chunk *chunk, int arity, VM *vm = nullptr);
-    static Obj* allocateAllocationObject(size_t kilobytes);
-    static void freeAllHeapObjects();
-    static void collectGarbage(VM *vm = nullptr);
-    static void markRoots(VM *vm = nullptr);
-    static void markObject(CLoxLiteral &obj);
-    static void markObject(Obj *obj);
-    static void traceReferences();
-    static void blackenObject(Obj *obj);
-    static void sweep();
+    //heaps with fewer objects are always marked on the thread that collects them, waking the markers costs more there
+    static const size_t PARALLEL_MARK_MIN_OBJECTS = 1u << 16u;
+    //slices of an incremental collection only read the clock every this many objects they mark or sweep
+    static const size_t OBJECTS_PER_CLOCK_CHECK = 64;
+
+    //how far the incremental collection in progress is, see collectGarbageSlice
+    enum class GCPhase {
+        IDLE,
+        MARKING,
+        SWEEPING
+    };
+
+    Memory();
+    ~Memory();
+    Memory(const Memory &) = delete;
+    Memory &operator=(const Memory &) = delete;
+
+    std::vector<Obj*> heapObjects;
+    StringTable strings;
+    std::stack<Obj*> grayObjects;
+    size_t bytesAllocated = 0;
+    size_t nextGCByteThreshold = 200;
+    size_t heapGrowFactor = 1;
+    //instances of this heap start out with this shape. Field names are strings of this heap, so heaps cannot share shapes
+    Shape rootShape;
+    VM *vm = nullptr; //the VM executing a script allocated in this heap
+    std::ostream *log = &std::clog; //where allocations and deallocations are logged, nullptr to not log them
+    //Threads marking large heaps, including the one collecting, see ParallelMarker. Defaults to one per hardware thread,
+    //changes after the first parallel collection have no effect
+    unsigned markThreadCount;
+    //Longest pause of the mutator the GC aims for. 0 collects the whole heap at once (collectGarbage), otherwise the heap
+    //is collected incrementally in slices of about this long (collectGarbageSlice)
+    std::chrono::nanoseconds maxPause{0};
+    GCPhase phase = GCPhase::IDLE;
+
+    //returns the interned string with these characters, only allocating it if it does not exist yet
+    Obj* allocateHeapString(std::string_view chars);
+    Obj* allocateHeapClass(StringObj *name);
+    Obj* allocateHeapInstance(ClassObj *klass);
+    Obj* allocateHeapFunction(StringObj *name, Chunk *chunk, int arity);
+    Obj* allocateHeapClosure(FunctionObj *function);
+    Obj* allocateHeapUpvalue(CLoxLiteral *slot);
+    Obj* allocateHeapBoundMethod(InstanceObj *receiver, Obj *method);
+    Obj* allocateAllocationObject(size_t kilobytes);
+    static void freeObject(Obj *obj);
+    //empties the heap so it can be reused for another script
+    void freeAllHeapObjects();
+    //collects the whole heap, first finishing the incremental collection in progress if there is one
+    void collectGarbage();
+    void collectGarbageSlice();
+    //must be called with the value a store into an object is about to overwrite, see collectGarbageSlice
+    void writeBarrier(const CLoxLiteral &overwritten);
+    void markRoots();
+    //calls mark with the roots in part of parts about equally large parts, which together are all the roots
+    void markRoots(size_t part, size_t parts, const std::function<void(Obj*)> &mark);
+    void markObject(CLoxLiteral &obj);
+    void markObject(Obj *obj);
+    void traceReferences();
+    void blackenObject(Obj *obj);
+    void sweep();
 
     static size_t calculateObjectSize(const Obj *obj);
 
+    //calls mark with every object obj refers to, which blackening obj marks
+    template<typename Mark>
+    static void forEachReference(Obj *obj, Mark mark);
+
 private:
+    using Deadline = std::chrono::steady_clock::time_point;
+
+    std::unique_ptr<ParallelMarker> parallelMarker; //created by the first collection that marks in parallel
+    Deadline nextSliceTime; //an incremental collection in progress does not run another slice before this
+    size_t sweepIndex = 0; //next object the incremental sweep looks at
+    size_t sweepKept = 0; //the objects that survived the sweep so far were moved to the front of heapObjects
+    size_t sweepEnd = 0; //the objects allocated after marking finished are behind this, they are not swept
+
+    void addObject(Obj *obj);
+    bool advanceCollection(Deadline deadline);
+    bool traceReferences(Deadline deadline);
+    bool sweep(Deadline deadline);
+
     static auto epochTime();
-    static void logDeallocation(const Obj *obj);
-    static void logAllocation(const Obj *obj);
+    void logDeallocation(const Obj *obj);
+    void logAllocation(const Obj *obj);
+    static std::string logName(const Obj *obj, bool isDeallocation);
 
 };
 
+inline void Memory::writeBarrier(const CLoxLiteral &overwritten) {
+    if (phase == GCPhase::MARKING && overwritten.isObj() && overwritten.getObj() != nullptr){
+        markObject(overwritten.getObj());
+    }
+}
+
+template<typename Mark>
+void Memory::forEachReference(Obj *obj, Mark mark) {
+    auto markValue = [&mark](const CLoxLiteral &value) {
+        if (value.isObj() && value.getObj() != nullptr){
+            mark(value.getObj());
+        }
+    };
+
+    switch (obj->type) {
+        case ObjType::STRING:
+            break;
+        case ObjType::FUNCTION: {
+            auto *function = static_cast<FunctionObj*>(obj);
+            mark(function->name);
+            for (const CLoxLiteral &literal : function->chunk->constants){
+                markValue(literal);
+            }
+            //a cached class could otherwise be freed and another one allocated at its address
+            for (const MethodCache &cache : function->chunk->methodCaches){
+                for (const MethodCache::Entry &entry : cache.entries){
+                    if (entry.klass != nullptr){
+                        mark(entry.klass);
+                        mark(entry.method);
+                    }
+                }
+            }
+            break;
+        }
+        case ObjType::CLASS: {
+            auto *klass = static_cast<ClassObj*>(obj);
+            mark(klass->name);
+            for (auto &[name, method] : klass->methods){
+                mark(name);
+                mark(method);
+            }
+            break;
+        }
+        case ObjType::INSTANCE: {
+            auto *instance = static_cast<InstanceObj*>(obj);
+            mark(instance->klass);
+            instance->forEachField(markValue);
+            instance->forEachDictionaryName([&mark](StringObj *name) { mark(name); });
+            break;
+        }
+        case ObjType::ALLOCATION:
+            break;
+        case ObjType::CLOSURE: {
+            auto *closure = static_cast<ClosureObj*>(obj);
+            mark(closure->function);
+            //captured slots are on the stack, which is a root
+            for (const ClosureObj::Capture &capture : closure->captures){
+                if (capture.upvalue != nullptr){
+                    mark(capture.upvalue);
+                }
+            }
+            break;
+        }
+        case ObjType::UPVALUE:
+            markValue(static_cast<UpvalueObj*>(obj)->closed);
+            break;
+        case ObjType::BOUND_METHOD: {
+            auto *boundMethod = static_cast<BoundMethodObj*>(obj);
+            mark(boundMethod->receiver);
+            mark(boundMethod->method);
+            break;
+        }
+    }
+}
+
 
 #endif //CLOX_MEMORY_H
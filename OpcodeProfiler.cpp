@@ -0,0 +1,61 @@
+#include <algorithm>
+#include "OpcodeProfiler.h"
+#include "DebugUtils.h"
+
+std::vector<uint64_t> OpcodeProfiler::pairCounts(OPCODE_COUNT * OPCODE_COUNT, 0);
+std::vector<uint64_t> OpcodeProfiler::tripleCounts(OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT, 0);
+const Chunk *OpcodeProfiler::previousChunk = nullptr;
+int OpcodeProfiler::expectedOffset = -1;
+int OpcodeProfiler::historyLength = 0;
+OpCode OpcodeProfiler::history[2];
+
+void OpcodeProfiler::record(const Chunk *chunk, int offset, OpCode opCode) {
+    if (chunk != previousChunk || offset != expectedOffset){
+        historyLength = 0; //control was transferred, so this instruction starts a new sequence
+    }
+
+    auto current = static_cast<int>(opCode);
+    if (historyLength >= 1){
+        pairCounts[static_cast<int>(history[1]) * OPCODE_COUNT + current]++;
+    }
+    if (historyLength == 2){
+        tripleCounts[(static_cast<int>(history[0]) * OPCODE_COUNT + static_cast<int>(history[1])) * OPCODE_COUNT + current]++;
+    }
+
+    history[0] = history[1];
+    history[1] = opCode;
+    historyLength = std::min(historyLength + 1, 2);
+    previousChunk = chunk;
+    expectedOffset = offset + Chunk::instructionLength(opCode);
+}
+
+void OpcodeProfiler::writeReport(std::ostream &out, size_t limit) {
+    out << "Opcode pairs:\n";
+    writeCounts(out, pairCounts, 2, limit);
+    out << "\nOpcode triples:\n";
+    writeCounts(out, tripleCounts, 3, limit);
+}
+
+void OpcodeProfiler::writeCounts(std::ostream &out, const std::vector<uint64_t> &counts, int sequenceLength, size_t limit) {
+    std::vector<size_t> sequences;
+    for (size_t i = 0; i < counts.size(); i++){
+        if (counts[i] > 0){
+            sequences.push_back(i);
+        }
+    }
+
+    std::sort(sequences.begin(), sequences.end(), [&counts](size_t a, size_t b){
+        return counts[a] > counts[b];
+    });
+
+    for (size_t i = 0; i < sequences.size() && i < limit; i++){
+        out << counts[sequences[i]];
+        //the index encodes the opcodes in base OPCODE_COUNT, first opcode in the most significant digit
+        size_t divisor = sequenceLength == 2 ? OPCODE_COUNT : OPCODE_COUNT * OPCODE_COUNT;
+        for (int j = 0; j < sequenceLength; j++){
+            out << " " << DebugUtils::opCodeName(static_cast<OpCode>(sequences[i] / divisor % OPCODE_COUNT));
+            divisor /= OPCODE_COUNT;
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef CLOX_OPCODEPROFILER_H
+#define CLOX_OPCODEPROFILER_H
+
+#include <vector>
+#include <ostream>
+#include "Chunk.h"
+
+/* Counts how often every sequence of two and three opcodes is executed. Only straight line sequences are counted: when
+ * the VM jumps, the history is cleared, since a sequence that spans a jump can never be fused into a superinstruction.
+ * The VM only records instructions when it is built with PROFILE_OPCODES (cmake -DCLOX_PROFILE_OPCODES=ON), and the
+ * report is written by clox --opcode-profile. The report is the input used to pick the fusions in PeepholeOptimizer.
+ */
+class OpcodeProfiler {
+public:
+    static void record(const Chunk *chunk, int offset, OpCode opCode);
+
+    //writes the most frequent pairs and triples, at most limit of each, most frequent first
+    static void writeReport(std::ostream &out, size_t limit = 30);
+
+private:
+    static const int OPCODE_COUNT = static_cast<int>(OpCode::OP_COUNT);
+
+    static std::vector<uint64_t> pairCounts;
+    static std::vector<uint64_t> tripleCounts;
+
+    static const Chunk *previousChunk;
+    static int expectedOffset; //offset of the instruction after the last one recorded
+    static int historyLength;
+    static OpCode history[2]; //last two opcodes recorded, most recent last
+
+    static void writeCounts(std::ostream &out, const std::vector<uint64_t> &counts, int sequenceLength, size_t limit);
+};
+
+
+#endif //CLOX_OPCODEPROFILER_H
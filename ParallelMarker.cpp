@@ -0,0 +1,141 @@
+#include "ParallelMarker.h"
+#include "Memory.h"
+
+ParallelMarker::ParallelMarker(Memory &heap, unsigned threadCount) : heap(heap) {
+    for (unsigned i = 0; i < threadCount; i++){
+        markers.push_back(std::make_unique<Marker>());
+    }
+    for (unsigned i = 1; i < threadCount; i++){
+        threads.emplace_back(&ParallelMarker::runThread, this, i);
+    }
+}
+
+ParallelMarker::~ParallelMarker() {
+    {
+        std::lock_guard<std::mutex> lock(cycleMutex);
+        stopping = true;
+    }
+    cycleStarted.notify_all();
+    for (std::thread &thread : threads){
+        thread.join();
+    }
+}
+
+void ParallelMarker::mark() {
+    idleMarkers = 0;
+    {
+        std::lock_guard<std::mutex> lock(cycleMutex);
+        cycle++;
+        finishedThreads = 0;
+    }
+    cycleStarted.notify_all();
+
+    markPart(0);
+
+    std::unique_lock<std::mutex> lock(cycleMutex);
+    cycleFinished.wait(lock, [this]() { return finishedThreads == threads.size(); });
+}
+
+void ParallelMarker::runThread(size_t index) {
+    uint64_t lastCycle = 0;
+    while (true){
+        {
+            std::unique_lock<std::mutex> lock(cycleMutex);
+            cycleStarted.wait(lock, [this, lastCycle]() { return stopping || cycle != lastCycle; });
+            if (stopping){
+                return;
+            }
+            lastCycle = cycle;
+        }
+
+        markPart(index);
+
+        {
+            std::lock_guard<std::mutex> lock(cycleMutex);
+            finishedThreads++;
+        }
+        cycleFinished.notify_one();
+    }
+}
+
+//Marks the part of the roots of marker index and traces until there is no work left anywhere. The mark bits only need
+//to be claimed atomically, the mutexes of the cycle order everything the markers read before the sweep
+void ParallelMarker::markPart(size_t index) {
+    Marker &marker = *markers[index];
+    auto mark = [&marker](Obj *obj) {
+        if (!obj->marked.load(std::memory_order_relaxed) && !obj->marked.exchange(true, std::memory_order_relaxed)){
+            marker.grayObjects.push_back(obj);
+        }
+    };
+
+    heap.markRoots(index, markers.size(), mark);
+    do {
+        while (!marker.grayObjects.empty()){
+            Obj *obj = marker.grayObjects.back();
+            marker.grayObjects.pop_back();
+            Memory::forEachReference(obj, mark);
+
+            if (marker.grayObjects.size() > SHARE_THRESHOLD && marker.sharedCount == 0){
+                share(marker);
+            }
+        }
+    } while (takeWork(index));
+}
+
+//moves the oldest half of the gray stack, the objects closest to the roots, where the larger subgraphs are likely to be
+void ParallelMarker::share(Marker &marker) {
+    size_t half = marker.grayObjects.size() / 2;
+    std::lock_guard<std::mutex> lock(marker.sharedMutex);
+    marker.sharedObjects.insert(marker.sharedObjects.end(), marker.grayObjects.begin(), marker.grayObjects.begin() + half);
+    marker.grayObjects.erase(marker.grayObjects.begin(), marker.grayObjects.begin() + half);
+    marker.sharedCount = marker.sharedObjects.size();
+}
+
+/* Refills the gray stack of marker index, returns false once marking is done. A marker only becomes idle after it found
+ * every shared deque empty, and only markers that are not idle share objects, and they look at their own deque before
+ * becoming idle. So once every marker is idle no objects are left to mark.
+ */
+bool ParallelMarker::takeWork(size_t index) {
+    if (steal(index)){
+        return true;
+    }
+
+    idleMarkers++;
+    while (idleMarkers < markers.size()){
+        for (const std::unique_ptr<Marker> &victim : markers){
+            if (victim->sharedCount == 0){
+                continue;
+            }
+            idleMarkers--;
+            if (steal(index)){
+                return true;
+            }
+            idleMarkers++;
+            break;
+        }
+        std::this_thread::yield();
+    }
+    return false;
+}
+
+//Takes back the whole shared deque of marker index, or half of the first other one that is not empty
+bool ParallelMarker::steal(size_t index) {
+    Marker &thief = *markers[index];
+    for (size_t i = 0; i < markers.size(); i++){
+        Marker &victim = *markers[(index + i) % markers.size()];
+        if (victim.sharedCount == 0){
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(victim.sharedMutex);
+        size_t count = i == 0 ? victim.sharedObjects.size() : (victim.sharedObjects.size() + 1) / 2;
+        if (count == 0){
+            continue;
+        }
+        thief.grayObjects.insert(thief.grayObjects.end(), victim.sharedObjects.begin(), victim.sharedObjects.begin() + count);
+        victim.sharedObjects.erase(victim.sharedObjects.begin(), victim.sharedObjects.begin() + count);
+        victim.sharedCount = victim.sharedObjects.size();
+        return true;
+    }
+    return false;
+}
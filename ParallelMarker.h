@@ -0,0 +1,66 @@
+#ifndef CLOX_PARALLELMARKER_H
+#define CLOX_PARALLELMARKER_H
+
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CLoxLiteral.h"
+
+class Memory;
+
+/* Marks the objects of a large heap on several threads. The thread collecting the heap is one of the markers, the others
+ * are started with the marker and wait for the next collection between them. The roots are split between the markers
+ * (see Memory::markRoots), and every marker traces from its part with a gray stack of its own. Objects are claimed by
+ * setting their mark bit atomically, so each one is blackened by exactly one marker.
+ *
+ * A marker whose gray stack grows beyond SHARE_THRESHOLD moves the bottom half of it to a shared deque when that is
+ * empty. A marker that runs out of work takes its shared deque back, and then steals half of the shared deque of another
+ * marker, from the end its owner does not refill, so a marker that drew the large part of the graph is helped by the
+ * others. Marking is done when every marker is out of work and every shared deque is empty.
+ */
+class ParallelMarker {
+public:
+    static const size_t SHARE_THRESHOLD = 64;
+
+    ParallelMarker(Memory &heap, unsigned threadCount);
+    ~ParallelMarker();
+    ParallelMarker(const ParallelMarker &) = delete;
+    ParallelMarker &operator=(const ParallelMarker &) = delete;
+
+    //marks every object reachable from the roots of the heap, returns once all of them are
+    void mark();
+
+private:
+    struct Marker {
+        std::vector<Obj*> grayObjects; //only touched by the thread of the marker
+        std::mutex sharedMutex;
+        std::deque<Obj*> sharedObjects;
+        std::atomic<size_t> sharedCount{0}; //size of sharedObjects, read by thieves without taking the mutex
+    };
+
+    Memory &heap;
+    std::vector<std::unique_ptr<Marker>> markers; //markers[0] runs on the thread calling mark()
+    std::vector<std::thread> threads;
+    std::atomic<size_t> idleMarkers{0};
+
+    std::mutex cycleMutex;
+    std::condition_variable cycleStarted;
+    std::condition_variable cycleFinished;
+    uint64_t cycle = 0; //number of collections started, the helper threads wait for it to change
+    size_t finishedThreads = 0;
+    bool stopping = false;
+
+    void runThread(size_t index);
+    void markPart(size_t index);
+    void share(Marker &marker);
+    bool takeWork(size_t index);
+    bool steal(size_t index);
+};
+
+
+#endif //CLOX_PARALLELMARKER_H
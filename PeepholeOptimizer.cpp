@@ -0,0 +1,117 @@
+#include "PeepholeOptimizer.h"
+
+PeepholeOptimizer::PeepholeOptimizer(Chunk *chunk) : chunk(chunk) {}
+
+void PeepholeOptimizer::optimize() {
+    findJumpTargets();
+
+    std::vector<std::byte> bytecode;
+    std::vector<int> oldLines = chunk->byteLines();
+    std::vector<int> byteLines; //line of every byte in bytecode
+    std::vector<int> newOffsets(chunk->byteCount(), -1); //where every instruction starts in the new bytecode
+    std::vector<std::pair<int, int>> jumps; //new offset of every jump and the old offset of its target
+
+    size_t offset = 0;
+    while (offset < chunk->byteCount()){
+        OpCode superinstruction = matchSuperinstruction(offset);
+        OpCode opCode = superinstruction != OpCode::OP_COUNT ? superinstruction : narrowedOpCodeAt(offset);
+        int newOffset = static_cast<int>(bytecode.size());
+        newOffsets[offset] = newOffset;
+
+        bytecode.push_back(std::byte(opCode));
+        byteLines.push_back(oldLines[offset]);
+
+        //operands are copied from every component, superinstructions take them in the same order. Jump operands are
+        //left empty because they may have been narrowed, they are filled in once every instruction has its new offset
+        for (OpCode component : Chunk::componentOpCodes(opCode)){
+            if (Chunk::isJump(component)){
+                jumps.emplace_back(newOffset, chunk->jumpTarget(offset));
+                for (int i = 0; i < Chunk::operandWidth(component); i++){
+                    bytecode.push_back(std::byte(0));
+                    byteLines.push_back(oldLines[offset]);
+                }
+            } else {
+                for (int i = 1; i < Chunk::instructionLength(component); i++){
+                    bytecode.push_back(chunk->readByte(offset + i));
+                    byteLines.push_back(oldLines[offset + i]);
+                }
+            }
+            offset += Chunk::instructionLength(opCodeAt(offset));
+        }
+    }
+
+    chunk->bytecode = bytecode;
+    for (const auto &jump : jumps){
+        auto opCode = static_cast<OpCode>(bytecode[jump.first]);
+        OpCode jumpOpCode = Chunk::componentOpCodes(opCode).back();
+        int next = jump.first + Chunk::instructionLength(opCode);
+        int target = newOffsets[jump.second];
+        //the code only shrinks, so the new distance always fits in the operand
+        int distance = Chunk::narrowForm(jumpOpCode) == OpCode::OP_LOOP ? next - target - 1 : target - next;
+        chunk->writeOperand(next - Chunk::operandWidth(jumpOpCode), jumpOpCode, static_cast<uint32_t>(distance));
+    }
+
+    chunk->lines.clear();
+    for (int line : byteLines){
+        chunk->writeLine(line);
+    }
+    chunk->verified = false;
+    chunk->threadedCode.clear();
+}
+
+void PeepholeOptimizer::findJumpTargets() {
+    jumpTargets.assign(chunk->byteCount(), false);
+    size_t offset = 0;
+    while (offset < chunk->byteCount()){
+        OpCode opCode = opCodeAt(offset);
+        if (Chunk::isJump(opCode)){
+            jumpTargets[chunk->jumpTarget(offset)] = true;
+        }
+        offset += Chunk::instructionLength(opCode);
+    }
+}
+
+OpCode PeepholeOptimizer::matchSuperinstruction(int offset) const {
+    OpCode longestMatch = OpCode::OP_COUNT;
+    size_t longestLength = 1;
+
+    for (int i = 0; i < static_cast<int>(OpCode::OP_COUNT); i++){
+        const std::vector<OpCode> &components = Chunk::componentOpCodes(static_cast<OpCode>(i));
+        //quickened superinstructions have the components of their generic form, but only the VM may pick them
+        if (components.size() <= longestLength || Chunk::genericForm(static_cast<OpCode>(i)) != static_cast<OpCode>(i)){
+            continue;
+        }
+
+        size_t componentOffset = offset;
+        bool matches = true;
+        for (size_t j = 0; j < components.size() && matches; j++){
+            matches = componentOffset < chunk->byteCount() && narrowedOpCodeAt(componentOffset) == components[j] && (j == 0 || !jumpTargets[componentOffset]);
+            if (matches){
+                componentOffset += Chunk::instructionLength(opCodeAt(componentOffset));
+            }
+        }
+
+        if (matches){
+            longestMatch = static_cast<OpCode>(i);
+            longestLength = components.size();
+        }
+    }
+
+    return longestMatch;
+}
+
+OpCode PeepholeOptimizer::opCodeAt(int offset) const {
+    return static_cast<OpCode>(chunk->readByte(offset));
+}
+
+//the compiler emits every forward jump in its long form because it does not know the distance yet, this picks the narrow
+//form for the ones that turned out to be short
+OpCode PeepholeOptimizer::narrowedOpCodeAt(int offset) const {
+    OpCode opCode = opCodeAt(offset);
+    if (!Chunk::isJump(opCode) || !Chunk::isLongForm(opCode)){
+        return opCode;
+    }
+
+    uint32_t distance = chunk->readOperand(offset + 1, opCode);
+    return distance <= UINT16_MAX ? Chunk::narrowForm(opCode) : opCode;
+}
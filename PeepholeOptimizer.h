@@ -0,0 +1,35 @@
+#ifndef CLOX_PEEPHOLEOPTIMIZER_H
+#define CLOX_PEEPHOLEOPTIMIZER_H
+
+
+#include <vector>
+#include "Chunk.h"
+
+/* Rewrites a compiled chunk, replacing common sequences of instructions with a single superinstruction so the VM
+ * dispatches fewer times for the same work. The superinstructions (the ones with more than one component in
+ * Chunk::componentOpCodes, except for quickened forms) are picked from the most frequent sequences in OpcodeProfiler
+ * reports of our scripts. To add one, add the opcode to OpCode, list its components in Chunk::componentOpCodes and give it
+ * a handler in VM::execute. A sequence is only fused if no jump lands in the middle of it, and only the last instruction
+ * of a sequence may be a jump. Long jumps that fit in a 16 bit operand are narrowed on the way, see Chunk::longForm.
+ */
+class PeepholeOptimizer {
+public:
+    explicit PeepholeOptimizer(Chunk *chunk);
+    void optimize();
+
+private:
+    Chunk *chunk;
+    std::vector<bool> jumpTargets;
+
+    void findJumpTargets();
+
+    //returns the superinstruction that replaces the instructions starting at offset, or OP_COUNT if there is none
+    OpCode matchSuperinstruction(int offset) const;
+    OpCode opCodeAt(int offset) const;
+
+    //opcode at offset, with long jumps replaced by their narrow form when their operand fits in it
+    OpCode narrowedOpCodeAt(int offset) const;
+};
+
+
+#endif //CLOX_PEEPHOLEOPTIMIZER_H
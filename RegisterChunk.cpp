@@ -0,0 +1,9 @@
+#include "RegisterChunk.h"
+
+//writes an instruction and returns its index
+size_t RegisterChunk::write(const RegisterInstruction &instruction, int sourceOffset) {
+    instructions.push_back(instruction);
+    sourceOffsets.push_back(sourceOffset);
+    propertyCaches.emplace_back();
+    return instructions.size() - 1;
+}
@@ -0,0 +1,75 @@
+#ifndef CLOX_REGISTERCHUNK_H
+#define CLOX_REGISTERCHUNK_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "Shape.h"
+
+/* Instruction set of the register backend. Instructions are three-address: a is usually the destination register and
+ * b and c the sources. Operands written RK can either name a register or a constant, depending on the matching bit of
+ * RegisterInstruction::constantOperands. K[x] always names a constant and R[x] a register. Registers are the slots of
+ * the frame's window on the VM stack, so register 0 holds the function being executed like slot 0 of the stack VM.
+ */
+enum class RegisterOpCode : uint8_t {
+    RETURN,
+    PRINT,          // print RK[b]
+    LOAD_CONSTANT,  // R[a] = K[b]
+    LOAD_NIL,       // R[a] = nil
+    LOAD_TRUE,      // R[a] = true
+    LOAD_FALSE,     // R[a] = false
+    MOVE,           // R[a] = R[b]
+    NEGATE,         // R[a] = -RK[b]
+    NOT,            // R[a] = !RK[b]
+    ADD,            // R[a] = RK[b] + RK[c]
+    SUBTRACT,       // R[a] = RK[b] - RK[c]
+    MULTIPLY,       // R[a] = RK[b] * RK[c]
+    DIVIDE,         // R[a] = RK[b] / RK[c]
+    EQUAL,          // R[a] = RK[b] == RK[c]
+    GREATER,        // R[a] = RK[b] > RK[c]
+    LESS,           // R[a] = RK[b] < RK[c]
+    DEFINE_GLOBAL,  // define global slot a = RK[b]
+    GET_GLOBAL,     // R[a] = global slot b
+    SET_GLOBAL,     // global slot a = RK[b]
+    JUMP,           // jump to instruction b
+    JUMP_IF_FALSE,  // if R[a] is falsey jump to instruction b
+    CLASS,          // R[a] = new class named K[b]
+    CALL,           // R[a] = new instance of RK[b], called with c arguments
+    GET_PROPERTY,   // R[a] = RK[b].K[c]
+    SET_PROPERTY,   // RK[b].K[c] = RK[a]
+    ALLOCATE,       // R[a] = allocate RK[b]
+    COUNT //number of opcodes, not an actual instruction
+};
+
+struct RegisterInstruction {
+    static constexpr uint8_t A_IS_CONSTANT = 1u;
+    static constexpr uint8_t B_IS_CONSTANT = 2u;
+    static constexpr uint8_t C_IS_CONSTANT = 4u;
+
+    RegisterOpCode opCode;
+    uint8_t constantOperands = 0; //which of the operands refer to constants instead of registers
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+class RegisterChunk {
+public:
+    std::vector<RegisterInstruction> instructions;
+
+    /* For every instruction, the offset in the stack bytecode right after the instruction it was translated from. The VM
+     * stores it in CallFrame::programCounter before calling a shared helper so errors report the same line as the stack VM.
+     */
+    std::vector<int> sourceOffsets;
+
+    //inline caches of the property instructions, indexed like instructions
+    std::vector<PropertyCache> propertyCaches;
+
+    //amount of registers a frame running this chunk needs, including register 0
+    int registerCount = 0;
+
+    size_t write(const RegisterInstruction &instruction, int sourceOffset);
+};
+
+
+#endif //CLOX_REGISTERCHUNK_H
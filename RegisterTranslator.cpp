@@ -0,0 +1,361 @@
+#include <stdexcept>
+#include "RegisterTranslator.h"
+
+RegisterTranslator::RegisterTranslator(Chunk *chunk, size_t globalCount) : chunk(chunk), verifier(chunk, globalCount) {}
+
+RegisterChunk *RegisterTranslator::translate() {
+    //the verifier is always run because the translation needs the stack depth at every jump target
+    verifier.verify();
+
+    result = new RegisterChunk();
+    result->registerCount = verifier.maxStackDepth();
+    findJumpTargets();
+    instructionIndexAt.assign(chunk->byteCount(), -1);
+
+    bool previousFallsThrough = false;
+    size_t offset = 0;
+    while (offset < chunk->byteCount()){
+        auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+        int length = Chunk::instructionLength(opCode);
+        int depth = verifier.stackDepthAt(offset);
+
+        if (depth == -1){ //unreachable code is dropped
+            previousFallsThrough = false;
+            offset += length;
+            continue;
+        }
+
+        //Control flow merges here, so values have to be in their own registers. Code falling through from the previous
+        //instruction moves them there, code jumping here already has them there.
+        if (jumpTargets[offset] || !previousFallsThrough){
+            if (previousFallsThrough){
+                materializeAll();
+            }
+            resetOperands(depth);
+        }
+
+        instructionIndexAt[offset] = static_cast<int>(result->instructions.size());
+        sourceOffset = offset + length;
+        translateInstruction(offset);
+
+        OpCode narrowOpCode = Chunk::narrowForm(opCode);
+        previousFallsThrough = narrowOpCode != OpCode::OP_JUMP && narrowOpCode != OpCode::OP_LOOP && narrowOpCode != OpCode::OP_RETURN;
+        offset += length;
+    }
+
+    for (const auto &fixup : jumpFixups){
+        result->instructions[fixup.first].b = instructionIndexAt[fixup.second];
+    }
+
+    return result;
+}
+
+void RegisterTranslator::findJumpTargets() {
+    jumpTargets.assign(chunk->byteCount(), false);
+    size_t offset = 0;
+    while (offset < chunk->byteCount()){
+        auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+        if (Chunk::isJump(opCode)){
+            jumpTargets[chunk->jumpTarget(offset)] = true;
+        }
+        offset += Chunk::instructionLength(opCode);
+    }
+}
+
+//superinstructions are translated as the sequence of instructions they replace
+void RegisterTranslator::translateInstruction(int offset) {
+    int operandOffset = offset + 1;
+    for (OpCode component : Chunk::componentOpCodes(static_cast<OpCode>(chunk->readByte(offset)))){
+        translateInstruction(offset, component, operandOffset);
+        operandOffset += Chunk::instructionLength(component) - 1;
+    }
+}
+
+void RegisterTranslator::translateInstruction(int offset, OpCode opCode, int operandOffset) {
+    RegisterInstruction instruction;
+    uint32_t operand = chunk->readOperand(operandOffset, opCode);
+
+    switch (Chunk::narrowForm(opCode)) {
+        case OpCode::OP_RETURN:
+            pop(); //the value a script returns is discarded
+            instruction.opCode = RegisterOpCode::RETURN;
+            emit(instruction);
+            break;
+        case OpCode::OP_PRINT:
+            instruction.opCode = RegisterOpCode::PRINT;
+            setOperand(instruction, 1, pop());
+            emit(instruction);
+            break;
+        case OpCode::OP_CONSTANT:
+            push(constantOperand(operand));
+            break;
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_NOT:
+            instruction.opCode = opCode == OpCode::OP_NEGATE ? RegisterOpCode::NEGATE : RegisterOpCode::NOT;
+            setOperand(instruction, 1, pop());
+            pushResult(instruction);
+            break;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_LESS: {
+            switch (opCode) {
+                case OpCode::OP_ADD: instruction.opCode = RegisterOpCode::ADD; break;
+                case OpCode::OP_SUBTRACT: instruction.opCode = RegisterOpCode::SUBTRACT; break;
+                case OpCode::OP_MULTIPLY: instruction.opCode = RegisterOpCode::MULTIPLY; break;
+                case OpCode::OP_DIVIDE: instruction.opCode = RegisterOpCode::DIVIDE; break;
+                case OpCode::OP_EQUAL: instruction.opCode = RegisterOpCode::EQUAL; break;
+                case OpCode::OP_GREATER: instruction.opCode = RegisterOpCode::GREATER; break;
+                default: instruction.opCode = RegisterOpCode::LESS;
+            }
+            Operand right = pop();
+            Operand left = pop();
+            setOperand(instruction, 1, left);
+            setOperand(instruction, 2, right);
+            pushResult(instruction);
+            break;
+        }
+        case OpCode::OP_TRUE:
+            instruction.opCode = RegisterOpCode::LOAD_TRUE;
+            pushResult(instruction);
+            break;
+        case OpCode::OP_FALSE:
+            instruction.opCode = RegisterOpCode::LOAD_FALSE;
+            pushResult(instruction);
+            break;
+        case OpCode::OP_NIL:
+            instruction.opCode = RegisterOpCode::LOAD_NIL;
+            pushResult(instruction);
+            break;
+        case OpCode::OP_POP:
+            pop();
+            break;
+        case OpCode::OP_DEFINE_GLOBAL:
+            instruction.opCode = RegisterOpCode::DEFINE_GLOBAL;
+            instruction.a = operand;
+            setOperand(instruction, 1, pop());
+            emit(instruction);
+            break;
+        case OpCode::OP_GET_GLOBAL:
+            instruction.opCode = RegisterOpCode::GET_GLOBAL;
+            instruction.b = operand;
+            pushResult(instruction);
+            break;
+        case OpCode::OP_SET_GLOBAL:
+            instruction.opCode = RegisterOpCode::SET_GLOBAL;
+            instruction.a = operand;
+            setOperand(instruction, 1, operands.back()); //the value stays on the stack
+            emit(instruction);
+            break;
+        case OpCode::OP_GET_LOCAL: {
+            materialize(operand);
+            push(registerOperand(operand));
+            break;
+        }
+        case OpCode::OP_SET_LOCAL:
+            setLocal(operand);
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+            materializeAll();
+            emitJump(RegisterOpCode::JUMP_IF_FALSE, static_cast<uint32_t>(operands.size() - 1), chunk->jumpTarget(offset));
+            break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+            materializeAll();
+            emitJump(RegisterOpCode::JUMP, 0, chunk->jumpTarget(offset));
+            break;
+        case OpCode::OP_CLASS:
+            instruction.opCode = RegisterOpCode::CLASS;
+            instruction.b = operand;
+            pushResult(instruction);
+            break;
+        case OpCode::OP_CALL:
+            //programs with functions run on the stack VM, so the callee can only be a class, which takes no arguments.
+            //Calling one with arguments is an error, the arguments are only counted to report it
+            instruction.opCode = RegisterOpCode::CALL;
+            instruction.c = operand;
+            for (uint32_t i = 0; i < operand; i++){
+                pop();
+            }
+            setOperand(instruction, 1, pop());
+            pushResult(instruction);
+            break;
+        case OpCode::OP_INVOKE: {
+            //Without functions there are no methods, so the property is a field holding the class that is called. The
+            //receiver is replaced by the field and called like with OP_CALL
+            uint32_t argCount = operand & 0xffu;
+            for (uint32_t i = 0; i < argCount; i++){
+                pop();
+            }
+            RegisterInstruction getProperty;
+            getProperty.opCode = RegisterOpCode::GET_PROPERTY;
+            setOperand(getProperty, 1, pop());
+            setOperand(getProperty, 2, constantOperand(operand >> 8u));
+            pushResult(getProperty);
+
+            instruction.opCode = RegisterOpCode::CALL;
+            instruction.c = argCount;
+            setOperand(instruction, 1, pop());
+            pushResult(instruction);
+            break;
+        }
+        case OpCode::OP_GET_PROPERTY:
+            instruction.opCode = RegisterOpCode::GET_PROPERTY;
+            setOperand(instruction, 1, pop());
+            setOperand(instruction, 2, constantOperand(operand));
+            pushResult(instruction);
+            break;
+        case OpCode::OP_SET_PROPERTY: {
+            instruction.opCode = RegisterOpCode::SET_PROPERTY;
+            Operand value = pop();
+            setOperand(instruction, 0, value);
+            setOperand(instruction, 1, pop());
+            setOperand(instruction, 2, constantOperand(operand));
+            emit(instruction);
+
+            //The value is the result of the expression. If it lives in a temporary register above its new depth, that
+            //register would be reused by the next push, so it is moved down.
+            if (!value.isConstant && value.index >= operands.size()){
+                RegisterInstruction move;
+                move.opCode = RegisterOpCode::MOVE;
+                move.b = value.index;
+                pushResult(move);
+            } else {
+                push(value);
+            }
+            break;
+        }
+        case OpCode::OP_ALLOCATE:
+            instruction.opCode = RegisterOpCode::ALLOCATE;
+            setOperand(instruction, 1, pop());
+            pushResult(instruction);
+            break;
+        default:
+            throw std::runtime_error("Unreachable");
+    }
+}
+
+void RegisterTranslator::push(const Operand &operand) {
+    Operand pushed = operand;
+    pushed.producer = -1;
+    operands.push_back(pushed);
+}
+
+RegisterTranslator::Operand RegisterTranslator::pop() {
+    Operand operand = operands.back();
+    operands.pop_back();
+    return operand;
+}
+
+//emits an instruction that computes a new value into the register at the top of the stack
+void RegisterTranslator::pushResult(RegisterInstruction instruction) {
+    auto destination = static_cast<uint32_t>(operands.size());
+    instruction.a = destination;
+    Operand operand = registerOperand(destination);
+    operand.producer = static_cast<int>(emit(instruction));
+    operands.push_back(operand);
+}
+
+//copies the value of the entry at depth into the register with the same index
+void RegisterTranslator::materialize(size_t depth) {
+    Operand &operand = operands[depth];
+    if (!operand.isConstant && operand.index == depth){
+        return;
+    }
+
+    RegisterInstruction instruction;
+    instruction.opCode = operand.isConstant ? RegisterOpCode::LOAD_CONSTANT : RegisterOpCode::MOVE;
+    instruction.a = static_cast<uint32_t>(depth);
+    instruction.b = operand.index;
+    operands[depth] = registerOperand(static_cast<uint32_t>(depth));
+    operands[depth].producer = static_cast<int>(emit(instruction));
+}
+
+void RegisterTranslator::materializeAll() {
+    for (size_t depth = 0; depth < operands.size(); depth++){
+        materialize(depth);
+    }
+}
+
+void RegisterTranslator::resetOperands(int depth) {
+    operands.clear();
+    for (int i = 0; i < depth; i++){
+        operands.push_back(registerOperand(i));
+    }
+}
+
+void RegisterTranslator::setLocal(uint32_t slot) {
+    size_t top = operands.size() - 1;
+    Operand value = operands[top];
+    if (!value.isConstant && value.index == slot){
+        return; //assigning a local to itself
+    }
+
+    //entries that still refer to the old value of the local need their own copy before it is overwritten
+    for (size_t depth = 0; depth < top; depth++){
+        if (depth != slot && !operands[depth].isConstant && operands[depth].index == slot){
+            materialize(depth);
+        }
+    }
+
+    bool producedByLastInstruction = value.producer != -1 && value.producer == static_cast<int>(result->instructions.size()) - 1;
+    if (!value.isConstant && value.index == top && producedByLastInstruction){
+        //the value was just computed into a temporary register, so compute it straight into the local instead
+        result->instructions.back().a = slot;
+    } else {
+        RegisterInstruction instruction;
+        instruction.opCode = value.isConstant ? RegisterOpCode::LOAD_CONSTANT : RegisterOpCode::MOVE;
+        instruction.a = slot;
+        instruction.b = value.index;
+        emit(instruction);
+    }
+
+    operands[slot] = registerOperand(slot);
+    operands[top] = registerOperand(slot);
+}
+
+void RegisterTranslator::emitJump(RegisterOpCode opCode, uint32_t conditionRegister, int target) {
+    RegisterInstruction instruction;
+    instruction.opCode = opCode;
+    instruction.a = conditionRegister;
+    jumpFixups.emplace_back(emit(instruction), target);
+}
+
+size_t RegisterTranslator::emit(const RegisterInstruction &instruction) {
+    return result->write(instruction, sourceOffset);
+}
+
+RegisterTranslator::Operand RegisterTranslator::registerOperand(uint32_t index) {
+    return Operand{false, index};
+}
+
+RegisterTranslator::Operand RegisterTranslator::constantOperand(uint32_t index) {
+    return Operand{true, index};
+}
+
+//position 0, 1 and 2 refer to operands a, b and c
+void RegisterTranslator::setOperand(RegisterInstruction &instruction, int position, const Operand &operand) {
+    uint8_t constantFlag;
+    switch (position) {
+        case 0:
+            instruction.a = operand.index;
+            constantFlag = RegisterInstruction::A_IS_CONSTANT;
+            break;
+        case 1:
+            instruction.b = operand.index;
+            constantFlag = RegisterInstruction::B_IS_CONSTANT;
+            break;
+        default:
+            instruction.c = operand.index;
+            constantFlag = RegisterInstruction::C_IS_CONSTANT;
+    }
+
+    if (operand.isConstant){
+        instruction.constantOperands |= constantFlag;
+    } else {
+        instruction.constantOperands &= static_cast<uint8_t>(~constantFlag);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CLOX_REGISTERTRANSLATOR_H
+#define CLOX_REGISTERTRANSLATOR_H
+
+
+#include <vector>
+#include "Chunk.h"
+#include "RegisterChunk.h"
+#include "BytecodeVerifier.h"
+
+/* Translates the stack bytecode emitted by the Compiler into register code for the RegisterVM.
+ *
+ * Every stack slot maps to the register with the same index, so a value at depth d of the operand stack lives in register
+ * d. The translator walks the bytecode keeping a virtual copy of the operand stack, where each entry remembers where its
+ * value can be found: either a register or a constant. Pushing a constant or a local therefore emits no code at all, and
+ * an operator reads its operands straight from wherever they are, so "i = i + 1" becomes a single ADD that writes into
+ * the register of i. Entries are only copied into their own register ("materialized") when that is needed: before a
+ * jump or a jump target, where both paths have to agree on where values live, and before overwriting a local that a
+ * pending entry still refers to.
+ */
+class RegisterTranslator {
+public:
+    RegisterTranslator(Chunk *chunk, size_t globalCount);
+
+    //the caller owns the returned chunk. Verifies the stack chunk if it has not been verified yet.
+    RegisterChunk* translate();
+
+private:
+    struct Operand {
+        bool isConstant;
+        uint32_t index; //register or constant index
+        int producer = -1; //index of the instruction that computed this value into its register, if any
+    };
+
+    Chunk *chunk;
+    BytecodeVerifier verifier;
+    RegisterChunk *result = nullptr;
+    std::vector<Operand> operands; //virtual operand stack
+    std::vector<bool> jumpTargets;
+    std::vector<int> instructionIndexAt; //stack bytecode offset -> index of the first register instruction for it
+    std::vector<std::pair<size_t, int>> jumpFixups; //register jump instruction -> stack bytecode target offset
+    int sourceOffset = 0;
+
+    void findJumpTargets();
+    void translateInstruction(int offset);
+    void translateInstruction(int offset, OpCode opCode, int operandOffset);
+
+    void push(const Operand &operand);
+    Operand pop();
+    void pushResult(RegisterInstruction instruction);
+    void materialize(size_t depth);
+    void materializeAll();
+    void resetOperands(int depth);
+    void setLocal(uint32_t slot);
+    void emitJump(RegisterOpCode opCode, uint32_t conditionRegister, int target);
+    size_t emit(const RegisterInstruction &instruction);
+
+    static Operand registerOperand(uint32_t index);
+    static Operand constantOperand(uint32_t index);
+    static void setOperand(RegisterInstruction &instruction, int position, const Operand &operand);
+};
+
+
+#endif //CLOX_REGISTERTRANSLATOR_H
@@ -0,0 +1,227 @@
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include "RegisterVM.h"
+#include "RegisterTranslator.h"
+#include "Memory.h"
+#include "SamplingProfiler.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define USE_COMPUTED_GOTO
+#endif
+
+ExecutionResult RegisterVM::execute(FunctionObj *function, GlobalVariables &globalVariables) {
+    //there are no calls between register frames, programs with functions are run by the stack VM instead
+    if (function->chunk->containsFunctions()){
+        return VM::execute(function, globalVariables);
+    }
+
+    heap.vm = this;
+    globals = &globalVariables;
+    globals->allocateValues();
+
+    if (function->registerChunk == nullptr){
+        function->registerChunk = RegisterTranslator(function->chunk, globals->count()).translate();
+    }
+    RegisterChunk *chunk = function->registerChunk;
+
+    currentFrame = CallFrame(function, 0, 0);
+
+    //the register file is the bottom of the stack, every register is live for the GC while the chunk runs
+    checkStackSpace(currentFrame.stackIndex, chunk->registerCount);
+    CLoxLiteral *registers = stack.get() + currentFrame.stackIndex;
+    stackTop = std::fill_n(registers, chunk->registerCount, CLoxLiteral::Nil());
+    registers[0] = CLoxLiteral(function);
+    SamplingProfiler::attach(this);
+    const CLoxLiteral *constants = function->chunk->constants.data();
+    const RegisterInstruction *code = chunk->instructions.data();
+    const RegisterInstruction *ip = code;
+    const RegisterInstruction *instruction;
+
+#define R(operand) (registers[instruction->operand])
+#define K(operand) (constants[instruction->operand])
+#define RK(operand, flag) ((instruction->constantOperands & RegisterInstruction::flag) ? K(operand) : R(operand))
+#define RK_A() RK(a, A_IS_CONSTANT)
+#define RK_B() RK(b, B_IS_CONSTANT)
+#define RK_C() RK(c, C_IS_CONSTANT)
+#define K_STRING(operand) (static_cast<StringObj*>(K(operand).getObj()))
+#define SAVE_PC() (currentFrame.programCounter = chunk->sourceOffsets[instruction - code])
+//samples the last byte of the stack instruction the current instruction was translated from, see VM::execute
+#define TAKE_SAMPLE() SamplingProfiler::takeSample(this, chunk->sourceOffsets[instruction - code] - 1)
+
+#ifdef USE_COMPUTED_GOTO
+    //must list a handler for every opcode, in the same order as the RegisterOpCode enum
+    static const void *const dispatchTable[static_cast<int>(RegisterOpCode::COUNT)] = {
+            &&TARGET_RETURN,
+            &&TARGET_PRINT,
+            &&TARGET_LOAD_CONSTANT,
+            &&TARGET_LOAD_NIL,
+            &&TARGET_LOAD_TRUE,
+            &&TARGET_LOAD_FALSE,
+            &&TARGET_MOVE,
+            &&TARGET_NEGATE,
+            &&TARGET_NOT,
+            &&TARGET_ADD,
+            &&TARGET_SUBTRACT,
+            &&TARGET_MULTIPLY,
+            &&TARGET_DIVIDE,
+            &&TARGET_EQUAL,
+            &&TARGET_GREATER,
+            &&TARGET_LESS,
+            &&TARGET_DEFINE_GLOBAL,
+            &&TARGET_GET_GLOBAL,
+            &&TARGET_SET_GLOBAL,
+            &&TARGET_JUMP,
+            &&TARGET_JUMP_IF_FALSE,
+            &&TARGET_CLASS,
+            &&TARGET_CALL,
+            &&TARGET_GET_PROPERTY,
+            &&TARGET_SET_PROPERTY,
+            &&TARGET_ALLOCATE
+    };
+
+#ifdef SAMPLING_PROFILER
+    //while profiling every opcode dispatches to sampledInstruction first, like the threaded code of VM::execute
+    const void *samplingDispatchTable[static_cast<int>(RegisterOpCode::COUNT)];
+    std::fill(std::begin(samplingDispatchTable), std::end(samplingDispatchTable), &&sampledInstruction);
+    const void *const *handlers = SamplingProfiler::isRunning() ? samplingDispatchTable : dispatchTable;
+#else
+    const void *const *handlers = dispatchTable;
+#endif
+
+#define TARGET(op) TARGET_##op: case RegisterOpCode::op
+#define DISPATCH() do { instruction = ip++; goto *handlers[static_cast<int>(instruction->opCode)]; } while (false)
+
+    DISPATCH();
+#ifdef SAMPLING_PROFILER
+sampledInstruction:
+    if (SamplingProfiler::sampleRequested){
+        TAKE_SAMPLE();
+    }
+    goto *dispatchTable[static_cast<int>(instruction->opCode)];
+#endif
+#else
+#define TARGET(op) case RegisterOpCode::op
+#define DISPATCH() break
+#endif
+
+    while (true){
+        instruction = ip++;
+#ifdef SAMPLING_PROFILER
+        if (SamplingProfiler::sampleRequested){
+            TAKE_SAMPLE();
+        }
+#endif
+        switch (instruction->opCode) {
+            TARGET(RETURN):
+                SamplingProfiler::detach(this);
+                heap.freeAllHeapObjects();
+                return ExecutionResult::OK;
+            TARGET(PRINT):
+                out << RK_B() << "\n";
+                DISPATCH();
+            TARGET(LOAD_CONSTANT):
+                R(a) = K(b);
+                DISPATCH();
+            TARGET(LOAD_NIL):
+                R(a) = CLoxLiteral::Nil();
+                DISPATCH();
+            TARGET(LOAD_TRUE):
+                R(a) = CLoxLiteral(true);
+                DISPATCH();
+            TARGET(LOAD_FALSE):
+                R(a) = CLoxLiteral(false);
+                DISPATCH();
+            TARGET(MOVE):
+                R(a) = R(b);
+                DISPATCH();
+            TARGET(NEGATE):
+                SAVE_PC();
+                R(a) = negate(RK_B());
+                DISPATCH();
+            TARGET(NOT):
+                R(a) = CLoxLiteral(!isTruthy(RK_B()));
+                DISPATCH();
+            TARGET(ADD):
+                SAVE_PC();
+                R(a) = add(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(SUBTRACT):
+                SAVE_PC();
+                R(a) = subtract(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(MULTIPLY):
+                SAVE_PC();
+                R(a) = multiply(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(DIVIDE):
+                SAVE_PC();
+                R(a) = divide(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(EQUAL):
+                R(a) = equal(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(GREATER):
+                SAVE_PC();
+                R(a) = greater(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(LESS):
+                SAVE_PC();
+                R(a) = less(RK_B(), RK_C());
+                DISPATCH();
+            TARGET(DEFINE_GLOBAL):
+                SAVE_PC();
+                defineGlobal(instruction->a, RK_B());
+                DISPATCH();
+            TARGET(GET_GLOBAL):
+                SAVE_PC();
+                R(a) = getGlobal(instruction->b);
+                DISPATCH();
+            TARGET(SET_GLOBAL):
+                SAVE_PC();
+                setGlobal(instruction->a, RK_B());
+                DISPATCH();
+            TARGET(JUMP):
+                ip = code + instruction->b;
+                DISPATCH();
+            TARGET(JUMP_IF_FALSE):
+                if (!isTruthy(R(a))){
+                    ip = code + instruction->b;
+                }
+                DISPATCH();
+            TARGET(CLASS):
+                R(a) = makeClass(K_STRING(b));
+                DISPATCH();
+            TARGET(CALL):
+                SAVE_PC();
+                R(a) = instantiate(RK_B(), static_cast<int>(instruction->c));
+                DISPATCH();
+            TARGET(GET_PROPERTY):
+                SAVE_PC();
+                R(a) = getProperty(RK_B(), K_STRING(c), chunk->propertyCaches[instruction - code]);
+                DISPATCH();
+            TARGET(SET_PROPERTY):
+                SAVE_PC();
+                setProperty(RK_B(), K_STRING(c), RK_A(), chunk->propertyCaches[instruction - code]);
+                DISPATCH();
+            TARGET(ALLOCATE):
+                SAVE_PC();
+                R(a) = allocate(RK_B());
+                DISPATCH();
+            case RegisterOpCode::COUNT:
+                break;
+        }
+    }
+
+#undef R
+#undef K
+#undef RK
+#undef RK_A
+#undef RK_B
+#undef RK_C
+#undef K_STRING
+#undef SAVE_PC
+#undef TAKE_SAMPLE
+#undef TARGET
+#undef DISPATCH
+}
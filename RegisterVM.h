@@ -0,0 +1,21 @@
+#ifndef CLOX_REGISTERVM_H
+#define CLOX_REGISTERVM_H
+
+
+#include "VM.h"
+#include "RegisterChunk.h"
+
+/* Execution backend for register code. Functions are translated from their stack bytecode the first time they run (see
+ * RegisterTranslator) and the translation is cached in the FunctionObj. Registers are the slots of the VM stack, so the
+ * GC finds every live value the same way it does for the stack VM, and all operations with semantics beyond moving
+ * values around are shared with the stack VM. Programs that declare functions are run by the stack VM.
+ */
+class RegisterVM : public VM {
+public:
+    using VM::VM;
+
+    ExecutionResult execute(FunctionObj *function, GlobalVariables &globalVariables);
+};
+
+
+#endif //CLOX_REGISTERVM_H
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <sys/time.h>
+#include "SamplingProfiler.h"
+#include "VM.h"
+
+std::unique_ptr<SamplingProfiler::Sample[]> SamplingProfiler::samples;
+std::atomic<size_t> SamplingProfiler::sampleCount(0);
+std::unique_ptr<SamplingProfiler::Frame[]> SamplingProfiler::frames;
+size_t SamplingProfiler::frameCount = 0;
+size_t SamplingProfiler::droppedSamples = 0;
+SamplingProfiler::Function SamplingProfiler::functions[MAX_FUNCTIONS];
+size_t SamplingProfiler::functionCount = 0;
+std::atomic<const VM*> SamplingProfiler::attachedVM(nullptr);
+bool SamplingProfiler::running = false;
+std::atomic<int> SamplingProfiler::sampleRequested(0);
+
+void SamplingProfiler::start() {
+    if (running){
+        return;
+    }
+    //allocated up front, the signal handler cannot allocate
+    samples.reset(new Sample[MAX_SAMPLES]);
+    sampleCount = 0;
+    frames.reset(new Frame[MAX_FRAMES]);
+    frameCount = 0;
+    running = true;
+
+    struct sigaction action = {};
+    action.sa_handler = handleSignal;
+    action.sa_flags = SA_RESTART; //so reads and writes of the script are not interrupted
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    itimerval timer = {};
+    timer.it_interval.tv_usec = SAMPLING_INTERVAL_MICROSECONDS;
+    timer.it_value.tv_usec = SAMPLING_INTERVAL_MICROSECONDS;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void SamplingProfiler::stop() {
+    if (!running){
+        return;
+    }
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN); //a signal that was already pending is discarded
+    attachedVM = nullptr;
+    sampleRequested = 0;
+    running = false;
+}
+
+bool SamplingProfiler::isRunning() {
+    return running;
+}
+
+void SamplingProfiler::attach(const VM *vm) {
+    if (running){
+        attachedVM = vm;
+    }
+}
+
+void SamplingProfiler::detach(const VM *vm) {
+    if (running && attachedVM.compare_exchange_strong(vm, nullptr)){
+        sampleRequested = 0;
+    }
+}
+
+//Every request is a sample, several are pending when the VM was running a trace of the TracingJit. A request the signal
+//handler makes while they are recorded is left for the next instruction
+void SamplingProfiler::takeSample(const VM *vm, int offset) {
+    int requests = sampleRequested.exchange(0, std::memory_order_relaxed);
+    for (int i = 0; i < requests; i++){
+        record(vm, offset);
+    }
+}
+
+//Runs in the signal handler, so it only reads the VM and writes to memory allocated by start()
+void SamplingProfiler::handleSignal(int) {
+    const VM *vm = attachedVM.load(std::memory_order_relaxed);
+    if (vm == nullptr || vm->executingOffset >= 0){
+        record(vm, vm == nullptr ? 0 : vm->executingOffset);
+    } else {
+        sampleRequested.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/* A null vm is a sample taken outside of a VM. The callers in callFrames saved the offset after their call instruction,
+ * their line is the line of the call.
+ */
+void SamplingProfiler::record(const VM *vm, int offset) {
+    size_t index = sampleCount.load(std::memory_order_relaxed);
+    size_t stackDepth = vm == nullptr ? 0 : static_cast<size_t>(vm->frameCount) + 1;
+    size_t depth = stackDepth < MAX_DEPTH ? stackDepth : MAX_DEPTH; //std::min would need a definition of MAX_DEPTH
+    if (index >= MAX_SAMPLES || frameCount + depth > MAX_FRAMES){
+        droppedSamples++;
+        return;
+    }
+
+    Sample sample = {static_cast<uint32_t>(frameCount), static_cast<uint16_t>(depth), depth < stackDepth};
+    for (size_t i = stackDepth - depth; i < stackDepth; i++){
+        bool isCurrent = i + 1 == stackDepth;
+        const CallFrame &frame = isCurrent ? vm->currentFrame : vm->callFrames[i];
+        int frameOffset = isCurrent ? offset : frame.programCounter - 1;
+        frames[frameCount++] = {functionIndex(frame.function), frame.function->chunk->readLineUnchecked(frameOffset)};
+    }
+    samples[index] = sample;
+    sampleCount.store(index + 1, std::memory_order_relaxed);
+}
+
+int16_t SamplingProfiler::functionIndex(const FunctionObj *function) {
+    for (size_t i = 0; i < functionCount; i++){
+        if (functions[i].function == function){
+            return static_cast<int16_t>(i);
+        }
+    }
+    if (functionCount == MAX_FUNCTIONS){
+        return -1;
+    }
+
+    Function &added = functions[functionCount];
+    added.function = function;
+    size_t length = std::min<size_t>(function->name->length, sizeof(added.name) - 1);
+    std::memcpy(added.name, function->name->chars(), length);
+    added.name[length] = '\0';
+    return static_cast<int16_t>(functionCount++);
+}
+
+//The outermost frame of a stack that was not truncated runs the script itself, it is named after the script
+void SamplingProfiler::writeReport(std::ostream &out, const std::string &scriptName) {
+    std::map<std::string, uint64_t> counts;
+    size_t count = sampleCount.load();
+    for (size_t i = 0; i < count; i++){
+        const Sample &sample = samples[i];
+        std::string stack = scriptName;
+        if (sample.truncated){
+            stack += ";(truncated)";
+        }
+        for (size_t j = 0; j < sample.depth; j++){
+            const Frame &frame = frames[sample.firstFrame + j];
+            if (j == 0 && !sample.truncated){
+                stack += ":";
+            } else {
+                stack += ";";
+                stack += frame.function >= 0 ? functions[frame.function].name : "(unknown)";
+                stack += ":";
+            }
+            stack += std::to_string(frame.line);
+        }
+        counts[stack]++;
+    }
+
+    for (const auto &entry : counts){
+        out << entry.first << " " << entry.second << "\n";
+    }
+    if (droppedSamples > 0){
+        out << scriptName << ";(dropped samples) " << droppedSamples << "\n";
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef CLOX_SAMPLINGPROFILER_H
+#define CLOX_SAMPLINGPROFILER_H
+
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include "CLoxLiteral.h"
+
+class VM;
+
+/* Samples where a Lox program spends its time (clox --profile). A SIGPROF timer interrupts the process every
+ * SAMPLING_INTERVAL_MICROSECONDS of CPU time. The signal handler does not know where the interpreters keep their
+ * instruction pointer, so it only sets sampleRequested. While the profiler runs, the interpreters dispatch every
+ * instruction through a check of it, and call takeSample with the function and offset they are about to execute.
+ * Otherwise their handlers jump straight to each other and profiling costs nothing. Code compiled by the BaselineJit
+ * while profiling stores its offset in VM::executingOffset instead, and the handler samples that directly. Time spent in traces of the TracingJit is attributed to the back edge
+ * of their loop, where the interpreter resumes, and time outside of a VM (scanning and compiling) to the script itself.
+ *
+ * Every sample records the whole call stack of the VM, the line every caller is at and the line being executed. The
+ * report has one line per distinct stack in the folded stack format flame graph tools read, outermost frame first
+ * ("script:line;caller:line;function:line samples"). The interpreters only check for samples when clox is built with
+ * SAMPLING_PROFILER (cmake -DCLOX_SAMPLING_PROFILER=ON, the default).
+ */
+class SamplingProfiler {
+public:
+    static const int SAMPLING_INTERVAL_MICROSECONDS = 1000;
+    static const size_t MAX_SAMPLES = 1u << 22u; //over an hour of CPU time, later samples are dropped
+    static const size_t MAX_FRAMES = 1u << 23u; //frames of all samples together, later samples are dropped
+    static const size_t MAX_DEPTH = 256; //only the innermost frames of deeper stacks are recorded
+    static const size_t MAX_FUNCTIONS = 256;
+
+    //starts the timer. Samples are taken until stop()
+    static void start();
+    static void stop();
+    static bool isRunning();
+
+    //Attaches the VM whose frames are sampled. The VM attaches itself once its frame is set up and detaches before it
+    //frees its heap, so the signal handler never reads a freed function. Only one VM is sampled, detaching any other one
+    //does nothing, and neither does anything while the profiler is not running, so VMs on other threads can call them.
+    static void attach(const VM *vm);
+    static void detach(const VM *vm);
+
+    //number of samples the signal handler requested from the attached VM, taken at its next instruction
+    static std::atomic<int> sampleRequested;
+    static_assert(decltype(sampleRequested)::is_always_lock_free, "the signal handler can only use lock free atomics");
+    //vm is about to execute the instruction at offset in the chunk of its currentFrame
+    static void takeSample(const VM *vm, int offset);
+
+    static void writeReport(std::ostream &out, const std::string &scriptName);
+
+private:
+    struct Frame {
+        int16_t function; //index in functions, -1 if there were too many
+        int32_t line;
+    };
+
+    //the frames of a sample are frames[firstFrame, firstFrame + depth), outermost first. No VM was attached if depth is 0
+    struct Sample {
+        uint32_t firstFrame;
+        uint16_t depth;
+        bool truncated; //the outermost frames did not fit into MAX_DEPTH
+    };
+
+    //names are copied when a function is first sampled, it is long gone when the report is written
+    struct Function {
+        const FunctionObj *function;
+        char name[64];
+    };
+
+    static std::unique_ptr<Sample[]> samples;
+    static std::atomic<size_t> sampleCount;
+    static std::unique_ptr<Frame[]> frames;
+    static size_t frameCount;
+    static size_t droppedSamples;
+    static Function functions[MAX_FUNCTIONS];
+    static size_t functionCount;
+    static std::atomic<const VM*> attachedVM;
+    static bool running;
+
+    static void handleSignal(int signal);
+    static void record(const VM *vm, int offset);
+    static int16_t functionIndex(const FunctionObj *function);
+};
+
+
+#endif //CLOX_SAMPLINGPROFILER_H
@@ -0,0 +1,42 @@
+#include "Shape.h"
+
+Shape::Shape(Shape *parent, StringObj *name) : slotCount(parent->slotCount + 1), parent(parent), name(name) {}
+
+Shape *Shape::dictionary() {
+    static Shape dictionary;
+    return &dictionary;
+}
+
+//walks up to the root, which is cheap enough for the slow path because shapes have at most MAX_SLOTS ancestors
+int Shape::lookup(const StringObj *fieldName) const {
+    for (const Shape *shape = this; shape->parent != nullptr; shape = shape->parent){
+        if (shape->name == fieldName){
+            return shape->slotCount - 1;
+        }
+    }
+
+    return -1;
+}
+
+std::vector<StringObj*> Shape::fieldNames() const {
+    std::vector<StringObj*> names(slotCount);
+    for (const Shape *shape = this; shape->parent != nullptr; shape = shape->parent){
+        names[shape->slotCount - 1] = shape->name;
+    }
+    return names;
+}
+
+Shape *Shape::transition(StringObj *fieldName) {
+    auto it = transitions.find(fieldName);
+    if (it != transitions.end()){
+        return it->second.get();
+    }
+
+    Shape *child = new Shape(this, fieldName);
+    transitions.emplace(fieldName, std::unique_ptr<Shape>(child));
+    return child;
+}
+
+bool Shape::isDictionary() const {
+    return this == dictionary();
+}
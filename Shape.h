@@ -0,0 +1,94 @@
+#ifndef CLOX_SHAPE_H
+#define CLOX_SHAPE_H
+
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+class StringObj;
+class ClassObj;
+class Obj;
+
+/* Hidden class describing the field layout of an instance. Shapes form a tree rooted at the rootShape of the instance's
+ * heap (see Memory): adding a field to an instance moves it to the child of its shape for that field name, so every
+ * instance that got the same fields in the same order shares one shape, and a field lives at the same slot index in all
+ * of them. Field names are interned strings, so they are compared by pointer. Shapes are only freed with their heap, and
+ * its GC keeps their names alive as roots.
+ *
+ * An instance that gets more than MAX_SLOTS fields leaves the tree and moves to Shape::dictionary(), where its fields are
+ * kept in a hash map instead. It has no fields and no transitions, so every heap shares it. Inline caches never store the
+ * dictionary shape.
+ */
+class Shape {
+public:
+    static const int MAX_SLOTS = 64;
+
+    //an empty root shape
+    Shape() = default;
+
+    static Shape *dictionary();
+
+    //returns the slot of the field with this name, or -1 if instances of this shape do not have that field
+    int lookup(const StringObj *name) const;
+
+    //names of the fields of this shape, indexed by slot
+    std::vector<StringObj*> fieldNames() const;
+
+    //returns the shape of an instance of this shape after adding a field with this name, which is stored in slot slotCount
+    Shape *transition(StringObj *name);
+
+    //calls visit with the field name of every shape in the tree below this one
+    template<typename Visitor>
+    void forEachFieldName(Visitor visit) const {
+        for (auto &transition : transitions){
+            visit(transition.first);
+            transition.second->forEachFieldName(visit);
+        }
+    }
+
+    bool isDictionary() const;
+
+    int slotCount = 0;
+
+private:
+    Shape(Shape *parent, StringObj *name);
+
+    Shape *parent = nullptr;
+    StringObj *name = nullptr; //name of the field added by the transition from parent, stored at slot slotCount - 1
+    std::unordered_map<StringObj*, std::unique_ptr<Shape>> transitions;
+};
+
+/* Inline cache of a single property instruction. It remembers the shape of the last instance the instruction accessed
+ * and the slot the property was found at, so as long as the instruction keeps seeing instances of that shape the access
+ * is a pointer compare and an indexed load. For a store that added a field, transition is the shape the instance moved
+ * to and slot is the new field's slot.
+ */
+struct PropertyCache {
+    Shape *shape = nullptr;
+    Shape *transition = nullptr;
+    int slot = 0;
+};
+
+/* Polymorphic inline cache of an OP_INVOKE. Every entry remembers a class of the receivers the instruction called the
+ * method on and the method it found, so as long as the receivers are of one of up to ENTRIES classes the method is found
+ * by comparing pointers instead of hashing the name. The entry also keys on the receiver's shape, because a field with
+ * the method's name shadows the method and which fields an instance has only depends on its shape. Entries are filled in
+ * order and never replaced, a call site that sees more classes than that is megamorphic and looks the others up every
+ * time. The GC keeps the classes and methods of the entries alive.
+ */
+struct MethodCache {
+    static const int ENTRIES = 4;
+
+    struct Entry {
+        ClassObj *klass = nullptr;
+        Shape *shape = nullptr;
+        Obj *method = nullptr; //a FunctionObj or a ClosureObj
+    };
+
+    Entry entries[ENTRIES];
+};
+
+
+#endif //CLOX_SHAPE_H
@@ -0,0 +1,92 @@
+#include "StringTable.h"
+
+StringObj *StringTable::find(std::string_view chars, uint32_t hash) const {
+    if (entries.empty()){
+        return nullptr;
+    }
+
+    size_t mask = entries.size() - 1;
+    for (size_t index = hash & mask; entries[index] != nullptr; index = (index + 1) & mask){
+        StringObj *string = entries[index];
+        if (string->hash == hash && string->view() == chars){
+            return string;
+        }
+    }
+
+    return nullptr;
+}
+
+void StringTable::insert(StringObj *string) {
+    if ((count + 1) * 4 > entries.size() * 3){ //keep the load factor under 3/4
+        resize(entries.empty() ? 64 : entries.size() * 2);
+    }
+
+    insertWithoutGrowing(string);
+}
+
+void StringTable::remove(StringObj *string) {
+    size_t mask = entries.size() - 1;
+    for (size_t index = string->hash & mask; entries[index] != nullptr; index = (index + 1) & mask){
+        if (entries[index] == string){
+            removeAt(index);
+            return;
+        }
+    }
+}
+
+void StringTable::removeUnmarked() {
+    for (size_t index = 0; index < entries.size(); index++){
+        //removing an entry can move a later one into its place, which has to be checked too
+        while (entries[index] != nullptr && !entries[index]->marked){
+            removeAt(index);
+        }
+    }
+}
+
+/* Deletes without leaving a tombstone by moving later entries of the probe sequence back into the hole, as long as that
+ * does not put them before the entry they hash to.
+ */
+void StringTable::removeAt(size_t index) {
+    size_t mask = entries.size() - 1;
+    entries[index] = nullptr;
+    count--;
+
+    for (size_t next = (index + 1) & mask; entries[next] != nullptr; next = (next + 1) & mask){
+        size_t home = entries[next]->hash & mask;
+        bool homeIsInHole = index <= next ? (home <= index || home > next) : (home <= index && home > next);
+        if (homeIsInHole){
+            entries[index] = entries[next];
+            entries[next] = nullptr;
+            index = next;
+        }
+    }
+}
+
+void StringTable::clear() {
+    entries.clear();
+    count = 0;
+}
+
+void StringTable::resize(size_t capacity) {
+    std::vector<StringObj*> old;
+    old.swap(entries);
+    entries.assign(capacity, nullptr);
+    count = 0;
+
+    for (StringObj *string : old){
+        if (string != nullptr){
+            insertWithoutGrowing(string);
+        }
+    }
+}
+
+void StringTable::insertWithoutGrowing(StringObj *string) {
+    size_t mask = entries.size() - 1;
+    size_t index = string->hash & mask;
+    while (entries[index] != nullptr){
+        index = (index + 1) & mask;
+    }
+
+    entries[index] = string;
+    count++;
+}
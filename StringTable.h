@@ -0,0 +1,36 @@
+#ifndef CLOX_STRINGTABLE_H
+#define CLOX_STRINGTABLE_H
+
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "CLoxLiteral.h"
+
+/* Intern table holding every live StringObj. Memory::allocateHeapString looks strings up here before creating them, so
+ * each distinct string exists once. The table does not keep strings alive: the GC removes unmarked strings from it
+ * right before sweeping them, or one by one while sweeping them incrementally. Open addressing with linear probing, keyed by the hash cached in every StringObj.
+ */
+class StringTable {
+public:
+    //returns the interned string with these characters, or nullptr if there is none
+    StringObj *find(std::string_view chars, uint32_t hash) const;
+    void insert(StringObj *string);
+
+    //string must be in the table
+    void remove(StringObj *string);
+    //drops every string that was not marked by the current GC cycle
+    void removeUnmarked();
+    void clear();
+
+private:
+    std::vector<StringObj*> entries; //nullptr marks an empty entry. The size is always 0 or a power of 2
+    size_t count = 0;
+
+    void resize(size_t capacity);
+    void insertWithoutGrowing(StringObj *string);
+    void removeAt(size_t index);
+};
+
+
+#endif //CLOX_STRINGTABLE_H
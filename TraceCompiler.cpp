@@ -0,0 +1,593 @@
+#include "TraceCompiler.h"
+
+CompiledTrace::CompiledTrace(std::unique_ptr<ExecutableMemory> memory, std::vector<TraceExit> exits) :
+    memory(std::move(memory)), exits(std::move(exits)) {}
+
+const TraceExit &CompiledTrace::run(CLoxLiteral *frame, CLoxLiteral *globals) const {
+    auto entry = reinterpret_cast<Entry>(const_cast<void*>(memory->entry()));
+    return exits[entry(frame, globals)];
+}
+
+TraceCompiler::TraceCompiler(const Trace &trace, const Chunk *chunk) : trace(trace), chunk(chunk) {}
+
+/* The code starts by loading the variables, followed by the loop body and a jump back to the start of the body, and the
+ * exit stubs after that. Every iteration starts with the variables in their registers and every other value in its
+ * stack slot.
+ */
+std::unique_ptr<CompiledTrace> TraceCompiler::compile() {
+    findVariables();
+    emitEntry();
+    int loopStart = assembler.size();
+
+    for (size_t i = 0; i < trace.steps.size(); i++){
+        if (!compileStep(i)){
+            return nullptr;
+        }
+    }
+
+    if (stack.size() != static_cast<size_t>(trace.entryDepth)){
+        return nullptr;
+    }
+    for (size_t position = 0; position < stack.size(); position++){
+        if (isVariableHome(position)){
+            const Value &value = stack[position];
+            if (value.kind != Value::Kind::VARIABLE || variables[value.index].isGlobal || variables[value.index].index != position){
+                return nullptr;
+            }
+        } else {
+            materialize(position);
+            stack[position].isNumber = false; //the start of the body does not know the types of the values it finds
+        }
+    }
+    assembler.jmpTo(loopStart);
+    emitExitStubs();
+
+    std::unique_ptr<ExecutableMemory> memory = ExecutableMemory::create(assembler.code());
+    if (memory == nullptr){
+        return nullptr;
+    }
+    return std::make_unique<CompiledTrace>(std::move(memory), exits);
+}
+
+//the first MAX_VARIABLES globals and locals of the enclosing code the trace uses, in order of first use
+void TraceCompiler::findVariables() {
+    for (const TraceStep &step : trace.steps){
+        bool isGlobal = step.opCode == OpCode::OP_GET_GLOBAL || step.opCode == OpCode::OP_SET_GLOBAL;
+        bool isLocal = step.opCode == OpCode::OP_GET_LOCAL || step.opCode == OpCode::OP_SET_LOCAL;
+        if (!(isGlobal || (isLocal && step.operand < static_cast<uint32_t>(trace.entryDepth)))){
+            continue;
+        }
+
+        if (findVariable(isGlobal, step.operand) == -1 && variables.size() < MAX_VARIABLES){
+            Variable variable;
+            variable.isGlobal = isGlobal;
+            variable.index = step.operand;
+            variable.readFirst = step.opCode == OpCode::OP_GET_GLOBAL || step.opCode == OpCode::OP_GET_LOCAL;
+            variables.push_back(variable);
+        }
+    }
+}
+
+//Loads every variable into its register. A variable that is written before it is read does not have to be a number,
+//it is only loaded so an exit can write it back unchanged.
+void TraceCompiler::emitEntry() {
+    assembler.movImmediate(NAN_MASK, CLoxLiteral::QUIET_NAN);
+    stack.assign(trace.entryDepth, Value());
+    int entryExit = addExit(trace.header, stack);
+    pendingExits[entryExit].writeBackVariables = false;
+
+    for (size_t i = 0; i < variables.size(); i++){
+        const Variable &variable = variables[i];
+        Register base = variable.isGlobal ? GLOBALS : FRAME;
+        if (variable.readFirst){
+            assembler.movLoad(X64Assembler::RCX, base, slotDisplacement(variable.index));
+            assembler.andRegister(X64Assembler::RCX, NAN_MASK);
+            assembler.cmpRegister(X64Assembler::RCX, NAN_MASK);
+            jumpToExit(X64Assembler::EQUAL, entryExit);
+        }
+        assembler.movLoad(X64Assembler::RAX, base, slotDisplacement(variable.index));
+        assembler.movqToXmm(variableRegister(i), X64Assembler::RAX);
+
+        if (!variable.isGlobal){
+            Value value;
+            value.kind = Value::Kind::VARIABLE;
+            value.index = static_cast<uint32_t>(i);
+            value.isNumber = true;
+            stack[variable.index] = value;
+        }
+    }
+}
+
+//index is advanced past any step that was compiled together with this one
+bool TraceCompiler::compileStep(size_t &index) {
+    const TraceStep &step = trace.steps[index];
+    if (step.startsInstruction){
+        instructionStack = stack;
+        instructionHadEffects = false;
+    }
+
+    switch (step.opCode) {
+        case OpCode::OP_CONSTANT:
+            stack.push_back(constant(chunk->constants[step.operand]));
+            return true;
+        case OpCode::OP_GET_LOCAL:
+            return compileGetLocal(step);
+        case OpCode::OP_GET_GLOBAL: {
+            Value value;
+            value.isNumber = true;
+            int variable = findVariable(true, step.operand);
+            if (variable != -1){
+                value.kind = Value::Kind::VARIABLE;
+                value.index = static_cast<uint32_t>(variable);
+            } else {
+                if (numberGlobals.count(step.operand) == 0){
+                    if (!guardNumber(GLOBALS, slotDisplacement(step.operand), step)){
+                        return false;
+                    }
+                    numberGlobals.insert(step.operand);
+                }
+                value.kind = Value::Kind::GLOBAL;
+                value.index = step.operand;
+            }
+            stack.push_back(value);
+            return true;
+        }
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_SET_GLOBAL:
+            return compileSetVariable(step);
+        case OpCode::OP_POP:
+            if (isVariableHome(stack.size() - 1)){
+                return false;
+            }
+            release(stack.back());
+            stack.pop_back();
+            return true;
+        case OpCode::OP_NEGATE:
+            return compileNegate();
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+            return compileArithmetic(step);
+        case OpCode::OP_LESS:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_EQUAL:
+            //comparisons are only supported as the condition of a branch, which is compiled with them
+            if (index + 1 >= trace.steps.size() || trace.steps[index + 1].opCode != OpCode::OP_JUMP_IF_FALSE){
+                return false;
+            }
+            index++;
+            return compileComparison(step, trace.steps[index]);
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+            return true; //the trace simply continues at the target
+        default:
+            return false;
+    }
+}
+
+bool TraceCompiler::compileGetLocal(const TraceStep &step) {
+    int variable = findVariable(false, step.operand);
+    if (variable != -1){
+        stack.push_back(stack[step.operand]);
+        return true;
+    }
+
+    //a local declared inside the loop body, or one that did not get a register
+    if (stack[step.operand].kind == Value::Kind::CONSTANT){
+        stack.push_back(stack[step.operand]);
+        return true;
+    }
+
+    materialize(step.operand);
+    if (!stack[step.operand].isNumber){
+        if (!guardNumber(FRAME, slotDisplacement(step.operand), step)){
+            return false;
+        }
+        stack[step.operand].isNumber = true; //the slot is only written by this trace from now on, which tracks its type
+    }
+
+    Value value;
+    value.kind = Value::Kind::LOCAL;
+    value.index = step.operand;
+    value.isNumber = true;
+    stack.push_back(value);
+    return true;
+}
+
+//the assigned value is the result of the assignment, so it stays on the stack
+bool TraceCompiler::compileSetVariable(const TraceStep &step) {
+    bool isGlobal = step.opCode == OpCode::OP_SET_GLOBAL;
+    size_t position = stack.size() - 1;
+    int variable = findVariable(isGlobal, step.operand);
+    instructionHadEffects = true;
+
+    if (variable != -1){
+        const Value &top = stack.back();
+        if (top.kind == Value::Kind::VARIABLE && top.index == static_cast<uint32_t>(variable)){
+            return true;
+        }
+        if (!top.isNumber){
+            return false;
+        }
+        materializeReferencesTo(Value::Kind::VARIABLE, static_cast<uint32_t>(variable));
+        loadNumber(variableRegister(variable), stack.back(), position);
+        return true;
+    }
+
+    if (isGlobal){
+        materializeReferencesTo(Value::Kind::GLOBAL, step.operand);
+        storeValue(GLOBALS, slotDisplacement(step.operand), stack.back(), position);
+        if (stack.back().isNumber){
+            numberGlobals.insert(step.operand);
+        } else {
+            numberGlobals.erase(step.operand);
+        }
+        return true;
+    }
+
+    materialize(step.operand);
+    materializeReferencesTo(Value::Kind::LOCAL, step.operand);
+    if (step.operand != position){
+        bool isNumber = stack.back().isNumber;
+        storeValue(FRAME, slotDisplacement(step.operand), stack.back(), position);
+        if (!writeSlot(step.operand)){
+            return false;
+        }
+        stack[step.operand].isNumber = isNumber;
+    }
+    return true;
+}
+
+bool TraceCompiler::compileArithmetic(const TraceStep &step) {
+    size_t rightPosition = stack.size() - 1;
+    size_t leftPosition = stack.size() - 2;
+    const Value &left = stack[leftPosition];
+    const Value &right = stack[rightPosition];
+    if (!left.isNumber || !right.isNumber || isVariableHome(leftPosition)){
+        return false;
+    }
+
+    Xmm leftRegister = numberRegister(left, leftPosition, X64Assembler::XMM0);
+    if (leftRegister != X64Assembler::XMM0){
+        assembler.movapd(X64Assembler::XMM0, leftRegister);
+    }
+    Xmm rightRegister = numberRegister(right, rightPosition, X64Assembler::XMM1);
+
+    switch (step.opCode) {
+        case OpCode::OP_ADD:
+            assembler.addsd(X64Assembler::XMM0, rightRegister);
+            break;
+        case OpCode::OP_SUBTRACT:
+            assembler.subsd(X64Assembler::XMM0, rightRegister);
+            break;
+        case OpCode::OP_MULTIPLY:
+            assembler.mulsd(X64Assembler::XMM0, rightRegister);
+            break;
+        default: {
+            //the interpreter reports the division by zero. ucomisd also sets ZF for a NaN divisor, which just leaves
+            //the trace without need
+            int exit;
+            if (!addInstructionExit(step, exit)){
+                return false;
+            }
+            assembler.xorpd(X64Assembler::XMM2, X64Assembler::XMM2);
+            assembler.ucomisd(rightRegister, X64Assembler::XMM2);
+            jumpToExit(X64Assembler::EQUAL, exit);
+            assembler.divsd(X64Assembler::XMM0, rightRegister);
+        }
+    }
+
+    release(stack.back());
+    stack.pop_back();
+    release(stack.back());
+    stack.pop_back();
+    return pushResult(X64Assembler::XMM0);
+}
+
+/* The comparison result is never computed: the branch is a guard that the result is the one seen while recording, so
+ * after it the condition left on the stack is a known constant. If the guard fails, the interpreter continues at the
+ * other side of the branch with the opposite condition on the stack.
+ */
+bool TraceCompiler::compileComparison(const TraceStep &step, const TraceStep &branch) {
+    size_t rightPosition = stack.size() - 1;
+    size_t leftPosition = stack.size() - 2;
+    if (!stack[leftPosition].isNumber || !stack[rightPosition].isNumber || isVariableHome(leftPosition)){
+        return false;
+    }
+
+    Xmm left = numberRegister(stack[leftPosition], leftPosition, X64Assembler::XMM0);
+    Xmm right = numberRegister(stack[rightPosition], rightPosition, X64Assembler::XMM1);
+    release(stack.back());
+    stack.pop_back();
+    release(stack.back());
+    stack.pop_back();
+
+    bool recordedResult = !branch.branchTaken;
+    stack.push_back(constant(CLoxLiteral(!recordedResult)));
+    int exit = addExit(branch.exitOffset, stack);
+    stack.back() = constant(CLoxLiteral(recordedResult));
+
+    //ucomisd sets ZF, PF and CF for unordered operands, so "above" is false whenever a NaN is involved, like in C++
+    if (step.opCode == OpCode::OP_LESS || step.opCode == OpCode::OP_GREATER){
+        if (step.opCode == OpCode::OP_LESS){
+            assembler.ucomisd(right, left); //a < b is b > a
+        } else {
+            assembler.ucomisd(left, right);
+        }
+        jumpToExit(recordedResult ? X64Assembler::BELOW_OR_EQUAL : X64Assembler::ABOVE, exit);
+    } else {
+        //equal is ZF set without PF
+        assembler.ucomisd(left, right);
+        if (recordedResult){
+            jumpToExit(X64Assembler::NOT_EQUAL, exit);
+            jumpToExit(X64Assembler::PARITY, exit);
+        } else {
+            int unordered = assembler.jcc(X64Assembler::PARITY);
+            jumpToExit(X64Assembler::EQUAL, exit);
+            assembler.bind(unordered, assembler.size());
+        }
+    }
+    return true;
+}
+
+bool TraceCompiler::compileNegate() {
+    size_t position = stack.size() - 1;
+    if (!stack.back().isNumber || isVariableHome(position)){
+        return false;
+    }
+
+    Xmm value = numberRegister(stack.back(), position, X64Assembler::XMM0);
+    if (value != X64Assembler::XMM0){
+        assembler.movapd(X64Assembler::XMM0, value);
+    }
+    assembler.movImmediate(X64Assembler::RAX, CLoxLiteral::SIGN_BIT);
+    assembler.movqToXmm(X64Assembler::XMM1, X64Assembler::RAX);
+    assembler.xorpd(X64Assembler::XMM0, X64Assembler::XMM1);
+
+    release(stack.back());
+    stack.pop_back();
+    return pushResult(X64Assembler::XMM0);
+}
+
+bool TraceCompiler::guardNumber(Register base, int32_t displacement, const TraceStep &step) {
+    int exit;
+    if (!addInstructionExit(step, exit)){
+        return false;
+    }
+    assembler.movLoad(X64Assembler::RAX, base, displacement);
+    assembler.andRegister(X64Assembler::RAX, NAN_MASK);
+    assembler.cmpRegister(X64Assembler::RAX, NAN_MASK);
+    jumpToExit(X64Assembler::EQUAL, exit);
+    return true;
+}
+
+bool TraceCompiler::addInstructionExit(const TraceStep &step, int &exit) {
+    if (instructionHadEffects){
+        return false;
+    }
+    exit = addExit(step.offset, instructionStack);
+    return true;
+}
+
+int TraceCompiler::addExit(int offset, const std::vector<Value> &exitStack) {
+    TraceExit exit;
+    exit.offset = offset;
+    exit.stackDepth = static_cast<int>(exitStack.size());
+    exits.push_back(exit);
+
+    PendingExit pending;
+    pending.stack = exitStack;
+    pendingExits.push_back(pending);
+    return static_cast<int>(exits.size() - 1);
+}
+
+void TraceCompiler::jumpToExit(X64Assembler::Condition condition, int exit) {
+    pendingExits[exit].jumps.push_back(assembler.jcc(condition));
+}
+
+//every stub writes back the variables and the stack slots that are not up to date, then returns its index
+void TraceCompiler::emitExitStubs() {
+    for (size_t i = 0; i < pendingExits.size(); i++){
+        for (int jump : pendingExits[i].jumps){
+            assembler.bind(jump, assembler.size());
+        }
+
+        if (pendingExits[i].writeBackVariables){
+            for (size_t variable = 0; variable < variables.size(); variable++){
+                Register base = variables[variable].isGlobal ? GLOBALS : FRAME;
+                assembler.movsdStore(base, slotDisplacement(variables[variable].index), variableRegister(variable));
+            }
+        }
+
+        const std::vector<Value> &exitStack = pendingExits[i].stack;
+        for (size_t position = 0; position < exitStack.size(); position++){
+            if (exitStack[position].kind != Value::Kind::STACK && !isVariableHome(position)){
+                storeValue(FRAME, slotDisplacement(position), exitStack[position], position);
+            }
+        }
+        assembler.movEax(static_cast<uint32_t>(i));
+        assembler.ret();
+    }
+}
+
+int TraceCompiler::findVariable(bool isGlobal, uint32_t index) const {
+    for (size_t i = 0; i < variables.size(); i++){
+        if (variables[i].isGlobal == isGlobal && variables[i].index == index){
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+bool TraceCompiler::isVariableHome(size_t position) const {
+    return findVariable(false, static_cast<uint32_t>(position)) != -1;
+}
+
+X64Assembler::Xmm TraceCompiler::variableRegister(uint32_t variable) const {
+    return static_cast<Xmm>(FIRST_VARIABLE + variable);
+}
+
+X64Assembler::Xmm TraceCompiler::temporaryRegister(uint32_t temporary) const {
+    return static_cast<Xmm>(FIRST_TEMPORARY + temporary);
+}
+
+int TraceCompiler::allocateTemporary() {
+    for (int i = 0; i < TEMPORARY_COUNT; i++){
+        if (!temporaryInUse[i]){
+            temporaryInUse[i] = true;
+            //exits at the start of the instruction may still need the value the register held then
+            for (const Value &value : instructionStack){
+                if (value.kind == Value::Kind::REGISTER && value.index == static_cast<uint32_t>(i)){
+                    instructionHadEffects = true;
+                }
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+void TraceCompiler::release(const Value &value) {
+    if (value.kind == Value::Kind::REGISTER){
+        temporaryInUse[value.index] = false;
+    }
+}
+
+X64Assembler::Xmm TraceCompiler::numberRegister(const Value &value, size_t position, Xmm scratch) {
+    switch (value.kind) {
+        case Value::Kind::REGISTER:
+            return temporaryRegister(value.index);
+        case Value::Kind::VARIABLE:
+            return variableRegister(value.index);
+        default:
+            loadNumber(scratch, value, position);
+            return scratch;
+    }
+}
+
+void TraceCompiler::loadNumber(Xmm destination, const Value &value, size_t position) {
+    switch (value.kind) {
+        case Value::Kind::STACK:
+            assembler.movsdLoad(destination, FRAME, slotDisplacement(position));
+            break;
+        case Value::Kind::LOCAL:
+            assembler.movsdLoad(destination, FRAME, slotDisplacement(value.index));
+            break;
+        case Value::Kind::GLOBAL:
+            assembler.movsdLoad(destination, GLOBALS, slotDisplacement(value.index));
+            break;
+        case Value::Kind::VARIABLE:
+        case Value::Kind::REGISTER: {
+            Xmm source = numberRegister(value, position, destination);
+            if (source != destination){
+                assembler.movapd(destination, source);
+            }
+            break;
+        }
+        case Value::Kind::CONSTANT:
+            assembler.movImmediate(X64Assembler::RAX, value.bits);
+            assembler.movqToXmm(destination, X64Assembler::RAX);
+            break;
+    }
+}
+
+void TraceCompiler::loadBits(Register destination, const Value &value, size_t position) {
+    switch (value.kind) {
+        case Value::Kind::STACK:
+            assembler.movLoad(destination, FRAME, slotDisplacement(position));
+            break;
+        case Value::Kind::LOCAL:
+            assembler.movLoad(destination, FRAME, slotDisplacement(value.index));
+            break;
+        case Value::Kind::GLOBAL:
+            assembler.movLoad(destination, GLOBALS, slotDisplacement(value.index));
+            break;
+        case Value::Kind::VARIABLE:
+        case Value::Kind::REGISTER:
+            assembler.movqFromXmm(destination, numberRegister(value, position, X64Assembler::XMM0));
+            break;
+        case Value::Kind::CONSTANT:
+            assembler.movImmediate(destination, value.bits);
+            break;
+    }
+}
+
+void TraceCompiler::storeValue(Register base, int32_t displacement, const Value &value, size_t position) {
+    if (value.kind == Value::Kind::VARIABLE || value.kind == Value::Kind::REGISTER){
+        assembler.movsdStore(base, displacement, numberRegister(value, position, X64Assembler::XMM0));
+    } else {
+        loadBits(X64Assembler::RAX, value, position);
+        assembler.movStore(base, displacement, X64Assembler::RAX);
+    }
+}
+
+//writes the value of a stack slot to the slot, for code that reads the slot from memory
+void TraceCompiler::materialize(size_t position) {
+    Value &value = stack[position];
+    if (value.kind == Value::Kind::STACK || isVariableHome(position)){
+        return;
+    }
+
+    storeValue(FRAME, slotDisplacement(position), value, position);
+    release(value);
+    value.kind = Value::Kind::STACK;
+}
+
+//called before a variable is written, so values read from it earlier keep their old value
+void TraceCompiler::materializeReferencesTo(Value::Kind kind, uint32_t index) {
+    for (size_t position = 0; position < stack.size(); position++){
+        if (stack[position].kind == kind && stack[position].index == index){
+            materialize(position);
+        }
+    }
+}
+
+bool TraceCompiler::pushResult(Xmm result) {
+    size_t position = stack.size();
+    if (isVariableHome(position)){
+        return false;
+    }
+
+    Value value;
+    value.isNumber = true;
+    int temporary = allocateTemporary();
+    if (temporary != -1){
+        assembler.movapd(temporaryRegister(temporary), result);
+        value.kind = Value::Kind::REGISTER;
+        value.index = static_cast<uint32_t>(temporary);
+    } else {
+        assembler.movsdStore(FRAME, slotDisplacement(position), result);
+        if (position < instructionStack.size()){
+            instructionHadEffects = true;
+        }
+    }
+    stack.push_back(value);
+    return true;
+}
+
+//called after code was emitted that stored a new value in the stack slot at position
+bool TraceCompiler::writeSlot(size_t position) {
+    if (isVariableHome(position)){
+        return false;
+    }
+
+    release(stack[position]);
+    stack[position] = Value();
+    if (position < instructionStack.size()){
+        instructionHadEffects = true;
+    }
+    return true;
+}
+
+int32_t TraceCompiler::slotDisplacement(uint32_t slot) {
+    return static_cast<int32_t>(slot * sizeof(CLoxLiteral));
+}
+
+TraceCompiler::Value TraceCompiler::constant(const CLoxLiteral &value) {
+    Value result;
+    result.kind = Value::Kind::CONSTANT;
+    result.bits = value.getBits();
+    result.isNumber = value.isNumber();
+    return result;
+}
@@ -0,0 +1,150 @@
+#ifndef CLOX_TRACECOMPILER_H
+#define CLOX_TRACECOMPILER_H
+
+
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include "TraceRecorder.h"
+#include "X64Assembler.h"
+#include "ExecutableMemory.h"
+
+//where the interpreter picks up when a compiled trace stops, and how many values the frame has on the stack at that point
+struct TraceExit {
+    int offset = 0;
+    int stackDepth = 0;
+};
+
+class CompiledTrace {
+public:
+    CompiledTrace(std::unique_ptr<ExecutableMemory> memory, std::vector<TraceExit> exits);
+
+    //Runs the loop until one of its guards fails. The stack and the globals are left exactly as the interpreter would
+    //have left them at the returned exit.
+    const TraceExit &run(CLoxLiteral *frame, CLoxLiteral *globals) const;
+
+private:
+    using Entry = uint32_t (*)(CLoxLiteral *frame, CLoxLiteral *globals);
+
+    std::unique_ptr<ExecutableMemory> memory;
+    std::vector<TraceExit> exits;
+};
+
+/* Compiles a recorded trace to x86-64 code that runs the loop until something differs from what the recorder saw. The
+ * code works on the values directly, so it needs NaN boxing: a number is stored as the double itself.
+ *
+ * Every point where the trace could go a different way than it did while recording gets a guard: loads of variables check
+ * that the value is still a number, branches check that the condition still has the recorded outcome, and divisions
+ * check for a zero divisor. A failing guard jumps to an exit stub that writes back the stack and the variables the
+ * interpreter expects and returns the index of the exit, so the interpreter can continue as if it had run every
+ * iteration itself.
+ *
+ * The variables the loop uses (globals and the locals that already exist at the loop header) live in xmm registers
+ * while the trace runs. They are loaded, and checked to be numbers, once when the trace is entered, and only written
+ * back when it exits. Inside the trace the operand stack is only simulated: temporaries stay in registers, constants
+ * and values just read from a variable are not written anywhere unless something needs them in their stack slot, and
+ * comparisons are fused with the branch that consumes them.
+ */
+class TraceCompiler {
+public:
+    TraceCompiler(const Trace &trace, const Chunk *chunk);
+
+    //returns nullptr if the trace uses something the compiler cannot handle
+    std::unique_ptr<CompiledTrace> compile();
+
+private:
+    using Register = X64Assembler::Register;
+    using Xmm = X64Assembler::Xmm;
+
+    static const Register FRAME = X64Assembler::RDI;    //first stack slot of the frame, first argument
+    static const Register GLOBALS = X64Assembler::RSI;  //values of the global variables, second argument
+    static const Register NAN_MASK = X64Assembler::R8;  //CLoxLiteral::QUIET_NAN, for type checks
+
+    //xmm0 to xmm2 are scratch registers, temporaries get xmm3 to xmm7 and variables xmm8 to xmm15
+    static const int FIRST_TEMPORARY = X64Assembler::XMM3;
+    static const int TEMPORARY_COUNT = 5;
+    static const int FIRST_VARIABLE = X64Assembler::XMM8;
+    static const int MAX_VARIABLES = 8;
+
+    struct Variable {
+        bool isGlobal = false;
+        uint32_t index = 0; //local or global slot
+        bool readFirst = false; //read before it is written in the trace, so it has to be checked on entry
+    };
+
+    //where the value of a stack slot currently is
+    struct Value {
+        enum class Kind {
+            STACK,      //in the stack slot itself
+            LOCAL,      //same as the local slot index, which is not a variable, not written to its stack slot yet
+            GLOBAL,     //same as the global slot index, which is not a variable, not written to its stack slot yet
+            VARIABLE,   //same as variables[index], whose register holds it
+            REGISTER,   //in the temporary register index
+            CONSTANT    //the value bits, not written to its stack slot yet
+        };
+
+        Kind kind = Kind::STACK;
+        uint32_t index = 0;
+        uint64_t bits = 0;
+        bool isNumber = false; //known to be a number, so it can be used in arithmetic without checking
+    };
+
+    struct PendingExit {
+        std::vector<int> jumps; //every jump to the exit, bound to the exit stub once it is emitted
+        std::vector<Value> stack;
+        bool writeBackVariables = true; //false for the checks on entry, which run before the variables are loaded
+    };
+
+    const Trace &trace;
+    const Chunk *chunk;
+    X64Assembler assembler;
+
+    std::vector<Variable> variables;
+    std::vector<Value> stack;
+    std::vector<Value> instructionStack; //stack at the start of the instruction being compiled
+    bool instructionHadEffects = false; //whether the instruction changed a variable, a register or a slot of instructionStack
+    std::unordered_set<uint32_t> numberGlobals; //globals that are not variables and are known to hold a number
+    bool temporaryInUse[TEMPORARY_COUNT] = {};
+
+    std::vector<TraceExit> exits;
+    std::vector<PendingExit> pendingExits;
+
+    void findVariables();
+    void emitEntry();
+    bool compileStep(size_t &index);
+    bool compileGetLocal(const TraceStep &step);
+    bool compileSetVariable(const TraceStep &step);
+    bool compileArithmetic(const TraceStep &step);
+    bool compileComparison(const TraceStep &step, const TraceStep &branch);
+    bool compileNegate();
+    bool guardNumber(Register base, int32_t displacement, const TraceStep &step);
+
+    //exit to the interpreter at the start of the instruction being compiled. Fails if the instruction already had effects
+    bool addInstructionExit(const TraceStep &step, int &exit);
+    int addExit(int offset, const std::vector<Value> &exitStack);
+    void jumpToExit(X64Assembler::Condition condition, int exit);
+    void emitExitStubs();
+
+    int findVariable(bool isGlobal, uint32_t index) const;
+    bool isVariableHome(size_t position) const; //whether the stack slot at position is a local that is a variable
+    Xmm variableRegister(uint32_t variable) const;
+    Xmm temporaryRegister(uint32_t temporary) const;
+    int allocateTemporary(); //returns -1 if every temporary register is taken
+    void release(const Value &value);
+
+    //returns the register holding value, loading it into scratch if it is not in one
+    Xmm numberRegister(const Value &value, size_t position, Xmm scratch);
+    void loadNumber(Xmm destination, const Value &value, size_t position);
+    void loadBits(Register destination, const Value &value, size_t position);
+    void storeValue(Register base, int32_t displacement, const Value &value, size_t position);
+    void materialize(size_t position);
+    void materializeReferencesTo(Value::Kind kind, uint32_t index);
+    bool pushResult(Xmm result); //pushes a number computed into result, which must be a scratch register
+    bool writeSlot(size_t position);
+
+    static int32_t slotDisplacement(uint32_t slot);
+    static Value constant(const CLoxLiteral &value);
+};
+
+
+#endif //CLOX_TRACECOMPILER_H
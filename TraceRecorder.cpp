@@ -0,0 +1,172 @@
+#include "TraceRecorder.h"
+
+TraceRecorder::TraceRecorder(const Chunk *chunk, CLoxLiteral *frame, CLoxLiteral *&stackTop, CLoxLiteral *globals) :
+    chunk(chunk), frame(frame), stackTop(stackTop), globals(globals) {}
+
+bool TraceRecorder::record(int header) {
+    recorded = Trace();
+    recorded.header = header;
+    recorded.entryDepth = static_cast<int>(stackTop - frame);
+    offset = header;
+
+    do {
+        if (recorded.steps.size() >= static_cast<size_t>(MAX_TRACE_LENGTH) || !recordInstruction()){
+            return false;
+        }
+    } while (offset != header);
+
+    return true;
+}
+
+int TraceRecorder::resumeOffset() const {
+    return offset;
+}
+
+const Trace &TraceRecorder::trace() const {
+    return recorded;
+}
+
+//An instruction is recorded as a whole or not at all. If one of its components cannot be recorded, the effects of the
+//components before it are undone so the interpreter can execute the instruction itself.
+bool TraceRecorder::recordInstruction() {
+    auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+    int next = offset + Chunk::instructionLength(opCode);
+    int nextOffset = next;
+    int operandOffset = offset + 1;
+    size_t stepCount = recorded.steps.size();
+    CLoxLiteral *instructionStackTop = stackTop;
+    undoLog.clear();
+
+    for (OpCode component : Chunk::componentOpCodes(opCode)){
+        TraceStep step;
+        step.offset = offset;
+        step.opCode = Chunk::narrowForm(component);
+        step.operand = chunk->readOperand(operandOffset, component);
+        step.startsInstruction = recorded.steps.size() == stepCount;
+
+        if (!recordStep(step, next, nextOffset)){
+            for (auto it = undoLog.rbegin(); it != undoLog.rend(); it++){
+                *it->first = it->second;
+            }
+            stackTop = instructionStackTop;
+            recorded.steps.resize(stepCount);
+            return false;
+        }
+
+        recorded.steps.push_back(step);
+        operandOffset += Chunk::operandWidth(component);
+    }
+
+    offset = nextOffset;
+    return true;
+}
+
+//Executes one component like VM::execute would, returning false if the trace compiler cannot handle it. Cases that
+//would raise a runtime error are left to the interpreter too.
+bool TraceRecorder::recordStep(TraceStep &step, int next, int &nextOffset) {
+    switch (step.opCode) {
+        case OpCode::OP_CONSTANT: {
+            const CLoxLiteral &constant = chunk->constants[step.operand];
+            if (!constant.isNumber()){
+                return false;
+            }
+            push(constant);
+            step.observedType = LiteralType::NUMBER;
+            break;
+        }
+        case OpCode::OP_GET_LOCAL:
+            if (!frame[step.operand].isNumber()){
+                return false;
+            }
+            push(frame[step.operand]);
+            step.observedType = LiteralType::NUMBER;
+            break;
+        case OpCode::OP_SET_LOCAL:
+            write(&frame[step.operand], stackTop[-1]);
+            break;
+        case OpCode::OP_GET_GLOBAL:
+            if (!globals[step.operand].isNumber()){ //also rejects undefined globals
+                return false;
+            }
+            push(globals[step.operand]);
+            step.observedType = LiteralType::NUMBER;
+            break;
+        case OpCode::OP_SET_GLOBAL:
+            if (globals[step.operand].isUndefined()){
+                return false;
+            }
+            write(&globals[step.operand], stackTop[-1]);
+            break;
+        case OpCode::OP_POP:
+            stackTop--;
+            break;
+        case OpCode::OP_NEGATE:
+            if (!stackTop[-1].isNumber()){
+                return false;
+            }
+            write(&stackTop[-1], CLoxLiteral(-stackTop[-1].getNumber()));
+            step.observedType = LiteralType::NUMBER;
+            break;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_LESS:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_EQUAL: {
+            if (!stackTop[-2].isNumber() || !stackTop[-1].isNumber()){
+                return false;
+            }
+            double a = stackTop[-2].getNumber();
+            double b = stackTop[-1].getNumber();
+            CLoxLiteral result;
+            switch (step.opCode) {
+                case OpCode::OP_ADD: result = CLoxLiteral(a + b); break;
+                case OpCode::OP_SUBTRACT: result = CLoxLiteral(a - b); break;
+                case OpCode::OP_MULTIPLY: result = CLoxLiteral(a * b); break;
+                case OpCode::OP_DIVIDE:
+                    if (b == 0.0){
+                        return false;
+                    }
+                    result = CLoxLiteral(a / b);
+                    break;
+                case OpCode::OP_LESS: result = CLoxLiteral(a < b); break;
+                case OpCode::OP_GREATER: result = CLoxLiteral(a > b); break;
+                default: result = CLoxLiteral(a == b);
+            }
+            stackTop--;
+            write(&stackTop[-1], result);
+            step.observedType = result.getType();
+            break;
+        }
+        case OpCode::OP_JUMP_IF_FALSE: {
+            if (!stackTop[-1].isBoolean()){
+                return false;
+            }
+            int target = chunk->jumpTarget(step.offset);
+            step.branchTaken = !stackTop[-1].getBoolean();
+            step.exitOffset = step.branchTaken ? next : target;
+            nextOffset = step.branchTaken ? target : next;
+            break;
+        }
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+            step.branchTaken = true;
+            nextOffset = chunk->jumpTarget(step.offset);
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+void TraceRecorder::write(CLoxLiteral *slot, const CLoxLiteral &value) {
+    undoLog.emplace_back(slot, *slot);
+    *slot = value;
+}
+
+void TraceRecorder::push(const CLoxLiteral &value) {
+    write(stackTop, value);
+    stackTop++;
+}
@@ -0,0 +1,66 @@
+#ifndef CLOX_TRACERECORDER_H
+#define CLOX_TRACERECORDER_H
+
+
+#include <vector>
+#include <utility>
+#include "Chunk.h"
+#include "CLoxLiteral.h"
+
+//One instruction of a recorded trace. Superinstructions are recorded as their components, which all share the offset of
+//the instruction they belong to
+struct TraceStep {
+    int offset = 0;
+    OpCode opCode = OpCode::OP_COUNT; //always the narrow form
+    uint32_t operand = 0;
+    bool startsInstruction = false; //whether this is the first component of its instruction
+    LiteralType observedType = LiteralType::NIL; //type of the value the step pushed, if it pushed one
+    bool branchTaken = false; //jumps only: whether execution followed the jump when the trace was recorded
+    int exitOffset = 0; //OP_JUMP_IF_FALSE only: where execution continues when the branch goes the other way
+};
+
+struct Trace {
+    int header = 0; //offset of the loop header the trace starts and ends at
+    int entryDepth = 0; //stack depth of the frame at the loop header
+    std::vector<TraceStep> steps;
+};
+
+/* Records one iteration of a hot loop for the TracingJit. The recorder executes the iteration itself, on the real stack
+ * and globals of the VM, so it can see the values every instruction works with and which way every branch goes. It only
+ * understands the instructions the TraceCompiler can compile, and only with number operands: anything else aborts the
+ * recording before the instruction has any effect, so the interpreter can pick up at that instruction as if nothing
+ * happened.
+ */
+class TraceRecorder {
+public:
+    static const int MAX_TRACE_LENGTH = 500;
+
+    //frame is the first stack slot of the frame running the chunk, globals the values of the global variables
+    TraceRecorder(const Chunk *chunk, CLoxLiteral *frame, CLoxLiteral *&stackTop, CLoxLiteral *globals);
+
+    //Runs the loop from header until it is back at header and returns whether the whole iteration could be recorded.
+    //Either way, resumeOffset is where the interpreter has to continue.
+    bool record(int header);
+
+    int resumeOffset() const;
+    const Trace &trace() const;
+
+private:
+    const Chunk *chunk;
+    CLoxLiteral *frame;
+    CLoxLiteral *&stackTop;
+    CLoxLiteral *globals;
+
+    Trace recorded;
+    int offset = 0;
+    std::vector<std::pair<CLoxLiteral*, CLoxLiteral>> undoLog; //old values of everything written by the current instruction
+
+    bool recordInstruction();
+    bool recordStep(TraceStep &step, int next, int &nextOffset);
+
+    void write(CLoxLiteral *slot, const CLoxLiteral &value);
+    void push(const CLoxLiteral &value);
+};
+
+
+#endif //CLOX_TRACERECORDER_H
@@ -0,0 +1,31 @@
+#include <limits>
+#include "TracingJit.h"
+
+int TracingJit::runHotLoop(Chunk *chunk, int header, CLoxLiteral *frame, CLoxLiteral *&stackTop, CLoxLiteral *globals) {
+    HotLoop &loop = loops[std::make_pair(chunk, header)];
+    int32_t &counter = chunk->loopCounters[header];
+
+    if (loop.trace == nullptr){
+        //recording runs one iteration, which ends back at the header if it succeeds
+        TraceRecorder recorder(chunk, frame, stackTop, globals);
+        if (recorder.record(header)){
+            loop.trace = TraceCompiler(recorder.trace(), chunk).compile();
+        }
+
+        if (loop.trace == nullptr){
+            loop.failedRecordings++;
+            counter = loop.failedRecordings < MAX_RECORDING_ATTEMPTS ? 0 : std::numeric_limits<int32_t>::min();
+            return recorder.resumeOffset();
+        }
+    }
+
+    //the next back edge to the header enters the trace again right away
+    counter = HOT_LOOP_THRESHOLD - 1;
+    const TraceExit &exit = loop.trace->run(frame, globals);
+    stackTop = frame + exit.stackDepth;
+    return exit.offset;
+}
+
+void TracingJit::clear() {
+    loops.clear();
+}
@@ -0,0 +1,40 @@
+#ifndef CLOX_TRACINGJIT_H
+#define CLOX_TRACINGJIT_H
+
+
+#include <map>
+#include <memory>
+#include "TraceCompiler.h"
+
+/* Compiles hot loops of the stack VM to machine code. The VM counts how often every loop header is reached through a
+ * back edge (Chunk::loopCounters) and calls runHotLoop once a loop reaches HOT_LOOP_THRESHOLD. The first time, the
+ * TraceRecorder records one iteration and the TraceCompiler turns it into a CompiledTrace, which is then run every time
+ * the loop comes around again. A loop whose recording or compilation fails MAX_RECORDING_ATTEMPTS times is left to the
+ * interpreter for good.
+ *
+ * Only loops over numbers are compiled, see TraceRecorder for the instructions that are supported. The JIT is built
+ * with TRACING_JIT (cmake -DCLOX_TRACING_JIT=ON, the default), which needs an x86-64 POSIX system and NaN boxing.
+ */
+class TracingJit {
+public:
+    static const int HOT_LOOP_THRESHOLD = 64;
+    static const int MAX_RECORDING_ATTEMPTS = 3;
+
+    //Runs the loop starting at header, which has just been reached through a back edge, for as long as the trace allows.
+    //Returns the offset where the interpreter continues, with stackTop set to the matching stack depth.
+    int runHotLoop(Chunk *chunk, int header, CLoxLiteral *frame, CLoxLiteral *&stackTop, CLoxLiteral *globals);
+
+    //drops every trace, called before the VM runs another script whose chunks may reuse their addresses
+    void clear();
+
+private:
+    struct HotLoop {
+        int failedRecordings = 0;
+        std::unique_ptr<CompiledTrace> trace;
+    };
+
+    std::map<std::pair<const Chunk*, int>, HotLoop> loops;
+};
+
+
+#endif //CLOX_TRACINGJIT_H
@@ -1,289 +1,965 @@
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <limits>
 #include "VM.h"
 #include "DebugUtils.h"
 #include "LoxError.h"
 #include "Memory.h"
+#include "BytecodeVerifier.h"
+#include "OpcodeProfiler.h"
+#include "InstructionCounter.h"
+#include "SamplingProfiler.h"
 
-CallFrame::CallFrame(FunctionObj *function, int programCounter, int stackIndex) : function(function), programCounter(programCounter), stackIndex(stackIndex) {};
+CallFrame::CallFrame(FunctionObj *function, int programCounter, int stackIndex, ClosureObj *closure) : function(function), programCounter(programCounter), stackIndex(stackIndex), closure(closure) {};
 
 //when this macro is enabled, the VM will print every instruction before executing it
 //#define DEBUG_VM
 
-ExecutionResult VM::execute(FunctionObj *function) {
-    CLoxLiteral functionLiteral(function);
-    pushStack(functionLiteral);
-    callFrames.emplace_back(CallFrame(function, 0, 0));
-    currentFrame = callFrames.back();
+//Dispatch instructions with computed gotos (a GCC/Clang extension) when the compiler supports them. Every handler jumps
+//straight to the handler of the next instruction instead of going back through a single switch, which removes the
+//bounds check of the switch and gives every opcode its own indirect branch for the predictor to learn. The switch is kept
+//as a fallback for other compilers and for DEBUG_VM, PROFILE_OPCODES and COUNT_INSTRUCTIONS, which need to run code around
+//every instruction.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DEBUG_VM) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+#define USE_COMPUTED_GOTO
+#endif
+
+VM::VM(Memory &heap, std::ostream &out) : heap(heap), out(out), stack(new CLoxLiteral[STACK_MAX]), stackTop(stack.get()), callFrames(new CallFrame[FRAMES_MAX]) {}
+
+VM::~VM() {
+    SamplingProfiler::detach(this);
+    if (heap.vm == this){
+        heap.vm = nullptr;
+    }
+}
+
+ExecutionResult VM::execute(FunctionObj *function, GlobalVariables &globalVariables) {
+    heap.vm = this;
+    globals = &globalVariables;
+    globals->allocateValues();
+    currentFrame = CallFrame(function, 0, 0);
+    stackTop = stack.get();
+    frameCount = 0;
+    openUpvalues = nullptr;
+#ifdef TRACING_JIT
+    jit.clear();
+#endif
+#ifdef BASELINE_JIT
+    baselineJit.clear();
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+    //must list a handler for every opcode, in the same order as the OpCode enum
+    static const void *const dispatchTable[static_cast<int>(OpCode::OP_COUNT)] = {
+            &&TARGET_OP_RETURN,
+            &&TARGET_OP_PRINT,
+            &&TARGET_OP_CONSTANT,
+            &&TARGET_OP_NEGATE,
+            &&TARGET_OP_ADD,
+            &&TARGET_OP_SUBTRACT,
+            &&TARGET_OP_MULTIPLY,
+            &&TARGET_OP_DIVIDE,
+            &&TARGET_OP_TRUE,
+            &&TARGET_OP_FALSE,
+            &&TARGET_OP_NIL,
+            &&TARGET_OP_NOT,
+            &&TARGET_OP_EQUAL,
+            &&TARGET_OP_GREATER,
+            &&TARGET_OP_LESS,
+            &&TARGET_OP_POP,
+            &&TARGET_OP_DEFINE_GLOBAL,
+            &&TARGET_OP_GET_GLOBAL,
+            &&TARGET_OP_SET_GLOBAL,
+            &&TARGET_OP_GET_LOCAL,
+            &&TARGET_OP_SET_LOCAL,
+            &&TARGET_OP_JUMP_IF_FALSE,
+            &&TARGET_OP_JUMP,
+            &&TARGET_OP_LOOP,
+            &&TARGET_OP_CLASS,
+            &&TARGET_OP_CALL,
+            &&TARGET_OP_TAIL_CALL,
+            &&TARGET_OP_CLOSURE,
+            &&TARGET_OP_GET_UPVALUE,
+            &&TARGET_OP_SET_UPVALUE,
+            &&TARGET_OP_CLOSE_UPVALUE,
+            &&TARGET_OP_METHOD,
+            &&TARGET_OP_INVOKE,
+            &&TARGET_OP_TAIL_INVOKE,
+            &&TARGET_OP_GET_PROPERTY,
+            &&TARGET_OP_SET_PROPERTY,
+            &&TARGET_OP_ALLOCATE,
+            &&TARGET_OP_CONSTANT_LONG,
+            &&TARGET_OP_DEFINE_GLOBAL_LONG,
+            &&TARGET_OP_GET_GLOBAL_LONG,
+            &&TARGET_OP_SET_GLOBAL_LONG,
+            &&TARGET_OP_GET_LOCAL_LONG,
+            &&TARGET_OP_SET_LOCAL_LONG,
+            &&TARGET_OP_JUMP_IF_FALSE_LONG,
+            &&TARGET_OP_JUMP_LONG,
+            &&TARGET_OP_LOOP_LONG,
+            &&TARGET_OP_CLASS_LONG,
+            &&TARGET_OP_GET_PROPERTY_LONG,
+            &&TARGET_OP_SET_PROPERTY_LONG,
+            &&TARGET_OP_CLOSURE_LONG,
+            &&TARGET_OP_METHOD_LONG,
+            &&TARGET_OP_GET_LOCAL_CONSTANT_ADD,
+            &&TARGET_OP_LESS_JUMP_IF_FALSE,
+            &&TARGET_OP_SET_LOCAL_POP,
+            &&TARGET_OP_SET_GLOBAL_POP,
+            &&TARGET_OP_ADD_NUMBER,
+            &&TARGET_OP_SUBTRACT_NUMBER,
+            &&TARGET_OP_MULTIPLY_NUMBER,
+            &&TARGET_OP_DIVIDE_NUMBER,
+            &&TARGET_OP_GREATER_NUMBER,
+            &&TARGET_OP_LESS_NUMBER,
+            &&TARGET_OP_GET_LOCAL_CONSTANT_ADD_NUMBER,
+            &&TARGET_OP_LESS_JUMP_IF_FALSE_NUMBER
+    };
+#ifdef SAMPLING_PROFILER
+    //While profiling every instruction is threaded to sampledInstruction, which checks for a sample request before jumping
+    //to the handler of the opcode. Without the profiler the handlers dispatch to each other and never check
+    const void *samplingDispatchTable[static_cast<int>(OpCode::OP_COUNT)];
+    std::fill(std::begin(samplingDispatchTable), std::end(samplingDispatchTable), &&sampledInstruction);
+    const void *const *threadingTable = SamplingProfiler::isRunning() ? samplingDispatchTable : dispatchTable;
+#else
+    const void *const *threadingTable = dispatchTable;
+#endif
+#else
+    const void *const *threadingTable = nullptr;
+#endif
+
+    prepareFunction(function, threadingTable);
+    //the stack overflow check of the script's frame, the verifier guarantees it never goes deeper than maxStackDepth
+    checkStackSpace(currentFrame.stackIndex, currentChunk()->maxStackDepth);
+    pushStack(CLoxLiteral(function));
+    SamplingProfiler::attach(this);
+
+#if defined(BASELINE_JIT) && !defined(DEBUG_VM) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+    //the chunk runs as machine code, the interpreter below is only used if it cannot be compiled
+    if (baselineJit.execute(this, currentChunk(), stackTop, stack.get() + currentFrame.stackIndex, globals->values.data())){
+        SamplingProfiler::detach(this);
+        heap.freeAllHeapObjects();
+        return ExecutionResult::OK;
+    }
+#endif
+
+#define READ_BYTE() (std::to_integer<uint8_t>(*ip++))
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>((std::to_integer<uint16_t>(ip[-2]) << 8u) | std::to_integer<uint16_t>(ip[-1])))
+#define READ_LONG() (ip += 3, (std::to_integer<uint32_t>(ip[-3]) << 16u) | (std::to_integer<uint32_t>(ip[-2]) << 8u) | std::to_integer<uint32_t>(ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+//the verifier guarantees that identifier operands point to string constants
+#define READ_STRING() (static_cast<StringObj*>(READ_CONSTANT().getObj()))
+#define READ_STRING_LONG() (static_cast<StringObj*>(READ_CONSTANT_LONG().getObj()))
+#define SAVE_PC() (currentFrame.programCounter = static_cast<int>(ip - code))
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+//Publishes sp and the pc before calling a helper that can allocate or throw: the GC marks the slots below stackTop, and
+//errors report the line of the pc. Helpers that move the top of the stack, like replaceFrame, are followed by LOAD_SP
+#define ENTER() (stackTop = sp, SAVE_PC())
+#define LOAD_SP() (sp = stackTop)
+//inline cache of the instruction being executed, only valid before its operands are read
+#define CURRENT_CACHE() (propertyCaches[ip - 1 - code])
+#define CURRENT_METHOD_CACHE() (methodCaches[ip - 1 - code])
+//Switches the locals below to currentFrame, when execution starts and after every call and return
+#if defined(TRACING_JIT) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+#define LOAD_LOOP_COUNTERS() (loopCounters = currentChunk()->loopCounters.data())
+#else
+#define LOAD_LOOP_COUNTERS() ((void) 0)
+#endif
+#ifdef USE_COMPUTED_GOTO
+#define LOAD_THREADED_CODE() (threadedCode = currentChunk()->threadedCode.data())
+#else
+#define LOAD_THREADED_CODE() ((void) 0)
+#endif
+#define LOAD_FRAME() \
+    do { \
+        code = currentChunk()->bytecode.data(); \
+        ip = code + currentFrame.programCounter; \
+        constants = currentChunk()->constants.data(); \
+        propertyCaches = currentChunk()->propertyCaches.data(); \
+        methodCaches = currentChunk()->methodCaches.data(); \
+        frame = stack.get() + currentFrame.stackIndex; \
+        LOAD_LOOP_COUNTERS(); \
+        LOAD_THREADED_CODE(); \
+    } while (false)
+//Called with ip at the header of a loop after taking its back edge. Once the loop is hot the TracingJit runs it, and the
+//interpreter continues wherever the compiled trace left off. Traces are not run while profiling opcodes or counting
+//instructions, the profile would stop at the first iterations of every hot loop and their cycles would be charged to
+//the back edge.
+#if defined(TRACING_JIT) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+#define HOT_LOOP() \
+    do { \
+        if (++loopCounters[ip - code] >= TracingJit::HOT_LOOP_THRESHOLD){ \
+            stackTop = sp; \
+            ip = code + jit.runHotLoop(currentChunk(), static_cast<int>(ip - code), frame, sp, globals->values.data()); \
+        } \
+    } while (false)
+#else
+#define HOT_LOOP() do {} while (false)
+#endif
+
+//Samples the instruction at ip, once the SamplingProfiler asked for it
+#define TAKE_SAMPLE() SamplingProfiler::takeSample(this, static_cast<int>(ip - code))
+
+    //The instruction pointer and the top of the stack are kept in locals so they can live in registers. They are only
+    //written back to currentFrame.programCounter and stackTop (ENTER) before calling into code that needs them, like the
+    //GC and the error reporting in the helpers. Locals are addressed relative to frame, the first slot of currentFrame.
+    std::byte *code; //not const, instructions are quickened in place
+    const std::byte *ip;
+    const CLoxLiteral *constants;
+    PropertyCache *propertyCaches;
+    MethodCache *methodCaches;
+    CLoxLiteral *frame;
+#if defined(TRACING_JIT) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+    int32_t *loopCounters;
+#endif
+#ifdef USE_COMPUTED_GOTO
+    const void **threadedCode;
+#endif
+    LOAD_FRAME();
+    CLoxLiteral *sp = stackTop;
+
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(op) TARGET_##op: case OpCode::op
+#define DISPATCH() do { const void *handler = threadedCode[ip - code]; ip++; goto *handler; } while (false)
+#define REWRITE(offset, op) (code[offset] = std::byte(OpCode::op), threadedCode[offset] = threadingTable[static_cast<int>(OpCode::op)])
+
+    DISPATCH();
+#ifdef SAMPLING_PROFILER
+sampledInstruction:
+    if (SamplingProfiler::sampleRequested){
+        ip--;
+        TAKE_SAMPLE();
+        ip++;
+    }
+    goto *dispatchTable[std::to_integer<uint8_t>(ip[-1])];
+#endif
+#else
+#define TARGET(op) case OpCode::op
+#define DISPATCH() break
+#define REWRITE(offset, op) (code[offset] = std::byte(OpCode::op))
+#endif
+
+/* Quickening, see Chunk::quickenedForm. A generic instruction whose operands are numbers rewrites itself into its
+ * quickened form, whose handler skips the type dispatch of the helpers and only checks a guard. If the guard fails, the
+ * instruction is rewritten back and executed again by the generic handler, which quickens it again once it sees numbers.
+ * QUICKEN is only valid before the operands of the instruction are read.
+ */
+#define QUICKEN(condition, op) do { if (condition) REWRITE(ip - 1 - code, op); } while (false)
+#define GUARD(condition, generic) \
+    if (!(condition)){ \
+        ip--; \
+        REWRITE(ip - code, generic); \
+        DISPATCH(); \
+    }
+#define BOTH_NUMBERS() (sp[-2].isNumber() && sp[-1].isNumber())
 
     while (true){
-        //keep track of the current offset before we modify it in case the DEBUG flag is on and we want to debug print info about
-        //the last executed instruction.
-        int currentOffset = currentFrame.programCounter;
-        std::byte instruction = currentChunk()->readByte(currentOffset);
-        currentFrame.programCounter++;
-
-        switch (static_cast<OpCode>(instruction)) {
-            case OpCode::OP_RETURN:
-                Memory::freeAllHeapObjects();
-                return ExecutionResult::OK;
-            case OpCode::OP_PRINT:
-                std::cout << popStack() << "\n";
-                break;
-            case OpCode::OP_CONSTANT:
-                pushStack(readConstant());
-                break;
-            case OpCode::OP_NEGATE:
-                negate();
-                break;
-            case OpCode::OP_ADD:
-                add();
-                break;
-            case OpCode::OP_SUBTRACT:
-                subtract();
-                break;
-            case OpCode::OP_MULTIPLY:
-                multiply();
-                break;
-            case OpCode::OP_DIVIDE:
-                divide();
-                break;
-            case OpCode::OP_TRUE:
-                pushStack(CLoxLiteral(true));
-                break;
-            case OpCode::OP_FALSE:
-                pushStack(CLoxLiteral(false));
-                break;
-            case OpCode::OP_NIL:
-                pushStack(CLoxLiteral::Nil());
-                break;
-            case OpCode::OP_NOT:
-                pushStack(CLoxLiteral(!isTruthy(popStack())));
-                break;
-            case OpCode::OP_EQUAL:
-                equal();
-                break;
-            case OpCode::OP_GREATER:
-                greater();
-                break;
-            case OpCode::OP_LESS:
-                less();
-                break;
-            case OpCode::OP_POP:
-                popStack();
-                break;
-            case OpCode::OP_DEFINE_GLOBAL:
-                defineGlobal();
-                break;
-            case OpCode::OP_GET_GLOBAL:
-                getGlobal();
-                break;
-            case OpCode::OP_SET_GLOBAL:
-                setGlobal();
-                break;
-            case OpCode::OP_GET_LOCAL:
-                getLocal();
-                break;
-            case OpCode::OP_SET_LOCAL:
-                setLocal();
-                break;
-            case OpCode::OP_JUMP_IF_FALSE: {
-                uint16_t offset = readTwoByteOffset();
-                if (!isTruthy(stack.back())){
-                    currentFrame.programCounter += offset;
+#ifdef DEBUG_VM
+        //keep track of the current offset before we modify it so we can debug print info about the last executed instruction.
+        int currentOffset = static_cast<int>(ip - code);
+        const Chunk *currentOffsetChunk = currentChunk();
+#endif
+#ifdef SAMPLING_PROFILER
+        if (SamplingProfiler::sampleRequested){
+            TAKE_SAMPLE();
+        }
+#endif
+#ifdef PROFILE_OPCODES
+        OpcodeProfiler::record(currentChunk(), static_cast<int>(ip - code), Chunk::genericForm(static_cast<OpCode>(*ip)));
+#endif
+#ifdef COUNT_INSTRUCTIONS
+        InstructionCounter::record(currentFrame.function, static_cast<int>(ip - code), static_cast<OpCode>(*ip));
+#endif
+        switch (static_cast<OpCode>(*ip++)) {
+            TARGET(OP_RETURN):
+                if (frameCount == 0){ //the script ends
+#ifdef COUNT_INSTRUCTIONS
+                    InstructionCounter::finish();
+#endif
+                    SamplingProfiler::detach(this);
+                    heap.freeAllHeapObjects();
+                    return ExecutionResult::OK;
                 }
-
-                break;
+                //the result replaces the function that was called, the rest of its frame is popped
+                closeUpvalues(frame);
+                frame[0] = sp[-1];
+                sp = frame + 1;
+                currentFrame = callFrames[--frameCount];
+                LOAD_FRAME();
+                DISPATCH();
+            TARGET(OP_PRINT):
+                out << POP() << "\n";
+                DISPATCH();
+            TARGET(OP_CONSTANT):
+                PUSH(READ_CONSTANT());
+                DISPATCH();
+            TARGET(OP_NEGATE):
+                ENTER();
+                sp[-1] = negate(sp[-1]);
+                DISPATCH();
+            TARGET(OP_ADD): {
+                QUICKEN(BOTH_NUMBERS(), OP_ADD_NUMBER);
+                ENTER();
+                //operands stay on the stack until the result is ready because concatenating strings can trigger the GC
+                sp[-2] = add(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
             }
-            case OpCode::OP_JUMP: {
-                uint16_t offset = readTwoByteOffset();
-                currentFrame.programCounter += offset;
-                break;
+            TARGET(OP_SUBTRACT): {
+                QUICKEN(BOTH_NUMBERS(), OP_SUBTRACT_NUMBER);
+                ENTER();
+                sp[-2] = subtract(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
             }
-            case OpCode::OP_LOOP: {
-                uint16_t offset = readTwoByteOffset();
-                currentFrame.programCounter -= offset + 1;
-                break;
+            TARGET(OP_MULTIPLY): {
+                QUICKEN(BOTH_NUMBERS(), OP_MULTIPLY_NUMBER);
+                ENTER();
+                sp[-2] = multiply(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
             }
-
-            case OpCode::OP_CLASS: {
-                runGCIfNecessary();
-                pushStack(CLoxLiteral(Memory::allocateHeapClass(readConstantAsStringObj(), this)));
-                break;
+            TARGET(OP_DIVIDE): {
+                QUICKEN(BOTH_NUMBERS(), OP_DIVIDE_NUMBER);
+                ENTER();
+                sp[-2] = divide(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_TRUE):
+                PUSH(CLoxLiteral(true));
+                DISPATCH();
+            TARGET(OP_FALSE):
+                PUSH(CLoxLiteral(false));
+                DISPATCH();
+            TARGET(OP_NIL):
+                PUSH(CLoxLiteral::Nil());
+                DISPATCH();
+            TARGET(OP_NOT):
+                sp[-1] = CLoxLiteral(!isTruthy(sp[-1]));
+                DISPATCH();
+            TARGET(OP_EQUAL): {
+                sp[-2] = equal(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GREATER): {
+                QUICKEN(BOTH_NUMBERS(), OP_GREATER_NUMBER);
+                ENTER();
+                sp[-2] = greater(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_LESS): {
+                QUICKEN(BOTH_NUMBERS(), OP_LESS_NUMBER);
+                ENTER();
+                sp[-2] = less(sp[-2], sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_POP):
+                sp--;
+                DISPATCH();
+            TARGET(OP_DEFINE_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                ENTER();
+                defineGlobal(slot, sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                ENTER();
+                PUSH(getGlobal(slot));
+                DISPATCH();
+            }
+            TARGET(OP_SET_GLOBAL): {
+                uint8_t slot = READ_BYTE();
+                ENTER();
+                setGlobal(slot, sp[-1]); //the value is the result of the assignment, so it stays on the stack
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCAL):
+                PUSH(frame[READ_BYTE()]);
+                DISPATCH();
+            TARGET(OP_SET_LOCAL):
+                frame[READ_BYTE()] = sp[-1];
+                DISPATCH();
+            TARGET(OP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                if (!isTruthy(sp[-1])){
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
+            }
+            TARGET(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                ip -= offset + 1;
+                HOT_LOOP();
+                DISPATCH();
+            }
+            TARGET(OP_CLASS): {
+                StringObj *name = READ_STRING();
+                ENTER();
+                PUSH(makeClass(name));
+                DISPATCH();
+            }
+            TARGET(OP_CALL): {
+                uint8_t argCount = READ_BYTE();
+                ENTER(); //where the call returns to
+                if (Obj *callable = prepareCall(sp[-1 - argCount], argCount)){
+                    pushFrame(callable, argCount);
+                    LOAD_FRAME();
+                }
+                DISPATCH();
+            }
+            TARGET(OP_TAIL_CALL): {
+                uint8_t argCount = READ_BYTE();
+                ENTER();
+                //a class without an initializer was replaced by its instance, which the OP_RETURN after the call returns
+                if (Obj *callable = prepareCall(sp[-1 - argCount], argCount)){
+                    if (capturesSlotsFrom(callable, frame)){
+                        //it captured slots of the frame it would take over, so it is called normally and the OP_RETURN
+                        //after the call returns its result
+                        pushFrame(callable, argCount);
+                    } else {
+                        replaceFrame(callable, argCount);
+                        LOAD_SP();
+                    }
+                    LOAD_FRAME();
+                }
+                DISPATCH();
+            }
+            TARGET(OP_CLOSURE): {
+                auto *function = static_cast<FunctionObj*>(READ_CONSTANT().getObj());
+                ENTER();
+                PUSH(makeClosure(function, frame));
+                DISPATCH();
+            }
+            //a function that has upvalues always runs as a closure
+            TARGET(OP_GET_UPVALUE):
+                PUSH(currentFrame.closure->captured(READ_BYTE()));
+                DISPATCH();
+            TARGET(OP_SET_UPVALUE): {
+                CLoxLiteral &captured = currentFrame.closure->captured(READ_BYTE());
+                heap.writeBarrier(captured); //a closed upvalue is an object
+                captured = sp[-1];
+                DISPATCH();
+            }
+            TARGET(OP_CLOSE_UPVALUE):
+                closeUpvalues(sp - 1);
+                sp--;
+                DISPATCH();
+            TARGET(OP_METHOD): {
+                StringObj *name = READ_STRING();
+                ENTER();
+                defineMethod(sp[-2], name, sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_INVOKE): {
+                MethodCache &cache = CURRENT_METHOD_CACHE();
+                StringObj *name = READ_STRING();
+                uint8_t argCount = READ_BYTE();
+                ENTER();
+                if (Obj *callable = prepareInvoke(sp[-1 - argCount], name, argCount, cache)){
+                    pushFrame(callable, argCount);
+                    LOAD_FRAME();
+                }
+                DISPATCH();
+            }
+            TARGET(OP_TAIL_INVOKE): {
+                MethodCache &cache = CURRENT_METHOD_CACHE();
+                StringObj *name = READ_STRING();
+                uint8_t argCount = READ_BYTE();
+                ENTER();
+                if (Obj *callable = prepareInvoke(sp[-1 - argCount], name, argCount, cache)){
+                    if (capturesSlotsFrom(callable, frame)){ //see OP_TAIL_CALL
+                        pushFrame(callable, argCount);
+                    } else {
+                        replaceFrame(callable, argCount);
+                        LOAD_SP();
+                    }
+                    LOAD_FRAME();
+                }
+                DISPATCH();
+            }
+            TARGET(OP_SET_PROPERTY): {
+                PropertyCache &cache = CURRENT_CACHE();
+                StringObj *name = READ_STRING();
+                ENTER();
+                setProperty(sp[-2], name, sp[-1], cache);
+                sp[-2] = sp[-1];
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GET_PROPERTY): {
+                PropertyCache &cache = CURRENT_CACHE();
+                StringObj *name = READ_STRING();
+                ENTER();
+                sp[-1] = getProperty(sp[-1], name, cache);
+                DISPATCH();
             }
-            case OpCode::OP_CALL: {
+            TARGET(OP_ALLOCATE):
+                ENTER();
+                sp[-1] = allocate(sp[-1]);
+                DISPATCH();
+            TARGET(OP_CONSTANT_LONG):
+                PUSH(READ_CONSTANT_LONG());
+                DISPATCH();
+            TARGET(OP_DEFINE_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                ENTER();
+                defineGlobal(slot, sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GET_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                ENTER();
+                PUSH(getGlobal(slot));
+                DISPATCH();
+            }
+            TARGET(OP_SET_GLOBAL_LONG): {
+                uint32_t slot = READ_LONG();
+                ENTER();
+                setGlobal(slot, sp[-1]);
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCAL_LONG):
+                PUSH(frame[READ_LONG()]);
+                DISPATCH();
+            TARGET(OP_SET_LOCAL_LONG):
+                frame[READ_LONG()] = sp[-1];
+                DISPATCH();
+            TARGET(OP_JUMP_IF_FALSE_LONG): {
+                uint32_t offset = READ_LONG();
+                if (!isTruthy(sp[-1])){
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JUMP_LONG): {
+                uint32_t offset = READ_LONG();
+                ip += offset;
+                DISPATCH();
+            }
+            TARGET(OP_LOOP_LONG): {
+                uint32_t offset = READ_LONG();
+                ip -= offset + 1;
+                HOT_LOOP();
+                DISPATCH();
+            }
+            TARGET(OP_CLASS_LONG): {
+                StringObj *name = READ_STRING_LONG();
+                ENTER();
+                PUSH(makeClass(name));
+                DISPATCH();
+            }
+            TARGET(OP_SET_PROPERTY_LONG): {
+                PropertyCache &cache = CURRENT_CACHE();
+                StringObj *name = READ_STRING_LONG();
+                ENTER();
+                setProperty(sp[-2], name, sp[-1], cache);
+                sp[-2] = sp[-1];
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GET_PROPERTY_LONG): {
+                PropertyCache &cache = CURRENT_CACHE();
+                StringObj *name = READ_STRING_LONG();
+                ENTER();
+                sp[-1] = getProperty(sp[-1], name, cache);
+                DISPATCH();
+            }
+            TARGET(OP_CLOSURE_LONG): {
+                auto *function = static_cast<FunctionObj*>(READ_CONSTANT_LONG().getObj());
+                ENTER();
+                PUSH(makeClosure(function, frame));
+                DISPATCH();
+            }
+            TARGET(OP_METHOD_LONG): {
+                StringObj *name = READ_STRING_LONG();
+                ENTER();
+                defineMethod(sp[-2], name, sp[-1]);
+                sp--;
+                DISPATCH();
+            }
+            TARGET(OP_GET_LOCAL_CONSTANT_ADD): {
+                QUICKEN(frame[std::to_integer<uint8_t>(ip[0])].isNumber() && constants[std::to_integer<uint8_t>(ip[1])].isNumber(), OP_GET_LOCAL_CONSTANT_ADD_NUMBER);
+                const CLoxLiteral &local = frame[READ_BYTE()];
+                const CLoxLiteral &constant = READ_CONSTANT();
+                ENTER();
+                PUSH(add(local, constant));
+                DISPATCH();
+            }
+            TARGET(OP_LESS_JUMP_IF_FALSE): {
+                QUICKEN(BOTH_NUMBERS(), OP_LESS_JUMP_IF_FALSE_NUMBER);
+                uint16_t offset = READ_SHORT();
+                ENTER();
+                sp[-2] = less(sp[-2], sp[-1]);
+                sp--; //the condition stays on the stack like with OP_JUMP_IF_FALSE
+                if (!isTruthy(sp[-1])){
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            TARGET(OP_SET_LOCAL_POP):
+                frame[READ_BYTE()] = POP();
+                DISPATCH();
+            TARGET(OP_SET_GLOBAL_POP): {
+                uint8_t slot = READ_BYTE();
+                ENTER();
+                setGlobal(slot, POP());
+                DISPATCH();
+            }
+            TARGET(OP_ADD_NUMBER):
+                GUARD(BOTH_NUMBERS(), OP_ADD);
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() + sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_SUBTRACT_NUMBER):
+                GUARD(BOTH_NUMBERS(), OP_SUBTRACT);
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() - sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_MULTIPLY_NUMBER):
+                GUARD(BOTH_NUMBERS(), OP_MULTIPLY);
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() * sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_DIVIDE_NUMBER):
+                GUARD(BOTH_NUMBERS() && sp[-1].getNumber() != 0.0, OP_DIVIDE); //the generic form reports division by 0
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() / sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_GREATER_NUMBER):
+                GUARD(BOTH_NUMBERS(), OP_GREATER);
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() > sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_LESS_NUMBER):
+                GUARD(BOTH_NUMBERS(), OP_LESS);
+                sp[-2] = CLoxLiteral(sp[-2].getNumber() < sp[-1].getNumber());
+                sp--;
+                DISPATCH();
+            TARGET(OP_GET_LOCAL_CONSTANT_ADD_NUMBER): {
+                const CLoxLiteral &local = frame[std::to_integer<uint8_t>(ip[0])];
+                const CLoxLiteral &constant = constants[std::to_integer<uint8_t>(ip[1])];
+                GUARD(local.isNumber() && constant.isNumber(), OP_GET_LOCAL_CONSTANT_ADD);
+                ip += 2;
+                PUSH(CLoxLiteral(local.getNumber() + constant.getNumber()));
+                DISPATCH();
+            }
+            TARGET(OP_LESS_JUMP_IF_FALSE_NUMBER): {
+                GUARD(BOTH_NUMBERS(), OP_LESS_JUMP_IF_FALSE);
+                uint16_t offset = READ_SHORT();
+                bool condition = sp[-2].getNumber() < sp[-1].getNumber();
+                sp[-2] = CLoxLiteral(condition);
+                sp--;
+                if (!condition){
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            case OpCode::OP_COUNT: //the verifier rejects it, so it never gets here
+                throw std::runtime_error("Unreachable");
+        }
+
+#ifdef DEBUG_VM
+        stackTop = sp;
+        printDebugInfo(currentOffsetChunk, currentOffset);
+#endif
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_STRING
+#undef READ_STRING_LONG
+#undef SAVE_PC
+#undef PUSH
+#undef POP
+#undef ENTER
+#undef LOAD_SP
+#undef CURRENT_CACHE
+#undef CURRENT_METHOD_CACHE
+#undef LOAD_LOOP_COUNTERS
+#undef LOAD_THREADED_CODE
+#undef LOAD_FRAME
+#undef HOT_LOOP
+#undef TAKE_SAMPLE
+#undef TARGET
+#undef DISPATCH
+#undef REWRITE
+#undef QUICKEN
+#undef GUARD
+#undef BOTH_NUMBERS
+}
 
-                CLoxLiteral obj = popStack();
-                assert(obj.isObj() && obj.getObj()->isClass());
-                auto *classObj = dynamic_cast<ClassObj*>(obj.getObj());
+/* Gets function ready to be interpreted, and every function declared in it, before the script starts so calls only have to
+ * switch to the chunk of the callee. Bad bytecode is rejected here, once: the interpreter relies on every chunk being
+ * verified and reads bytes, constants and local slots without bounds checks. The compiler verifies the chunks it produces,
+ * so that is usually skipped. The chunks also get the tables the interpreter keeps per instruction.
+ */
+void VM::prepareFunction(FunctionObj *function, const void *const *dispatchTable) {
+    Chunk *chunk = function->chunk;
+    if (!chunk->verified){
+        BytecodeVerifier(chunk, globals->count(), function->arity + 1).verify();
+    }
+    if (chunk->propertyCaches.size() != chunk->byteCount()){
+        chunk->propertyCaches.assign(chunk->byteCount(), PropertyCache());
+    }
+    if (chunk->methodCaches.size() != chunk->byteCount()){
+        chunk->methodCaches.assign(chunk->byteCount(), MethodCache());
+    }
+#if defined(TRACING_JIT) && !defined(PROFILE_OPCODES) && !defined(COUNT_INSTRUCTIONS)
+    if (chunk->loopCounters.size() != chunk->byteCount()){
+        chunk->loopCounters.assign(chunk->byteCount(), 0);
+    }
+#endif
+    if (dispatchTable != nullptr && chunk->threadedCode.size() != chunk->byteCount()){
+        threadChunk(chunk, dispatchTable);
+    }
+
+    for (const CLoxLiteral &constant : chunk->constants){
+        if (constant.isObj() && constant.getObj()->isFunction()){
+            prepareFunction(static_cast<FunctionObj*>(constant.getObj()), dispatchTable);
+        }
+    }
+}
+
+Obj *VM::prepareCall(CLoxLiteral &callee, int argCount) {
+    if (callee.isObj()){
+        Obj *obj = callee.getObj();
+        switch (obj->type) {
+            case ObjType::FUNCTION:
+            case ObjType::CLOSURE:
+                return obj;
+            case ObjType::BOUND_METHOD: {
+                auto *boundMethod = static_cast<BoundMethodObj*>(obj);
+                callee = CLoxLiteral(boundMethod->receiver);
+                return boundMethod->method;
+            }
+            case ObjType::CLASS: {
+                auto *klass = static_cast<ClassObj*>(obj);
+                if (klass->initializer == nullptr){
+                    callee = instantiate(callee, argCount);
+                    return nullptr;
+                }
                 runGCIfNecessary();
-                pushStack(CLoxLiteral(Memory::allocateHeapInstance(classObj, this)));
+                callee = CLoxLiteral(heap.allocateHeapInstance(klass));
+                return klass->initializer;
+            }
+            default:
                 break;
+        }
+    }
+    throw LoxRuntimeError("Can only call functions and classes", readChunkLine(currentFrame.programCounter));
+}
+
+//The lookup in the cache is all a call of a method that is cached costs on top of a call of a function
+inline Obj *VM::prepareInvoke(CLoxLiteral &receiver, StringObj *name, int argCount, MethodCache &cache) {
+    if (receiver.isObj() && receiver.getObj()->isInstance()){
+        auto *instance = static_cast<InstanceObj*>(receiver.getObj());
+        for (const MethodCache::Entry &entry : cache.entries){
+            if (entry.klass == instance->klass && entry.shape == instance->shape){
+                return entry.method;
             }
-            case OpCode::OP_SET_PROPERTY: {
-                CLoxLiteral value = popStack();
-                StringObj *strObj = readConstantAsStringObj();
-                popStack();
+        }
+    }
+    return prepareUncachedInvoke(receiver, name, argCount, cache);
+}
 
-                CLoxLiteral literal = popStack();
+//A field with the name is called like any other value. Otherwise the method is looked up and cached
+Obj *VM::prepareUncachedInvoke(CLoxLiteral &receiver, StringObj *name, int argCount, MethodCache &cache) {
+    if (!receiver.isObj() || !receiver.getObj()->isInstance()){
+        throw LoxRuntimeError("Cannot access property. Only instances have fields."); //like getProperty, which the other backends use
+    }
 
-                if (!literal.isObj() || !literal.getObj()->isInstance()){
-                    throw LoxRuntimeError("Cannot access property. Only instances have fields.");
-                }
+    auto *instance = static_cast<InstanceObj*>(receiver.getObj());
+    if (CLoxLiteral *field = instance->findField(name)){
+        receiver = *field;
+        return prepareCall(receiver, argCount);
+    }
 
-                auto *instanceObj = dynamic_cast<InstanceObj*>(literal.getObj());
-                instanceObj->fields[strObj->str] = value;
-                pushStack(value);
+    Obj *method = instance->klass->findMethod(name);
+    if (method == nullptr){
+        throw LoxRuntimeError("Undefined property " + name->str(), readChunkLine(currentFrame.programCounter));
+    }
+    if (!instance->shape->isDictionary()){
+        for (MethodCache::Entry &entry : cache.entries){
+            if (entry.klass == nullptr){
+                entry = {instance->klass, instance->shape, method};
                 break;
             }
-            case OpCode::OP_GET_PROPERTY: {
-                StringObj *strObj = readConstantAsStringObj();
-                popStack();
-                CLoxLiteral literal = popStack();
-
-                if (!literal.isObj() || !literal.getObj()->isInstance()){
-                    throw LoxRuntimeError("Cannot access property. Only instances have fields.");
-                }
+        }
+    }
+    return method;
+}
 
-                auto *instanceObj = dynamic_cast<InstanceObj*>(literal.getObj());
+//Makes callable, called with the argCount values on top of the stack, the current frame. Its frame starts at the slot of
+//the callee, so the arguments already are its first locals.
+void VM::pushFrame(Obj *callable, int argCount) {
+    int base = static_cast<int>(stackTop - stack.get()) - argCount - 1;
+    CallFrame callFrame = frameOf(callable, base);
+    checkArity(callFrame.function, argCount);
+    if (frameCount == FRAMES_MAX){
+        throw LoxRuntimeError("Stack overflow", readChunkLine(currentFrame.programCounter));
+    }
 
-                if (instanceObj->fields.find(strObj->str) != instanceObj->fields.end()){
-                    pushStack(instanceObj->fields.at(strObj->str));
-                } else {
-                    throw LoxRuntimeError("Undefined property " + strObj->str, readChunkLine(currentFrame.programCounter));
-                }
+    //the only stack overflow check of the frame, the verifier guarantees it never goes deeper than maxStackDepth
+    checkStackSpace(base, callFrame.function->chunk->maxStackDepth);
+    callFrames[frameCount++] = currentFrame;
+    currentFrame = callFrame;
+}
 
-                break;
+//A tail call: callable, called with the argCount values on top of the stack, takes over the current frame instead of
+//getting a new one. It and its arguments are moved down to the start of the frame, so neither callFrames nor the stack
+//grow however deep tail calls recurse. The upvalues of the old frame are closed first, like on a return.
+void VM::replaceFrame(Obj *callable, int argCount) {
+    int base = currentFrame.stackIndex;
+    CallFrame callFrame = frameOf(callable, base);
+    checkArity(callFrame.function, argCount);
+    checkStackSpace(base, callFrame.function->chunk->maxStackDepth);
+    closeUpvalues(stack.get() + base);
+    stackTop = std::copy(stackTop - argCount - 1, stackTop, stack.get() + base);
+    currentFrame = callFrame;
+}
 
-            }
+void VM::checkArity(FunctionObj *function, int argCount) {
+    if (argCount != function->arity){
+        throw LoxRuntimeError("Expected " + std::to_string(function->arity) + " arguments but got " + std::to_string(argCount), readChunkLine(currentFrame.programCounter));
+    }
+}
 
-            case OpCode::OP_ALLOCATE: {
-                CLoxLiteral kilobytes = popStack();
-                assert(kilobytes.isNumber());
-                runGCIfNecessary();
-                Obj *obj = Memory::allocateAllocationObject(kilobytes.getNumber());
-                pushStack(CLoxLiteral(obj));
-            }
-        }
+CallFrame VM::frameOf(Obj *callable, int base) {
+    if (callable->isClosure()){
+        auto *closure = static_cast<ClosureObj*>(callable);
+        return CallFrame(closure->function, 0, base, closure);
+    }
+    return CallFrame(static_cast<FunctionObj*>(callable), 0, base);
+}
 
+bool VM::capturesSlotsFrom(Obj *callable, const CLoxLiteral *base) {
+    if (!callable->isClosure()){
+        return false;
+    }
+    const CLoxLiteral *highestSlot = static_cast<ClosureObj*>(callable)->highestSlot;
+    return highestSlot != nullptr && highestSlot >= base;
+}
 
-#ifdef DEBUG_VM
-        printDebugInfo(currentOffset);
-#endif
+//Fills in the chunk's pre-decoded handler table by looking up the handler of every instruction in the dispatch table.
+void VM::threadChunk(Chunk *chunk, const void *const *dispatchTable) {
+    chunk->threadedCode.assign(chunk->byteCount(), nullptr);
+    size_t offset = 0;
+    while (offset < chunk->byteCount()){
+        auto opCode = static_cast<OpCode>(chunk->readByte(offset));
+        chunk->threadedCode[offset] = dispatchTable[static_cast<uint8_t>(opCode)];
+        offset += Chunk::instructionLength(opCode);
     }
-    return ExecutionResult::OK;
 }
 
 
 
-void VM::add() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+CLoxLiteral VM::add(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
-        pushStack(CLoxLiteral(a.getNumber() + b.getNumber()));
+        return CLoxLiteral(a.getNumber() + b.getNumber());
     } else if (a.isObj() && b.isObj() && a.getObj()->isString() && b.getObj()->isString()){
-        auto *aObj = dynamic_cast<StringObj*>(a.getObj());
-        auto *bObj = dynamic_cast<StringObj*>(b.getObj());
+        auto *aObj = static_cast<StringObj*>(a.getObj());
+        auto *bObj = static_cast<StringObj*>(b.getObj());
         runGCIfNecessary();
-        Obj* cObj = Memory::allocateHeapString(aObj->str + bObj->str, this);
-        pushStack(CLoxLiteral(cObj));
-    } else {
-        throw LoxRuntimeError("Cannot apply operand '+' to objects of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        std::string concatenated;
+        concatenated.reserve(aObj->length + bObj->length);
+        concatenated.append(aObj->view()).append(bObj->view());
+        return CLoxLiteral(heap.allocateHeapString(concatenated));
     }
+
+    throw LoxRuntimeError("Cannot apply operand '+' to objects of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
 }
 
-void VM::subtract() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+CLoxLiteral VM::subtract(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
-        pushStack(CLoxLiteral(a.getNumber() - b.getNumber()));
-    } else {
-        throw LoxRuntimeError("Cannot apply operand '-' to objects of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        return CLoxLiteral(a.getNumber() - b.getNumber());
     }
+
+    throw LoxRuntimeError("Cannot apply operand '-' to objects of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
 }
 
-void VM::multiply() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+CLoxLiteral VM::multiply(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
-        pushStack(CLoxLiteral(a.getNumber() * b.getNumber()));
-    } else {
-        throw LoxRuntimeError("Cannot apply operand '*' to objects of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        return CLoxLiteral(a.getNumber() * b.getNumber());
     }
+
+    throw LoxRuntimeError("Cannot apply operand '*' to objects of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
 }
 
-void VM::divide() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+CLoxLiteral VM::divide(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
         if (b.getNumber() == 0.0){
             throw LoxRuntimeError("Cannot divide by 0", readChunkLine(currentFrame.programCounter));
         }
-        pushStack(CLoxLiteral(a.getNumber() / b.getNumber()));
-    } else {
-        throw LoxRuntimeError("Cannot apply operand '*' to objects of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        return CLoxLiteral(a.getNumber() / b.getNumber());
     }
-}
 
-void VM::equal() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+    throw LoxRuntimeError("Cannot apply operand '/' to objects of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
+}
 
-    if (a.type != b.type) pushStack(CLoxLiteral(false));
+//Values of different types are never equal. Objects are compared by identity, which works for strings because they are interned.
+CLoxLiteral VM::equal(const CLoxLiteral &a, const CLoxLiteral &b) {
+    if (a.getType() != b.getType()) return CLoxLiteral(false);
 
-    if (a.isNumber() && b.isNumber()){
-         pushStack(CLoxLiteral(a.getNumber() == b.getNumber()));
-    } else if (a.isObj() && b.isObj()){
-        if (a.getObj()->isString() && b.getObj()->isString()){
-            pushStack(CLoxLiteral(dynamic_cast<StringObj*>(a.getObj())->str == dynamic_cast<StringObj*>(b.getObj())->str));
-        }
-    } else if (a.isBoolean() && b.isBoolean()){
-        pushStack(CLoxLiteral(a.getBoolean() == b.getBoolean()));
-    } else if (a.isNil() && b.isNil()){
-         pushStack(CLoxLiteral(true));
-    } else {
-        throw std::runtime_error("This should be unreachable. Missing case");
+    if (a.isNumber()){
+        return CLoxLiteral(a.getNumber() == b.getNumber());
+    } else if (a.isObj()){
+        return CLoxLiteral(a.getObj() == b.getObj());
+    } else if (a.isBoolean()){
+        return CLoxLiteral(a.getBoolean() == b.getBoolean());
+    } else if (a.isNil()){
+        return CLoxLiteral(true);
     }
-}
 
-void VM::greater() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+    throw std::runtime_error("This should be unreachable. Missing case");
+}
 
+CLoxLiteral VM::greater(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
-         pushStack(CLoxLiteral(a.getNumber() > b.getNumber()));
-    } else if (a.isObj() && b.isObj()){
-        if (a.getObj()->isString() && b.getObj()->isString()){
-             pushStack(CLoxLiteral(dynamic_cast<StringObj*>(a.getObj()) > dynamic_cast<StringObj*>(b.getObj())));
-        }
-    } else {
-        throw LoxRuntimeError("Cannot apply operator '>' to operands of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        return CLoxLiteral(a.getNumber() > b.getNumber());
+    } else if (a.isObj() && b.isObj() && a.getObj()->isString() && b.getObj()->isString()){
+        return CLoxLiteral(static_cast<StringObj*>(a.getObj())->view() > static_cast<StringObj*>(b.getObj())->view());
     }
-}
 
-void VM::less() {
-    CLoxLiteral b = popStack();
-    CLoxLiteral a = popStack();
+    throw LoxRuntimeError("Cannot apply operator '>' to operands of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
+}
 
+CLoxLiteral VM::less(const CLoxLiteral &a, const CLoxLiteral &b) {
     if (a.isNumber() && b.isNumber()){
-        pushStack(CLoxLiteral(a.getNumber() < b.getNumber()));
-    } else if (a.isObj() && b.isObj()){
-        if (a.getObj()->isString() && b.getObj()->isString()){
-            pushStack(CLoxLiteral(dynamic_cast<StringObj*>(a.getObj()) < dynamic_cast<StringObj*>(b.getObj())));
-        }
-    } else {
-        throw LoxRuntimeError("Cannot apply operator '>' to operands of type " + literalTypeToString(a.type) + " and " + literalTypeToString(b.type), readChunkLine(currentFrame.programCounter));
+        return CLoxLiteral(a.getNumber() < b.getNumber());
+    } else if (a.isObj() && b.isObj() && a.getObj()->isString() && b.getObj()->isString()){
+        return CLoxLiteral(static_cast<StringObj*>(a.getObj())->view() < static_cast<StringObj*>(b.getObj())->view());
     }
+
+    throw LoxRuntimeError("Cannot apply operator '<' to operands of type " + literalTypeToString(a.getType()) + " and " + literalTypeToString(b.getType()), readChunkLine(currentFrame.programCounter));
 }
 
-void VM::negate() {
-    CLoxLiteral a = popStack();
+CLoxLiteral VM::negate(const CLoxLiteral &a) {
     if (a.isNumber()){
-        pushStack(CLoxLiteral(-a.getNumber()));
-        return;
+        return CLoxLiteral(-a.getNumber());
     }
 
-    throw std::runtime_error("Cannot apply unary operator '-' to operand of type " + literalTypeToString(a.type));
+    throw LoxRuntimeError("Cannot apply unary operator '-' to operand of type " + literalTypeToString(a.getType()), readChunkLine(currentFrame.programCounter));
 }
 
 bool VM::isTruthy(const CLoxLiteral &a) {
@@ -298,79 +974,205 @@ bool VM::isTruthy(const CLoxLiteral &a) {
     return true;
 }
 
-void VM::defineGlobal() {
-    std::string name = readConstantAsStringObj()->str;
-    if (globals.find(name) != globals.end()){
-        throw LoxRuntimeError("Cannot redefine global variable '" + name + "' ", currentFrame.function->chunk->readLine(currentFrame.programCounter));
+//global slots are checked against the amount of globals by the verifier
+void VM::defineGlobal(uint32_t slot, const CLoxLiteral &value) {
+    CLoxLiteral &global = globals->values[slot];
+    if (!global.isUndefined()){
+        throw LoxRuntimeError("Cannot redefine global variable '" + globals->name(slot) + "' ", readChunkLine(currentFrame.programCounter));
     }
-    globals[name] = popStack();
-    popStack(); //pop variable identifier from stack
+    global = value;
 }
 
-void VM::getGlobal() {
-    std::string name = readConstantAsStringObj()->str;
-    if (globals.find(name) == globals.end()){
-        throw LoxRuntimeError("Undefined variable '" + name + "'", readChunkLine(currentFrame.programCounter));
+const CLoxLiteral &VM::getGlobal(uint32_t slot) {
+    const CLoxLiteral &global = globals->values[slot];
+    if (global.isUndefined()){
+        throw LoxRuntimeError("Undefined variable '" + globals->name(slot) + "'", readChunkLine(currentFrame.programCounter));
     }
-    popStack(); //pop variable identifier from stack
-    pushStack(globals.at(name));
+    return global;
+}
+
+void VM::setGlobal(uint32_t slot, const CLoxLiteral &value) {
+    CLoxLiteral &global = globals->values[slot];
+    if (global.isUndefined()){
+        throw LoxRuntimeError("Undefined variable '" + globals->name(slot) + "'", readChunkLine(currentFrame.programCounter));
+    }
+    global = value;
+}
+
+/* Both property helpers first try the instruction's inline cache, which only needs the instance to have the cached shape.
+ * On a miss they fall back to looking the name up in the shape and refill the cache, unless the instance is in
+ * dictionary mode.
+ */
+void VM::setProperty(const CLoxLiteral &instance, StringObj *name, const CLoxLiteral &value, PropertyCache &cache) {
+    if (!instance.isObj() || !instance.getObj()->isInstance()){
+        throw LoxRuntimeError("Cannot access property. Only instances have fields.");
+    }
+
+    auto *instanceObj = static_cast<InstanceObj*>(instance.getObj());
+    if (instanceObj->shape == cache.shape){
+        if (cache.transition == nullptr){
+            heap.writeBarrier(instanceObj->slot(cache.slot));
+            instanceObj->slot(cache.slot) = value;
+        } else {
+            instanceObj->addSlot(cache.transition, value);
+        }
+        return;
+    }
+
+    if (heap.phase == Memory::GCPhase::MARKING){
+        if (CLoxLiteral *field = instanceObj->findField(name)){
+            heap.writeBarrier(*field);
+        }
+    }
+    Shape *oldShape = instanceObj->shape;
+    instanceObj->setField(name, value);
+    if (oldShape->isDictionary() || instanceObj->shape->isDictionary()){
+        return;
+    }
+
+    cache.shape = oldShape;
+    cache.transition = instanceObj->shape == oldShape ? nullptr : instanceObj->shape;
+    cache.slot = instanceObj->shape->lookup(name);
 }
 
-void VM::setGlobal() {
-    std::string name = readConstantAsStringObj()->str;
-    if (globals.find(name) == globals.end()){
-        throw LoxRuntimeError("Undefined variable '" + name + "'", readChunkLine(currentFrame.programCounter));
+CLoxLiteral VM::getProperty(const CLoxLiteral &instance, StringObj *name, PropertyCache &cache) {
+    if (!instance.isObj() || !instance.getObj()->isInstance()){
+        throw LoxRuntimeError("Cannot access property. Only instances have fields.");
     }
-    globals[name] = popStack();
+
+    auto *instanceObj = static_cast<InstanceObj*>(instance.getObj());
+    if (instanceObj->shape == cache.shape && cache.transition == nullptr){
+        return instanceObj->slot(cache.slot);
+    }
+
+    CLoxLiteral *field = instanceObj->findField(name);
+    if (field == nullptr){
+        Obj *method = instanceObj->klass->findMethod(name);
+        if (method == nullptr){
+            throw LoxRuntimeError("Undefined property " + name->str(), readChunkLine(currentFrame.programCounter));
+        }
+        //the instance stays on the stack while the bound method is allocated
+        runGCIfNecessary();
+        return CLoxLiteral(heap.allocateHeapBoundMethod(instanceObj, method));
+    }
+
+    if (!instanceObj->shape->isDictionary()){
+        cache.shape = instanceObj->shape;
+        cache.transition = nullptr;
+        cache.slot = instanceObj->shape->lookup(name);
+    }
+    return *field;
 }
 
-void VM::getLocal() {
-    int localIndex = readOneByteOffset();
-    pushStack(stack.at(localIndex));
+//Callers must keep any object they still need reachable from the stack, because these allocations can run the GC
+CLoxLiteral VM::makeClass(StringObj *name) {
+    runGCIfNecessary();
+    return CLoxLiteral(heap.allocateHeapClass(name));
 }
 
-void VM::setLocal() {
-    uint8_t localIndex = readOneByteOffset();
-    stack.at(localIndex) = stack.back();
+void VM::defineMethod(const CLoxLiteral &klass, StringObj *name, const CLoxLiteral &method) {
+    if (!klass.isObj() || !klass.getObj()->isClass() || !method.isObj() || !(method.getObj()->isFunction() || method.getObj()->isClosure())){
+        throw LoxRuntimeError("Can only add functions to classes as methods", readChunkLine(currentFrame.programCounter));
+    }
+    auto *classObj = static_cast<ClassObj*>(klass.getObj());
+    Obj *&definition = classObj->methods[name];
+    if (definition != nullptr){
+        heap.writeBarrier(CLoxLiteral(definition)); //a class can define a method twice
+    }
+    definition = method.getObj();
+    if (name->view() == "init"){
+        classObj->initializer = method.getObj();
+    }
 }
 
-CLoxLiteral VM::readConstant() {
-    uint8_t constantOffset = readOneByteOffset();
-    return currentChunk()->readConstant(constantOffset);
+/* The compiler only lets a closure capture a slot directly when the closure cannot be called after the slot's scope ends.
+ * The closure stays on the stack while its upvalues are allocated, allocating them can collect the heap.
+ */
+CLoxLiteral VM::makeClosure(FunctionObj *function, CLoxLiteral *frame) {
+    runGCIfNecessary();
+    auto *closure = static_cast<ClosureObj*>(heap.allocateHeapClosure(function));
+    pushStack(CLoxLiteral(closure));
+    const std::vector<UpvalueDescriptor> &upvalues = function->chunk->upvalues;
+    for (size_t i = 0; i < upvalues.size(); i++){
+        ClosureObj::Capture &capture = closure->captures[i];
+        if (!upvalues[i].isLocal){
+            capture = currentFrame.closure->captures[upvalues[i].index];
+        } else if (upvalues[i].escapes){
+            capture.upvalue = captureUpvalue(frame + upvalues[i].index);
+        } else {
+            capture.slot = frame + upvalues[i].index;
+        }
+        if (capture.slot != nullptr && (closure->highestSlot == nullptr || capture.slot > closure->highestSlot)){
+            closure->highestSlot = capture.slot;
+        }
+    }
+    return popStack();
 }
 
-StringObj *VM::readConstantAsStringObj() {
-    CLoxLiteral constant = readConstant();
-    assert(constant.isObj() && constant.getObj()->isString());
-    return dynamic_cast<StringObj*>(constant.getObj());
+//returns the open upvalue of slot, creating it if no closure captured the slot yet
+UpvalueObj *VM::captureUpvalue(CLoxLiteral *slot) {
+    UpvalueObj **link = &openUpvalues;
+    while (*link != nullptr && (*link)->location > slot){
+        link = &(*link)->nextOpen;
+    }
+    if (*link != nullptr && (*link)->location == slot){
+        return *link;
+    }
+
+    auto *upvalue = static_cast<UpvalueObj*>(heap.allocateHeapUpvalue(slot));
+    upvalue->nextOpen = *link;
+    *link = upvalue;
+    return upvalue;
 }
 
-ClassObj *VM::readConstantAsClassObj() {
-    CLoxLiteral constant = readConstant();
-    assert(constant.isObj() && constant.getObj()->isClass());
-    return dynamic_cast<ClassObj*>(constant.getObj());
+void VM::closeUpvalues(const CLoxLiteral *last) {
+    while (openUpvalues != nullptr && openUpvalues->location >= last){
+        UpvalueObj *upvalue = openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        openUpvalues = upvalue->nextOpen;
+        upvalue->nextOpen = nullptr;
+    }
+}
+
+CLoxLiteral VM::instantiate(const CLoxLiteral &klass, int argCount) {
+    if (!klass.isObj() || !klass.getObj()->isClass()){
+        throw LoxRuntimeError("Can only call functions and classes", readChunkLine(currentFrame.programCounter));
+    }
+    if (argCount != 0){
+        throw LoxRuntimeError("Expected 0 arguments but got " + std::to_string(argCount), readChunkLine(currentFrame.programCounter));
+    }
+    auto *classObj = static_cast<ClassObj*>(klass.getObj());
+    runGCIfNecessary();
+    return CLoxLiteral(heap.allocateHeapInstance(classObj));
 }
 
-uint16_t VM::readTwoByteOffset() {
-    uint16_t offset = ((uint16_t) currentChunk()->readByte(currentFrame.programCounter) >> 8u) | (uint16_t) currentChunk()->readByte(currentFrame.programCounter + 1);
-    currentFrame.programCounter += 2;
-    return offset;
+CLoxLiteral VM::allocate(const CLoxLiteral &kilobytes) {
+    assert(kilobytes.isNumber());
+    if (kilobytes.getNumber() * 1024 > std::numeric_limits<uint32_t>::max()){ //object sizes are stored in 32 bits, see Obj::size
+        throw LoxRuntimeError("Cannot allocate more than 4 GB at once", readChunkLine(currentFrame.programCounter));
+    }
+    runGCIfNecessary();
+    return CLoxLiteral(heap.allocateAllocationObject(kilobytes.getNumber()));
 }
 
-uint8_t VM::readOneByteOffset() {
-    uint8_t offset = (uint8_t) currentChunk()->readByte(currentFrame.programCounter);
-    currentFrame.programCounter++;
-    return offset;
+void VM::checkStackSpace(int base, int depth) {
+    if (depth > STACK_MAX - base){
+        throw LoxRuntimeError("Stack overflow", readChunkLine(currentFrame.programCounter));
+    }
 }
 
 void VM::pushStack(const CLoxLiteral& val) {
-    stack.push_back(val);
+    *stackTop++ = val;
 }
 
 CLoxLiteral VM::popStack() {
-    CLoxLiteral val = stack.back();
-    stack.pop_back();
-    return val;
+    return *--stackTop;
+}
+
+//returns the value distance slots below the top of the stack without popping it
+CLoxLiteral &VM::peekStack(int distance) {
+    return stackTop[-1 - distance];
 }
 
 Chunk *VM::currentChunk() {
@@ -381,19 +1183,25 @@ int VM::readChunkLine(int offset) {
     return currentChunk()->readLine(offset);
 }
 
+//An incremental collection in progress gets a slice at every allocation point until it is done, see Memory
 void VM::runGCIfNecessary() {
-    if (Memory::bytesAllocated > Memory::nextGCByteThreshold){
-        Memory::collectGarbage(this);
+    if (heap.phase == Memory::GCPhase::IDLE && heap.bytesAllocated <= heap.nextGCByteThreshold){
+        return;
+    }
+    if (heap.maxPause.count() == 0){
+        heap.collectGarbage();
+    } else {
+        heap.collectGarbageSlice();
     }
 }
 
-void VM::printDebugInfo(int offset) {
+void VM::printDebugInfo(const Chunk *chunk, int offset) {
     std::cout << "[DEBUG]";
     std::cout << "\tInstruction: ";
-    DebugUtils::printInstruction(offset, currentChunk());
+    DebugUtils::printInstruction(offset, chunk);
     std::cout << "\tStack: [";
-    for (auto reverse_it = stack.rbegin(); reverse_it != stack.rend(); reverse_it++){
-        std::cout << *reverse_it << ", ";
+    for (CLoxLiteral *slot = stackTop - 1; slot >= stack.get(); slot--){
+        std::cout << *slot << ", ";
     }
     std::cout << "]\n";
 }
@@ -3,10 +3,18 @@
 
 
 #include <memory>
+#include <iostream>
 #include <stack>
 #include <functional>
 #include "Chunk.h"
 #include "CLoxLiteral.h"
+#include "GlobalVariables.h"
+#ifdef TRACING_JIT
+#include "TracingJit.h"
+#endif
+#ifdef BASELINE_JIT
+#include "BaselineJit.h"
+#endif
 
 enum class ExecutionResult {
     OK,
@@ -17,58 +25,134 @@ enum class ExecutionResult {
 class CallFrame {
 public:
     CallFrame() = default;
-    CallFrame(FunctionObj *function, int programCounter, int stackIndex);
+    CallFrame(FunctionObj *function, int programCounter, int stackIndex, ClosureObj *closure = nullptr);
 
     FunctionObj *function = nullptr;
     int programCounter = 0;
     int stackIndex = 0;
+    ClosureObj *closure = nullptr; //the closure being run if function has upvalues
 };
 
+class Memory;
+
 class VM {
 public:
-
-    ExecutionResult execute(FunctionObj *function);
-
-
-private:
-    std::vector<CLoxLiteral> stack;
-    std::unordered_map<std::string, CLoxLiteral> globals;
-    std::vector<CallFrame> callFrames;
+    //heap is where the scripts the VM executes are allocated, see Memory. print writes to out
+    explicit VM(Memory &heap, std::ostream &out = std::cout);
+    //detaches from the SamplingProfiler and the heap, a runtime error leaves the VM attached
+    ~VM();
+
+    //Function must be allocated in the VM's heap, which is emptied when it returns. A VM can execute any number of
+    //scripts one after the other, the heap has to be emptied before the next one is compiled if a runtime error stopped it.
+    ExecutionResult execute(FunctionObj *function, GlobalVariables &globalVariables);
+
+    //size of the value stack in slots. A frame whose chunk needs more than what is left of it is a stack overflow
+    static const int STACK_MAX = 1 << 16;
+    //maximum depth of calls, a call any deeper is a stack overflow too
+    static const int FRAMES_MAX = 1 << 12;
+
+protected:
+    Memory &heap;
+    std::ostream &out;
+    /* The stack is allocated once with STACK_MAX slots and never grows. Every frame checks that its chunk's
+     * maxStackDepth fits when it is entered, so pushes and pops are plain pointer bumps. The slots in [stack, stackTop)
+     * are the live values the GC marks. execute keeps the top in a local and only stores it here before calling a helper
+     * that can allocate or throw.
+     */
+    std::unique_ptr<CLoxLiteral[]> stack;
+    CLoxLiteral *stackTop = nullptr;
+    GlobalVariables *globals = nullptr;
+    /* Frames are windows over the stack starting at the function being called, or the receiver for methods, with the
+     * arguments right above it, so calls pass arguments in place. currentFrame is the frame being executed, callFrames holds the frames of its callers,
+     * innermost last. It is allocated once with FRAMES_MAX frames, so calls and returns only copy a frame and bump
+     * frameCount.
+     */
+    std::unique_ptr<CallFrame[]> callFrames;
+    int frameCount = 0;
     CallFrame currentFrame;
+    //Upvalues still pointing at a stack slot, sorted by slot with the highest first so a frame or scope going away only
+    //has to look at the head of the list. Linked through UpvalueObj::nextOpen.
+    UpvalueObj *openUpvalues = nullptr;
+    //Offset of the instruction being executed in currentFrame's chunk by code of the BaselineJit compiled while
+    //profiling, read by the SamplingProfiler's signal handler. -1 while interpreting.
+    volatile int32_t executingOffset = -1;
+#ifdef TRACING_JIT
+    TracingJit jit;
+#endif
+#ifdef BASELINE_JIT
+    BaselineJit baselineJit;
+#endif
 
     Chunk *currentChunk();
 
-    CLoxLiteral readConstant();
-    StringObj* readConstantAsStringObj();
-    ClassObj* readConstantAsClassObj();
+    //throws a LoxRuntimeError if a frame starting at slot base cannot fit depth values on the stack
+    void checkStackSpace(int base, int depth);
+
     void pushStack(const CLoxLiteral& val);
     CLoxLiteral popStack();
-
-    void add();
-    void subtract();
-    void multiply();
-    void divide();
-    void equal();
-    void greater();
-    void less();
-    void negate();
+    CLoxLiteral& peekStack(int distance);
+
+    //Operations shared by every execution backend. Errors are reported on the line of currentFrame.programCounter
+    CLoxLiteral add(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral subtract(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral multiply(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral divide(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral equal(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral greater(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral less(const CLoxLiteral &a, const CLoxLiteral &b);
+    CLoxLiteral negate(const CLoxLiteral &a);
     bool isTruthy(const CLoxLiteral &literal);
 
-    void defineGlobal();
-    void getGlobal();
-    void setGlobal();
-    void setLocal();
-    void getLocal();
+    void defineGlobal(uint32_t slot, const CLoxLiteral &value);
+    const CLoxLiteral &getGlobal(uint32_t slot);
+    void setGlobal(uint32_t slot, const CLoxLiteral &value);
+    //cache is the inline cache of the instruction doing the access, see PropertyCache
+    void setProperty(const CLoxLiteral &instance, StringObj *name, const CLoxLiteral &value, PropertyCache &cache);
+    //a method that is not shadowed by a field is returned bound to the instance
+    CLoxLiteral getProperty(const CLoxLiteral &instance, StringObj *name, PropertyCache &cache);
+    CLoxLiteral makeClass(StringObj *name);
+    void defineMethod(const CLoxLiteral &klass, StringObj *name, const CLoxLiteral &method);
+    //creates a closure of function from the frame starting at frame, which is currentFrame executing OP_CLOSURE
+    CLoxLiteral makeClosure(FunctionObj *function, CLoxLiteral *frame);
+    //calls a class without an initializer, which takes no arguments. Backends that only run chunks declaring no functions
+    //call every callee with it
+    CLoxLiteral instantiate(const CLoxLiteral &klass, int argCount);
+    CLoxLiteral allocate(const CLoxLiteral &kilobytes);
 
-    uint16_t readTwoByteOffset();
-    uint8_t readOneByteOffset();
     int readChunkLine(int offset);
 
     void runGCIfNecessary();
 
-    void printDebugInfo(int offset);
-
     friend class Memory; //Memory.h defined in this project, not the standard <memory> module
+    friend class BaselineStencils;
+    friend class BaselineJit;
+    friend class SamplingProfiler;
+
+private:
+    void prepareFunction(FunctionObj *function, const void *const *dispatchTable);
+    /* Gets the call of callee with the argCount values above it on the stack ready. Returns the function or closure to
+     * push a frame for, with callee replaced by what goes in slot 0 of the frame: the receiver of a bound method, or the
+     * new instance of a class with an initializer. A class without one returns nullptr, its instance already replaced it.
+     */
+    Obj *prepareCall(CLoxLiteral &callee, int argCount);
+    //the same for OP_INVOKE, which calls the method name of receiver. cache is the instruction's MethodCache
+    Obj *prepareInvoke(CLoxLiteral &receiver, StringObj *name, int argCount, MethodCache &cache);
+    Obj *prepareUncachedInvoke(CLoxLiteral &receiver, StringObj *name, int argCount, MethodCache &cache);
+    //callable is a function or a closure, see prepareCall
+    void pushFrame(Obj *callable, int argCount);
+    void replaceFrame(Obj *callable, int argCount);
+    void checkArity(FunctionObj *function, int argCount);
+    UpvalueObj *captureUpvalue(CLoxLiteral *slot);
+    void closeUpvalues(const CLoxLiteral *last); //closes every open upvalue of a slot at or above last
+
+    //the frame of callable, a function or a closure, starting at slot base
+    static CallFrame frameOf(Obj *callable, int base);
+    //true if callable, a function or a closure, captured a stack slot at or above base directly
+    static bool capturesSlotsFrom(Obj *callable, const CLoxLiteral *base);
+
+    static void threadChunk(Chunk *chunk, const void *const *dispatchTable);
+
+    void printDebugInfo(const Chunk *chunk, int offset);
 };
 
 
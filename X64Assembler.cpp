@@ -0,0 +1,242 @@
+#include "X64Assembler.h"
+
+//REX prefix: W selects 64 bit operands, R extends ModRM.reg and B extends ModRM.rm to reach r8-r15
+void X64Assembler::emitRex(bool wide, uint8_t reg, uint8_t base) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8u) ? 0x04 : 0) | ((base & 8u) ? 0x01 : 0);
+    if (rex != 0x40){
+        emit(rex);
+    }
+}
+
+//always uses a 32 bit displacement. rsp and r12 as a base can only be encoded with a SIB byte
+void X64Assembler::emitMemoryOperand(uint8_t reg, Register base, int32_t displacement) {
+    emit(0x80 | ((reg & 7u) << 3u) | (base & 7u));
+    if ((base & 7u) == RSP){
+        emit(0x24);
+    }
+    emit32(static_cast<uint32_t>(displacement));
+}
+
+void X64Assembler::emitRegisterOperand(uint8_t reg, uint8_t rm) {
+    emit(0xC0 | ((reg & 7u) << 3u) | (rm & 7u));
+}
+
+//SSE instructions take their mandatory prefix before the REX prefix
+void X64Assembler::emitSse(uint8_t prefix, uint8_t opcode, uint8_t reg, uint8_t rm) {
+    emit(prefix);
+    emitRex(false, reg, rm);
+    emit(0x0F);
+    emit(opcode);
+    emitRegisterOperand(reg, rm);
+}
+
+void X64Assembler::movLoad(Register destination, Register base, int32_t displacement) {
+    emitRex(true, destination, base);
+    emit(0x8B);
+    emitMemoryOperand(destination, base, displacement);
+}
+
+void X64Assembler::movStore(Register base, int32_t displacement, Register source) {
+    emitRex(true, source, base);
+    emit(0x89);
+    emitMemoryOperand(source, base, displacement);
+}
+
+void X64Assembler::movImmediate(Register destination, uint64_t immediate) {
+    emitRex(true, 0, destination);
+    emit(0xB8 | (destination & 7u));
+    emit32(static_cast<uint32_t>(immediate));
+    emit32(static_cast<uint32_t>(immediate >> 32u));
+}
+
+void X64Assembler::movEax(uint32_t immediate) {
+    emit(0xB8);
+    emit32(immediate);
+}
+
+void X64Assembler::andRegister(Register destination, Register source) {
+    emitRex(true, source, destination);
+    emit(0x21);
+    emitRegisterOperand(source, destination);
+}
+
+void X64Assembler::xorRegister(Register destination, Register source) {
+    emitRex(true, source, destination);
+    emit(0x31);
+    emitRegisterOperand(source, destination);
+}
+
+void X64Assembler::cmpRegister(Register a, Register b) {
+    emitRex(true, b, a);
+    emit(0x39);
+    emitRegisterOperand(b, a);
+}
+
+void X64Assembler::testRegister(Register a, Register b) {
+    emitRex(true, b, a);
+    emit(0x85);
+    emitRegisterOperand(b, a);
+}
+
+void X64Assembler::movRegister(Register destination, Register source) {
+    emitRex(true, source, destination);
+    emit(0x89);
+    emitRegisterOperand(source, destination);
+}
+
+void X64Assembler::addImmediate(Register destination, int32_t immediate) {
+    emitRex(true, 0, destination);
+    emit(0x81);
+    emitRegisterOperand(0, destination);
+    emit32(static_cast<uint32_t>(immediate));
+}
+
+void X64Assembler::movMemory32(Register base, int32_t displacement, int32_t immediate) {
+    emitRex(false, 0, base);
+    emit(0xC7);
+    emitMemoryOperand(0, base, displacement);
+    emit32(static_cast<uint32_t>(immediate));
+}
+
+void X64Assembler::addMemory32(Register base, int32_t displacement, int32_t immediate) {
+    emitRex(false, 0, base);
+    emit(0x81);
+    emitMemoryOperand(0, base, displacement);
+    emit32(static_cast<uint32_t>(immediate));
+}
+
+void X64Assembler::cmpMemory32(Register base, int32_t displacement, int32_t immediate) {
+    emitRex(false, 0, base);
+    emit(0x81);
+    emitMemoryOperand(7, base, displacement);
+    emit32(static_cast<uint32_t>(immediate));
+}
+
+void X64Assembler::push(Register source) {
+    emitRex(false, 0, source);
+    emit(0x50 | (source & 7u));
+}
+
+void X64Assembler::pop(Register destination) {
+    emitRex(false, 0, destination);
+    emit(0x58 | (destination & 7u));
+}
+
+void X64Assembler::movsdLoad(Xmm destination, Register base, int32_t displacement) {
+    emit(0xF2);
+    emitRex(false, destination, base);
+    emit(0x0F);
+    emit(0x10);
+    emitMemoryOperand(destination, base, displacement);
+}
+
+void X64Assembler::movsdStore(Register base, int32_t displacement, Xmm source) {
+    emit(0xF2);
+    emitRex(false, source, base);
+    emit(0x0F);
+    emit(0x11);
+    emitMemoryOperand(source, base, displacement);
+}
+
+void X64Assembler::movqToXmm(Xmm destination, Register source) {
+    emit(0x66);
+    emitRex(true, destination, source);
+    emit(0x0F);
+    emit(0x6E);
+    emitRegisterOperand(destination, source);
+}
+
+void X64Assembler::movqFromXmm(Register destination, Xmm source) {
+    emit(0x66);
+    emitRex(true, source, destination);
+    emit(0x0F);
+    emit(0x7E);
+    emitRegisterOperand(source, destination);
+}
+
+void X64Assembler::movapd(Xmm destination, Xmm source) {
+    emitSse(0x66, 0x28, destination, source);
+}
+
+void X64Assembler::addsd(Xmm destination, Xmm source) {
+    emitSse(0xF2, 0x58, destination, source);
+}
+
+void X64Assembler::subsd(Xmm destination, Xmm source) {
+    emitSse(0xF2, 0x5C, destination, source);
+}
+
+void X64Assembler::mulsd(Xmm destination, Xmm source) {
+    emitSse(0xF2, 0x59, destination, source);
+}
+
+void X64Assembler::divsd(Xmm destination, Xmm source) {
+    emitSse(0xF2, 0x5E, destination, source);
+}
+
+void X64Assembler::xorpd(Xmm destination, Xmm source) {
+    emitSse(0x66, 0x57, destination, source);
+}
+
+void X64Assembler::ucomisd(Xmm a, Xmm b) {
+    emitSse(0x66, 0x2E, a, b);
+}
+
+int X64Assembler::jcc(Condition condition) {
+    emit(0x0F);
+    emit(0x80 | condition);
+    emit32(0);
+    return size() - 4;
+}
+
+int X64Assembler::jmp() {
+    emit(0xE9);
+    emit32(0);
+    return size() - 4;
+}
+
+void X64Assembler::jmpTo(int target) {
+    bind(jmp(), target);
+}
+
+void X64Assembler::jmpRegister(Register target) {
+    emitRex(false, 0, target);
+    emit(0xFF);
+    emitRegisterOperand(4, target);
+}
+
+void X64Assembler::callRegister(Register target) {
+    emitRex(false, 0, target);
+    emit(0xFF);
+    emitRegisterOperand(2, target);
+}
+
+//displacements are relative to the end of the jump, which is right after its displacement
+void X64Assembler::bind(int displacementOffset, int target) {
+    auto displacement = static_cast<uint32_t>(target - (displacementOffset + 4));
+    for (int i = 0; i < 4; i++){
+        bytes[displacementOffset + i] = static_cast<uint8_t>(displacement >> (8u * i));
+    }
+}
+
+void X64Assembler::ret() {
+    emit(0xC3);
+}
+
+int X64Assembler::size() const {
+    return static_cast<int>(bytes.size());
+}
+
+const std::vector<uint8_t> &X64Assembler::code() const {
+    return bytes;
+}
+
+void X64Assembler::emit(uint8_t byte) {
+    bytes.push_back(byte);
+}
+
+void X64Assembler::emit32(uint32_t value) {
+    for (int i = 0; i < 4; i++){
+        emit(static_cast<uint8_t>(value >> (8u * i)));
+    }
+}
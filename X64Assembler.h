@@ -0,0 +1,80 @@
+#ifndef CLOX_X64ASSEMBLER_H
+#define CLOX_X64ASSEMBLER_H
+
+
+#include <vector>
+#include <cstdint>
+
+/* Encodes the handful of x86-64 instructions the TraceCompiler and the BaselineCompiler need into a byte buffer. Memory operands are always
+ * [base + disp32] and doubles are handled with scalar SSE2 instructions. Jumps are emitted with a 32 bit displacement
+ * that is filled in later with bind, so they can target code that has not been emitted yet.
+ */
+class X64Assembler {
+public:
+    enum Register : uint8_t {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15};
+    enum Xmm : uint8_t {XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15};
+
+    //condition codes, named after the flags they test
+    enum Condition : uint8_t {
+        EQUAL = 0x4,
+        NOT_EQUAL = 0x5,
+        BELOW_OR_EQUAL = 0x6, //unsigned, also the result of a ucomisd that is not "above"
+        ABOVE = 0x7,
+        GREATER_OR_EQUAL = 0xD, //signed
+        PARITY = 0xA, //set by ucomisd when a NaN was compared
+        NO_PARITY = 0xB
+    };
+
+    void movLoad(Register destination, Register base, int32_t displacement);   //mov destination, [base + displacement]
+    void movStore(Register base, int32_t displacement, Register source);       //mov [base + displacement], source
+    void movImmediate(Register destination, uint64_t immediate);               //mov destination, immediate
+    void movEax(uint32_t immediate);                                           //mov eax, immediate
+    void andRegister(Register destination, Register source);
+    void xorRegister(Register destination, Register source);
+    void cmpRegister(Register a, Register b);                                  //flags of a - b
+    void testRegister(Register a, Register b);                                 //flags of a & b
+    void movRegister(Register destination, Register source);
+    void addImmediate(Register destination, int32_t immediate);
+    void movMemory32(Register base, int32_t displacement, int32_t immediate);  //mov dword [base + displacement], immediate
+    void addMemory32(Register base, int32_t displacement, int32_t immediate);  //add dword [base + displacement], immediate
+    void cmpMemory32(Register base, int32_t displacement, int32_t immediate);  //cmp dword [base + displacement], immediate
+    void push(Register source);
+    void pop(Register destination);
+
+    void movsdLoad(Xmm destination, Register base, int32_t displacement);
+    void movsdStore(Register base, int32_t displacement, Xmm source);
+    void movqToXmm(Xmm destination, Register source);
+    void movqFromXmm(Register destination, Xmm source);
+    void movapd(Xmm destination, Xmm source);
+    void addsd(Xmm destination, Xmm source);
+    void subsd(Xmm destination, Xmm source);
+    void mulsd(Xmm destination, Xmm source);
+    void divsd(Xmm destination, Xmm source);
+    void xorpd(Xmm destination, Xmm source);
+    void ucomisd(Xmm a, Xmm b);                                                //unordered compare of a with b
+
+    //jumps return the offset of their displacement, which has to be passed to bind
+    int jcc(Condition condition);
+    int jmp();
+    void jmpTo(int target);
+    void jmpRegister(Register target);
+    void callRegister(Register target);
+    void bind(int displacementOffset, int target); //makes the jump whose displacement is at displacementOffset land on target
+    void ret();
+
+    int size() const;
+    const std::vector<uint8_t> &code() const;
+
+private:
+    std::vector<uint8_t> bytes;
+
+    void emit(uint8_t byte);
+    void emit32(uint32_t value);
+    void emitRex(bool wide, uint8_t reg, uint8_t base);
+    void emitMemoryOperand(uint8_t reg, Register base, int32_t displacement);
+    void emitRegisterOperand(uint8_t reg, uint8_t rm);
+    void emitSse(uint8_t prefix, uint8_t opcode, uint8_t reg, uint8_t rm);
+};
+
+
+#endif //CLOX_X64ASSEMBLER_H
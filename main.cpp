@@ -1,68 +1,185 @@
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <thread>
 #include <functional>
+#include <stdexcept>
 #include "VM.h"
+#include "RegisterVM.h"
 #include "FileReader.h"
 #include "LoxError.h"
 #include "Scanner.h"
 #include "Compiler.h"
 #include "DebugUtils.h"
 #include "Memory.h"
+#include "OpcodeProfiler.h"
+#include "InstructionCounter.h"
+#include "SamplingProfiler.h"
+#include "CppEmitter.h"
+#include "BatchRunner.h"
 
 #define LOG_HEAP
 
 
+struct CLoxOptions {
+    bool useRegisterVM = false;
+    bool emitCpp = false; //print the script as C++ instead of running it, see CppEmitter
+    std::string batchFile; //manifest of the scripts run by BatchRunner, empty if a single script is run
+    unsigned markThreads = 0; //threads marking the heap, see ParallelMarker. 0 uses one per hardware thread
+    std::string opcodeProfileFile; //empty if no profile should be written
+    std::string instructionCountsFile; //annotated disassembly of the InstructionCounter, empty if none should be written
+    std::string profileFile; //folded stacks of the SamplingProfiler, empty if the script is not profiled
+    std::chrono::microseconds maxGcPause{0}; //see Memory::maxPause, 0 collects the heap all at once
+    std::string scriptFile;
+    std::string gcLogFile;
+};
+
+bool parseOptions(int argc, char *argv[], CLoxOptions &options);
 void displayCLoxUsage();
-ExecutionResult runRepl();
-ExecutionResult runScript(const std::string& filename);
-ExecutionResult runCode(const std::string &code);
+ExecutionResult runRepl(const CLoxOptions &options);
+ExecutionResult runScript(const std::string& filename, const CLoxOptions &options);
+ExecutionResult runCode(const std::string &code, const CLoxOptions &options);
+int runBatch(const CLoxOptions &options);
+int exitCode(ExecutionResult result);
 
 auto getEpochTimeMillis(){
     return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3){
+    CLoxOptions options;
+    if (!parseOptions(argc, argv, options)){
         displayCLoxUsage();
         return 0;
     }
 
 #ifdef LOG_HEAP
-    std::ofstream out(argv[2]);
+    std::ofstream out(options.gcLogFile);
     auto old_rdbuf = std::clog.rdbuf();
     std::clog.rdbuf(out.rdbuf());
     std::clog << getEpochTimeMillis() << "\n";
 #endif
 
-    ExecutionResult result;
+    int status;
+    if (!options.batchFile.empty()){
+        status = runBatch(options);
+    } else {
+        if (!options.profileFile.empty()){
+            SamplingProfiler::start();
+        }
+        ExecutionResult result = runScript(options.scriptFile, options);
+        SamplingProfiler::stop();
+        status = exitCode(result);
+    }
+
+    std::clog << getEpochTimeMillis() << "\n";
+
+    if (!options.opcodeProfileFile.empty()){
+        std::ofstream profile(options.opcodeProfileFile);
+        OpcodeProfiler::writeReport(profile);
+    }
+
+    if (!options.instructionCountsFile.empty()){
+        std::ofstream counts(options.instructionCountsFile);
+        InstructionCounter::writeReport(counts);
+    }
+
+    if (!options.profileFile.empty()){
+        std::ofstream profile(options.profileFile);
+        SamplingProfiler::writeReport(profile, options.scriptFile);
+    }
 
-    result = runScript(argv[1]);
+#ifdef LOG_HEAP
+    std::clog.rdbuf(old_rdbuf);
+#endif
 
-    int exitCode;
+    return status;
+}
 
+int exitCode(ExecutionResult result){
     switch (result) {
         case ExecutionResult::OK:
-            exitCode = 0;
-            break;
+            return 0;
         case ExecutionResult::COMPILE_ERROR:
-            exitCode = 65;
-            break;
+            return 65;
         case ExecutionResult::RUNTIME_ERROR:
-            exitCode = 70;
-            break;
+            return 70;
     }
+    return 70;
+}
 
-    std::clog << getEpochTimeMillis() << "\n";
-
-#ifdef LOG_HEAP
-    std::clog.rdbuf(old_rdbuf);
+bool parseOptions(int argc, char *argv[], CLoxOptions &options){
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++){
+        std::string argument = argv[i];
+        if (argument == "--register"){
+            options.useRegisterVM = true;
+        } else if (argument == "--emit-cpp"){
+            options.emitCpp = true;
+        } else if (argument == "--batch" && i + 1 < argc){
+#if defined(PROFILE_OPCODES) || defined(COUNT_INSTRUCTIONS)
+            //the counters of these builds are shared by every VM, the workers would write them at the same time
+            std::cout << "--batch cannot be used in clox built with -DCLOX_PROFILE_OPCODES=ON or -DCLOX_COUNT_INSTRUCTIONS=ON\n";
+            return false;
+#endif
+            options.batchFile = argv[++i];
+        } else if (argument == "--mark-threads" && i + 1 < argc){
+            try {
+                options.markThreads = static_cast<unsigned>(std::stoul(argv[++i]));
+            } catch (const std::logic_error &) { //not a number or out of range
+                return false;
+            }
+            if (options.markThreads == 0){
+                return false;
+            }
+        } else if (argument == "--max-gc-pause" && i + 1 < argc){
+            try {
+                options.maxGcPause = std::chrono::microseconds(std::stoul(argv[++i]));
+            } catch (const std::logic_error &) { //not a number or out of range
+                return false;
+            }
+        } else if (argument == "--opcode-profile" && i + 1 < argc){
+#ifndef PROFILE_OPCODES
+            std::cout << "--opcode-profile requires clox to be built with -DCLOX_PROFILE_OPCODES=ON\n";
+            return false;
 #endif
+            options.opcodeProfileFile = argv[++i];
+        } else if (argument == "--instruction-counts" && i + 1 < argc){
+#ifndef COUNT_INSTRUCTIONS
+            std::cout << "--instruction-counts requires clox to be built with -DCLOX_COUNT_INSTRUCTIONS=ON\n";
+            return false;
+#endif
+            options.instructionCountsFile = argv[++i];
+        } else if (argument == "--profile" && i + 1 < argc){
+#ifndef SAMPLING_PROFILER
+            std::cout << "--profile requires clox to be built with -DCLOX_SAMPLING_PROFILER=ON\n";
+            return false;
+#endif
+            options.profileFile = argv[++i];
+        } else {
+            positional.push_back(argument);
+        }
+    }
+
+    //a batch has no GC log, the scripts are listed in the manifest
+    if (!options.batchFile.empty()){
+        return positional.empty();
+    }
 
-    return exitCode;
+    //the GC log is optional when the script is only translated to C++
+    if (positional.size() != 2 && !(options.emitCpp && positional.size() == 1)){
+        return false;
+    }
+
+    options.scriptFile = positional[0];
+    if (positional.size() == 2){
+        options.gcLogFile = positional[1];
+    }
+    return true;
 }
 
-ExecutionResult runScript(const std::string &filename){
+ExecutionResult runScript(const std::string &filename, const CLoxOptions &options){
     std::string code;
     try {
         FileReader reader(filename);
@@ -75,10 +192,10 @@ ExecutionResult runScript(const std::string &filename){
         return ExecutionResult::COMPILE_ERROR;
     }
 
-    return runCode(code);
+    return runCode(code, options);
 }
 
-ExecutionResult runRepl(){
+ExecutionResult runRepl(const CLoxOptions &options){
     std::cout << "Interactive Repl mode. Type \"quit()\" or press CTRL-C to exit\n";
     std::string line;
     while (true){
@@ -86,7 +203,7 @@ ExecutionResult runRepl(){
         std::getline(std::cin, line);
         if (line == "quit()") return ExecutionResult::OK;
         try {
-            runCode(line);
+            runCode(line, options);
         } catch (const LoxError &exception){
             std::cout << exception.what() << "\n"; //use cout instead of cerr to avoid the two streams not being synchronized when printing the next '< '
         }
@@ -95,7 +212,7 @@ ExecutionResult runRepl(){
     return ExecutionResult::OK;
 }
 
-ExecutionResult runCode(const std::string &code){
+ExecutionResult runCode(const std::string &code, const CLoxOptions &options){
     Scanner scanner(code);
     std::vector<Token> tokens;
 
@@ -110,7 +227,13 @@ ExecutionResult runCode(const std::string &code){
 //        std::cout << t << "\n";
 //    }
 
-    Compiler compiler;
+    Memory heap;
+    if (options.markThreads > 0){
+        heap.markThreadCount = options.markThreads;
+    }
+    heap.maxPause = options.maxGcPause;
+    GlobalVariables globals;
+    Compiler compiler(globals, heap);
     bool successFlag;
     FunctionObj *function = compiler.compile(tokens, successFlag);
 //    DebugUtils::printChunk(function->chunk, "main");
@@ -119,10 +242,27 @@ ExecutionResult runCode(const std::string &code){
         return ExecutionResult::COMPILE_ERROR;
     }
 
-    VM vm;
     ExecutionResult result;
     try {
-        result = vm.execute(function);
+        if (options.emitCpp){
+            CppEmitter(function, globals, options.scriptFile).emit(std::cout);
+            result = ExecutionResult::OK;
+        } else if (options.useRegisterVM){
+            if (function->chunk->containsFunctions()){
+                std::cerr << "Warning: the register VM cannot call functions, running the script on the stack VM\n";
+            }
+            RegisterVM vm(heap);
+            result = vm.execute(function, globals);
+        } else {
+            VM vm(heap);
+            result = vm.execute(function, globals);
+        }
+    } catch (const LoxVerificationError &error) {
+        std::cout << error.what() << "\n";
+        return ExecutionResult::COMPILE_ERROR;
+    } catch (const LoxUnsupportedError &error) {
+        std::cerr << error.what() << "\n"; //only --emit-cpp throws it, its output is the generated program
+        return ExecutionResult::COMPILE_ERROR;
     } catch (const LoxRuntimeError &error) {
         std::cout << error.what() << "\n";
         return ExecutionResult::RUNTIME_ERROR;
@@ -131,8 +271,33 @@ ExecutionResult runCode(const std::string &code){
     return result;
 }
 
+/* Runs every script of the manifest (see BatchRunner) and prints what each one printed, in manifest order, each under a
+ * line with its name and the exit code clox would have exited with for it alone. The batch exits with the highest of them.
+ */
+int runBatch(const CLoxOptions &options){
+    std::vector<std::string> scriptFiles;
+    try {
+        scriptFiles = BatchRunner::readManifest(options.batchFile);
+    } catch (const LoxFileNotFoundError &error) {
+        std::cout << error.what() << "\n";
+        return exitCode(ExecutionResult::COMPILE_ERROR);
+    }
+
+    int status = 0;
+    for (const BatchRunner::Job &job : BatchRunner(scriptFiles).run()){
+        int jobStatus = exitCode(job.result);
+        std::cout << "==> " << job.scriptFile << " (exit " << jobStatus << ")\n" << job.output;
+        status = std::max(status, jobStatus);
+    }
+    return status;
+}
+
 void displayCLoxUsage(){
-    std::cout << "Usage: clox [script] [GC Log File]\n";
+    std::cout << "Usage: clox [--register] [--mark-threads count] [--max-gc-pause microseconds] [--opcode-profile file] [--instruction-counts file] [--profile file] [script] [GC Log File]\n"
+              << "       clox --emit-cpp [script] [GC Log File] > script.cpp\n"
+              << "       clox --batch manifest\n"
+              << "--register, --emit-cpp and the baseline JIT only handle scripts that declare no functions or methods. With\n"
+              << "--register other scripts run on the stack VM, --emit-cpp rejects them and the JIT leaves them to the interpreter\n";
 }
 
 
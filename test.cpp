@@ -1,22 +1,78 @@
-#include <chrono>
+#include <cstddef>
+#include <initializer_list>
 #include <iostream>
-#include <vector>
+#include <string>
+#include "BytecodeVerifier.h"
+#include "CLoxLiteral.h"
+#include "LoxError.h"
 
-class Outer {
-public:
+/* Checks that the BytecodeVerifier rejects malformed chunks (ctest runs it as verifier). Every case writes a chunk by
+ * hand, the compiler never produces any of them, and fails unless verifying it throws a LoxVerificationError whose
+ * message contains the expected reason.
+ */
+namespace {
+    const size_t GLOBAL_COUNT = 1;
+    int failures = 0;
 
-    class Inner {
-    public:
-         static void innerFunc(){
-            std::cout << stack.back() << "\n";
+    int op(OpCode code) {
+        return static_cast<int>(code);
+    }
+
+    Chunk makeChunk(std::initializer_list<int> bytes, int constantCount = 0) {
+        Chunk chunk;
+        for (int byte : bytes){
+            chunk.write(std::byte(byte), 1);
+        }
+        for (int i = 0; i < constantCount; i++){
+            chunk.writeConstant(CLoxLiteral(static_cast<double>(i)));
         }
-    };
+        return chunk;
+    }
 
+    void expectRejected(const std::string &name, Chunk chunk, const std::string &reason) {
+        try {
+            BytecodeVerifier(&chunk, GLOBAL_COUNT).verify();
+            std::cout << name << ": accepted\n";
+            failures++;
+        } catch (const LoxVerificationError &error) {
+            if (std::string(error.what()).find(reason) == std::string::npos){
+                std::cout << name << ": rejected with \"" << error.what() << "\" instead of \"" << reason << "\"\n";
+                failures++;
+            }
+        }
+    }
 
-private:
-    static std::vector<std::string> stack;
-};
+    void expectAccepted(const std::string &name, Chunk chunk) {
+        try {
+            BytecodeVerifier(&chunk, GLOBAL_COUNT).verify();
+        } catch (const LoxVerificationError &error) {
+            std::cout << name << ": rejected with \"" << error.what() << "\"\n";
+            failures++;
+        }
+    }
+}
 
 int main(){
-    Outer::Inner::innerFunc();
-}
\ No newline at end of file
+    expectAccepted("valid chunk", makeChunk({op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_PRINT), op(OpCode::OP_RETURN)}, 1));
+
+    expectRejected("bad opcode", makeChunk({op(OpCode::OP_COUNT), op(OpCode::OP_RETURN)}), "Invalid opcode");
+    expectRejected("constant out of range", makeChunk({op(OpCode::OP_CONSTANT), 1, op(OpCode::OP_POP), op(OpCode::OP_RETURN)}, 1),
+                   "Constant index out of range");
+    expectRejected("global out of range", makeChunk({op(OpCode::OP_GET_GLOBAL), GLOBAL_COUNT, op(OpCode::OP_POP), op(OpCode::OP_RETURN)}),
+                   "does not exist");
+    expectRejected("slot out of range", makeChunk({op(OpCode::OP_GET_LOCAL), 1, op(OpCode::OP_POP), op(OpCode::OP_RETURN)}),
+                   "is not on the stack");
+    //the jump lands on the operand of the OP_CONSTANT after it
+    expectRejected("jump into an operand", makeChunk({op(OpCode::OP_JUMP), 0, 1, op(OpCode::OP_CONSTANT), 0, op(OpCode::OP_POP), op(OpCode::OP_RETURN)}, 1),
+                   "is not the start of an instruction");
+    expectRejected("stack underflow", makeChunk({op(OpCode::OP_POP), op(OpCode::OP_POP), op(OpCode::OP_RETURN)}), "Stack underflow");
+    //the OP_NIL is only executed when the jump is not taken
+    expectRejected("depths that disagree", makeChunk({op(OpCode::OP_TRUE), op(OpCode::OP_JUMP_IF_FALSE), 0, 1, op(OpCode::OP_NIL), op(OpCode::OP_RETURN)}),
+                   "Inconsistent stack depth");
+    expectAccepted("long constant", makeChunk({op(OpCode::OP_CONSTANT_LONG), 0, 1, 0, op(OpCode::OP_PRINT), op(OpCode::OP_RETURN)}, 257));
+    expectRejected("long constant out of range", makeChunk({op(OpCode::OP_CONSTANT_LONG), 0, 1, 1, op(OpCode::OP_POP), op(OpCode::OP_RETURN)}, 257),
+                   "Constant index out of range");
+    expectRejected("falling off the end", makeChunk({op(OpCode::OP_NIL), op(OpCode::OP_POP)}), "run past the end of the chunk");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+#Writes the C++ that clox --emit-cpp prints for a script to a file, failing if clox does. Used by the build of the aot
+#test in CMakeLists.txt as cmake -DCLOX=... -DSCRIPT=... -DOUTPUT=... -P EmitCpp.cmake, the redirection of the shell
+#is not portable across generators
+execute_process(COMMAND ${CLOX} --emit-cpp ${SCRIPT}
+        OUTPUT_FILE ${OUTPUT}
+        ERROR_VARIABLE errors
+        RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0)
+    file(REMOVE ${OUTPUT})
+    message(FATAL_ERROR "clox --emit-cpp ${SCRIPT} exited with ${result}\n${errors}")
+endif()
@@ -0,0 +1,13 @@
+#Writes the script of the parallel_mark tests: 70000 globals holding distinct strings followed by parallel_mark.lox.
+#Called by CMakeLists.txt as cmake -DSCRIPT=parallel_mark.lox -DOUTPUT=... -P GenerateParallelMark.cmake
+file(WRITE ${OUTPUT} "")
+foreach (block RANGE 69)
+    set(globals "") #appended a block at a time, growing one string to the whole script is slow
+    foreach (i RANGE 999)
+        math(EXPR index "${block} * 1000 + ${i}")
+        string(APPEND globals "var g${index} = \"s${index}\";\n")
+    endforeach()
+    file(APPEND ${OUTPUT} "${globals}")
+endforeach()
+file(READ ${SCRIPT} script)
+file(APPEND ${OUTPUT} "${script}")
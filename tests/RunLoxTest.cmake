@@ -0,0 +1,16 @@
+#Runs clox on a script and fails unless it prints exactly the expected output and exits with the expected status.
+#Called by the tests in CMakeLists.txt as cmake -DCLOX=... -DOPTIONS=... -DEXPECTED=... -DEXIT_CODE=... -P RunLoxTest.cmake,
+#OPTIONS holds the arguments of clox separated by spaces. Warnings on stderr are ignored, they are not part of the output
+separate_arguments(arguments UNIX_COMMAND "${OPTIONS}")
+execute_process(COMMAND ${CLOX} ${arguments}
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE errors
+        RESULT_VARIABLE result)
+
+file(READ ${EXPECTED} expected)
+if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "clox ${OPTIONS} printed\n${output}${errors}\ninstead of\n${expected}")
+endif()
+if (NOT result STREQUAL EXIT_CODE)
+    message(FATAL_ERROR "clox ${OPTIONS} exited with ${result} instead of ${EXIT_CODE}\n${errors}")
+endif()